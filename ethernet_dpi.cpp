@@ -39,15 +39,71 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <math.h>
 
 #include <unistd.h>  // For close().
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <linux/filter.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sched.h>  // For unshare() and setns().
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/veth.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>  // For kill().
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+// The one's complement sums for the checksums have SSE4.1 and AVX2 versions,
+// which are selected at run time depending on the CPU.
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) )
+  #define ETHDPI_USE_X86_SIMD
+  #include <immintrin.h>
+#endif
+
+// Statically-defined tracing probes for tools like bpftrace and perf, see "Tracing probes" in the README file.
+// Each probe is a single NOP instruction until a tool attaches to it. Without the SystemTap SDT header
+// (package systemtap-sdt-dev or systemtap-sdt-devel), or with -DETHDPI_NO_SDT, the probes compile to nothing.
+#if !defined(ETHDPI_NO_SDT) && defined(__has_include)
+  #if __has_include(<sys/sdt.h>)
+    #define ETHDPI_USE_SDT
+  #endif
+#endif
+
+#ifdef ETHDPI_USE_SDT
+  #include <sys/sdt.h>
+  #define ETHDPI_PROBE1( name, a1 )          STAP_PROBE1( ethernet_dpi, name, a1 )
+  #define ETHDPI_PROBE2( name, a1, a2 )      STAP_PROBE2( ethernet_dpi, name, a1, a2 )
+  #define ETHDPI_PROBE3( name, a1, a2, a3 )  STAP_PROBE3( ethernet_dpi, name, a1, a2, a3 )
+#else
+  #define ETHDPI_PROBE1( name, a1 )          do {} while ( false )
+  #define ETHDPI_PROBE2( name, a1, a2 )      do {} while ( false )
+  #define ETHDPI_PROBE3( name, a1, a2, a3 )  do {} while ( false )
+#endif
 
 #include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <map>
+#include <vector>
+#include <deque>
+#include <atomic>
+
+#include "ethernet_dpi.h"
 
 
 // We may have more error codes in the future, that's why the success value is zero.
@@ -57,6 +113,10 @@ static const int RET_SUCCESS = 0;
 static const int RET_FAILURE = 1;
 
 static const char ERROR_MSG_PREFIX[] = "Error in the Ethernet DPI module: ";
+static const char WARNING_MSG_PREFIX[] = "Warning from the Ethernet DPI module: ";
+
+// With option "check_tx_checksums", only the first bad frames are logged, the rest are just counted.
+static const uint64_t MAX_LOGGED_CHECKSUM_ERRORS = 20;
 
 // The default maximum frame length in the Ethernet controller core is 1536.
 // The TAP interface has normally an MTU of 1500, which is the length
@@ -65,39 +125,338 @@ static const char ERROR_MSG_PREFIX[] = "Error in the Ethernet DPI module: ";
 // Sending 2000 bytes fails silently though, no error is returned from the write() call,
 // and the frame is just dropped.
 // I am not sure where the limit should be. I'll just add 36, so that we get 1536
-// out of 1500, which should normally be OK.
-static const char MTU_MARGIN = 36;
+// out of 1500, which should normally be OK. The margin covers the Ethernet header,
+// VLAN tags and so on, so it does not grow with the MTU, and it is also fine for jumbo frames
+// (for example, with an MTU of 9000).
+static const int MTU_MARGIN = 36;
+
+static const int CRC_LENGTH = 4;
+
+// The frame length fields in the Buffer Descriptors are 16 bits wide.
+static const int MAX_FRAME_LENGTH = 0xFFFF;
+
+// Same layout as struct virtio_net_hdr in <linux/virtio_net.h>, which cannot be included from C++ code.
+// The TAP interface uses the legacy virtio format by default, so the fields are in host byte order.
+struct virtio_net_hdr
+{
+  uint8_t  flags;
+  uint8_t  gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+};
 
-static const char CRC_LENGTH = 4;
+static const uint8_t VIRTIO_NET_HDR_F_NEEDS_CSUM = 1;
+static const uint8_t VIRTIO_NET_HDR_GSO_NONE     = 0;
+static const uint8_t VIRTIO_NET_HDR_GSO_TCPV4    = 1;
+static const uint8_t VIRTIO_NET_HDR_GSO_TCPV6    = 4;
+static const uint8_t VIRTIO_NET_HDR_GSO_ECN      = 0x80;
+
+// In vnet_hdr mode, the TAP interface delivers GSO super-frames of up to 64 KiB of IP payload,
+// preceded by a virtio_net_hdr.
+static const int VNET_FRAME_BUFFER_SIZE = int( sizeof( virtio_net_hdr ) ) + 0x10000 + MTU_MARGIN;
 
 // The Linux and eCos drivers assume that the CRC is added at the end, althought it's actually discarded.
 static const bool APPEND_DUMMY_CRC = true;
 
+// The DMA engine writes whole 32-bit words to memory, so received frames are padded up to this alignment.
+static const int DMA_ALIGNMENT = 4;
+
+
+// The options string passed to ethernet_dpi_create() looks like "key1=value1,key2=value2".
+typedef std::map< std::string, std::string > option_map;
+
+typedef std::map< std::string, ethernet_dpi_memory_accessor * > memory_accessor_map;
+
+static memory_accessor_map s_memory_accessors;  // Protected by s_instance_table_mutex.
+
+// Reasons for the frame_discarded probe.
+static const int DISCARD_REASON_RELEASED = 0;  // The simulation has written the frame to memory or rejected it.
+static const int DISCARD_REASON_FLUSHED  = 1;  // Stale frame, see flush_tap_receive_buffer().
+static const int DISCARD_REASON_PAUSE    = 2;  // PAUSE frame consumed by the flow control logic.
+
+// Default number of frames that each instance can buffer in reactor mode.
+static const unsigned DEFAULT_REACTOR_RING_SLOT_COUNT = 64;
+
+// Identifiers and version numbers for the checkpoint data, see ethernet_dpi_save_state().
+static const uint32_t CHECKPOINT_PROCESS_MAGIC  = 0x45445053;  // "EDPS"
+static const uint32_t CHECKPOINT_INSTANCE_MAGIC = 0x45445049;  // "EDPI"
+static const uint32_t CHECKPOINT_VERSION        = 5;
+
+// Record types and other constants for the frame log, see class frame_log_writer.
+static const char FRAME_LOG_MAGIC[]       = "ETHDPIFL";
+static const char FRAME_LOG_INDEX_MAGIC[] = "ETHDPIIX";
+static const uint32_t FRAME_LOG_VERSION   = 1;
+static const char FRAME_LOG_RECEIVED      = 'R';
+static const char FRAME_LOG_SENT          = 'T';
+static const uint64_t FRAME_LOG_INDEX_INTERVAL = 1024;  // Records between index entries.
+
+// Event types for the trace ring, see class trace_ring. The values below 0x100 come from the Verilog side
+// and must match the ETHDPI_TRACE_xxx definitions in ethernet_dpi.v .
+static const uint32_t TRACE_TX_BD_START       = 1;
+static const uint32_t TRACE_TX_DMA_READ       = 2;
+static const uint32_t TRACE_TX_BD_DONE        = 3;
+static const uint32_t TRACE_RX_BD_START       = 4;
+static const uint32_t TRACE_RX_DMA_WRITE      = 5;
+static const uint32_t TRACE_RX_BD_DONE        = 6;
+static const uint32_t TRACE_RX_FRAME_REJECTED = 7;
+static const uint32_t TRACE_FRAME_RECEIVED    = 0x100;
+static const uint32_t TRACE_FRAME_SENT        = 0x101;
+
+// Default number of events that the trace ring can hold before the trace thread writes them out.
+static const unsigned DEFAULT_TRACE_RING_SIZE = 65536;
+static const size_t FRAME_LOG_FILE_BUFFER_SIZE = 1024 * 1024;
+
+// Bits in the MODER register, which the Verilog side passes to ethernet_dpi_configure_mac().
+static const uint32_t MODER_RXEN = 0x01;  // Receive Enable.
+static const uint32_t MODER_BRO  = 0x08;  // Reject Broadcast.
+static const uint32_t MODER_PRO  = 0x20;  // Promiscuous.
+
+// Bits in the CTRLMODER register, which the Verilog side passes to ethernet_dpi_configure_mac().
+static const uint32_t CTRLMODER_PASSALL = 1;  // Pass received control frames to the simulation.
+static const uint32_t CTRLMODER_RXFLOW  = 2;  // Honour received PAUSE frames.
+static const uint32_t CTRLMODER_TXFLOW  = 4;  // Allow sending PAUSE frames.
+
+// Clock cycles per pause quantum (512 bit times). The default matches a 100 Mbit/s link and a 50 MHz clock.
+static const uint64_t DEFAULT_PAUSE_QUANTUM_CYCLES = 256;
+
+
+// Helper class to serialise the checkpoint data. All integers are stored in little-endian byte order.
+
+class checkpoint_writer
+{
+  std::string * const m_data;
+
+public:
+  explicit checkpoint_writer ( std::string * const data )
+    : m_data( data )
+  {
+  }
+
+  void write_u8 ( const uint8_t val )
+  {
+    m_data->push_back( char( val ) );
+  }
+
+  void write_u32 ( const uint32_t val )
+  {
+    for ( int i = 0; i < 4; ++i )
+      write_u8( uint8_t( val >> ( 8 * i ) ) );
+  }
+
+  void write_u64 ( const uint64_t val )
+  {
+    write_u32( uint32_t( val ) );
+    write_u32( uint32_t( val >> 32 ) );
+  }
+
+  void write_bytes ( const void * const data, const size_t byte_count )
+  {
+    write_u32( uint32_t( byte_count ) );
+    m_data->append( (const char *) data, byte_count );
+  }
+
+  void write_string ( const std::string & str )
+  {
+    write_bytes( str.data(), str.size() );
+  }
+};
+
+
+class checkpoint_reader
+{
+  const uint8_t * m_pos;
+  const uint8_t * const m_end;
+
+public:
+  checkpoint_reader ( const void * const data, const size_t byte_count )
+    : m_pos( (const uint8_t *) data )
+    , m_end( (const uint8_t *) data + byte_count )
+  {
+  }
+
+  bool is_at_end ( void ) const { return m_pos == m_end; }
+
+  const void * read_raw ( const size_t byte_count )
+  {
+    if ( size_t( m_end - m_pos ) < byte_count )
+      throw std::runtime_error( "The checkpoint data is truncated." );
+
+    const void * const ret = m_pos;
+    m_pos += byte_count;
+    return ret;
+  }
+
+  uint8_t read_u8 ( void )
+  {
+    return *(const uint8_t *) read_raw( 1 );
+  }
+
+  uint32_t read_u32 ( void )
+  {
+    uint32_t ret = 0;
+
+    for ( int i = 0; i < 4; ++i )
+      ret |= uint32_t( read_u8() ) << ( 8 * i );
+
+    return ret;
+  }
+
+  uint64_t read_u64 ( void )
+  {
+    const uint64_t low = read_u32();
+    return low | ( uint64_t( read_u32() ) << 32 );
+  }
+
+  // Returns a pointer into the checkpoint data.
+  const void * read_bytes ( uint32_t * const byte_count )
+  {
+    *byte_count = read_u32();
+    return read_raw( *byte_count );
+  }
+
+  std::string read_string ( void )
+  {
+    uint32_t byte_count;
+    const char * const data = (const char *) read_bytes( &byte_count );
+    return std::string( data, byte_count );
+  }
+};
+
+class frame_log_writer;
+class frame_log_reader;
+class trace_ring;
+class traffic_generator;
+class latency_monitor;
+class dma_profile;
+class xdp_socket;
+class vhost_user_device;
+class shared_tap;
+
 class ethernet_dpi
 {
 private:
   bool m_print_informational_messages;
   std::string m_informational_message_prefix;
 
+  // The creation parameters are kept in order to re-create this instance when restoring a checkpoint.
+  std::string m_tap_interface_name;
+  std::string m_options;
+
   int m_tun_tap_clone_device;
   int m_socket;
   int m_mtu;
 
+  // In vnet_hdr mode, every frame read from or written to the TAP interface starts with a virtio_net_hdr,
+  // and the TAP interface may deliver GSO super-frames and frames with partial checksums.
+  // These are segmented and completed in segment_vnet_frame() before the simulation sees them.
+  bool m_use_vnet_hdr;
+  char * m_vnet_read_buffer;   // VNET_FRAME_BUFFER_SIZE bytes. Only used in vnet_hdr mode. With the reactor, only when flushing.
+  char * m_vnet_segment_buffer;
+
   char * m_send_buffer;
   char * m_receive_buffer;
+  size_t m_frame_buffer_size;
 
   int m_received_byte_count;
   int m_send_byte_count;
 
+  // Frames that have been received but not yet delivered to the simulation.
+  // They take precedence over the frames coming from the TAP interface.
+  std::deque< std::string > m_received_frame_queue;
+
+  ethernet_dpi_memory_accessor * m_backdoor_memory_accessor;  // NULL if the backdoor DMA mode is not enabled.
+
+  // Reactor mode, see class ethernet_dpi_reactor. The reactor thread fills the ring with received frames,
+  // and the simulation thread consumes them. Each side only writes to its own index,
+  // so the ring needs no locking. The indexes are free-running, use modulo m_reactor_ring_slot_count to get the slot.
+  bool m_use_reactor;
+  uint64_t m_reactor_registration_id;  // 0 if not registered.
+  unsigned m_reactor_ring_slot_count;
+  size_t m_reactor_ring_slot_size;     // Normally m_frame_buffer_size, see VNET_FRAME_BUFFER_SIZE.
+  char * m_reactor_ring;               // m_reactor_ring_slot_count slots of m_reactor_ring_slot_size bytes each.
+  int  * m_reactor_ring_frame_lengths;
+  std::atomic< unsigned > m_reactor_ring_head;  // Next slot to consume, only written by the simulation thread.
+  std::atomic< unsigned > m_reactor_ring_tail;  // Next slot to fill, only written by the reactor thread.
+  std::atomic< bool > m_reactor_rx_paused;      // Whether the reactor stopped watching our TAP interface because the ring was full.
+  std::atomic< bool > m_reactor_failed;         // If set, m_reactor_error_message is valid.
+  std::string m_reactor_error_message;
+
+  // Option "xdp", see class xdp_socket. NULL if the TAP interface is used instead.
+  xdp_socket * m_xdp_socket;
+
+  // Option "vhost_user", see class vhost_user_device. NULL if not enabled.
+  vhost_user_device * m_vhost_user_device;
+
+  // Option "shared_tap", see class shared_tap. NULL if not enabled.
+  shared_tap * m_shared_tap;
+  int m_shared_tap_slot;  // -1 if the instance has not been added yet.
+
+  // Record and replay modes, see class frame_log_writer. At most one of them is active.
+  // In replay mode, there is no TAP interface.
+  frame_log_writer * m_record_log;
+  frame_log_reader * m_replay_log;
+  bool m_replay_end_reported;
+
+  uint64_t m_cycle_count;  // Number of tick() calls so far, the time base for the frame log and the trace.
+
+  unsigned char m_last_ready_to_send;  // For the ready_to_send_changed probe.
+
+  trace_ring * m_trace_ring;  // NULL if option "trace" is not set.
+
+  // Generator mode, see class traffic_generator. Like in replay mode, there is no TAP interface.
+  traffic_generator * m_generator;
+
+  // Option "latency", see class latency_monitor. NULL if not enabled.
+  latency_monitor * m_latency_monitor;
+  std::string m_latency_log_filename;
+
+  // Created when the Verilog side reports the first frame, see its PROFILE_DMA parameter.
+  dma_profile * m_dma_profile;
+
+  // Option "check_tx_checksums", see check_sent_frame_checksums().
+  bool m_check_tx_checksums;
+  uint64_t m_checked_tx_frame_count;
+  uint64_t m_bad_tx_frame_count;
+
+  // IEEE 802.3x flow control, see configure_mac(). The pause times are measured in clock cycles.
+  uint32_t m_flow_control_flags;          // CTRLMODER_xxx bits.
+  uint8_t  m_station_mac_addr[ 6 ];       // Source address of the PAUSE frames.
+  uint64_t m_pause_quantum_cycles;        // Option "pause_quantum_cycles".
+  uint64_t m_tx_paused_until_cycle;       // The transmitter is paused until this cycle, see process_received_pause_frame().
+  bool     m_is_pause_frame_received;     // For the RXC interrupt, see take_pause_frame_received_event().
+  unsigned m_pause_watermark;             // Option "pause_watermark", 0 if disabled.
+  uint16_t m_pause_time;                  // Option "pause_time", in pause quanta.
+  bool     m_is_peer_paused;              // Whether the reactor ring has reached the watermark.
+  uint64_t m_peer_pause_refresh_cycle;    // When to repeat the PAUSE frame if the ring has not drained yet.
+
+  // Option "rx_filter=auto", see attach_auto_rx_filter().
+  bool m_use_auto_rx_filter;
+  std::vector< uint16_t > m_rx_filter_ethertypes;  // Option "rx_filter_ethertypes", empty means all.
+  uint32_t m_rx_filter_moder;                      // The MODER value the filter or the shared TAP interface was set up for, 0 if none yet.
+
 public:
+  // If 'is_restoring_checkpoint' is true, the TAP interface is not flushed, so that no frames are lost
+  // when continuing a simulation from a checkpoint.
   ethernet_dpi ( const char * tap_interface_name,
                  unsigned char print_informational_messages,
-                 const char * informational_message_prefix );
+                 const char * informational_message_prefix,
+                 const char * options,
+                 bool is_restoring_checkpoint );
   ~ethernet_dpi ( void );
 
+  void save_checkpoint ( std::string * data );
+  void restore_checkpoint ( checkpoint_reader * reader );
+  static ethernet_dpi * create_from_checkpoint ( checkpoint_reader * reader );
+
   void tick ( int * received_frame_byte_count,
               unsigned char * ready_to_send );
 
+  void configure_mac ( uint32_t moder, uint32_t ctrlmoder, uint64_t mac_addr );
+  void send_pause_frame ( uint16_t pause_time );
+  bool take_pause_frame_received_event ( void );
+
   void new_tx_frame ( void );
   void add_byte_to_tx_frame ( char data );
   void send_tx_frame ( void );
@@ -106,16 +465,138 @@ public:
   void discard_received_frame ( void );
   void flush_tap_receive_buffer ( void );
 
+  bool is_backdoor_dma_enabled ( void ) const { return m_backdoor_memory_accessor != NULL; }
+  void backdoor_send_tx_frame ( uint32_t addr, int byte_count );
+  void backdoor_write_received_frame ( uint32_t addr, int byte_count );
+
+  void trace ( uint32_t event_type, uint32_t bd_index, uint32_t addr, uint32_t data );
+
+  void profile_dma_frame ( bool is_rx,
+                           int byte_count,
+                           int queue_cycles,
+                           int dma_cycles,
+                           int beat_count,
+                           int ack_wait_cycles,
+                           int wait_state_cycles,
+                           int bus_error_count );
+
+  void reactor_receive_frames ( void );  // Only called from the reactor thread.
+
+  bool prepare_to_wait_for_activity ( std::vector< pollfd > * polled_fds, bool * should_poll_reactor );
+
 private:
   void init ( const char * tap_interface_name,
               unsigned char print_informational_messages,
-              const char * informational_message_prefix );
+              const char * informational_message_prefix,
+              const char * options,
+              bool is_restoring_checkpoint );
+  void open_tap ( const char * tap_interface_name,
+                  int requested_mtu,
+                  bool configure_interface,
+                  const std::string & ip_addr,
+                  bool is_multi_queue );
+  void attach_shared_tap ( const char * tap_interface_name,
+                           int requested_mtu,
+                           bool configure_interface,
+                           const std::string & ip_addr,
+                           unsigned ring_size );
+  void open_xdp ( const char * interface_name, int requested_mtu, const std::string & ip_addr, unsigned ring_size );
   void close_tap ( void );
   void close_socket ( void );
   void release_resources ( void );
   int receive_frame ( void );
+  int read_frame ( char * buffer );
+  int get_tap_read_size ( void ) const;
+  int segment_vnet_frame ( const char * data, int byte_count );
+  int build_tcp_segment ( char * dest,
+                          const uint8_t * frame,
+                          int l3_offset,
+                          int l4_offset,
+                          int header_length,
+                          bool is_ipv4,
+                          const uint8_t * payload,
+                          int payload_length,
+                          int segment_index,
+                          int payload_offset,
+                          bool is_last_segment );
+  int take_frame_from_reactor_ring ( void );
+  int take_frame_from_shared_tap ( void );
+  void set_reactor_rx_interest ( bool is_enabled );
+  void poll_network ( int * received_frame_byte_count,
+                      unsigned char * ready_to_send );
+  void update_flow_control ( unsigned char * ready_to_send );
+  bool process_received_pause_frame ( void );
+  void attach_auto_rx_filter ( void );
+  void attach_rx_filter ( const std::vector< sock_filter > & program );
+  int build_pause_frame ( char * frame, uint16_t pause_time ) const;
+  void send_frame ( const char * frame, int byte_count );
+  void write_frame_to_tap ( const char * frame, int byte_count );
+  void write_frame_to_fd ( int fd, const char * frame, int byte_count );
+  void replay_received_frames ( void );
+  void check_sent_frame_against_replay_log ( const char * frame, int byte_count );
+  void report_replay_log_end ( void );
+  void check_sent_frame_checksums ( void );
+  void print_checksum_summary ( void );
+  void print_latency_report ( void );
+};
+
+
+// The reactor is a single background thread that serves all Ethernet DPI instances in reactor mode.
+// It waits for incoming frames on all their TAP interfaces with a single epoll set,
+// and reads the frames into the per-instance rings. This way, ethernet_dpi::tick() does not need
+// to make any system calls, so the cost of many instances does not grow with the number
+// of system calls per simulated clock cycle.
+//
+// The reactor thread is started when the first instance registers, and it is stopped
+// when the last one unregisters.
+
+class ethernet_dpi_reactor
+{
+public:
+  static uint64_t register_instance ( ethernet_dpi * instance, int fd );
+  static void unregister_instance ( uint64_t registration_id, int fd );
+  static void set_rx_interest ( uint64_t registration_id, int fd, bool is_enabled );
+
+  // See wait_for_activity(). Returns the file descriptor to poll, or -1 if the reactor is not running.
+  static int begin_waiting_for_activity ( void );
+  static void end_waiting_for_activity ( void );
+
+private:
+  typedef std::map< uint64_t, ethernet_dpi * > instance_map;
+
+  // While the simulation thread is waiting for activity, the reactor thread signals this event
+  // after reading frames. Only the simulation thread starts and stops the reactor, so it can use
+  // this file descriptor without locking the mutex.
+  static int s_activity_event_fd;
+  static std::atomic< bool > s_is_simulation_waiting;
+
+  // The mutex protects all static members below. The reactor thread holds it while it is dispatching events,
+  // so that no instance can unregister during that time.
+  static pthread_mutex_t s_mutex;
+  static int s_epoll_fd;
+  static int s_wakeup_event_fd;  // Its epoll registration id is 0.
+  static bool s_is_thread_running;
+  static bool s_should_stop;
+  static pthread_t s_thread;
+  static instance_map s_instances;
+  static uint64_t s_next_registration_id;
+
+  static void start ( void );
+  static void stop ( void );
+  static void * thread_main ( void * );
 };
 
+pthread_mutex_t ethernet_dpi_reactor::s_mutex = PTHREAD_MUTEX_INITIALIZER;
+int ethernet_dpi_reactor::s_epoll_fd = -1;
+int ethernet_dpi_reactor::s_wakeup_event_fd = -1;
+int ethernet_dpi_reactor::s_activity_event_fd = -1;
+std::atomic< bool > ethernet_dpi_reactor::s_is_simulation_waiting( false );
+bool ethernet_dpi_reactor::s_is_thread_running = false;
+bool ethernet_dpi_reactor::s_should_stop = false;
+pthread_t ethernet_dpi_reactor::s_thread;
+ethernet_dpi_reactor::instance_map ethernet_dpi_reactor::s_instances;
+uint64_t ethernet_dpi_reactor::s_next_registration_id = 1;
+
 
 static std::string format_msg_v ( const char * format_str, va_list arg_list )
 {
@@ -217,6 +698,64 @@ static std::string ip_address_to_text ( const in_addr * const addr )
 }
 
 
+// Splits an options string like "key1=value1,key2=value2" into its components.
+// A key without a value, like "key1", gets the value "1".
+
+static option_map parse_options ( const char * const options )
+{
+  option_map ret;
+
+  if ( options == NULL )
+    return ret;
+
+  const char * p = options;
+
+  while ( *p != 0 )
+  {
+    const char * const end = p + strcspn( p, "," );
+
+    const std::string option( p, end );
+
+    if ( !option.empty() )
+    {
+      const size_t equal_pos = option.find( '=' );
+
+      const std::string key   = option.substr( 0, equal_pos );
+      const std::string value = equal_pos == std::string::npos ? "1" : option.substr( equal_pos + 1 );
+
+      if ( key.empty() )
+        throw std::runtime_error( format_msg( "Invalid option \"%s\".", option.c_str() ) );
+
+      if ( ret.find( key ) != ret.end() )
+        throw std::runtime_error( format_msg( "Option \"%s\" specified more than once.", key.c_str() ) );
+
+      ret[ key ] = value;
+    }
+
+    p = ( *end == 0 ) ? end : end + 1;
+  }
+
+  return ret;
+}
+
+
+// Removes the given option from the map and returns its value, or the default value if not present.
+
+static std::string take_option ( option_map * const options,
+                                 const char * const key,
+                                 const char * const default_value )
+{
+  const option_map::iterator it = options->find( key );
+
+  if ( it == options->end() )
+    return default_value;
+
+  const std::string ret = it->second;
+  options->erase( it );
+  return ret;
+}
+
+
 static void close_a ( const int fd )
 {
   for ( ; ; )
@@ -233,464 +772,8100 @@ static void close_a ( const int fd )
 }
 
 
-ethernet_dpi::ethernet_dpi ( const char * const tap_interface_name,
-                             const unsigned char print_informational_messages,
-                             const char * const informational_message_prefix )
- : m_tun_tap_clone_device( -1 )
- , m_socket( -1 )
- , m_send_buffer( NULL )
- , m_receive_buffer( NULL )
- , m_received_byte_count( 0 )
- , m_send_byte_count( 0 )
+// ------------------------- Frame log for the record and replay modes -------------------------
+//
+// The log file is written sequentially, so it can grow to any size. It starts with a header,
+// followed by one record per frame in the order in which the events happened:
+//   header: magic "ETHDPIFL", u32 version, u32 MTU
+//   record: u8 type ('R' for received, 'T' for sent), u64 cycle, u32 frame length, frame data
+// All integers are little-endian. The cycle is the value of ethernet_dpi::m_cycle_count.
+//
+// Every FRAME_LOG_INDEX_INTERVAL records, an entry with the record's cycle and file offset (u64 each)
+// is appended to the index file "<log file>.idx", after its header (magic "ETHDPIIX", u32 version).
+// The index allows jumping to a given cycle without reading the log from the beginning.
+// The index file is optional when replaying.
+
+static std::string get_frame_log_index_filename ( const std::string & log_filename )
 {
-  try
-  {
-    init( tap_interface_name,
-          print_informational_messages,
-          informational_message_prefix );
-  }
-  catch ( ... )
-  {
-    release_resources();
-    throw;
-  }
+  return log_filename + ".idx";
 }
 
 
-ethernet_dpi::~ethernet_dpi ( void )
+static void write_to_log_file ( FILE * const f, const std::string & data, const std::string & filename )
 {
-  release_resources();
+  if ( data.size() != fwrite( data.data(), 1, data.size(), f ) )
+    throw std::runtime_error( format_error_message( errno, "Error writing to file \"%s\": ", filename.c_str() ) );
 }
 
 
-void ethernet_dpi::release_resources ( void )
+// Returns false if the end of the file has been reached before reading anything.
+
+static bool read_from_log_file ( FILE * const f, void * const buffer, const size_t byte_count, const std::string & filename )
 {
-  if ( m_tun_tap_clone_device != -1 )
-    close_tap();
+  const size_t read_byte_count = fread( buffer, 1, byte_count, f );
 
-  if ( m_socket != -1 )
-    close_socket();
+  if ( read_byte_count == byte_count )
+    return true;
 
-  free( m_send_buffer );
-  m_send_buffer = NULL;
+  if ( ferror( f ) )
+    throw std::runtime_error( format_msg( "Error reading from file \"%s\".", filename.c_str() ) );
 
-  free( m_receive_buffer );
-  m_receive_buffer = NULL;
+  if ( read_byte_count == 0 )
+    return false;
+
+  throw std::runtime_error( format_msg( "File \"%s\" is truncated.", filename.c_str() ) );
 }
 
 
-void ethernet_dpi::init ( const char * const tap_interface_name,
-                          const unsigned char print_informational_messages,
-                          const char * const informational_message_prefix )
+static void close_log_file ( FILE * const f, const std::string & filename )
 {
-  if ( tap_interface_name == NULL ||
-       tap_interface_name[0] == 0 ||
-       strlen(tap_interface_name) >= IFNAMSIZ )
+  if ( 0 != fclose( f ) )
   {
-    throw std::runtime_error( "Invalid tap_interface_name parameter." );
+    // This routine is called from destructors, so the error cannot be thrown.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, format_error_message( errno, "Error closing file \"%s\": ", filename.c_str() ).c_str() );
+    fflush( stderr );
   }
+}
 
-  switch ( print_informational_messages )
+
+class frame_log_writer
+{
+  std::string m_filename;
+  FILE * m_file;
+  FILE * m_index_file;
+  uint64_t m_offset;
+  uint64_t m_record_count;
+
+public:
+  frame_log_writer ( const char * const filename, const int mtu )
+    : m_filename( filename )
+    , m_file( NULL )
+    , m_index_file( NULL )
+    , m_offset( 0 )
+    , m_record_count( 0 )
   {
-  case 0:
-    m_print_informational_messages = false;
-    break;
+    try
+    {
+      const std::string index_filename = get_frame_log_index_filename( m_filename );
 
-  case 1:
-    m_print_informational_messages = true;
-    break;
+      m_file = fopen( filename, "wb" );
 
-  default:
-    throw std::runtime_error( "Invalid print_informational_messages parameter." );
-  }
+      if ( m_file == NULL )
+        throw std::runtime_error( format_error_message( errno, "Error creating file \"%s\": ", filename ) );
 
-  m_informational_message_prefix = informational_message_prefix ? informational_message_prefix : "";
+      m_index_file = fopen( index_filename.c_str(), "wb" );
 
-  const char tun_tap_clone_device_name[] = "/dev/net/tun";
+      if ( m_index_file == NULL )
+        throw std::runtime_error( format_error_message( errno, "Error creating file \"%s\": ", index_filename.c_str() ) );
 
-  m_tun_tap_clone_device = open( tun_tap_clone_device_name, O_RDWR );
+      setvbuf( m_file, NULL, _IOFBF, FRAME_LOG_FILE_BUFFER_SIZE );
 
-  if ( m_tun_tap_clone_device == -1 )
+      std::string header( FRAME_LOG_MAGIC );
+      checkpoint_writer writer( &header );
+      writer.write_u32( FRAME_LOG_VERSION );
+      writer.write_u32( uint32_t( mtu ) );
+      write_to_log_file( m_file, header, m_filename );
+      m_offset = header.size();
+
+      std::string index_header( FRAME_LOG_INDEX_MAGIC );
+      checkpoint_writer index_writer( &index_header );
+      index_writer.write_u32( FRAME_LOG_VERSION );
+      write_to_log_file( m_index_file, index_header, index_filename );
+    }
+    catch ( ... )
+    {
+      close();
+      throw;
+    }
+  }
+
+  ~frame_log_writer ( void )
   {
-    throw std::runtime_error( format_error_message( errno,
-                                                    "Error opening TUN/TAP clone device \"%s\": ",
-                                                    tun_tap_clone_device_name ) );
+    close();
   }
 
-  // If the TAP device exists, attempt to open it. This should succeed if the
-  // parameters match the ones used at creation time and the user is the owner.
-  // If the TAP device does not exist, attempt to create it. The user must be root
-  // or at least have the CAP_NET_ADMIN capability.
-  // Unfortunately, there does not seem to be a way to open the TAP interface only if
-  // it already exists, and not to attempt to create it if it does not.
+  void write_record ( const char type, const uint64_t cycle, const void * const data, const int byte_count )
+  {
+    if ( m_record_count % FRAME_LOG_INDEX_INTERVAL == 0 )
+    {
+      std::string entry;
+      checkpoint_writer writer( &entry );
+      writer.write_u64( cycle );
+      writer.write_u64( m_offset );
+      write_to_log_file( m_index_file, entry, get_frame_log_index_filename( m_filename ) );
+    }
 
-  ifreq ifr_setiff;
-  memset( &ifr_setiff, 0, sizeof(ifr_setiff) );
-  ifr_setiff.ifr_flags = IFF_TAP |  // Raw ethernet, the alternative would be TUN.
-                         IFF_NO_PI; // No Packet Information (no extra header with procotol ID and flags)
-  strncpy( ifr_setiff.ifr_name, tap_interface_name, IFNAMSIZ );
+    std::string record;
+    checkpoint_writer writer( &record );
+    writer.write_u8( uint8_t( type ) );
+    writer.write_u64( cycle );
+    writer.write_bytes( data, byte_count );
+    write_to_log_file( m_file, record, m_filename );
 
-  if ( ioctl( m_tun_tap_clone_device, TUNSETIFF, (void *) &ifr_setiff ) == -1 )
-  {
-    throw std::runtime_error( format_error_message( errno,
-                                                    "Error opening/creating TAP interface \"%s\": ",
-                                                    tap_interface_name ) );
+    m_offset += record.size();
+    ++m_record_count;
   }
 
-  // Create a socket. We need one in order to retrieve some information from a network interface.
-  m_socket = socket( AF_INET, SOCK_DGRAM, 0 );
-
-  if ( m_socket == -1 )
+private:
+  void close ( void )
   {
-    throw std::runtime_error( format_error_message( errno,
-                                                    "Error creating a socket: ") );
+    if ( m_index_file != NULL )
+    {
+      close_log_file( m_index_file, get_frame_log_index_filename( m_filename ) );
+      m_index_file = NULL;
+    }
+
+    if ( m_file != NULL )
+    {
+      close_log_file( m_file, m_filename );
+      m_file = NULL;
+    }
   }
+};
 
 
-  // Get the IP address of the TAP interface.
-  ifreq ifr_getipaddr;
-  memset( &ifr_getipaddr, 0, sizeof(ifr_getipaddr) );
-  strncpy( ifr_getipaddr.ifr_name, tap_interface_name, IFNAMSIZ );
-  if ( ioctl( m_socket, SIOCGIFADDR, (void *)&ifr_getipaddr ) == -1 )
-  {
-    throw std::runtime_error( format_error_message( errno,
-                                                    "Error getting the IP address of TAP interface \"%s\": ",
-                                                    tap_interface_name ) );
-  }
+// Reads the frame log one record ahead, so that the caller can see the next event before consuming it.
 
-  // Get the MTU of the TAP interface.
-  ifreq ifr_getmtu;
-  memset( &ifr_getmtu, 0, sizeof(ifr_getmtu) );
-  strncpy( ifr_getmtu.ifr_name, tap_interface_name, IFNAMSIZ );
+class frame_log_reader
+{
+  std::string m_filename;
+  FILE * m_file;
+  int m_mtu;
 
-  if ( ioctl( m_socket, SIOCGIFMTU, (void *) &ifr_getmtu ) == -1 )
-  {
-    throw std::runtime_error( format_error_message( errno,
-                                                    "Error getting the MTU for TAP interface \"%s\": ",
-                                                    tap_interface_name ) );
-  }
+  bool m_has_next_record;
+  char m_next_record_type;
+  uint64_t m_next_record_cycle;
+  std::string m_next_record_data;
 
-  m_mtu = ifr_getmtu.ifr_mtu;
+  static const size_t HEADER_SIZE = 16;
+  static const size_t INDEX_HEADER_SIZE = 12;
+  static const size_t INDEX_ENTRY_SIZE = 16;
+  static const size_t RECORD_HEADER_SIZE = 13;
 
-  close_socket();  // We don't really need the socket any more.
+public:
+  explicit frame_log_reader ( const char * const filename )
+    : m_filename( filename )
+    , m_file( NULL )
+    , m_mtu( 0 )
+    , m_has_next_record( false )
+    , m_next_record_type( 0 )
+    , m_next_record_cycle( 0 )
+  {
+    m_file = fopen( filename, "rb" );
 
-  if ( m_print_informational_messages )
+    if ( m_file == NULL )
+      throw std::runtime_error( format_error_message( errno, "Error opening file \"%s\": ", filename ) );
+
+    try
+    {
+      setvbuf( m_file, NULL, _IOFBF, FRAME_LOG_FILE_BUFFER_SIZE );
+
+      uint8_t header[ HEADER_SIZE ];
+
+      if ( !read_from_log_file( m_file, header, sizeof(header), m_filename ) ||
+           0 != memcmp( header, FRAME_LOG_MAGIC, 8 ) )
+      {
+        throw std::runtime_error( format_msg( "File \"%s\" is not a frame log.", filename ) );
+      }
+
+      checkpoint_reader reader( header + 8, sizeof(header) - 8 );
+
+      if ( reader.read_u32() != FRAME_LOG_VERSION )
+        throw std::runtime_error( format_msg( "The version of frame log \"%s\" is not supported.", filename ) );
+
+      m_mtu = int( reader.read_u32() );
+
+      advance();
+    }
+    catch ( ... )
+    {
+      close_log_file( m_file, m_filename );
+      throw;
+    }
+  }
+
+  ~frame_log_reader ( void )
   {
-    printf( "%sUsing TAP interface \"%s\", IP addr: %s, MTU: %d.\n",
-            m_informational_message_prefix.c_str(),
-            tap_interface_name,
-            ip_address_to_text( &((const sockaddr_in *)&ifr_getipaddr.ifr_addr)->sin_addr ).c_str(),
-            m_mtu );
-    fflush( stdout );
+    close_log_file( m_file, m_filename );
   }
 
-  const size_t buffer_size = m_mtu + MTU_MARGIN + 1 + CRC_LENGTH;  // We read one byte more than the MTU in order to know if the frame is longer than the maximum allowed.
+  int get_mtu ( void ) const { return m_mtu; }
 
-  m_send_buffer    = (char *) malloc( buffer_size );
-  m_receive_buffer = (char *) malloc( buffer_size );
+  bool has_next_record ( void ) const { return m_has_next_record; }
+  char get_next_record_type ( void ) const { assert( m_has_next_record ); return m_next_record_type; }
+  uint64_t get_next_record_cycle ( void ) const { assert( m_has_next_record ); return m_next_record_cycle; }
+  const std::string & get_next_record_data ( void ) const { assert( m_has_next_record ); return m_next_record_data; }
 
-  if ( m_send_buffer == NULL || m_receive_buffer == NULL )
-    throw std::bad_alloc();
+  void advance ( void )
+  {
+    uint8_t record_header[ RECORD_HEADER_SIZE ];
 
+    m_has_next_record = read_from_log_file( m_file, record_header, sizeof(record_header), m_filename );
 
-  // Notes about the TAP interface's receive buffer.
-  //
-  // From empiric evidence under Ubuntu 10.04, it looks like a persistent TAP interface drops
-  // all incoming packets if no-one holds a file handle to it.
-  // I used Thomas Habets's 'arping' tool in order to overload the receive buffer between the
-  // open() and recv() calls, and I eventually got this error message:
-  //    arping: libnet_write(): libnet_write_link(): only -1 bytes written (No buffer space available)
-  //    202 packets transmitted, 0 packets received, 100% unanswered (0 extra)
-  // I then repeatedly called recv() and got 201 packets with 42 bytes each, that is a little over 8 KB's
-  // worth of data.
-  // Afterwards, I tested the following scenario:
-  //  - open(TAP interface)
-  //  - overflow the buffer with arping
-  //  - kill the process
-  //  - open(TAP interface)
-  //  - recv all packets
-  // The receive buffer still delivered 100 stale packets. It looks like the receive buffer is not cleared
-  // when the last handle is closed on the TAP interface.
-  //
-  // Therefore, I think it's good idea to flush the receive buffer at this point.
+    if ( !m_has_next_record )
+      return;
 
-  flush_tap_receive_buffer();
-}
+    checkpoint_reader reader( record_header, sizeof(record_header) );
+    m_next_record_type  = char( reader.read_u8() );
+    m_next_record_cycle = reader.read_u64();
+    const uint32_t byte_count = reader.read_u32();
 
+    if ( ( m_next_record_type != FRAME_LOG_RECEIVED && m_next_record_type != FRAME_LOG_SENT ) ||
+         byte_count > uint32_t( m_mtu + MTU_MARGIN + CRC_LENGTH ) )
+    {
+      throw std::runtime_error( format_msg( "File \"%s\" is corrupt.", m_filename.c_str() ) );
+    }
 
-void ethernet_dpi::flush_tap_receive_buffer ( void )
-{
-  for ( ; ; )
+    m_next_record_data.resize( byte_count );
+
+    if ( byte_count != 0 &&
+         !read_from_log_file( m_file, &m_next_record_data[ 0 ], byte_count, m_filename ) )
+    {
+      throw std::runtime_error( format_msg( "File \"%s\" is truncated.", m_filename.c_str() ) );
+    }
+  }
+
+  // Positions the log at the first record after the given cycle. Uses a binary search
+  // in the index file if available, so that only a few records need to be read.
+
+  void seek_after_cycle ( const uint64_t cycle )
   {
-    const int received_byte_count = receive_frame();
+    off_t start_offset = HEADER_SIZE;
 
-    if ( received_byte_count == 0 )
-      break;
+    const std::string index_filename = get_frame_log_index_filename( m_filename );
+    FILE * const index_file = fopen( index_filename.c_str(), "rb" );
 
-    if ( false )  // Flush silently.
+    if ( index_file != NULL )
     {
-      if ( m_print_informational_messages )
+      try
       {
-        printf( "%sDiscarding stale frame with %d bytes.\n",
-                m_informational_message_prefix.c_str(),
-                received_byte_count );
-        fflush( stdout );
+        uint8_t index_header[ INDEX_HEADER_SIZE ];
+
+        if ( read_from_log_file( index_file, index_header, sizeof(index_header), index_filename ) &&
+             0 == memcmp( index_header, FRAME_LOG_INDEX_MAGIC, 8 ) &&
+             0 == fseeko( index_file, 0, SEEK_END ) )
+        {
+          const off_t index_file_size = ftello( index_file );
+          const uint64_t entry_count = index_file_size < off_t( INDEX_HEADER_SIZE ) ? 0 : ( index_file_size - INDEX_HEADER_SIZE ) / INDEX_ENTRY_SIZE;
+
+          // Find the last entry whose cycle is not after the given one.
+          uint64_t low  = 0;
+          uint64_t high = entry_count;
+
+          while ( low < high )
+          {
+            const uint64_t middle = low + ( high - low ) / 2;
+            uint8_t entry[ INDEX_ENTRY_SIZE ];
+
+            if ( 0 != fseeko( index_file, off_t( INDEX_HEADER_SIZE + middle * INDEX_ENTRY_SIZE ), SEEK_SET ) ||
+                 !read_from_log_file( index_file, entry, sizeof(entry), index_filename ) )
+            {
+              throw std::runtime_error( format_msg( "Error reading from file \"%s\".", index_filename.c_str() ) );
+            }
+
+            checkpoint_reader reader( entry, sizeof(entry) );
+            const uint64_t entry_cycle = reader.read_u64();
+            const uint64_t entry_offset = reader.read_u64();
+
+            if ( entry_cycle <= cycle )
+            {
+              start_offset = off_t( entry_offset );
+              low = middle + 1;
+            }
+            else
+              high = middle;
+          }
+        }
       }
+      catch ( ... )
+      {
+        close_log_file( index_file, index_filename );
+        throw;
+      }
+
+      close_log_file( index_file, index_filename );
+    }
+
+    if ( 0 != fseeko( m_file, start_offset, SEEK_SET ) )
+      throw std::runtime_error( format_error_message( errno, "Error seeking in file \"%s\": ", m_filename.c_str() ) );
+
+    for ( advance(); m_has_next_record && m_next_record_cycle <= cycle; advance() )
+    {
     }
   }
+};
 
-  m_received_byte_count = 0;
-}
 
+// ------------------------- Binary trace ring -------------------------
 
-void ethernet_dpi::add_byte_to_tx_frame ( const char data )
+struct trace_record
 {
-  if ( m_send_byte_count >= m_mtu + MTU_MARGIN )
-    throw std::runtime_error( format_msg( "The frame size exceeds the MTU limit of %d.", m_mtu ) );
+  uint64_t cycle;
+  uint32_t event_type;
+  uint32_t bd_index;
+  uint32_t addr;
+  uint32_t data;
+};
 
-  const bool dump_tx_byte = false;
 
-  if ( dump_tx_byte )
-    printf( "Adding tx byte: 0x%02X\n", (unsigned char)data );
+// Formatting and writing a text line for every traced event would slow the simulation down
+// by orders of magnitude. Instead, the simulation thread stores the events as fixed-size binary records
+// in this ring, and a background thread renders them as text into the trace file.
+//
+// The simulation thread is the only one that writes m_tail, and the trace thread is the only one
+// that writes m_head, so the ring needs no locking. If the ring is full, new events are dropped
+// and counted, so that tracing never stalls the simulation. The trace file reports how many were lost.
 
-  m_send_buffer[ m_send_byte_count ] = data;
+class trace_ring
+{
+  std::string m_filename;
+  FILE * m_file;
+  trace_record * m_records;
+  unsigned m_slot_count;
+  std::atomic< unsigned > m_head;  // Next record to write out, only written by the trace thread.
+  std::atomic< unsigned > m_tail;  // Next record to fill, only written by the simulation thread.
+  std::atomic< uint64_t > m_lost_event_count;
+  uint64_t m_reported_lost_event_count;  // Only used by the trace thread.
+  std::atomic< bool > m_should_stop;
+  bool m_is_thread_running;
+  pthread_t m_thread;
 
-  ++m_send_byte_count;
-}
+public:
+  trace_ring ( const std::string & filename, const unsigned slot_count )
+    : m_filename( filename )
+    , m_file( NULL )
+    , m_records( NULL )
+    , m_slot_count( slot_count )
+    , m_head( 0 )
+    , m_tail( 0 )
+    , m_lost_event_count( 0 )
+    , m_reported_lost_event_count( 0 )
+    , m_should_stop( false )
+    , m_is_thread_running( false )
+  {
+    m_records = (trace_record *) malloc( sizeof( trace_record ) * slot_count );
 
+    if ( m_records == NULL )
+      throw std::bad_alloc();
 
-void ethernet_dpi::new_tx_frame ( void )
-{
-  m_send_byte_count = 0;
-}
+    m_file = fopen( filename.c_str(), "w" );
 
+    if ( m_file == NULL )
+    {
+      free( m_records );
+      throw std::runtime_error( format_error_message( errno, "Cannot create trace file \"%s\": ", filename.c_str() ) );
+    }
 
-void ethernet_dpi::send_tx_frame ( void )
-{
-  if ( m_send_byte_count <= 0 )
-      throw std::runtime_error( "The frame size exceeds the MTU." );
+    const int res = pthread_create( &m_thread, NULL, thread_main, this );
+
+    if ( res != 0 )
+    {
+      fclose( m_file );
+      free( m_records );
+      throw std::runtime_error( format_error_message( res, "Error creating the trace thread: " ) );
+    }
+
+    m_is_thread_running = true;
+  }
 
-  const bool dump_tx_frame = false;
-  if ( dump_tx_frame )
+  ~trace_ring ( void )
   {
-    printf( "Sending frame of %d bytes, data:\n", m_send_byte_count );
-    for ( int i = 0; i < m_send_byte_count; ++i )
-      printf( "%02X ", (unsigned char)m_send_buffer[i] );
-    printf( "\n" );
+    m_should_stop = true;
+
+    const int res = pthread_join( m_thread, NULL );
+    assert( res == 0 );
+    (void) res;
+
+    if ( 0 != fclose( m_file ) )
+    {
+      fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, format_error_message( errno, "Error closing trace file \"%s\": ", m_filename.c_str() ).c_str() );
+      fflush( stderr );
+    }
+
+    free( m_records );
   }
 
-  for ( ; ; )  // Repeat if EINTR.
+  // Only called from the simulation thread.
+
+  void add ( const uint64_t cycle,
+             const uint32_t event_type,
+             const uint32_t bd_index,
+             const uint32_t addr,
+             const uint32_t data )
   {
-    const ssize_t sent_byte_count = write( m_tun_tap_clone_device,
-                                           m_send_buffer,
-                                           m_send_byte_count );
-    if ( sent_byte_count == 0 )
+    const unsigned tail = m_tail.load( std::memory_order_relaxed );
+
+    if ( tail - m_head.load( std::memory_order_acquire ) == m_slot_count )
     {
-      throw std::runtime_error( "Cannot write data to the TAP interface." );
+      m_lost_event_count.fetch_add( 1, std::memory_order_relaxed );
+      return;
     }
 
-    if ( sent_byte_count == -1 )
+    trace_record * const record = &m_records[ tail % m_slot_count ];
+
+    record->cycle      = cycle;
+    record->event_type = event_type;
+    record->bd_index   = bd_index;
+    record->addr       = addr;
+    record->data       = data;
+
+    m_tail.store( tail + 1, std::memory_order_release );
+  }
+
+private:
+  static void * thread_main ( void * const arg )
+  {
+    trace_ring * const this_obj = (trace_ring *) arg;
+
+    for ( ; ; )
     {
-      const int errno_value = errno;
+      // Read the flag before writing out the records, so that no events are left behind when stopping.
+      const bool should_stop = this_obj->m_should_stop.load();
 
-      if ( errno_value == EINTR )
-        continue;
+      const bool has_written_records = this_obj->write_pending_records();
 
-      throw std::runtime_error( format_error_message( errno, "Error writing data to the TAP interface: " ) );
+      if ( should_stop )
+        break;
+
+      if ( !has_written_records )
+      {
+        // The simulation thread does not signal new events, as that would cost a system call each time.
+        // Polling every millisecond is often enough for the default ring size.
+        usleep( 1000 );
+      }
+    }
+
+    this_obj->write_pending_records();
+
+    return NULL;
+  }
+
+  // Returns whether there were any records to write.
+
+  bool write_pending_records ( void )
+  {
+    const unsigned tail = m_tail.load( std::memory_order_acquire );
+    unsigned head = m_head.load( std::memory_order_relaxed );
+
+    if ( head == tail )
+    {
+      report_lost_events();
+      return false;
     }
 
-    if ( sent_byte_count != m_send_byte_count )
+    for ( ; head != tail; ++head )
     {
-      throw std::runtime_error( "Error writing data to the TAP interface, only part of the ethernet frame could be written." );
+      write_record( m_records[ head % m_slot_count ] );
+
+      // Release every slot straight away, so that the simulation thread can reuse it.
+      m_head.store( head + 1, std::memory_order_release );
     }
 
-    break;
+    report_lost_events();
+
+    // The file is only flushed when the ring is empty, and not once per line.
+    if ( 0 != fflush( m_file ) )
+    {
+      fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, format_error_message( errno, "Error writing to trace file \"%s\": ", m_filename.c_str() ).c_str() );
+      fflush( stderr );
+    }
+
+    return true;
   }
-}
 
+  void report_lost_events ( void )
+  {
+    const uint64_t lost_event_count = m_lost_event_count.load( std::memory_order_relaxed );
+
+    if ( lost_event_count == m_reported_lost_event_count )
+      return;
 
-void ethernet_dpi::close_tap ( void )
+    fprintf( m_file, "The trace ring was full, %llu events have been lost.\n",
+             (unsigned long long)( lost_event_count - m_reported_lost_event_count ) );
+
+    m_reported_lost_event_count = lost_event_count;
+  }
+
+  void write_record ( const trace_record & r )
+  {
+    const unsigned long long cycle = (unsigned long long) r.cycle;
+
+    switch ( r.event_type )
+    {
+    case TRACE_TX_BD_START:
+      fprintf( m_file, "%llu: Tx BD %u: Start sending %u bytes from address 0x%08X.\n", cycle, r.bd_index, r.data, r.addr );
+      break;
+
+    case TRACE_TX_DMA_READ:
+      fprintf( m_file, "%llu: Tx BD %u: DMA read 0x%08X from address 0x%08X.\n", cycle, r.bd_index, r.data, r.addr );
+      break;
+
+    case TRACE_TX_BD_DONE:
+      fprintf( m_file, "%llu: Tx BD %u: Done, %u bytes sent.\n", cycle, r.bd_index, r.data );
+      break;
+
+    case TRACE_RX_BD_START:
+      fprintf( m_file, "%llu: Rx BD %u: Start writing %u bytes to address 0x%08X.\n", cycle, r.bd_index, r.data, r.addr );
+      break;
+
+    case TRACE_RX_DMA_WRITE:
+      fprintf( m_file, "%llu: Rx BD %u: DMA write 0x%08X to address 0x%08X.\n", cycle, r.bd_index, r.data, r.addr );
+      break;
+
+    case TRACE_RX_BD_DONE:
+      fprintf( m_file, "%llu: Rx BD %u: Done, flags 0x%08X.\n", cycle, r.bd_index, r.data );
+      break;
+
+    case TRACE_RX_FRAME_REJECTED:
+      fprintf( m_file, "%llu: Rx BD %u: Frame of %u bytes rejected by the address filter.\n", cycle, r.bd_index, r.data );
+      break;
+
+    case TRACE_FRAME_RECEIVED:
+      fprintf( m_file, "%llu: Received a frame of %u bytes.\n", cycle, r.data );
+      break;
+
+    case TRACE_FRAME_SENT:
+      fprintf( m_file, "%llu: Sent a frame of %u bytes.\n", cycle, r.data );
+      break;
+
+    default:
+      fprintf( m_file, "%llu: Unknown event %u, BD %u, address 0x%08X, data 0x%08X.\n", cycle, r.event_type, r.bd_index, r.addr, r.data );
+      break;
+    }
+  }
+};
+
+
+// ------------------------- Network namespaces -------------------------
+
+// The network namespace that this process has entered with ethernet_dpi_enter_network_namespace(),
+// empty if it is still in the original one. All instances share it, as namespaces are a per-process property here.
+// Protected by s_instance_table_mutex.
+static std::string s_network_namespace;
+
+// Entering a user namespace fails with EINVAL if the process has several threads.
+static const char MULTITHREADED_NAMESPACE_HINT[] = " This usually means that the process has already started other threads."
+                                                   " Call ethernet_dpi_enter_network_namespace() at the beginning of main().";
+
+
+static void write_proc_file ( const char * const filename, const std::string & content )
 {
-  assert( m_tun_tap_clone_device != -1 );
+  const int fd = open( filename, O_WRONLY );
 
-  close_a( m_tun_tap_clone_device );
+  if ( fd == -1 )
+    throw std::runtime_error( format_error_message( errno, "Cannot open file \"%s\": ", filename ) );
 
-  m_tun_tap_clone_device = -1;
+  const ssize_t written_byte_count = write( fd, content.data(), content.size() );
+  const int errno_value = errno;
+
+  close_a( fd );
+
+  if ( written_byte_count != ssize_t( content.size() ) )
+    throw std::runtime_error( format_error_message( errno_value, "Error writing to file \"%s\": ", filename ) );
 }
 
 
-void ethernet_dpi::close_socket ( void )
+static void join_namespace ( const char * const path, const int ns_type, const char * const description )
 {
-  assert( m_socket != -1 );
+  const int fd = open( path, O_RDONLY | O_CLOEXEC );
 
-  close_a( m_socket );
+  if ( fd == -1 )
+    throw std::runtime_error( format_error_message( errno, "Cannot open %s namespace \"%s\": ", description, path ) );
 
-  m_socket = -1;
+  const int res = setns( fd, ns_type );
+  const int errno_value = errno;
+
+  close_a( fd );
+
+  if ( res == -1 )
+  {
+    throw std::runtime_error( format_error_message( errno_value, "Error joining %s namespace \"%s\": ", description, path ) +
+                              ( errno_value == EINVAL && ns_type == CLONE_NEWUSER ? MULTITHREADED_NAMESPACE_HINT : "" ) );
+  }
 }
 
 
-// Returns the frame length, or zero if the receive queue is empty.
+// Sends a request over an rtnetlink socket and waits for the acknowledgement.
 
-int ethernet_dpi::receive_frame ( void )
+static void send_rtnetlink_request ( const int netlink_socket,
+                                     nlmsghdr * const request,
+                                     const std::string & description )
 {
-  for ( ; ; )  // Repeat if EINTR.
-  {
-    pollfd polled_fd;
+  static std::atomic< uint32_t > s_sequence_number( 0 );
 
-    polled_fd.fd      = m_tun_tap_clone_device;
-    polled_fd.events  = POLLIN;
-    polled_fd.revents = 0;
+  request->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+  request->nlmsg_seq = ++s_sequence_number;
 
-    const int poll_res = poll( &polled_fd, 1, 0 );
+  sockaddr_nl kernel_addr;
+  memset( &kernel_addr, 0, sizeof(kernel_addr) );
+  kernel_addr.nl_family = AF_NETLINK;
 
-    if ( poll_res == -1 )
+  if ( -1 == sendto( netlink_socket, request, request->nlmsg_len, 0, (const sockaddr *) &kernel_addr, sizeof(kernel_addr) ) )
+    throw std::runtime_error( format_error_message( errno, "Error %s: ", description.c_str() ) );
+
+  for ( ; ; )
+  {
+    char reply_buffer[ 4096 ];
+    const ssize_t reply_length = recv( netlink_socket, reply_buffer, sizeof(reply_buffer), 0 );
+
+    if ( reply_length == -1 )
     {
       if ( errno == EINTR )
         continue;
 
-      throw std::runtime_error( format_error_message( errno, "Error polling the TAP interface to receive: " ) );
+      throw std::runtime_error( format_error_message( errno, "Error %s: ", description.c_str() ) );
     }
 
-    if ( poll_res == 0 )
-      return 0;
+    unsigned remaining_length = unsigned( reply_length );
 
-    assert( poll_res == 1 );
+    for ( const nlmsghdr * reply = (const nlmsghdr *) reply_buffer;
+          NLMSG_OK( reply, remaining_length );
+          reply = NLMSG_NEXT( reply, remaining_length ) )
+    {
+      if ( reply->nlmsg_seq != request->nlmsg_seq || reply->nlmsg_type != NLMSG_ERROR )
+        continue;
 
-    break;
+      const nlmsgerr * const err = (const nlmsgerr *) NLMSG_DATA( reply );
+
+      if ( err->error != 0 )
+        throw std::runtime_error( format_error_message( -err->error, "Error %s: ", description.c_str() ) );
+
+      return;
+    }
   }
+}
 
-  for ( ; ; )  // Repeat if EINTR.
+
+// Returns the new attribute, so that further attributes can be nested inside, see end_rtnetlink_nested_attribute().
+
+static rtattr * add_rtnetlink_attribute ( nlmsghdr * const msg,
+                                          const size_t max_length,
+                                          const unsigned short type,
+                                          const void * const data,
+                                          const size_t data_length )
+{
+  const size_t attr_length = RTA_LENGTH( data_length );
+
+  if ( NLMSG_ALIGN( msg->nlmsg_len ) + RTA_ALIGN( attr_length ) > max_length )
+    throw std::runtime_error( "Internal error: rtnetlink message too long." );
+
+  rtattr * const attr = (rtattr *)( ( (char *) msg ) + NLMSG_ALIGN( msg->nlmsg_len ) );
+  attr->rta_type = type;
+  attr->rta_len  = (unsigned short) attr_length;
+
+  if ( data_length != 0 )
+    memcpy( RTA_DATA( attr ), data, data_length );
+
+  msg->nlmsg_len = NLMSG_ALIGN( msg->nlmsg_len ) + RTA_ALIGN( attr_length );
+
+  return attr;
+}
+
+
+// Extends the given attribute to cover all attributes added after it.
+
+static void end_rtnetlink_nested_attribute ( nlmsghdr * const msg, rtattr * const attr )
+{
+  attr->rta_len = (unsigned short)( ( (char *) msg ) + msg->nlmsg_len - (char *) attr );
+}
+
+
+// Brings the given network interface up and optionally sets its MTU. Pass 0 to leave the MTU alone.
+
+static void set_link_up ( const int netlink_socket, const char * const interface_name, const int mtu )
+{
+  const unsigned interface_index = if_nametoindex( interface_name );
+
+  if ( interface_index == 0 )
+    throw std::runtime_error( format_error_message( errno, "Cannot find network interface \"%s\": ", interface_name ) );
+
+  struct
   {
-    ssize_t received_byte_count = read( m_tun_tap_clone_device,
-                                        m_receive_buffer,
-                                        m_mtu + MTU_MARGIN + 1 );
-    if ( received_byte_count == 0 )
-    {
-      throw std::runtime_error( "Cannot read data from the TAP interface." );
-    }
+    nlmsghdr   hdr;
+    ifinfomsg  info;
+    char       attributes[ 64 ];
+  } request;
+
+  memset( &request, 0, sizeof(request) );
+  request.hdr.nlmsg_len   = NLMSG_LENGTH( sizeof(request.info) );
+  request.hdr.nlmsg_type  = RTM_NEWLINK;
+  request.info.ifi_family = AF_UNSPEC;
+  request.info.ifi_index  = int( interface_index );
+  request.info.ifi_flags  = IFF_UP;
+  request.info.ifi_change = IFF_UP;
+
+  if ( mtu != 0 )
+  {
+    const uint32_t mtu_value = uint32_t( mtu );
+    add_rtnetlink_attribute( &request.hdr, sizeof(request), IFLA_MTU, &mtu_value, sizeof(mtu_value) );
+  }
 
-    if ( received_byte_count == -1 )
-    {
-      const int errno_value = errno;
+  send_rtnetlink_request( netlink_socket,
+                          &request.hdr,
+                          format_msg( "configuring network interface \"%s\"", interface_name ) );
+}
 
-      if ( errno_value == EINTR )
-        continue;
+
+// Assigns an IPv4 address like "10.0.0.1/24" to the given network interface. The prefix length defaults to 24.
+
+static void add_ip_address ( const int netlink_socket, const char * const interface_name, const std::string & ip_addr )
+{
+  const size_t slash_pos = ip_addr.find( '/' );
+  const std::string addr_text = ip_addr.substr( 0, slash_pos );
+  int prefix_length = 24;
+
+  if ( slash_pos != std::string::npos )
+  {
+    prefix_length = atoi( ip_addr.c_str() + slash_pos + 1 );
+
+    if ( prefix_length <= 0 || prefix_length > 32 )
+      throw std::runtime_error( format_msg( "Invalid prefix length in IP address \"%s\".", ip_addr.c_str() ) );
+  }
+
+  in_addr addr;
+
+  if ( 1 != inet_pton( AF_INET, addr_text.c_str(), &addr ) )
+    throw std::runtime_error( format_msg( "Invalid IP address \"%s\".", ip_addr.c_str() ) );
+
+  const unsigned interface_index = if_nametoindex( interface_name );
+
+  if ( interface_index == 0 )
+    throw std::runtime_error( format_error_message( errno, "Cannot find network interface \"%s\": ", interface_name ) );
+
+  struct
+  {
+    nlmsghdr  hdr;
+    ifaddrmsg info;
+    char      attributes[ 64 ];
+  } request;
+
+  memset( &request, 0, sizeof(request) );
+  request.hdr.nlmsg_len     = NLMSG_LENGTH( sizeof(request.info) );
+  request.hdr.nlmsg_type    = RTM_NEWADDR;
+  request.hdr.nlmsg_flags   = NLM_F_CREATE | NLM_F_EXCL;
+  request.info.ifa_family    = AF_INET;
+  request.info.ifa_prefixlen = (unsigned char) prefix_length;
+  request.info.ifa_index     = interface_index;
+
+  add_rtnetlink_attribute( &request.hdr, sizeof(request), IFA_LOCAL,   &addr, sizeof(addr) );
+  add_rtnetlink_attribute( &request.hdr, sizeof(request), IFA_ADDRESS, &addr, sizeof(addr) );
+
+  send_rtnetlink_request( netlink_socket,
+                          &request.hdr,
+                          format_msg( "assigning IP address \"%s\" to network interface \"%s\"", ip_addr.c_str(), interface_name ) );
+}
+
+
+static int open_rtnetlink_socket ( void )
+{
+  const int netlink_socket = socket( AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE );
+
+  if ( netlink_socket == -1 )
+    throw std::runtime_error( format_error_message( errno, "Error creating an rtnetlink socket: " ) );
+
+  return netlink_socket;
+}
+
+
+// Moves this process into a network namespace, see ethernet_dpi.h . Returns false if the process
+// was already there, and throws an exception if it is in a different one.
+
+static bool enter_network_namespace ( const std::string & netns, const std::string & userns )
+{
+  const std::string description = userns.empty() ? netns : netns + "," + userns;
+
+  if ( s_network_namespace == description )
+    return false;
+
+  if ( !s_network_namespace.empty() )
+  {
+    throw std::runtime_error( format_msg( "This process has already entered network namespace \"%s\", it cannot enter \"%s\" too.",
+                                          s_network_namespace.c_str(),
+                                          description.c_str() ) );
+  }
+
+  if ( netns == "private" )
+  {
+    if ( !userns.empty() )
+      throw std::runtime_error( "Option \"userns\" cannot be used together with \"netns=private\"." );
+
+    const uid_t uid = geteuid();
+    const gid_t gid = getegid();
+
+    if ( unshare( CLONE_NEWUSER | CLONE_NEWNET ) == -1 )
+    {
+      const int errno_value = errno;
+      throw std::runtime_error( format_error_message( errno_value, "Error creating a user and network namespace: " ) +
+                                ( errno_value == EINVAL ? MULTITHREADED_NAMESPACE_HINT : "" ) );
+    }
+
+    // Map our user to root inside the new user namespace, so that we get the CAP_NET_ADMIN capability
+    // for the new network namespace. The kernel requires disabling setgroups() before writing the group map.
+    write_proc_file( "/proc/self/uid_map", format_msg( "0 %u 1\n", unsigned( uid ) ) );
+    write_proc_file( "/proc/self/setgroups", "deny\n" );
+    write_proc_file( "/proc/self/gid_map", format_msg( "0 %u 1\n", unsigned( gid ) ) );
+  }
+  else
+  {
+    if ( !userns.empty() )
+      join_namespace( userns.c_str(), CLONE_NEWUSER, "user" );
+
+    join_namespace( netns.c_str(), CLONE_NEWNET, "network" );
+  }
+
+  s_network_namespace = description;
+
+  if ( netns == "private" )
+  {
+    // The loopback interface of a new network namespace is down.
+    const int netlink_socket = open_rtnetlink_socket();
+
+    try
+    {
+      set_link_up( netlink_socket, "lo", 0 );
+    }
+    catch ( ... )
+    {
+      close_a( netlink_socket );
+      throw;
+    }
+
+    close_a( netlink_socket );
+  }
+
+  return true;
+}
+
+
+// ------------------------- Traffic generator and sink -------------------------
+
+// In generator mode, the frames received by the simulation do not come from a TAP interface,
+// but are synthesised at a given rate, and the frames sent by the simulation go to a sink
+// that matches the replies against the generated requests. See option "generator" in the README file.
+//
+// The ICMP echo requests and UDP datagrams carry GENERATOR_PAYLOAD_MAGIC followed by a 64-bit
+// big-endian sequence number in their payload, and the rest of the payload is filled with
+// a pattern derived from the sequence number. The sink expects the same payload in the replies.
+// The generator also answers ARP requests for its own IP address, so that the simulated software
+// can send the replies. The random numbers are reproducible, so that the generated traffic is always the same.
+
+static const char GENERATOR_PAYLOAD_MAGIC[] = "EDPG";
+static const int GENERATOR_PAYLOAD_HEADER_LENGTH = 4 + 8;
+static const uint16_t GENERATOR_ICMP_ID = 0x4544;
+static const uint16_t GENERATOR_UDP_SRC_PORT = 50000;
+static const int MIN_ETHERNET_FRAME_LENGTH = 60;  // Without the CRC.
+
+class traffic_generator
+{
+public:
+  traffic_generator ( const std::string & traffic_type, option_map * options, int mtu );
+
+  // Returns the length of the next generated frame, if one is due, or 0 otherwise.
+  // The buffer must have room for the MTU plus the Ethernet header.
+  int generate_frame ( uint64_t cycle, char * buffer );
+
+  // Processes a frame sent by the simulation. Returns a frame to deliver to the simulation as a reply,
+  // which is empty if there is none.
+  std::string sink_frame ( uint64_t cycle, const char * data, int byte_count );
+
+  bool has_more_frames ( void ) const;
+  void print_report ( const std::string & prefix, uint64_t cycle ) const;
+
+  // The schedule, the random state and the statistics are part of the checkpoint data,
+  // so that a restored simulation sees the same traffic again.
+  void save_state ( checkpoint_writer * writer ) const;
+  void restore_state ( checkpoint_reader * reader );
+
+private:
+  enum traffic_type_enum { traffic_arp, traffic_icmp, traffic_udp };
+
+  struct frame_size_entry
+  {
+    int size;
+    unsigned weight;
+  };
+
+  traffic_type_enum m_traffic_type;
+  int m_max_frame_length;
+  double m_burst_interval;  // In clock cycles.
+  unsigned m_burst_length;
+  uint64_t m_frame_count_limit;  // 0 means no limit.
+  std::vector< frame_size_entry > m_frame_sizes;  // If empty, the size is chosen uniformly between the 2 limits below.
+  unsigned m_total_frame_size_weight;
+  int m_min_frame_size;
+  int m_max_frame_size;
+  uint8_t m_dst_mac[ 6 ];
+  uint8_t m_src_mac[ 6 ];
+  in_addr m_dst_ip;
+  in_addr m_src_ip;
+  uint16_t m_udp_port;
+  uint64_t m_random_state;
+
+  // The schedule starts when the simulation takes the first frame, so that the time it takes
+  // to boot the simulated software does not count.
+  bool m_is_schedule_started;
+  double m_next_burst_cycle;
+  unsigned m_frames_left_in_burst;
+  uint64_t m_first_cycle;
+  uint64_t m_last_generated_frame_cycle;
+
+  // Statistics.
+  uint64_t m_generated_frame_count;
+  uint64_t m_generated_byte_count;
+  uint64_t m_overrun_frame_count;
+  uint64_t m_sent_frame_count;
+  uint64_t m_sent_byte_count;
+  uint64_t m_reply_count;
+  uint64_t m_duplicate_reply_count;
+  uint64_t m_out_of_order_reply_count;
+  uint64_t m_corrupt_reply_count;
+  uint64_t m_other_frame_count;
+  uint64_t m_highest_reply_sequence_number;
+  std::vector< bool > m_is_reply_received;  // Indexed by sequence number.
+  struct timespec m_start_time;
+
+  uint64_t get_next_random_number ( void );
+  void parse_frame_sizes ( const std::string & sizes );
+  int choose_frame_size ( void );
+  int build_arp_frame ( uint8_t * frame, uint16_t operation, const uint8_t * target_mac, const in_addr & target_ip ) const;
+  int build_ip_frame ( uint8_t * frame, int frame_length, uint64_t sequence_number ) const;
+  void check_reply ( const uint8_t * payload, int payload_length );
+};
+
+
+// ------------------------- Round-trip latency -------------------------
+
+// A histogram with logarithmic buckets, each one divided into linear sub-buckets, like HdrHistogram.
+// Values are recorded with a relative precision of 1/64 (about 2 significant decimal digits)
+// whatever their magnitude, and recording a value only takes a few instructions.
+// The percentiles report the highest value that is equivalent at that precision.
+
+static const int HISTOGRAM_SUB_BUCKET_BITS = 7;
+static const int HISTOGRAM_SUB_BUCKET_COUNT = 1 << HISTOGRAM_SUB_BUCKET_BITS;
+static const int HISTOGRAM_SUB_BUCKET_HALF_COUNT = HISTOGRAM_SUB_BUCKET_COUNT / 2;
+static const int HISTOGRAM_SLOT_COUNT = ( 64 - HISTOGRAM_SUB_BUCKET_BITS + 2 ) * HISTOGRAM_SUB_BUCKET_HALF_COUNT;
+
+class hdr_histogram
+{
+public:
+  hdr_histogram ( void )
+    : m_counts( HISTOGRAM_SLOT_COUNT, 0 )
+    , m_count( 0 )
+    , m_min( 0 )
+    , m_max( 0 )
+    , m_sum( 0 )
+  {
+  }
+
+  void record ( const uint64_t value )
+  {
+    ++m_counts[ get_slot_index( value ) ];
+
+    if ( m_count == 0 || value < m_min )
+      m_min = value;
+
+    if ( value > m_max )
+      m_max = value;
+
+    ++m_count;
+    m_sum += double( value );
+  }
+
+  uint64_t get_count ( void ) const { return m_count; }
+
+  uint64_t get_value_at_percentile ( const double percentile ) const
+  {
+    if ( m_count == 0 )
+      return 0;
+
+    const uint64_t target_count = std::max( uint64_t( 1 ), uint64_t( ceil( percentile / 100 * double( m_count ) ) ) );
+    uint64_t cumulative_count = 0;
+
+    for ( int i = 0; i < HISTOGRAM_SLOT_COUNT; ++i )
+    {
+      cumulative_count += m_counts[ i ];
+
+      if ( cumulative_count >= target_count )
+        return std::min( get_highest_equivalent_value( i ), m_max );
+    }
+
+    return m_max;
+  }
+
+  // Returns a line like "min 10, p50 12, p90 15, p99 20, p99.9 31, max 40, mean 12.5".
+  // The values are divided by 'unit_divisor' and printed with the given number of decimals.
+
+  std::string format_summary ( const double unit_divisor, const int decimals ) const
+  {
+    return format_msg( "min %.*f, p50 %.*f, p90 %.*f, p99 %.*f, p99.9 %.*f, max %.*f, mean %.*f",
+                       decimals, double( m_min ) / unit_divisor,
+                       decimals, double( get_value_at_percentile( 50   ) ) / unit_divisor,
+                       decimals, double( get_value_at_percentile( 90   ) ) / unit_divisor,
+                       decimals, double( get_value_at_percentile( 99   ) ) / unit_divisor,
+                       decimals, double( get_value_at_percentile( 99.9 ) ) / unit_divisor,
+                       decimals, double( m_max ) / unit_divisor,
+                       decimals, m_count == 0 ? 0.0 : m_sum / double( m_count ) / unit_divisor );
+  }
+
+  // Writes the percentile distribution in the text format of HdrHistogram, which its plotting tools understand.
+
+  void write_percentile_distribution ( FILE * const file, const double unit_divisor ) const
+  {
+    fprintf( file, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)" );
+
+    uint64_t cumulative_count = 0;
+    double sum_of_squared_deviations = 0;
+    const double mean = m_count == 0 ? 0.0 : m_sum / double( m_count );
+
+    for ( int i = 0; i < HISTOGRAM_SLOT_COUNT; ++i )
+    {
+      if ( m_counts[ i ] == 0 )
+        continue;
+
+      cumulative_count += m_counts[ i ];
+
+      const double value = double( std::min( get_highest_equivalent_value( i ), m_max ) );
+      const double fraction = double( cumulative_count ) / double( m_count );
+
+      sum_of_squared_deviations += double( m_counts[ i ] ) * ( value - mean ) * ( value - mean );
+
+      if ( cumulative_count == m_count )
+      {
+        fprintf( file, "%12.3f %2.12f %10llu\n", value / unit_divisor, fraction, (unsigned long long) cumulative_count );
+      }
+      else
+      {
+        fprintf( file, "%12.3f %2.12f %10llu %14.2f\n",
+                 value / unit_divisor,
+                 fraction,
+                 (unsigned long long) cumulative_count,
+                 1 / ( 1 - fraction ) );
+      }
+    }
+
+    fprintf( file, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n",
+             mean / unit_divisor,
+             m_count == 0 ? 0.0 : sqrt( sum_of_squared_deviations / double( m_count ) ) / unit_divisor );
+    fprintf( file, "#[Max     = %12.3f, Total count    = %12llu]\n",
+             double( m_max ) / unit_divisor,
+             (unsigned long long) m_count );
+    fprintf( file, "#[Buckets = %12d, SubBuckets     = %12d]\n",
+             64 - HISTOGRAM_SUB_BUCKET_BITS + 1,
+             HISTOGRAM_SUB_BUCKET_COUNT );
+  }
+
+private:
+  std::vector< uint64_t > m_counts;
+  uint64_t m_count;
+  uint64_t m_min;
+  uint64_t m_max;
+  double m_sum;
+
+  static int get_slot_index ( const uint64_t value )
+  {
+    if ( value < uint64_t( HISTOGRAM_SUB_BUCKET_COUNT ) )
+      return int( value );
+
+    const int shift = 63 - __builtin_clzll( value ) - HISTOGRAM_SUB_BUCKET_BITS + 1;
+
+    return shift * HISTOGRAM_SUB_BUCKET_HALF_COUNT + int( value >> shift );
+  }
+
+  static uint64_t get_highest_equivalent_value ( const int slot_index )
+  {
+    if ( slot_index < HISTOGRAM_SUB_BUCKET_COUNT )
+      return uint64_t( slot_index );
+
+    const int shift = slot_index / HISTOGRAM_SUB_BUCKET_HALF_COUNT - 1;
+    const uint64_t sub_bucket = uint64_t( slot_index - shift * HISTOGRAM_SUB_BUCKET_HALF_COUNT );
+
+    return ( ( sub_bucket + 1 ) << shift ) - 1;
+  }
+};
+
+
+// Measures the time the simulated system takes to answer requests, see option "latency" in the README file.
+//
+// Each received ICMP echo request, and optionally each received UDP datagram, is stamped with the clock cycle
+// and the wall-clock time at which tick() first reports it. The first sent frame that answers it
+// (an ICMP echo reply with the same identifier and sequence number, or a UDP datagram in the opposite direction
+// with the same tag in its payload) completes the measurement. The simulated cycles show how fast the firmware is,
+// and the wall-clock time shows what a host-side tool like ping would measure, which includes the simulator speed.
+// Only IPv4 without VLAN tags is supported.
+
+static const size_t MAX_PENDING_LATENCY_PROBES = 65536;
+static const int MAX_LATENCY_UDP_TAG_LENGTH = 64;
+
+class latency_monitor
+{
+public:
+  latency_monitor ( const std::string & protocols, const std::string & udp_tag );
+
+  void note_received_frame ( uint64_t cycle, const uint8_t * frame, int byte_count );
+  void note_sent_frame ( uint64_t cycle, const uint8_t * frame, int byte_count );
+  void forget_pending_probes ( void );
+
+  void print_report ( const std::string & prefix ) const;
+  void write_log ( const std::string & filename ) const;
+
+private:
+  struct probe
+  {
+    uint64_t cycle;
+    timespec time;
+    uint64_t serial;  // Tells a probe apart from a later one with the same key.
+  };
+
+  typedef std::map< std::string, probe > probe_map;
+
+  bool m_match_icmp;
+  bool m_match_udp;
+  int m_udp_tag_offset;  // In the UDP payload.
+  int m_udp_tag_length;
+
+  probe_map m_pending_probes;
+
+  // Oldest first. The entries of probes that have already been answered are skipped when evicting.
+  std::deque< std::pair< std::string, uint64_t > > m_probe_order;
+  uint64_t m_next_probe_serial;
+  uint64_t m_unanswered_probe_count;  // Evicted, or replaced by a later request with the same key.
+
+  hdr_histogram m_cycle_histogram;
+  hdr_histogram m_wall_clock_histogram;  // In nanoseconds.
+
+  bool get_flow_key ( const uint8_t * frame, int byte_count, bool is_sent_frame, std::string * key ) const;
+};
+
+
+// ------------------------- DMA cost profile -------------------------
+
+// Collects the DMA costs per frame that the Verilog side measures if its PROFILE_DMA parameter is set,
+// split by direction and by frame size. This shows how much the interconnect arbitration and the wait states
+// cost per byte without dumping waveforms.
+
+static const int DMA_PROFILE_SIZE_CLASS_COUNT = 7;
+static const int DMA_PROFILE_SIZE_CLASS_LIMITS[ DMA_PROFILE_SIZE_CLASS_COUNT - 1 ] = { 64, 127, 255, 511, 1023, 1518 };
+
+class dma_profile
+{
+public:
+  void record_frame ( bool is_rx,
+                      int byte_count,
+                      int queue_cycles,
+                      int dma_cycles,
+                      int beat_count,
+                      int ack_wait_cycles,
+                      int wait_state_cycles,
+                      int bus_error_count );
+
+  void print_report ( const std::string & prefix ) const;
+
+private:
+  struct size_class_stats
+  {
+    hdr_histogram queue_cycles;  // From the frame becoming ready until the state machine takes it.
+    hdr_histogram dma_cycles;    // From the first DMA beat until the last one completes.
+    hdr_histogram ack_wait_cycles;
+  };
+
+  struct direction_stats
+  {
+    uint64_t frame_count;
+    uint64_t byte_count;
+    uint64_t dma_cycles;
+    uint64_t beat_count;
+    uint64_t ack_wait_cycles;
+    uint64_t wait_state_cycles;
+    uint64_t bus_error_count;
+    size_class_stats size_classes[ DMA_PROFILE_SIZE_CLASS_COUNT ];
+
+    direction_stats ( void )
+      : frame_count( 0 )
+      , byte_count( 0 )
+      , dma_cycles( 0 )
+      , beat_count( 0 )
+      , ack_wait_cycles( 0 )
+      , wait_state_cycles( 0 )
+      , bus_error_count( 0 )
+    {
+    }
+  };
+
+  direction_stats m_directions[ 2 ];  // Indexed by is_rx.
+
+  static void print_direction_report ( const std::string & prefix, const char * direction_name, const direction_stats & stats );
+};
+
+
+// ------------------------- Receive filter -------------------------
+
+// See option "rx_filter" in the README file.
+
+static std::vector< sock_filter > read_rx_filter_file ( const std::string & filename );
+static std::vector< uint16_t > parse_ethertype_list ( const std::string & list );
+
+
+// ------------------------- AF_XDP transport -------------------------
+
+// With option "xdp", the frames do not go through a TAP interface, but through an AF_XDP socket bound to one end
+// of a veth pair. The host uses the other end like it would use the TAP interface. A tiny XDP program redirects
+// every frame arriving at our end into the socket. The frames are exchanged through rings in memory shared
+// with the kernel, so receiving needs no system calls at all, and sending needs one to wake the kernel up.
+//
+// The veth driver does not support the zero-copy mode, so the kernel copies each frame once
+// into or out of the shared memory area (the UMEM). That is still much cheaper than a read() or write() call.
+
+static const unsigned DEFAULT_XDP_RING_SIZE = 256;
+static const uint32_t XDP_UMEM_FRAME_SIZE   = 4096;
+
+class xdp_socket
+{
+public:
+  // 'interface_name' is our end of the veth pair. The Rx and Tx rings have 'ring_size' entries each,
+  // which must be a power of 2. Frames can have up to 'max_frame_length' bytes.
+  xdp_socket ( const std::string & interface_name, unsigned ring_size, int max_frame_length );
+  ~xdp_socket ( void );
+
+  int get_fd ( void ) const { return m_fd; }
+
+  // Copies the next received frame to the buffer, which must have room for 'max_frame_length' bytes.
+  // Returns the frame length, or zero if the Rx ring is empty.
+  int receive_frame ( char * buffer );
+
+  // Whether a frame can be sent without waiting for the kernel to release a Tx buffer.
+  bool is_ready_to_send ( void );
+
+  void send_frame ( const char * frame, int byte_count );
+
+private:
+  // A ring shared with the kernel. The producer and consumer indexes are free-running.
+  struct ring
+  {
+    void * mapping;
+    size_t mapping_length;
+    uint32_t * producer;
+    uint32_t * consumer;
+    void * entries;  // xdp_desc for the Rx and Tx rings, uint64_t UMEM addresses for the fill and completion rings.
+  };
+
+  std::string m_interface_name;
+  unsigned m_ring_size;
+  int m_max_frame_length;
+  int m_fd;
+  int m_map_fd;
+  int m_program_fd;
+  bool m_is_program_attached;
+  void * m_umem;
+  size_t m_umem_length;
+  ring m_rx_ring;
+  ring m_tx_ring;
+  ring m_fill_ring;
+  ring m_completion_ring;
+  std::vector< uint64_t > m_free_tx_frames;  // UMEM addresses.
+
+  void release_resources ( void );
+  void map_ring ( ring * r, const xdp_ring_offset & offsets, uint64_t page_offset, size_t entry_size );
+  void create_redirect_program ( void );
+  void reclaim_tx_frames ( void );
+  void wake_up_tx ( void );
+};
+
+
+// ------------------------- vhost-user transport -------------------------
+
+// With option "vhost_user", this module acts as the front-end of a virtio-net device, like QEMU does for a virtual machine,
+// and a vhost-user back-end like a userspace switch or DPDK's testpmd takes care of the frames.
+// Both sides exchange the frames through a receive and a transmit virtqueue in a shared memory area,
+// which is set up once with messages over a UNIX socket. The kernel is not involved afterwards,
+// except for the notifications, which the back-end can suppress.
+//
+// Only the split virtqueue layout is implemented, without any offload features. Each frame takes 2 chained descriptors,
+// one for the virtio-net header and another one for the data, which also works with back-ends that do not accept
+// VIRTIO_F_ANY_LAYOUT. The virtqueue fields are in host byte order, which is what VIRTIO_F_VERSION_1 requires
+// on little-endian hosts.
+
+static const unsigned DEFAULT_VHOST_USER_QUEUE_SIZE = 256;
+static const int      DEFAULT_VHOST_USER_MTU        = 1500;
+static const size_t   VHOST_USER_BUFFER_SIZE        = 4096;  // One page per frame, virtio-net header included.
+static const size_t   VHOST_USER_FRAME_OFFSET       = 16;    // Where the frame starts in the buffer, after the header.
+
+struct vring_descriptor
+{
+  uint64_t addr;  // In the address space the front-end describes with VHOST_USER_SET_MEM_TABLE.
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+};
+
+struct vring_used_element
+{
+  uint32_t id;   // Index of the first descriptor in the chain.
+  uint32_t len;  // Bytes written by the back-end.
+};
+
+class vhost_user_device
+{
+public:
+  // Connects to the back-end listening on 'socket_path' and sets up both virtqueues, which have 'queue_size' entries each.
+  // Frames can have up to 'max_frame_length' bytes.
+  vhost_user_device ( const std::string & socket_path, unsigned queue_size, int max_frame_length );
+  ~vhost_user_device ( void );
+
+  // Copies the next received frame to the buffer, which must have room for 'max_frame_length' bytes.
+  // Returns the frame length, or zero if there is none.
+  int receive_frame ( char * buffer );
+
+  bool is_ready_to_send ( void );
+  void send_frame ( const char * frame, int byte_count );
+
+  // Returns true if a frame has arrived in the meantime. Otherwise, the receive event file descriptor
+  // becomes readable when the next one arrives.
+  bool prepare_to_wait ( void );
+  int get_receive_event_fd ( void ) const { return m_queues[ 0 ].call_fd; }
+
+private:
+  struct virtqueue
+  {
+    vring_descriptor * desc;
+    uint16_t * avail;  // flags, idx, ring[ queue size ], used_event
+    uint16_t * used;   // flags, idx, followed by the ring of vring_used_element entries.
+    uint16_t next_avail_idx;
+    uint16_t last_used_idx;
+    int kick_fd;
+    int call_fd;  // Only used for the receive queue.
+  };
+
+  std::string m_socket_path;
+  unsigned m_queue_size;
+  int m_max_frame_length;
+  int m_socket;
+  int m_memory_fd;
+  char * m_memory;
+  size_t m_memory_length;
+  size_t m_queue_area_length;
+  size_t m_header_length;  // The virtio-net header is 12 bytes long with VIRTIO_F_VERSION_1, and 10 bytes otherwise.
+  bool m_is_rx_interrupt_enabled;
+  virtqueue m_queues[ 2 ];  // Indexed by virtqueue number: 0 receives and 1 transmits.
+  std::vector< uint16_t > m_free_tx_buffers;
+
+  void release_resources ( void );
+  void send_message ( uint32_t request, const void * payload, uint32_t payload_size, int fd );
+  void receive_reply ( uint32_t request, void * payload, uint32_t payload_size );
+  void set_up_queue ( unsigned index );
+  uint64_t get_buffer_offset ( unsigned buffer_index ) const;
+  void make_available ( virtqueue * q, uint16_t head );
+  vring_used_element * take_used_element ( virtqueue * q );
+  void reclaim_tx_buffers ( void );
+};
+
+
+// ------------------------- Shared TAP interface -------------------------
+
+// With option "shared_tap", several instances, possibly in different processes, use the same TAP interface.
+// The frames are read only once, by whichever instance gets hold of the dispatcher lock first,
+// and distributed to the per-instance rings according to their destination MAC addresses.
+// The rings, the MAC address table and the lock live in a POSIX shared memory object named after the TAP interface,
+// so that the instances in other processes can attach to it too.
+//
+// All instances in a process share one file descriptor. Each process opens its own queue of the TAP interface,
+// so a TAP interface shared between processes must have been created with multi-queue support.
+// The kernel then spreads the incoming frames across the queues, and the process that reads a frame
+// delivers it to the right ring, even if it belongs to another process. While an instance waits for activity,
+// a datagram on its doorbell socket wakes it up when the dispatcher has put a frame into its ring.
+
+static const unsigned DEFAULT_SHARED_TAP_RING_SIZE = 64;
+static const unsigned MAX_SHARED_TAP_INSTANCES     = 64;
+
+struct shared_tap_area;
+
+class shared_tap
+{
+public:
+  // Returns the object that the instances in this process use for the given TAP interface, or NULL if there is none yet.
+  // In that case, the caller opens the TAP interface and creates the object. Call release() once for every
+  // successful call to find_and_retain() or to the constructor.
+  static shared_tap * find_and_retain ( const std::string & interface_name );
+
+  // Takes ownership of the TAP interface file descriptor. Each instance gets a ring with 'ring_size' frames.
+  shared_tap ( const std::string & interface_name, int fd, int mtu, unsigned ring_size );
+  void release ( void );
+
+  int get_fd ( void ) const { return m_fd; }
+  int get_mtu ( void ) const { return m_mtu; }
+  unsigned get_ring_size ( void ) const { return m_ring_size; }
+
+  // Other instances in this process write to the same file descriptor.
+  pthread_mutex_t * get_tx_mutex ( void ) { return &m_tx_mutex; }
+
+  // Returns the slot number of the new instance in the shared memory object.
+  unsigned add_instance ( void );
+  void remove_instance ( unsigned slot );
+
+  // An all-zero MAC address means none, and then the instance only gets the broadcast and multicast frames.
+  void set_station_address ( unsigned slot, const uint8_t * mac_addr, bool is_promiscuous );
+
+  // Reads the frames waiting in this process' queue of the TAP interface and delivers them to the rings.
+  // Does nothing if another instance is doing that at the moment.
+  void dispatch_frames ( void );
+
+  // Copies the next frame in the slot's ring to the buffer, which must have room for MTU + MTU_MARGIN bytes.
+  // Returns the frame length, or zero if the ring is empty.
+  int take_frame ( unsigned slot, char * buffer );
+
+  // Returns true if a frame is waiting in the slot's ring. Otherwise, its doorbell file descriptor
+  // becomes readable when the next frame arrives.
+  bool prepare_to_wait ( unsigned slot );
+  int get_doorbell_fd ( unsigned slot ) const { return m_doorbell_fds[ slot ]; }
+
+  uint64_t get_dropped_frame_count ( unsigned slot ) const;
+
+private:
+  typedef std::map< std::string, shared_tap * > shared_tap_map;
+
+  // Protects the map and the reference counts. Creating instances is already serialised,
+  // but they can be destroyed at any time.
+  static pthread_mutex_t s_mutex;
+  static shared_tap_map s_shared_taps;
+
+  std::string m_interface_name;
+  unsigned m_reference_count;
+  int m_fd;
+  int m_mtu;
+  unsigned m_ring_size;
+  size_t m_entry_size;  // Bytes per ring entry, including the frame length.
+  int m_area_fd;
+  shared_tap_area * m_area;
+  size_t m_area_length;
+  pthread_mutex_t m_tx_mutex;
+  int m_doorbell_sender;
+  int m_doorbell_fds[ MAX_SHARED_TAP_INSTANCES ];  // Only for the slots that belong to this process, -1 otherwise.
+  char * m_dispatch_buffer;
+
+  ~shared_tap ( void );
+  void release_resources ( void );
+  void map_area ( void );
+  void open_doorbell ( unsigned slot );
+  void rebuild_hash_table ( void );
+  void deliver_frame ( unsigned slot, const char * frame, int byte_count );
+  char * get_ring_entry ( unsigned slot, uint32_t index ) const;
+};
+
+
+// Helper class to automatically release a mutex.
+
+class auto_mutex_lock
+{
+  pthread_mutex_t * const m_mutex;
+
+public:
+  explicit auto_mutex_lock ( pthread_mutex_t * const mutex )
+    : m_mutex( mutex )
+  {
+    const int res = pthread_mutex_lock( m_mutex );
+    assert( res == 0 );
+    (void) res;
+  }
+
+  ~auto_mutex_lock ( void )
+  {
+    const int res = pthread_mutex_unlock( m_mutex );
+    assert( res == 0 );
+    (void) res;
+  }
+};
+
+
+// Helper class to keep the lines of a multi-line report together, in case several threads write to the same stream.
+// Single-line messages do not need it, as each stdio call locks the stream anyway.
+
+class auto_stdio_lock
+{
+  FILE * const m_stream;
+
+public:
+  explicit auto_stdio_lock ( FILE * const stream )
+    : m_stream( stream )
+  {
+    flockfile( m_stream );
+  }
+
+  ~auto_stdio_lock ( void )
+  {
+    funlockfile( m_stream );
+  }
+};
+
+
+// Must be called with the mutex locked.
+
+void ethernet_dpi_reactor::start ( void )
+{
+  assert( !s_is_thread_running );
+
+  try
+  {
+    s_epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+
+    if ( s_epoll_fd == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error creating the reactor's epoll set: " ) );
+
+    s_wakeup_event_fd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+
+    if ( s_wakeup_event_fd == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error creating the reactor's wake-up event: " ) );
+
+    s_activity_event_fd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+
+    if ( s_activity_event_fd == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error creating the reactor's activity event: " ) );
+
+    epoll_event ev;
+    memset( &ev, 0, sizeof(ev) );
+    ev.events   = EPOLLIN;
+    ev.data.u64 = 0;
+
+    if ( epoll_ctl( s_epoll_fd, EPOLL_CTL_ADD, s_wakeup_event_fd, &ev ) == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error adding the wake-up event to the reactor's epoll set: " ) );
+
+    s_should_stop = false;
+
+    const int res = pthread_create( &s_thread, NULL, thread_main, NULL );
+
+    if ( res != 0 )
+      throw std::runtime_error( format_error_message( res, "Error creating the reactor thread: " ) );
+
+    s_is_thread_running = true;
+  }
+  catch ( ... )
+  {
+    if ( s_activity_event_fd != -1 )
+    {
+      close_a( s_activity_event_fd );
+      s_activity_event_fd = -1;
+    }
+
+    if ( s_wakeup_event_fd != -1 )
+    {
+      close_a( s_wakeup_event_fd );
+      s_wakeup_event_fd = -1;
+    }
+
+    if ( s_epoll_fd != -1 )
+    {
+      close_a( s_epoll_fd );
+      s_epoll_fd = -1;
+    }
+
+    throw;
+  }
+}
+
+
+// Must be called with the mutex locked. The mutex is temporarily released while waiting for the thread to terminate.
+
+void ethernet_dpi_reactor::stop ( void )
+{
+  assert( s_is_thread_running );
+
+  s_should_stop = true;
+
+  const uint64_t one = 1;
+
+  if ( sizeof(one) != write( s_wakeup_event_fd, &one, sizeof(one) ) )
+  {
+    // This should never happen, the event counter cannot overflow here.
+    assert( false );
+  }
+
+  pthread_mutex_unlock( &s_mutex );
+  const int res = pthread_join( s_thread, NULL );
+  pthread_mutex_lock( &s_mutex );
+
+  assert( res == 0 );
+  (void) res;
+
+  s_is_thread_running = false;
+
+  close_a( s_wakeup_event_fd );
+  s_wakeup_event_fd = -1;
+
+  close_a( s_activity_event_fd );
+  s_activity_event_fd = -1;
+
+  close_a( s_epoll_fd );
+  s_epoll_fd = -1;
+}
+
+
+// The simulation thread must call this routine before checking whether the reactor rings have any frames,
+// so that the reactor thread does not miss signalling the event if a frame arrives in the meantime.
+
+int ethernet_dpi_reactor::begin_waiting_for_activity ( void )
+{
+  if ( s_activity_event_fd == -1 )
+    return -1;
+
+  s_is_simulation_waiting.store( true );
+
+  // Pairs with the fence in the reactor thread loop. Otherwise, the flag store could become visible
+  // only after our caller has checked the reactor rings, and both threads would miss the new frames.
+  std::atomic_thread_fence( std::memory_order_seq_cst );
+
+  return s_activity_event_fd;
+}
+
+
+void ethernet_dpi_reactor::end_waiting_for_activity ( void )
+{
+  if ( s_activity_event_fd == -1 )
+    return;
+
+  s_is_simulation_waiting.store( false );
+
+  uint64_t counter;
+
+  if ( -1 == read( s_activity_event_fd, &counter, sizeof(counter) ) )
+  {
+    assert( errno == EAGAIN );
+  }
+}
+
+
+uint64_t ethernet_dpi_reactor::register_instance ( ethernet_dpi * const instance, const int fd )
+{
+  auto_mutex_lock lock( &s_mutex );
+
+  if ( !s_is_thread_running )
+    start();
+
+  const uint64_t registration_id = s_next_registration_id++;
+
+  epoll_event ev;
+  memset( &ev, 0, sizeof(ev) );
+  ev.events   = EPOLLIN;
+  ev.data.u64 = registration_id;
+
+  // Insert the instance first, as the reactor thread may see an event as soon as the file descriptor is in the epoll set.
+  s_instances[ registration_id ] = instance;
+
+  if ( epoll_ctl( s_epoll_fd, EPOLL_CTL_ADD, fd, &ev ) == -1 )
+  {
+    const int errno_val = errno;
+
+    s_instances.erase( registration_id );
+
+    if ( s_instances.empty() )
+      stop();
+
+    throw std::runtime_error( format_error_message( errno_val, "Error adding the TAP interface to the reactor's epoll set: " ) );
+  }
+
+  return registration_id;
+}
+
+
+void ethernet_dpi_reactor::unregister_instance ( const uint64_t registration_id, const int fd )
+{
+  auto_mutex_lock lock( &s_mutex );
+
+  assert( s_is_thread_running );
+
+  if ( epoll_ctl( s_epoll_fd, EPOLL_CTL_DEL, fd, NULL ) == -1 )
+  {
+    assert( false );
+  }
+
+  // The reactor thread might still have an event for this instance in its list, but it will not find it in the map any more.
+  s_instances.erase( registration_id );
+
+  if ( s_instances.empty() )
+    stop();
+}
+
+
+// This routine does not lock the mutex, as epoll_ctl() is thread safe.
+// Either the reactor thread or the simulation thread calls it.
+
+void ethernet_dpi_reactor::set_rx_interest ( const uint64_t registration_id, const int fd, const bool is_enabled )
+{
+  epoll_event ev;
+  memset( &ev, 0, sizeof(ev) );
+  ev.events   = is_enabled ? uint32_t( EPOLLIN ) : 0;
+  ev.data.u64 = registration_id;
+
+  if ( epoll_ctl( s_epoll_fd, EPOLL_CTL_MOD, fd, &ev ) == -1 )
+  {
+    throw std::runtime_error( format_error_message( errno, "Error modifying the reactor's epoll set: " ) );
+  }
+}
+
+
+void * ethernet_dpi_reactor::thread_main ( void * )
+{
+  const int MAX_EVENT_COUNT = 64;
+  epoll_event events[ MAX_EVENT_COUNT ];
+
+  for ( ; ; )
+  {
+    const int event_count = epoll_wait( s_epoll_fd, events, MAX_EVENT_COUNT, -1 );
+
+    if ( event_count == -1 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      // There is no way to report this error to the simulation thread, as we do not know
+      // which instance is affected. This should never happen anyway.
+      fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, format_error_message( errno, "Error waiting for events in the reactor thread: " ).c_str() );
+      fflush( stderr );
+      abort();
+    }
+
+    auto_mutex_lock lock( &s_mutex );
+
+    bool has_read_frames = false;
+
+    for ( int i = 0; i < event_count; ++i )
+    {
+      const uint64_t registration_id = events[ i ].data.u64;
+
+      if ( registration_id == 0 )
+      {
+        uint64_t counter;
+
+        if ( -1 == read( s_wakeup_event_fd, &counter, sizeof(counter) ) )
+        {
+          assert( errno == EAGAIN );
+        }
+
+        continue;
+      }
+
+      const instance_map::const_iterator it = s_instances.find( registration_id );
+
+      if ( it != s_instances.end() )
+      {
+        it->second->reactor_receive_frames();
+        has_read_frames = true;
+      }
+    }
+
+    // The ring tail stores above must be globally visible before we check the flag,
+    // see the matching fence in begin_waiting_for_activity().
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+
+    if ( has_read_frames && s_is_simulation_waiting.load() )
+    {
+      const uint64_t one = 1;
+
+      if ( sizeof(one) != write( s_activity_event_fd, &one, sizeof(one) ) )
+      {
+        // This should never happen, the event counter cannot realistically overflow.
+        assert( false );
+      }
+    }
+
+    if ( s_should_stop )
+      break;
+  }
+
+  return NULL;
+}
+
+
+ethernet_dpi::ethernet_dpi ( const char * const tap_interface_name,
+                             const unsigned char print_informational_messages,
+                             const char * const informational_message_prefix,
+                             const char * const options,
+                             const bool is_restoring_checkpoint )
+ : m_tun_tap_clone_device( -1 )
+ , m_socket( -1 )
+ , m_use_vnet_hdr( false )
+ , m_vnet_read_buffer( NULL )
+ , m_vnet_segment_buffer( NULL )
+ , m_send_buffer( NULL )
+ , m_receive_buffer( NULL )
+ , m_received_byte_count( 0 )
+ , m_send_byte_count( 0 )
+ , m_backdoor_memory_accessor( NULL )
+ , m_use_reactor( false )
+ , m_reactor_registration_id( 0 )
+ , m_reactor_ring_slot_count( 0 )
+ , m_reactor_ring_slot_size( 0 )
+ , m_reactor_ring( NULL )
+ , m_reactor_ring_frame_lengths( NULL )
+ , m_reactor_ring_head( 0 )
+ , m_reactor_ring_tail( 0 )
+ , m_reactor_rx_paused( false )
+ , m_reactor_failed( false )
+ , m_xdp_socket( NULL )
+ , m_vhost_user_device( NULL )
+ , m_shared_tap( NULL )
+ , m_shared_tap_slot( -1 )
+ , m_record_log( NULL )
+ , m_replay_log( NULL )
+ , m_replay_end_reported( false )
+ , m_cycle_count( 0 )
+ , m_last_ready_to_send( 1 )
+ , m_trace_ring( NULL )
+ , m_generator( NULL )
+ , m_latency_monitor( NULL )
+ , m_dma_profile( NULL )
+ , m_check_tx_checksums( false )
+ , m_checked_tx_frame_count( 0 )
+ , m_bad_tx_frame_count( 0 )
+ , m_flow_control_flags( 0 )
+ , m_pause_quantum_cycles( DEFAULT_PAUSE_QUANTUM_CYCLES )
+ , m_tx_paused_until_cycle( 0 )
+ , m_is_pause_frame_received( false )
+ , m_pause_watermark( 0 )
+ , m_pause_time( 0xFFFF )
+ , m_is_peer_paused( false )
+ , m_peer_pause_refresh_cycle( 0 )
+ , m_use_auto_rx_filter( false )
+ , m_rx_filter_moder( 0 )
+{
+  memset( m_station_mac_addr, 0, sizeof(m_station_mac_addr) );
+
+  try
+  {
+    init( tap_interface_name,
+          print_informational_messages,
+          informational_message_prefix,
+          options,
+          is_restoring_checkpoint );
+  }
+  catch ( ... )
+  {
+    release_resources();
+    throw;
+  }
+}
+
+
+ethernet_dpi::~ethernet_dpi ( void )
+{
+  {
+    // Other instances may be destroyed at the same time in other threads.
+    auto_stdio_lock stdout_lock( stdout );
+
+    if ( m_check_tx_checksums )
+      print_checksum_summary();
+
+    if ( m_generator != NULL )
+      m_generator->print_report( m_informational_message_prefix, m_cycle_count );
+
+    if ( m_latency_monitor != NULL )
+      print_latency_report();
+
+    if ( m_dma_profile != NULL )
+      m_dma_profile->print_report( m_informational_message_prefix );
+
+    if ( m_shared_tap != NULL && m_shared_tap_slot != -1 && m_print_informational_messages )
+    {
+      const uint64_t dropped_frame_count = m_shared_tap->get_dropped_frame_count( unsigned( m_shared_tap_slot ) );
+
+      if ( dropped_frame_count != 0 )
+      {
+        printf( "%sDropped %llu received frames because the shared TAP interface ring was full.\n",
+                m_informational_message_prefix.c_str(),
+                (unsigned long long) dropped_frame_count );
+        fflush( stdout );
+      }
+    }
+  }
+
+  release_resources();
+}
+
+
+void ethernet_dpi::release_resources ( void )
+{
+  if ( m_reactor_registration_id != 0 )
+  {
+    ethernet_dpi_reactor::unregister_instance( m_reactor_registration_id, m_tun_tap_clone_device );
+    m_reactor_registration_id = 0;
+  }
+
+  free( m_reactor_ring );
+  m_reactor_ring = NULL;
+
+  free( m_reactor_ring_frame_lengths );
+  m_reactor_ring_frame_lengths = NULL;
+
+  delete m_record_log;
+  m_record_log = NULL;
+
+  delete m_replay_log;
+  m_replay_log = NULL;
+
+  delete m_trace_ring;
+  m_trace_ring = NULL;
+
+  delete m_generator;
+  m_generator = NULL;
+
+  delete m_latency_monitor;
+  m_latency_monitor = NULL;
+
+  delete m_dma_profile;
+  m_dma_profile = NULL;
+
+  delete m_xdp_socket;
+  m_xdp_socket = NULL;
+
+  delete m_vhost_user_device;
+  m_vhost_user_device = NULL;
+
+  if ( m_shared_tap != NULL )
+  {
+    if ( m_shared_tap_slot != -1 )
+      m_shared_tap->remove_instance( unsigned( m_shared_tap_slot ) );
+
+    m_shared_tap->release();
+    m_shared_tap = NULL;
+    m_shared_tap_slot = -1;
+  }
+
+  if ( m_tun_tap_clone_device != -1 )
+    close_tap();
+
+  if ( m_socket != -1 )
+    close_socket();
+
+  free( m_send_buffer );
+  m_send_buffer = NULL;
+
+  free( m_receive_buffer );
+  m_receive_buffer = NULL;
+
+  free( m_vnet_read_buffer );
+  m_vnet_read_buffer = NULL;
+
+  free( m_vnet_segment_buffer );
+  m_vnet_segment_buffer = NULL;
+}
+
+
+void ethernet_dpi::init ( const char * const tap_interface_name,
+                          const unsigned char print_informational_messages,
+                          const char * const informational_message_prefix,
+                          const char * const options,
+                          const bool is_restoring_checkpoint )
+{
+  if ( tap_interface_name == NULL ||
+       tap_interface_name[0] == 0 ||
+       strlen(tap_interface_name) >= IFNAMSIZ )
+  {
+    throw std::runtime_error( "Invalid tap_interface_name parameter." );
+  }
+
+  switch ( print_informational_messages )
+  {
+  case 0:
+    m_print_informational_messages = false;
+    break;
+
+  case 1:
+    m_print_informational_messages = true;
+    break;
+
+  default:
+    throw std::runtime_error( "Invalid print_informational_messages parameter." );
+  }
+
+  m_informational_message_prefix = informational_message_prefix ? informational_message_prefix : "";
+
+  m_tap_interface_name = tap_interface_name;
+  m_options = options ? options : "";
+
+  option_map option_values = parse_options( options );
+
+  const std::string backdoor_dma = take_option( &option_values, "backdoor_dma", "" );
+
+  if ( !backdoor_dma.empty() )
+  {
+    const memory_accessor_map::const_iterator it = s_memory_accessors.find( backdoor_dma );
+
+    if ( it == s_memory_accessors.end() )
+      throw std::runtime_error( format_msg( "No memory accessor has been registered with name \"%s\" for the backdoor DMA mode.", backdoor_dma.c_str() ) );
+
+    m_backdoor_memory_accessor = it->second;
+  }
+
+  m_use_reactor = take_option( &option_values, "reactor", "0" ) != "0";
+
+  const std::string reactor_ring_size = take_option( &option_values, "reactor_ring_size", "" );
+
+  if ( reactor_ring_size.empty() )
+  {
+    m_reactor_ring_slot_count = DEFAULT_REACTOR_RING_SLOT_COUNT;
+  }
+  else
+  {
+    const int val = atoi( reactor_ring_size.c_str() );
+
+    if ( val <= 0 )
+      throw std::runtime_error( "Invalid reactor_ring_size option." );
+
+    m_reactor_ring_slot_count = unsigned( val );
+  }
+
+  const std::string mtu = take_option( &option_values, "mtu", "" );
+  int requested_mtu = 0;
+
+  if ( !mtu.empty() )
+  {
+    requested_mtu = atoi( mtu.c_str() );
+
+    if ( requested_mtu <= 0 || requested_mtu > MAX_FRAME_LENGTH - MTU_MARGIN - CRC_LENGTH )
+      throw std::runtime_error( "Invalid mtu option." );
+  }
+
+  m_use_vnet_hdr = take_option( &option_values, "vnet_hdr", "0" ) != "0";
+
+  m_check_tx_checksums = take_option( &option_values, "check_tx_checksums", "0" ) != "0";
+
+  const std::string rx_filter            = take_option( &option_values, "rx_filter", "" );
+  const std::string rx_filter_ethertypes = take_option( &option_values, "rx_filter_ethertypes", "" );
+
+  m_use_auto_rx_filter = rx_filter == "auto";
+
+  const bool use_xdp = take_option( &option_values, "xdp", "0" ) != "0";
+  const std::string xdp_ring_size = take_option( &option_values, "xdp_ring_size", "" );
+  unsigned xdp_ring_slot_count = DEFAULT_XDP_RING_SIZE;
+
+  if ( !xdp_ring_size.empty() )
+  {
+    const int val = atoi( xdp_ring_size.c_str() );
+
+    // The kernel requires a power of 2.
+    if ( val <= 0 || val > 32768 || 0 != ( val & ( val - 1 ) ) )
+      throw std::runtime_error( "Invalid xdp_ring_size option." );
+
+    xdp_ring_slot_count = unsigned( val );
+  }
+
+  const std::string vhost_user_socket     = take_option( &option_values, "vhost_user", "" );
+  const std::string vhost_user_queue_size = take_option( &option_values, "vhost_user_queue_size", "" );
+  unsigned vhost_user_queue_slot_count = DEFAULT_VHOST_USER_QUEUE_SIZE;
+
+  if ( !vhost_user_queue_size.empty() )
+  {
+    const int val = atoi( vhost_user_queue_size.c_str() );
+
+    // Virtqueues must have a power-of-2 size, and each frame takes 2 entries.
+    if ( val < 2 || val > 32768 || 0 != ( val & ( val - 1 ) ) )
+      throw std::runtime_error( "Invalid vhost_user_queue_size option." );
+
+    vhost_user_queue_slot_count = unsigned( val );
+  }
+
+  const bool use_shared_tap = take_option( &option_values, "shared_tap", "0" ) != "0";
+  const std::string shared_tap_ring_size = take_option( &option_values, "shared_tap_ring_size", "" );
+  unsigned shared_tap_ring_slot_count = DEFAULT_SHARED_TAP_RING_SIZE;
+
+  if ( !shared_tap_ring_size.empty() )
+  {
+    const int val = atoi( shared_tap_ring_size.c_str() );
+
+    if ( val <= 0 || val > 65536 )
+      throw std::runtime_error( "Invalid shared_tap_ring_size option." );
+
+    shared_tap_ring_slot_count = unsigned( val );
+  }
+
+  if ( !rx_filter_ethertypes.empty() )
+    m_rx_filter_ethertypes = parse_ethertype_list( rx_filter_ethertypes );
+
+  const std::string pause_quantum_cycles = take_option( &option_values, "pause_quantum_cycles", "" );
+
+  if ( !pause_quantum_cycles.empty() )
+  {
+    const int val = atoi( pause_quantum_cycles.c_str() );
+
+    if ( val <= 0 )
+      throw std::runtime_error( "Invalid pause_quantum_cycles option." );
+
+    m_pause_quantum_cycles = uint64_t( val );
+  }
+
+  const std::string pause_watermark = take_option( &option_values, "pause_watermark", "" );
+  const std::string pause_time      = take_option( &option_values, "pause_time", "" );
+
+  if ( !pause_watermark.empty() )
+  {
+    const int val = atoi( pause_watermark.c_str() );
+
+    if ( val <= 0 )
+      throw std::runtime_error( "Invalid pause_watermark option." );
+
+    m_pause_watermark = unsigned( val );
+  }
+
+  if ( !pause_time.empty() )
+  {
+    const int val = atoi( pause_time.c_str() );
+
+    if ( val <= 0 || val > 0xFFFF )
+      throw std::runtime_error( "Invalid pause_time option." );
+
+    m_pause_time = uint16_t( val );
+  }
+
+  const std::string record_filename = take_option( &option_values, "record", "" );
+  const std::string replay_filename = take_option( &option_values, "replay", "" );
+
+  const std::string netns   = take_option( &option_values, "netns", "" );
+  const std::string userns  = take_option( &option_values, "userns", "" );
+  const std::string ip_addr = take_option( &option_values, "ip_addr", "" );
+
+  const std::string generator = take_option( &option_values, "generator", "" );
+
+  if ( !generator.empty() )
+  {
+    // The generator takes its own options, which start with "gen_".
+    // The MTU is needed beforehand, as there is no TAP interface to get it from.
+    m_mtu = requested_mtu != 0 ? requested_mtu : 1500;
+    m_generator = new traffic_generator( generator, &option_values, m_mtu );
+  }
+
+  const std::string latency         = take_option( &option_values, "latency", "" );
+  const std::string latency_udp_tag = take_option( &option_values, "latency_udp_tag", "" );
+  m_latency_log_filename = take_option( &option_values, "latency_log", "" );
+
+  if ( !latency.empty() )
+    m_latency_monitor = new latency_monitor( latency, latency_udp_tag );
+  else if ( !latency_udp_tag.empty() || !m_latency_log_filename.empty() )
+    throw std::runtime_error( "Options \"latency_udp_tag\" and \"latency_log\" require option \"latency\"." );
+
+  const std::string trace_filename  = take_option( &option_values, "trace", "" );
+  const std::string trace_ring_size = take_option( &option_values, "trace_ring_size", "" );
+  unsigned trace_ring_slot_count = DEFAULT_TRACE_RING_SIZE;
+
+  if ( !trace_ring_size.empty() )
+  {
+    const int val = atoi( trace_ring_size.c_str() );
+
+    if ( val <= 0 )
+      throw std::runtime_error( "Invalid trace_ring_size option." );
+
+    trace_ring_slot_count = unsigned( val );
+  }
+
+  if ( !option_values.empty() )
+    throw std::runtime_error( format_msg( "Unknown option \"%s\".", option_values.begin()->first.c_str() ) );
+
+  if ( !record_filename.empty() && !replay_filename.empty() )
+    throw std::runtime_error( "Options \"record\" and \"replay\" cannot be used together." );
+
+  if ( m_use_reactor && !replay_filename.empty() )
+    throw std::runtime_error( "Options \"reactor\" and \"replay\" cannot be used together." );
+
+  if ( m_generator != NULL && ( !replay_filename.empty() || m_use_reactor ) )
+    throw std::runtime_error( "Option \"generator\" cannot be used together with options \"replay\" or \"reactor\"." );
+
+  // Only the reactor ring has a fill level that the watermark can refer to.
+  if ( m_pause_watermark != 0 && !m_use_reactor )
+    throw std::runtime_error( "Option \"pause_watermark\" requires option \"reactor\"." );
+
+  if ( m_pause_watermark > m_reactor_ring_slot_count )
+    throw std::runtime_error( "Option \"pause_watermark\" is greater than the reactor ring size." );
+
+  if ( !pause_time.empty() && m_pause_watermark == 0 )
+    throw std::runtime_error( "Option \"pause_time\" requires option \"pause_watermark\"." );
+
+  if ( requested_mtu != 0 && !replay_filename.empty() )
+    throw std::runtime_error( "Options \"mtu\" and \"replay\" cannot be used together, the MTU comes from the replay log." );
+
+  if ( !rx_filter.empty() && ( !replay_filename.empty() || m_generator != NULL ) )
+    throw std::runtime_error( "Option \"rx_filter\" requires a TAP interface, so it cannot be used together with options \"replay\" or \"generator\"." );
+
+  if ( !rx_filter_ethertypes.empty() && !m_use_auto_rx_filter )
+    throw std::runtime_error( "Option \"rx_filter_ethertypes\" requires option \"rx_filter=auto\"." );
+
+  if ( use_xdp && ( !replay_filename.empty() || m_generator != NULL || m_use_reactor || m_use_vnet_hdr || !rx_filter.empty() ) )
+    throw std::runtime_error( "Option \"xdp\" cannot be used together with options \"replay\", \"generator\", \"reactor\", \"vnet_hdr\" or \"rx_filter\"." );
+
+  // The kernel only allows loading the XDP program with privileges in the initial user namespace.
+  if ( use_xdp && netns == "private" )
+    throw std::runtime_error( "Option \"xdp\" cannot be used together with \"netns=private\"." );
+
+  if ( !xdp_ring_size.empty() && !use_xdp )
+    throw std::runtime_error( "Option \"xdp_ring_size\" requires option \"xdp\"." );
+
+  if ( !vhost_user_socket.empty() &&
+       ( !replay_filename.empty() || m_generator != NULL || m_use_reactor || m_use_vnet_hdr || !rx_filter.empty() || use_xdp ) )
+  {
+    throw std::runtime_error( "Option \"vhost_user\" cannot be used together with options \"replay\", \"generator\", \"reactor\", \"vnet_hdr\", \"rx_filter\" or \"xdp\"." );
+  }
+
+  if ( !vhost_user_queue_size.empty() && vhost_user_socket.empty() )
+    throw std::runtime_error( "Option \"vhost_user_queue_size\" requires option \"vhost_user\"." );
+
+  // A receive filter would apply to all instances sharing the TAP interface.
+  if ( use_shared_tap &&
+       ( !replay_filename.empty() || m_generator != NULL || m_use_reactor || m_use_vnet_hdr || !rx_filter.empty() ||
+         use_xdp || !vhost_user_socket.empty() ) )
+  {
+    throw std::runtime_error( "Option \"shared_tap\" cannot be used together with options \"replay\", \"generator\", \"reactor\", \"vnet_hdr\", \"rx_filter\", \"xdp\" or \"vhost_user\"." );
+  }
+
+  if ( !shared_tap_ring_size.empty() && !use_shared_tap )
+    throw std::runtime_error( "Option \"shared_tap_ring_size\" requires option \"shared_tap\"." );
+
+  if ( !record_filename.empty() && is_restoring_checkpoint )
+    throw std::runtime_error( "Checkpoints cannot be restored in record mode." );
+
+  if ( netns.empty() && !userns.empty() )
+    throw std::runtime_error( "Option \"userns\" requires option \"netns\"." );
+
+  if ( netns.empty() && !use_xdp && !ip_addr.empty() )
+    throw std::runtime_error( "Option \"ip_addr\" requires option \"netns\" or option \"xdp\"." );
+
+  // This must happen before starting any threads, see ethernet_dpi_enter_network_namespace().
+  if ( !netns.empty() && enter_network_namespace( netns, userns ) && m_print_informational_messages )
+  {
+    if ( netns == "private" )
+    {
+      printf( "%sCreated a private network namespace, other processes can join it with: nsenter --target %d --user --net --preserve-credentials\n",
+              m_informational_message_prefix.c_str(),
+              int( getpid() ) );
+    }
+    else
+    {
+      printf( "%sJoined network namespace \"%s\".\n",
+              m_informational_message_prefix.c_str(),
+              netns.c_str() );
+    }
+
+    fflush( stdout );
+  }
+
+  if ( !trace_filename.empty() )
+    m_trace_ring = new trace_ring( trace_filename, trace_ring_slot_count );
+
+  if ( m_generator != NULL )
+  {
+    if ( m_print_informational_messages )
+    {
+      printf( "%sGenerating %s traffic instead of using TAP interface \"%s\", MTU: %d.\n",
+              m_informational_message_prefix.c_str(),
+              generator.c_str(),
+              tap_interface_name,
+              m_mtu );
+      fflush( stdout );
+    }
+  }
+  else if ( use_xdp )
+  {
+    open_xdp( tap_interface_name, requested_mtu, ip_addr, xdp_ring_slot_count );
+  }
+  else if ( !vhost_user_socket.empty() )
+  {
+    // There is no network interface to take the MTU from.
+    m_mtu = requested_mtu != 0 ? requested_mtu : DEFAULT_VHOST_USER_MTU;
+    m_vhost_user_device = new vhost_user_device( vhost_user_socket, vhost_user_queue_slot_count, m_mtu + MTU_MARGIN );
+
+    if ( m_print_informational_messages )
+    {
+      printf( "%sUsing vhost-user back-end \"%s\" instead of TAP interface \"%s\", MTU: %d.\n",
+              m_informational_message_prefix.c_str(),
+              vhost_user_socket.c_str(),
+              tap_interface_name,
+              m_mtu );
+      fflush( stdout );
+    }
+  }
+  else if ( use_shared_tap )
+  {
+    attach_shared_tap( tap_interface_name, requested_mtu, !netns.empty(), ip_addr, shared_tap_ring_slot_count );
+  }
+  else if ( replay_filename.empty() )
+  {
+    open_tap( tap_interface_name, requested_mtu, !netns.empty(), ip_addr, false );
+
+    // The automatic filter is attached later on, when the simulated software enables the receiver,
+    // because it depends on the MAC address and on the MODER register.
+    if ( !rx_filter.empty() && !m_use_auto_rx_filter )
+      attach_rx_filter( read_rx_filter_file( rx_filter ) );
+  }
+  else
+  {
+    m_replay_log = new frame_log_reader( replay_filename.c_str() );
+    m_mtu = m_replay_log->get_mtu();
+
+    if ( m_print_informational_messages )
+    {
+      printf( "%sReplaying frame log \"%s\" instead of using TAP interface \"%s\", MTU: %d.\n",
+              m_informational_message_prefix.c_str(),
+              replay_filename.c_str(),
+              tap_interface_name,
+              m_mtu );
+      fflush( stdout );
+    }
+  }
+
+  m_frame_buffer_size = m_mtu + MTU_MARGIN + 1 + CRC_LENGTH;  // We read one byte more than the MTU in order to know if the frame is longer than the maximum allowed.
+
+  m_send_buffer    = (char *) malloc( m_frame_buffer_size );
+  m_receive_buffer = (char *) malloc( m_frame_buffer_size );
+
+  if ( m_send_buffer == NULL || m_receive_buffer == NULL )
+    throw std::bad_alloc();
+
+  if ( !record_filename.empty() )
+  {
+    m_record_log = new frame_log_writer( record_filename.c_str(), m_mtu );
+
+    if ( m_print_informational_messages )
+    {
+      printf( "%sRecording frames to log \"%s\".\n",
+              m_informational_message_prefix.c_str(),
+              record_filename.c_str() );
+      fflush( stdout );
+    }
+  }
+
+  if ( m_replay_log != NULL || m_generator != NULL )
+  {
+    m_use_vnet_hdr = false;  // There is no TAP interface.
+    return;
+  }
+
+  if ( m_use_vnet_hdr )
+  {
+    m_vnet_segment_buffer = (char *) malloc( m_frame_buffer_size );
+
+    // Even with the reactor, flush_tap_receive_buffer() reads from the TAP interface directly.
+    m_vnet_read_buffer = (char *) malloc( VNET_FRAME_BUFFER_SIZE );
+
+    if ( m_vnet_segment_buffer == NULL || m_vnet_read_buffer == NULL )
+      throw std::bad_alloc();
+  }
+
+
+  // Notes about the TAP interface's receive buffer.
+  //
+  // From empiric evidence under Ubuntu 10.04, it looks like a persistent TAP interface drops
+  // all incoming packets if no-one holds a file handle to it.
+  // I used Thomas Habets's 'arping' tool in order to overload the receive buffer between the
+  // open() and recv() calls, and I eventually got this error message:
+  //    arping: libnet_write(): libnet_write_link(): only -1 bytes written (No buffer space available)
+  //    202 packets transmitted, 0 packets received, 100% unanswered (0 extra)
+  // I then repeatedly called recv() and got 201 packets with 42 bytes each, that is a little over 8 KB's
+  // worth of data.
+  // Afterwards, I tested the following scenario:
+  //  - open(TAP interface)
+  //  - overflow the buffer with arping
+  //  - kill the process
+  //  - open(TAP interface)
+  //  - recv all packets
+  // The receive buffer still delivered 100 stale packets. It looks like the receive buffer is not cleared
+  // when the last handle is closed on the TAP interface.
+  //
+  // Therefore, I think it's good idea to flush the receive buffer at this point.
+  // However, when restoring a checkpoint, the simulation continues where it left off,
+  // so any frames waiting in the TAP interface are not stale.
+
+  if ( !is_restoring_checkpoint )
+    flush_tap_receive_buffer();
+
+  if ( m_use_reactor )
+  {
+    m_reactor_ring_slot_size = m_use_vnet_hdr ? size_t( VNET_FRAME_BUFFER_SIZE ) : m_frame_buffer_size;
+    m_reactor_ring = (char *) malloc( m_reactor_ring_slot_count * m_reactor_ring_slot_size );
+    m_reactor_ring_frame_lengths = (int *) malloc( m_reactor_ring_slot_count * sizeof(int) );
+
+    if ( m_reactor_ring == NULL || m_reactor_ring_frame_lengths == NULL )
+      throw std::bad_alloc();
+
+    // The reactor thread must never block on a read() call.
+    const int flags = fcntl( m_tun_tap_clone_device, F_GETFL );
+
+    if ( flags == -1 || -1 == fcntl( m_tun_tap_clone_device, F_SETFL, flags | O_NONBLOCK ) )
+      throw std::runtime_error( format_error_message( errno, "Error setting the TAP interface to non-blocking mode: " ) );
+
+    m_reactor_registration_id = ethernet_dpi_reactor::register_instance( this, m_tun_tap_clone_device );
+  }
+}
+
+
+// Opens or creates the TAP interface and retrieves its MTU. If 'requested_mtu' is not zero,
+// the MTU of the TAP interface is changed first.
+
+// If 'configure_interface' is true, this process is in its own network namespace (see option "netns"),
+// so it can assign the IP address and the MTU and bring the TAP interface up itself.
+// If 'is_multi_queue' is true, the TAP interface must have been created with multi-queue support,
+// or it must not exist yet.
+
+void ethernet_dpi::open_tap ( const char * const tap_interface_name,
+                              const int requested_mtu,
+                              const bool configure_interface,
+                              const std::string & ip_addr,
+                              const bool is_multi_queue )
+{
+  const char tun_tap_clone_device_name[] = "/dev/net/tun";
+
+
+  m_tun_tap_clone_device = open( tun_tap_clone_device_name, O_RDWR );
+
+  if ( m_tun_tap_clone_device == -1 )
+  {
+    throw std::runtime_error( format_error_message( errno,
+                                                    "Error opening TUN/TAP clone device \"%s\": ",
+                                                    tun_tap_clone_device_name ) );
+  }
+
+  // If the TAP device exists, attempt to open it. This should succeed if the
+  // parameters match the ones used at creation time and the user is the owner.
+  // If the TAP device does not exist, attempt to create it. The user must be root
+  // or at least have the CAP_NET_ADMIN capability.
+  // Unfortunately, there does not seem to be a way to open the TAP interface only if
+  // it already exists, and not to attempt to create it if it does not.
+
+  ifreq ifr_setiff;
+  memset( &ifr_setiff, 0, sizeof(ifr_setiff) );
+  ifr_setiff.ifr_flags = IFF_TAP |  // Raw ethernet, the alternative would be TUN.
+                         IFF_NO_PI; // No Packet Information (no extra header with procotol ID and flags)
+
+  if ( m_use_vnet_hdr )
+    ifr_setiff.ifr_flags |= IFF_VNET_HDR;
+
+  // Each process sharing the TAP interface opens its own queue, see class shared_tap.
+  if ( is_multi_queue )
+    ifr_setiff.ifr_flags |= IFF_MULTI_QUEUE;
+
+  strncpy( ifr_setiff.ifr_name, tap_interface_name, IFNAMSIZ );
+
+  if ( ioctl( m_tun_tap_clone_device, TUNSETIFF, (void *) &ifr_setiff ) == -1 )
+  {
+    if ( is_multi_queue && errno == EINVAL )
+    {
+      throw std::runtime_error( format_msg( "Error opening TAP interface \"%s\" with multi-queue support, "
+                                            "create it with \"ip tuntap add dev %s mode tap multi_queue\" for option \"shared_tap\".",
+                                            tap_interface_name,
+                                            tap_interface_name ) );
+    }
+
+    throw std::runtime_error( format_error_message( errno,
+                                                    "Error opening/creating TAP interface \"%s\": ",
+                                                    tap_interface_name ) );
+  }
+
+  // In vnet_hdr mode, let the kernel hand us TCP super-frames and frames without the final checksum.
+  // UDP fragmentation offload (UFO) is not enabled, as it is deprecated.
+  // Otherwise, disable all offload features explicitly, because they are a property of the network interface,
+  // so a persistent TAP interface keeps them after a previous run in vnet_hdr mode.
+  const unsigned offload_flags = m_use_vnet_hdr ? ( TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN ) : 0;
+
+  if ( ioctl( m_tun_tap_clone_device, TUNSETOFFLOAD, offload_flags ) == -1 )
+  {
+    throw std::runtime_error( format_error_message( errno,
+                                                    "Error setting the offload features of TAP interface \"%s\": ",
+                                                    tap_interface_name ) );
+  }
+
+  // A persistent TAP interface also keeps the receive filter from a previous run. Option "rx_filter"
+  // attaches a new one later on.
+  if ( ioctl( m_tun_tap_clone_device, TUNDETACHFILTER, 0 ) == -1 )
+  {
+    throw std::runtime_error( format_error_message( errno,
+                                                    "Error detaching the receive filter from TAP interface \"%s\": ",
+                                                    tap_interface_name ) );
+  }
+
+  if ( configure_interface )
+  {
+    const int netlink_socket = open_rtnetlink_socket();
+
+    try
+    {
+      if ( !ip_addr.empty() )
+        add_ip_address( netlink_socket, tap_interface_name, ip_addr );
+
+      set_link_up( netlink_socket, tap_interface_name, requested_mtu );
+    }
+    catch ( ... )
+    {
+      close_a( netlink_socket );
+      throw;
+    }
+
+    close_a( netlink_socket );
+  }
+
+  // Create a socket. We need one in order to retrieve some information from a network interface.
+  m_socket = socket( AF_INET, SOCK_DGRAM, 0 );
+
+  if ( m_socket == -1 )
+  {
+    throw std::runtime_error( format_error_message( errno,
+                                                    "Error creating a socket: ") );
+  }
+
+
+  // Get the IP address of the TAP interface. In a private network namespace, it may not have one.
+  ifreq ifr_getipaddr;
+  memset( &ifr_getipaddr, 0, sizeof(ifr_getipaddr) );
+  strncpy( ifr_getipaddr.ifr_name, tap_interface_name, IFNAMSIZ );
+  std::string ip_addr_text;
+
+  if ( ioctl( m_socket, SIOCGIFADDR, (void *)&ifr_getipaddr ) == -1 )
+  {
+    if ( !configure_interface || errno != EADDRNOTAVAIL )
+    {
+      throw std::runtime_error( format_error_message( errno,
+                                                      "Error getting the IP address of TAP interface \"%s\": ",
+                                                      tap_interface_name ) );
+    }
+
+    ip_addr_text = "none";
+  }
+  else
+    ip_addr_text = ip_address_to_text( &((const sockaddr_in *)&ifr_getipaddr.ifr_addr)->sin_addr );
+
+  if ( requested_mtu != 0 && !configure_interface )
+  {
+    // Changing the MTU requires the CAP_NET_ADMIN capability, even if we own the TAP interface.
+    ifreq ifr_setmtu;
+    memset( &ifr_setmtu, 0, sizeof(ifr_setmtu) );
+    strncpy( ifr_setmtu.ifr_name, tap_interface_name, IFNAMSIZ );
+    ifr_setmtu.ifr_mtu = requested_mtu;
+
+    if ( ioctl( m_socket, SIOCSIFMTU, (void *) &ifr_setmtu ) == -1 )
+    {
+      throw std::runtime_error( format_error_message( errno,
+                                                      "Error setting the MTU for TAP interface \"%s\" to %d: ",
+                                                      tap_interface_name,
+                                                      requested_mtu ) );
+    }
+  }
+
+  // Get the MTU of the TAP interface.
+  ifreq ifr_getmtu;
+  memset( &ifr_getmtu, 0, sizeof(ifr_getmtu) );
+  strncpy( ifr_getmtu.ifr_name, tap_interface_name, IFNAMSIZ );
+
+  if ( ioctl( m_socket, SIOCGIFMTU, (void *) &ifr_getmtu ) == -1 )
+  {
+    throw std::runtime_error( format_error_message( errno,
+                                                    "Error getting the MTU for TAP interface \"%s\": ",
+                                                    tap_interface_name ) );
+  }
+
+  m_mtu = ifr_getmtu.ifr_mtu;
+
+  if ( m_mtu > MAX_FRAME_LENGTH - MTU_MARGIN - CRC_LENGTH )
+  {
+    throw std::runtime_error( format_msg( "The MTU of %d for TAP interface \"%s\" is too big, the maximum is %d.",
+                                          m_mtu,
+                                          tap_interface_name,
+                                          MAX_FRAME_LENGTH - MTU_MARGIN - CRC_LENGTH ) );
+  }
+
+  close_socket();  // We don't really need the socket any more.
+
+  if ( m_print_informational_messages )
+  {
+    printf( "%sUsing TAP interface \"%s\", IP addr: %s, MTU: %d.\n",
+            m_informational_message_prefix.c_str(),
+            tap_interface_name,
+            ip_addr_text.c_str(),
+            m_mtu );
+    fflush( stdout );
+  }
+}
+
+
+// The first instance in this process opens the TAP interface, and the other ones use the same file descriptor.
+// The parameters are the same as for open_tap(), but the later instances ignore them.
+
+void ethernet_dpi::attach_shared_tap ( const char * const tap_interface_name,
+                                       const int requested_mtu,
+                                       const bool configure_interface,
+                                       const std::string & ip_addr,
+                                       const unsigned ring_size )
+{
+  m_shared_tap = shared_tap::find_and_retain( tap_interface_name );
+
+  if ( m_shared_tap == NULL )
+  {
+    open_tap( tap_interface_name, requested_mtu, configure_interface, ip_addr, true );
+
+    m_shared_tap = new shared_tap( tap_interface_name, m_tun_tap_clone_device, m_mtu, ring_size );
+    m_tun_tap_clone_device = -1;  // The shared_tap object owns it now.
+  }
+  else
+  {
+    if ( m_shared_tap->get_ring_size() != ring_size )
+    {
+      throw std::runtime_error( format_msg( "All instances sharing TAP interface \"%s\" must use the same shared_tap_ring_size option.",
+                                            tap_interface_name ) );
+    }
+
+    m_mtu = m_shared_tap->get_mtu();
+  }
+
+  m_shared_tap_slot = int( m_shared_tap->add_instance() );
+
+  if ( m_print_informational_messages )
+  {
+    printf( "%sSharing TAP interface \"%s\" as slot %d, MTU: %d.\n",
+            m_informational_message_prefix.c_str(),
+            tap_interface_name,
+            m_shared_tap_slot,
+            m_mtu );
+    fflush( stdout );
+  }
+}
+
+
+void ethernet_dpi::flush_tap_receive_buffer ( void )
+{
+  m_received_frame_queue.clear();
+
+  if ( m_replay_log != NULL || m_generator != NULL )
+  {
+    // The frames in the replay log are delivered at their recorded cycles, there is nothing stale to flush.
+    // The generator has not produced any frames yet either.
+    m_received_byte_count = 0;
+    return;
+  }
+
+  if ( m_use_reactor )
+  {
+    while ( take_frame_from_reactor_ring() != 0 )
+    {
+    }
+  }
+
+  // In reactor mode, the reactor thread may be reading from the TAP interface at the same time.
+  // That is not a problem, as each read() call returns a whole frame.
+  for ( ; ; )
+  {
+    const int received_byte_count = receive_frame();
+
+    if ( received_byte_count == 0 )
+      break;
+
+    ETHDPI_PROBE3( frame_discarded, m_tap_interface_name.c_str(), received_byte_count, DISCARD_REASON_FLUSHED );
+
+    if ( false )  // Flush silently.
+    {
+      if ( m_print_informational_messages )
+      {
+        printf( "%sDiscarding stale frame with %d bytes.\n",
+                m_informational_message_prefix.c_str(),
+                received_byte_count );
+        fflush( stdout );
+      }
+    }
+  }
+
+  m_received_frame_queue.clear();  // In vnet_hdr mode, receive_frame() may have queued more segments.
+  m_received_byte_count = 0;
+}
+
+
+void ethernet_dpi::add_byte_to_tx_frame ( const char data )
+{
+  if ( m_send_byte_count >= m_mtu + MTU_MARGIN )
+    throw std::runtime_error( format_msg( "The frame size exceeds the MTU limit of %d.", m_mtu ) );
+
+  m_send_buffer[ m_send_byte_count ] = data;
+
+  ++m_send_byte_count;
+}
+
+
+void ethernet_dpi::trace ( const uint32_t event_type,
+                           const uint32_t bd_index,
+                           const uint32_t addr,
+                           const uint32_t data )
+{
+  if ( m_trace_ring != NULL )
+    m_trace_ring->add( m_cycle_count, event_type, bd_index, addr, data );
+}
+
+
+void ethernet_dpi::new_tx_frame ( void )
+{
+  m_send_byte_count = 0;
+}
+
+
+void ethernet_dpi::send_tx_frame ( void )
+{
+  if ( m_send_byte_count <= 0 )
+      throw std::runtime_error( "The frame size exceeds the MTU." );
+
+  if ( m_check_tx_checksums )
+    check_sent_frame_checksums();
+
+  send_frame( m_send_buffer, m_send_byte_count );
+}
+
+
+static int append_dummy_crc ( char * buffer, int byte_count );
+
+
+// Sends a frame assembled by the simulation, or a PAUSE frame that the software has requested.
+
+void ethernet_dpi::send_frame ( const char * const frame, const int byte_count )
+{
+  trace( TRACE_FRAME_SENT, 0, 0, uint32_t( byte_count ) );
+  ETHDPI_PROBE3( frame_sent, m_tap_interface_name.c_str(), byte_count, m_cycle_count );
+
+  if ( m_latency_monitor != NULL )
+    m_latency_monitor->note_sent_frame( m_cycle_count, (const uint8_t *) frame, byte_count );
+
+  if ( m_record_log != NULL )
+    m_record_log->write_record( FRAME_LOG_SENT, m_cycle_count, frame, byte_count );
+
+  if ( m_replay_log != NULL )
+  {
+    check_sent_frame_against_replay_log( frame, byte_count );
+    return;
+  }
+
+  if ( m_generator != NULL )
+  {
+    const std::string reply = m_generator->sink_frame( m_cycle_count, frame, byte_count );
+
+    if ( !reply.empty() )
+    {
+      // Like any other received frame, the reply must end with the dummy CRC.
+      std::string received_frame( reply.size() + CRC_LENGTH, '\0' );
+      memcpy( &received_frame[ 0 ], reply.data(), reply.size() );
+      received_frame.resize( size_t( append_dummy_crc( &received_frame[ 0 ], int( reply.size() ) ) ) );
+
+      m_received_frame_queue.push_back( received_frame );
+    }
+
+    return;
+  }
+
+  write_frame_to_tap( frame, byte_count );
+}
+
+
+void ethernet_dpi::write_frame_to_tap ( const char * const frame, const int byte_count )
+{
+  if ( m_xdp_socket != NULL )
+  {
+    m_xdp_socket->send_frame( frame, byte_count );
+    return;
+  }
+
+  if ( m_vhost_user_device != NULL )
+  {
+    m_vhost_user_device->send_frame( frame, byte_count );
+    return;
+  }
+
+  if ( m_shared_tap != NULL )
+  {
+    // The instances sharing the TAP interface may run in different threads.
+    auto_mutex_lock lock( m_shared_tap->get_tx_mutex() );
+
+    write_frame_to_fd( m_shared_tap->get_fd(), frame, byte_count );
+    return;
+  }
+
+  write_frame_to_fd( m_tun_tap_clone_device, frame, byte_count );
+}
+
+
+void ethernet_dpi::write_frame_to_fd ( const int fd, const char * const frame, const int byte_count )
+{
+  // In vnet_hdr mode, the frame must be preceded by a virtio_net_hdr. An all-zero header means
+  // that the frame is complete, without any offload requests.
+  virtio_net_hdr vnet_hdr;
+  memset( &vnet_hdr, 0, sizeof(vnet_hdr) );
+
+  iovec iov[ 2 ];
+  int iov_count = 0;
+
+  if ( m_use_vnet_hdr )
+  {
+    iov[ iov_count ].iov_base = &vnet_hdr;
+    iov[ iov_count ].iov_len  = sizeof(vnet_hdr);
+    ++iov_count;
+  }
+
+  iov[ iov_count ].iov_base = const_cast< char * >( frame );
+  iov[ iov_count ].iov_len  = byte_count;
+  ++iov_count;
+
+  const ssize_t expected_byte_count = byte_count + ( m_use_vnet_hdr ? sizeof(vnet_hdr) : 0 );
+
+  for ( ; ; )  // Repeat if EINTR.
+  {
+    const ssize_t sent_byte_count = writev( fd, iov, iov_count );
+    if ( sent_byte_count == 0 )
+    {
+      throw std::runtime_error( "Cannot write data to the TAP interface." );
+    }
+
+    if ( sent_byte_count == -1 )
+    {
+      const int errno_value = errno;
+
+      if ( errno_value == EINTR )
+        continue;
+
+      if ( errno_value == EAGAIN || errno_value == EWOULDBLOCK )
+      {
+        // The TAP interface is in non-blocking mode (see the reactor mode and option "shared_tap"),
+        // wait until it accepts the frame.
+        pollfd polled_fd;
+
+        polled_fd.fd      = fd;
+        polled_fd.events  = POLLOUT;
+        polled_fd.revents = 0;
+
+        if ( poll( &polled_fd, 1, -1 ) == -1 && errno != EINTR )
+          throw std::runtime_error( format_error_message( errno, "Error polling the TAP interface to send: " ) );
+
+        continue;
+      }
+
+      throw std::runtime_error( format_error_message( errno, "Error writing data to the TAP interface: " ) );
+    }
+
+    if ( sent_byte_count != expected_byte_count )
+    {
+      throw std::runtime_error( "Error writing data to the TAP interface, only part of the ethernet frame could be written." );
+    }
+
+    break;
+  }
+}
+
+
+void ethernet_dpi::close_tap ( void )
+{
+  assert( m_tun_tap_clone_device != -1 );
+
+  close_a( m_tun_tap_clone_device );
+
+  m_tun_tap_clone_device = -1;
+}
+
+
+void ethernet_dpi::close_socket ( void )
+{
+  assert( m_socket != -1 );
+
+  close_a( m_socket );
+
+  m_socket = -1;
+}
+
+
+// Returns the frame length, or zero if the receive queue is empty.
+
+int ethernet_dpi::receive_frame ( void )
+{
+  if ( m_xdp_socket != NULL )
+  {
+    const int received_byte_count = m_xdp_socket->receive_frame( m_receive_buffer );
+
+    return received_byte_count == 0 ? 0 : append_dummy_crc( m_receive_buffer, received_byte_count );
+  }
+
+  if ( m_vhost_user_device != NULL )
+  {
+    const int received_byte_count = m_vhost_user_device->receive_frame( m_receive_buffer );
+
+    return received_byte_count == 0 ? 0 : append_dummy_crc( m_receive_buffer, received_byte_count );
+  }
+
+  if ( m_shared_tap != NULL )
+  {
+    m_shared_tap->dispatch_frames();
+    return take_frame_from_shared_tap();
+  }
+
+  for ( ; ; )  // Repeat if EINTR.
+  {
+    pollfd polled_fd;
+
+    polled_fd.fd      = m_tun_tap_clone_device;
+    polled_fd.events  = POLLIN;
+    polled_fd.revents = 0;
+
+    const int poll_res = poll( &polled_fd, 1, 0 );
+
+    if ( poll_res == -1 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      throw std::runtime_error( format_error_message( errno, "Error polling the TAP interface to receive: " ) );
+    }
+
+    if ( poll_res == 0 )
+      return 0;
+
+    assert( poll_res == 1 );
+
+    break;
+  }
+
+  if ( m_use_vnet_hdr )
+  {
+    const int received_byte_count = read_frame( m_vnet_read_buffer );
+
+    return received_byte_count == 0 ? 0 : segment_vnet_frame( m_vnet_read_buffer, received_byte_count );
+  }
+
+  return read_frame( m_receive_buffer );
+}
+
+
+// Appends the dummy CRC to a received frame, if enabled. The buffer must have room for it.
+// Returns the new frame length.
+
+static int append_dummy_crc ( char * const buffer, int byte_count )
+{
+  if ( APPEND_DUMMY_CRC )
+  {
+    // The dummy CRC is "DEADFOOD" in hex.
+    assert( CRC_LENGTH == 4 );
+    buffer[ byte_count++ ] = char( 0xDE );
+    buffer[ byte_count++ ] = char( 0xAD );
+    buffer[ byte_count++ ] = char( 0xF0 );
+    buffer[ byte_count++ ] = char( 0x0D );
+  }
+
+  return byte_count;
+}
+
+
+int ethernet_dpi::take_frame_from_shared_tap ( void )
+{
+  const int received_byte_count = m_shared_tap->take_frame( unsigned( m_shared_tap_slot ), m_receive_buffer );
+
+  return received_byte_count == 0 ? 0 : append_dummy_crc( m_receive_buffer, received_byte_count );
+}
+
+
+int ethernet_dpi::get_tap_read_size ( void ) const
+{
+  // We read one byte more than the MTU in order to know if the frame is longer than the maximum allowed.
+  return m_use_vnet_hdr ? VNET_FRAME_BUFFER_SIZE : m_mtu + MTU_MARGIN + 1;
+}
+
+
+// Reads the next frame from the TAP interface into the given buffer, which must be m_frame_buffer_size bytes long,
+// or VNET_FRAME_BUFFER_SIZE bytes long in vnet_hdr mode. In that mode, the data is returned as it comes,
+// including the virtio_net_hdr, see segment_vnet_frame().
+// Returns the frame length, or zero if the TAP interface is in non-blocking mode and no frame is available.
+
+int ethernet_dpi::read_frame ( char * const buffer )
+{
+  for ( ; ; )  // Repeat if EINTR.
+  {
+    ssize_t received_byte_count = read( m_tun_tap_clone_device,
+                                        buffer,
+                                        get_tap_read_size() );
+    if ( received_byte_count == 0 )
+    {
+      throw std::runtime_error( "Cannot read data from the TAP interface." );
+    }
+
+    if ( received_byte_count == -1 )
+    {
+      const int errno_value = errno;
+
+      if ( errno_value == EINTR )
+        continue;
 
       if ( errno_value == EAGAIN || errno_value == EWOULDBLOCK )
       {
-        // No data available yet. This shouldn't happen, as we have called poll() before,
-        // and we are not actually reading from a socket which might be in non-blocking mode.
-        assert( false );
-        return 0;
+        // No data available yet. This shouldn't happen if we have called poll() before,
+        // but in reactor mode the TAP interface is in non-blocking mode, and another thread may have read the frame in the meantime.
+        return 0;
+      }
+
+      throw std::runtime_error( format_error_message( errno, "Error reading data from the TAP interface: " ) );
+    }
+
+    if ( m_use_vnet_hdr )
+    {
+      if ( received_byte_count >= VNET_FRAME_BUFFER_SIZE || received_byte_count <= ssize_t( sizeof( virtio_net_hdr ) ) )
+        throw std::runtime_error( "Error reading data from the TAP interface, the received packet has an invalid length." );
+
+      return (int) received_byte_count;
+    }
+
+    if ( received_byte_count > ssize_t( m_mtu + MTU_MARGIN ) )
+    {
+      throw std::runtime_error( "Error reading data from the TAP interface, the received packet is bigger than the MTU." );
+    }
+
+    return append_dummy_crc( buffer, (int) received_byte_count );
+  }
+}
+
+
+// ------------------------- Header fields and Internet checksums -------------------------
+
+// These helpers are shared by the vnet_hdr offload support, the checksum validator and the traffic generator.
+
+static uint16_t get_be16 ( const uint8_t * const p )
+{
+  return uint16_t( ( p[0] << 8 ) | p[1] );
+}
+
+static void put_be16 ( uint8_t * const p, const uint16_t val )
+{
+  p[0] = uint8_t( val >> 8 );
+  p[1] = uint8_t( val );
+}
+
+static uint32_t get_be32 ( const uint8_t * const p )
+{
+  return ( uint32_t( get_be16( p ) ) << 16 ) | get_be16( p + 2 );
+}
+
+static void put_be32 ( uint8_t * const p, const uint32_t val )
+{
+  put_be16( p, uint16_t( val >> 16 ) );
+  put_be16( p + 2, uint16_t( val ) );
+}
+
+
+static uint16_t fold_internet_checksum ( uint64_t sum )
+{
+  while ( sum >> 16 )
+    sum = ( sum & 0xFFFF ) + ( sum >> 16 );
+
+  return uint16_t( sum );
+}
+
+
+// The one's complement sum does not depend on the byte order, except for a final byte swap (RFC 1071).
+// Therefore, the following routines add the data as 32-bit words in host byte order,
+// or even wider ones with SIMD instructions, into a 64-bit accumulator, which cannot overflow for Ethernet frames.
+// They return the sum folded to 16 bits, still in host byte order. Trailing bytes are padded with zeros.
+
+static uint64_t add_native_words ( uint64_t sum, const uint8_t * const data, const size_t byte_count )
+{
+  size_t i = 0;
+
+  for ( ; i + 4 <= byte_count; i += 4 )
+  {
+    uint32_t word;
+    memcpy( &word, data + i, sizeof(word) );
+    sum += word;
+  }
+
+  if ( i < byte_count )
+  {
+    uint8_t last_bytes[ 4 ] = { 0, 0, 0, 0 };
+    memcpy( last_bytes, data + i, byte_count - i );
+
+    uint32_t word;
+    memcpy( &word, last_bytes, sizeof(word) );
+    sum += word;
+  }
+
+  return sum;
+}
+
+
+static uint16_t native_sum_scalar ( const uint8_t * const data, const size_t byte_count )
+{
+  return fold_internet_checksum( add_native_words( 0, data, byte_count ) );
+}
+
+
+#ifdef ETHDPI_USE_X86_SIMD
+
+__attribute__(( target( "sse4.1" ) ))
+static uint16_t native_sum_sse41 ( const uint8_t * const data, const size_t byte_count )
+{
+  __m128i sum0 = _mm_setzero_si128();
+  __m128i sum1 = _mm_setzero_si128();
+  size_t i = 0;
+
+  for ( ; i + 16 <= byte_count; i += 16 )
+  {
+    const __m128i words = _mm_loadu_si128( (const __m128i *)( data + i ) );
+
+    sum0 = _mm_add_epi64( sum0, _mm_cvtepu32_epi64( words ) );
+    sum1 = _mm_add_epi64( sum1, _mm_cvtepu32_epi64( _mm_srli_si128( words, 8 ) ) );
+  }
+
+  uint64_t lanes[ 2 ];
+  _mm_storeu_si128( (__m128i *) lanes, _mm_add_epi64( sum0, sum1 ) );
+
+  return fold_internet_checksum( add_native_words( lanes[0] + lanes[1], data + i, byte_count - i ) );
+}
+
+
+__attribute__(( target( "avx2" ) ))
+static uint16_t native_sum_avx2 ( const uint8_t * const data, const size_t byte_count )
+{
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i sum0 = zero;
+  __m256i sum1 = zero;
+  size_t i = 0;
+
+  for ( ; i + 32 <= byte_count; i += 32 )
+  {
+    const __m256i words = _mm256_loadu_si256( (const __m256i *)( data + i ) );
+
+    // The unpack instructions interleave the 32-bit words with zeros, which yields 64-bit values.
+    sum0 = _mm256_add_epi64( sum0, _mm256_unpacklo_epi32( words, zero ) );
+    sum1 = _mm256_add_epi64( sum1, _mm256_unpackhi_epi32( words, zero ) );
+  }
+
+  uint64_t lanes[ 4 ];
+  _mm256_storeu_si256( (__m256i *) lanes, _mm256_add_epi64( sum0, sum1 ) );
+
+  return fold_internet_checksum( add_native_words( lanes[0] + lanes[1] + lanes[2] + lanes[3], data + i, byte_count - i ) );
+}
+
+#endif  // #ifdef ETHDPI_USE_X86_SIMD
+
+
+typedef uint16_t native_sum_routine ( const uint8_t * data, size_t byte_count );
+
+static native_sum_routine * select_native_sum_routine ( void )
+{
+  #ifdef ETHDPI_USE_X86_SIMD
+    __builtin_cpu_init();
+
+    if ( __builtin_cpu_supports( "avx2" ) )
+      return native_sum_avx2;
+
+    if ( __builtin_cpu_supports( "sse4.1" ) )
+      return native_sum_sse41;
+  #endif
+
+  return native_sum_scalar;
+}
+
+static native_sum_routine * const s_native_sum_routine = select_native_sum_routine();
+
+
+// Adds the given data to a one's complement sum (RFC 1071). The data is a sequence of 16-bit big-endian words,
+// an odd byte at the end is padded with zero.
+
+static uint64_t add_to_internet_checksum ( const uint64_t sum, const uint8_t * const data, const size_t byte_count )
+{
+  return sum + ntohs( s_native_sum_routine( data, byte_count ) );
+}
+
+
+// Folds the sum to 16 bits and returns its one's complement, ready to be stored in a checksum field.
+
+static uint16_t finish_internet_checksum ( const uint64_t sum )
+{
+  return uint16_t( ~fold_internet_checksum( sum ) );
+}
+
+
+// ------------------------- Offload support for the vnet_hdr mode -------------------------
+
+// Returns the offset of the IP header, skipping any VLAN tags.
+
+static int get_l3_offset ( const uint8_t * const frame, const int frame_length )
+{
+  int offset = 12;
+
+  for ( ; ; )
+  {
+    if ( offset + 2 > frame_length )
+      throw std::runtime_error( "The Ethernet frame from the TAP interface is truncated." );
+
+    const uint16_t ether_type = get_be16( frame + offset );
+
+    if ( ether_type != 0x8100 && ether_type != 0x88A8 )  // 802.1Q and 802.1ad tags.
+      return offset + 2;
+
+    offset += 4;
+  }
+}
+
+
+// Takes a frame as read from the TAP interface in vnet_hdr mode. Completes any partial checksum
+// and splits GSO super-frames into MTU-sized TCP segments. The first frame is placed in the receive buffer,
+// and the rest are appended to the received frame queue. Returns the length of the first frame.
+
+int ethernet_dpi::segment_vnet_frame ( const char * const data, const int byte_count )
+{
+  virtio_net_hdr hdr;
+  memcpy( &hdr, data, sizeof(hdr) );
+
+  const uint8_t * const frame = (const uint8_t *) data + sizeof(hdr);
+  const int frame_length = byte_count - int( sizeof(hdr) );
+  const uint8_t gso_type = hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+
+  if ( gso_type == VIRTIO_NET_HDR_GSO_NONE )
+  {
+    if ( frame_length > m_mtu + MTU_MARGIN )
+      throw std::runtime_error( "Error reading data from the TAP interface, the received packet is bigger than the MTU." );
+
+    memcpy( m_receive_buffer, frame, frame_length );
+
+    if ( 0 != ( hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM ) )
+    {
+      // The checksum field already holds the pseudo-header sum, so it is included in the sum.
+      if ( hdr.csum_start + hdr.csum_offset + 2 > frame_length )
+        throw std::runtime_error( "Invalid checksum offload request from the TAP interface." );
+
+      uint8_t * const start = (uint8_t *) m_receive_buffer + hdr.csum_start;
+
+      const uint16_t checksum = finish_internet_checksum( add_to_internet_checksum( 0, start, frame_length - hdr.csum_start ) );
+
+      put_be16( start + hdr.csum_offset, checksum );
+    }
+
+    return append_dummy_crc( m_receive_buffer, frame_length );
+  }
+
+  if ( gso_type != VIRTIO_NET_HDR_GSO_TCPV4 && gso_type != VIRTIO_NET_HDR_GSO_TCPV6 )
+    throw std::runtime_error( format_msg( "Unsupported GSO type %u from the TAP interface.", unsigned( gso_type ) ) );
+
+  // For GSO frames, the kernel always requests a checksum, and csum_start points to the TCP header.
+  const int l3_offset = get_l3_offset( frame, frame_length );
+  const int l4_offset = hdr.csum_start;
+
+  if ( 0 == ( hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM ) ||
+       l4_offset < l3_offset + 20 ||
+       l4_offset + 20 > frame_length )
+  {
+    throw std::runtime_error( "Invalid GSO frame from the TAP interface." );
+  }
+
+  const int header_length = l4_offset + ( frame[ l4_offset + 12 ] >> 4 ) * 4;
+  const int mss = hdr.gso_size;
+
+  if ( header_length > frame_length || mss == 0 )
+    throw std::runtime_error( "Invalid GSO frame from the TAP interface." );
+
+  if ( header_length + mss > m_mtu + MTU_MARGIN )
+    throw std::runtime_error( format_msg( "The GSO segment size of %d bytes from the TAP interface does not fit in the MTU.", mss ) );
+
+  const uint8_t * const payload = frame + header_length;
+  const int payload_length = frame_length - header_length;
+  const bool is_ipv4 = gso_type == VIRTIO_NET_HDR_GSO_TCPV4;
+
+  int first_segment_length = 0;
+
+  for ( int segment_index = 0, payload_offset = 0; ; ++segment_index )
+  {
+    const int segment_payload_length = std::min( mss, payload_length - payload_offset );
+    const bool is_last_segment = payload_offset + segment_payload_length >= payload_length;
+
+    char * const dest = segment_index == 0 ? m_receive_buffer : m_vnet_segment_buffer;
+
+    const int segment_length = build_tcp_segment( dest,
+                                                  frame,
+                                                  l3_offset,
+                                                  l4_offset,
+                                                  header_length,
+                                                  is_ipv4,
+                                                  payload + payload_offset,
+                                                  segment_payload_length,
+                                                  segment_index,
+                                                  payload_offset,
+                                                  is_last_segment );
+    if ( segment_index == 0 )
+      first_segment_length = segment_length;
+    else
+      m_received_frame_queue.push_back( std::string( dest, segment_length ) );
+
+    payload_offset += segment_payload_length;
+
+    if ( is_last_segment )
+      break;
+  }
+
+  return first_segment_length;
+}
+
+
+// Builds one TCP segment out of a GSO super-frame, the same way the Linux kernel does in software:
+// the IP length and the IPv4 identification are adjusted, the sequence number is advanced,
+// FIN and PSH are only kept in the last segment, CWR only in the first one, and all checksums are recalculated.
+// The Ethernet, IP and TCP headers are the first 'header_length' bytes of 'frame'.
+// Returns the segment length, including the dummy CRC.
+
+int ethernet_dpi::build_tcp_segment ( char * const dest,
+                                      const uint8_t * const frame,
+                                      const int l3_offset,
+                                      const int l4_offset,
+                                      const int header_length,
+                                      const bool is_ipv4,
+                                      const uint8_t * const payload,
+                                      const int payload_length,
+                                      const int segment_index,
+                                      const int payload_offset,
+                                      const bool is_last_segment )
+{
+  const uint8_t TCP_FLAG_FIN = 0x01;
+  const uint8_t TCP_FLAG_PSH = 0x08;
+  const uint8_t TCP_FLAG_CWR = 0x80;
+  const uint8_t IP_PROTOCOL_TCP = 6;
+
+  memcpy( dest, frame, header_length );
+  memcpy( dest + header_length, payload, payload_length );
+
+  uint8_t * const ip  = (uint8_t *) dest + l3_offset;
+  uint8_t * const tcp = (uint8_t *) dest + l4_offset;
+  const int segment_length = header_length + payload_length;
+  const int tcp_length = segment_length - l4_offset;
+
+  uint64_t sum;
+
+  if ( is_ipv4 )
+  {
+    const int ip_header_length = ( ip[0] & 0x0F ) * 4;
+
+    put_be16( ip + 2, uint16_t( segment_length - l3_offset ) );          // Total length.
+    put_be16( ip + 4, uint16_t( get_be16( ip + 4 ) + segment_index ) );  // Identification.
+    put_be16( ip + 10, 0 );
+    put_be16( ip + 10, finish_internet_checksum( add_to_internet_checksum( 0, ip, ip_header_length ) ) );
+
+    sum = add_to_internet_checksum( 0, ip + 12, 8 );  // Source and destination addresses.
+  }
+  else
+  {
+    put_be16( ip + 4, uint16_t( segment_length - l3_offset - 40 ) );    // Payload length, including any extension headers.
+
+    sum = add_to_internet_checksum( 0, ip + 8, 32 );  // Source and destination addresses.
+  }
+
+  sum += IP_PROTOCOL_TCP;
+  sum += uint32_t( tcp_length );
+
+  put_be32( tcp + 4, get_be32( tcp + 4 ) + uint32_t( payload_offset ) );  // Sequence number.
+
+  if ( !is_last_segment )
+    tcp[ 13 ] &= ~( TCP_FLAG_FIN | TCP_FLAG_PSH );
+
+  if ( segment_index != 0 )
+    tcp[ 13 ] &= ~TCP_FLAG_CWR;
+
+  put_be16( tcp + 16, 0 );
+  put_be16( tcp + 16, finish_internet_checksum( add_to_internet_checksum( sum, tcp, tcp_length ) ) );
+
+  return append_dummy_crc( dest, segment_length );
+}
+
+
+// Called from the reactor thread when our TAP interface has incoming frames.
+// Errors are not thrown to the reactor thread, but passed to the simulation thread, see take_frame_from_reactor_ring().
+
+void ethernet_dpi::reactor_receive_frames ( void )
+{
+  if ( m_reactor_failed.load() )
+    return;
+
+  try
+  {
+    for ( ; ; )
+    {
+      const unsigned tail = m_reactor_ring_tail.load( std::memory_order_relaxed );
+
+      if ( tail - m_reactor_ring_head.load( std::memory_order_acquire ) == m_reactor_ring_slot_count )
+      {
+        // The ring is full. Stop watching the TAP interface until the simulation consumes a frame,
+        // otherwise epoll_wait() would return straight away again.
+        ETHDPI_PROBE2( queue_full, m_tap_interface_name.c_str(), m_reactor_ring_slot_count );
+
+        // The interest must be off before the flag is published. Otherwise, the simulation could
+        // re-enable it in between, and we would then switch it off for good.
+        set_reactor_rx_interest( false );
+        m_reactor_rx_paused.store( true );
+
+        // The simulation may have consumed a frame in the meantime and missed the flag above.
+        // Whoever manages to reset the flag re-enables the interest. The fence pairs with the one
+        // in take_frame_from_reactor_ring(), so that at least one side sees the other's store.
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+
+        bool expected = true;
+
+        if ( tail - m_reactor_ring_head.load( std::memory_order_acquire ) < m_reactor_ring_slot_count &&
+             m_reactor_rx_paused.compare_exchange_strong( expected, false ) )
+        {
+          set_reactor_rx_interest( true );
+        }
+
+        return;
+      }
+
+      const unsigned slot = tail % m_reactor_ring_slot_count;
+
+      const int received_byte_count = read_frame( m_reactor_ring + slot * m_reactor_ring_slot_size );
+
+      if ( received_byte_count == 0 )
+        return;
+
+      m_reactor_ring_frame_lengths[ slot ] = received_byte_count;
+
+      m_reactor_ring_tail.store( tail + 1, std::memory_order_release );
+    }
+  }
+  catch ( const std::exception & e )
+  {
+    m_reactor_error_message = e.what();
+  }
+  catch ( ... )
+  {
+    m_reactor_error_message = "Unexpected C++ exception in the reactor thread.";
+  }
+
+  // Stop watching this TAP interface, the simulation thread will report the error.
+  try
+  {
+    set_reactor_rx_interest( false );
+  }
+  catch ( ... )
+  {
+  }
+
+  m_reactor_failed.store( true );
+}
+
+
+// Moves the next frame in the reactor ring to the receive buffer.
+// Returns the frame length, or zero if the ring is empty.
+
+int ethernet_dpi::take_frame_from_reactor_ring ( void )
+{
+  if ( m_reactor_failed.load() )
+    throw std::runtime_error( m_reactor_error_message );
+
+  const unsigned head = m_reactor_ring_head.load( std::memory_order_relaxed );
+
+  if ( head == m_reactor_ring_tail.load( std::memory_order_acquire ) )
+    return 0;
+
+  const unsigned slot = head % m_reactor_ring_slot_count;
+  int received_byte_count = m_reactor_ring_frame_lengths[ slot ];
+  const char * const slot_data = m_reactor_ring + slot * m_reactor_ring_slot_size;
+
+  if ( m_use_vnet_hdr )
+    received_byte_count = segment_vnet_frame( slot_data, received_byte_count );
+  else
+    memcpy( m_receive_buffer, slot_data, received_byte_count );
+
+  m_reactor_ring_head.store( head + 1, std::memory_order_release );
+
+  // See the fence in reactor_receive_frames().
+  std::atomic_thread_fence( std::memory_order_seq_cst );
+
+  bool expected = true;
+
+  if ( m_reactor_rx_paused.compare_exchange_strong( expected, false ) )
+    set_reactor_rx_interest( true );
+
+  return received_byte_count;
+}
+
+
+void ethernet_dpi::set_reactor_rx_interest ( const bool is_enabled )
+{
+  ethernet_dpi_reactor::set_rx_interest( m_reactor_registration_id, m_tun_tap_clone_device, is_enabled );
+}
+
+
+// In replay mode, delivers the next received frame in the log if its cycle has come,
+// and checks that the simulation has not fallen behind the log.
+
+void ethernet_dpi::replay_received_frames ( void )
+{
+  if ( !m_replay_log->has_next_record() )
+  {
+    report_replay_log_end();
+    return;
+  }
+
+  const uint64_t cycle = m_replay_log->get_next_record_cycle();
+
+  if ( cycle < m_cycle_count )
+  {
+    if ( m_replay_log->get_next_record_type() == FRAME_LOG_RECEIVED )
+    {
+      throw std::runtime_error( format_msg( "The simulation has diverged from the replay log: the frame received at cycle %llu could not be delivered on time, the current cycle is %llu.",
+                                            (unsigned long long) cycle,
+                                            (unsigned long long) m_cycle_count ) );
+    }
+    else
+    {
+      throw std::runtime_error( format_msg( "The simulation has diverged from the replay log: the frame sent at cycle %llu has not been sent, the current cycle is %llu.",
+                                            (unsigned long long) cycle,
+                                            (unsigned long long) m_cycle_count ) );
+    }
+  }
+
+  if ( cycle != m_cycle_count ||
+       m_replay_log->get_next_record_type() != FRAME_LOG_RECEIVED ||
+       m_received_byte_count != 0 ||
+       !m_received_frame_queue.empty() )
+  {
+    return;
+  }
+
+  const std::string & frame = m_replay_log->get_next_record_data();
+
+  assert( frame.size() <= m_frame_buffer_size );
+  memcpy( m_receive_buffer, frame.data(), frame.size() );
+  m_received_byte_count = int( frame.size() );
+
+  trace( TRACE_FRAME_RECEIVED, 0, 0, uint32_t( m_received_byte_count ) );
+  ETHDPI_PROBE3( frame_received, m_tap_interface_name.c_str(), m_received_byte_count, m_cycle_count );
+
+  if ( m_latency_monitor != NULL )
+    m_latency_monitor->note_received_frame( m_cycle_count, (const uint8_t *) m_receive_buffer, m_received_byte_count );
+
+  m_replay_log->advance();
+
+  if ( 0 != ( m_flow_control_flags & CTRLMODER_RXFLOW ) && process_received_pause_frame() )
+    m_received_byte_count = 0;
+}
+
+
+void ethernet_dpi::check_sent_frame_against_replay_log ( const char * const frame, const int byte_count )
+{
+  if ( !m_replay_log->has_next_record() )
+  {
+    report_replay_log_end();
+    return;
+  }
+
+  const uint64_t cycle = m_replay_log->get_next_record_cycle();
+
+  if ( m_replay_log->get_next_record_type() != FRAME_LOG_SENT || cycle != m_cycle_count )
+  {
+    throw std::runtime_error( format_msg( "The simulation has diverged from the replay log: a frame has been sent at cycle %llu, but the next event in the log is a frame %s at cycle %llu.",
+                                          (unsigned long long) m_cycle_count,
+                                          m_replay_log->get_next_record_type() == FRAME_LOG_SENT ? "sent" : "received",
+                                          (unsigned long long) cycle ) );
+  }
+
+  const std::string & recorded_frame = m_replay_log->get_next_record_data();
+
+  if ( recorded_frame.size() != size_t( byte_count ) ||
+       0 != memcmp( recorded_frame.data(), frame, byte_count ) )
+  {
+    throw std::runtime_error( format_msg( "The simulation has diverged from the replay log: the frame sent at cycle %llu (%d bytes) does not match the recorded one (%d bytes).",
+                                          (unsigned long long) cycle,
+                                          byte_count,
+                                          int( recorded_frame.size() ) ) );
+  }
+
+  m_replay_log->advance();
+}
+
+
+// After the end of the replay log, no more frames are received, and the sent frames cannot be checked any more.
+
+void ethernet_dpi::report_replay_log_end ( void )
+{
+  if ( m_replay_end_reported )
+    return;
+
+  m_replay_end_reported = true;
+
+  if ( m_print_informational_messages )
+  {
+    printf( "%sThe replay log has ended at cycle %llu, sent frames will not be checked any more.\n",
+            m_informational_message_prefix.c_str(),
+            (unsigned long long) m_cycle_count );
+    fflush( stdout );
+  }
+}
+
+
+void ethernet_dpi::tick ( int * const received_frame_byte_count,
+                          unsigned char * const ready_to_send )
+{
+  ++m_cycle_count;
+
+  poll_network( received_frame_byte_count, ready_to_send );
+
+  if ( m_flow_control_flags != 0 )
+    update_flow_control( ready_to_send );
+
+  if ( *ready_to_send != m_last_ready_to_send )
+  {
+    m_last_ready_to_send = *ready_to_send;
+    ETHDPI_PROBE3( ready_to_send_changed, m_tap_interface_name.c_str(), int( *ready_to_send ), m_cycle_count );
+  }
+}
+
+
+void ethernet_dpi::poll_network ( int * const received_frame_byte_count,
+                                  unsigned char * const ready_to_send )
+{
+  if ( m_received_byte_count == 0 )
+  {
+    if ( !m_received_frame_queue.empty() )
+    {
+      const std::string & frame = m_received_frame_queue.front();
+
+      assert( frame.size() <= m_frame_buffer_size );
+      memcpy( m_receive_buffer, frame.data(), frame.size() );
+      m_received_byte_count = int( frame.size() );
+
+      m_received_frame_queue.pop_front();
+    }
+    else if ( m_replay_log != NULL )
+    {
+      // See replay_received_frames() below.
+    }
+    else if ( m_generator != NULL )
+    {
+      m_received_byte_count = m_generator->generate_frame( m_cycle_count, m_receive_buffer );
+
+      if ( m_received_byte_count != 0 )
+        m_received_byte_count = append_dummy_crc( m_receive_buffer, m_received_byte_count );
+    }
+    else if ( m_use_reactor )
+      m_received_byte_count = take_frame_from_reactor_ring();
+    else
+      m_received_byte_count = receive_frame();
+
+    if ( m_received_byte_count != 0 )
+    {
+      trace( TRACE_FRAME_RECEIVED, 0, 0, uint32_t( m_received_byte_count ) );
+      ETHDPI_PROBE3( frame_received, m_tap_interface_name.c_str(), m_received_byte_count, m_cycle_count );
+
+      if ( m_latency_monitor != NULL )
+        m_latency_monitor->note_received_frame( m_cycle_count, (const uint8_t *) m_receive_buffer, m_received_byte_count );
+
+      if ( m_record_log != NULL )
+        m_record_log->write_record( FRAME_LOG_RECEIVED, m_cycle_count, m_receive_buffer, m_received_byte_count );
+
+      if ( 0 != ( m_flow_control_flags & CTRLMODER_RXFLOW ) && process_received_pause_frame() )
+        m_received_byte_count = 0;
+    }
+  }
+
+  if ( m_replay_log != NULL )
+  {
+    replay_received_frames();
+
+    *received_frame_byte_count = m_received_byte_count;
+    *ready_to_send = 1;
+    return;
+  }
+
+  if ( m_generator != NULL )
+  {
+    *received_frame_byte_count = m_received_byte_count;
+    *ready_to_send = 1;
+    return;
+  }
+
+  *received_frame_byte_count = m_received_byte_count;
+
+  if ( m_use_reactor )
+  {
+    // The TAP interface never really blocks when sending, the kernel drops the frame if its queue is full.
+    // Therefore, there is no need to poll it here. If write() does report EAGAIN, send_tx_frame() waits.
+    *ready_to_send = 1;
+    return;
+  }
+
+  if ( m_xdp_socket != NULL )
+  {
+    // Only the Tx buffers in the shared memory area can run out.
+    *ready_to_send = m_xdp_socket->is_ready_to_send() ? 1 : 0;
+    return;
+  }
+
+  if ( m_vhost_user_device != NULL )
+  {
+    *ready_to_send = m_vhost_user_device->is_ready_to_send() ? 1 : 0;
+    return;
+  }
+
+  if ( m_shared_tap != NULL )
+  {
+    // Same as in reactor mode above.
+    *ready_to_send = 1;
+    return;
+  }
+
+
+  // Possible optimisation: if the TAP interface was ready to send the last time,
+  // and we have not sent or received anything, then it should still be ready to send,
+  // there is no need to poll.
+
+  for ( ; ; )  // Repeat if EINTR.
+  {
+    pollfd polled_fd;
+
+    polled_fd.fd      = m_tun_tap_clone_device;
+    polled_fd.events  = POLLOUT | POLLERR;
+    polled_fd.revents = 0;
+
+    const int poll_res = poll( &polled_fd, 1, 0 );
+
+    if ( poll_res == -1 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      throw std::runtime_error( format_error_message( errno, "Error polling the TAP interface to send: " ) );
+    }
+
+    if ( poll_res == 0 )
+    {
+      *ready_to_send = 0;
+      break;
+    }
+
+    assert( poll_res == 1 );
+    *ready_to_send = 1;
+    break;
+  }
+}
+
+
+void ethernet_dpi::get_received_frame_byte ( const int offset, char * const data )
+{
+  if ( offset < 0 || offset >= m_received_byte_count )
+      throw std::runtime_error( "The received frame byte offset is out of range." );
+
+  *data = m_receive_buffer[ offset ];
+}
+
+
+void ethernet_dpi::discard_received_frame ( void )
+{
+  ETHDPI_PROBE3( frame_discarded, m_tap_interface_name.c_str(), m_received_byte_count, DISCARD_REASON_RELEASED );
+
+  m_received_byte_count = 0;
+}
+
+
+// Reads the whole frame to send straight from the simulated memory and sends it,
+// instead of assembling it byte by byte from the DMA read cycles.
+
+void ethernet_dpi::backdoor_send_tx_frame ( const uint32_t addr, const int byte_count )
+{
+  assert( is_backdoor_dma_enabled() );
+
+  if ( byte_count <= 0 )
+    throw std::runtime_error( "Invalid frame length for the backdoor DMA mode." );
+
+  if ( byte_count > m_mtu + MTU_MARGIN )
+    throw std::runtime_error( format_msg( "The frame size exceeds the MTU limit of %d.", m_mtu ) );
+
+  m_backdoor_memory_accessor->read_memory( addr, m_send_buffer, byte_count );
+
+  m_send_byte_count = byte_count;
+
+  send_tx_frame();
+}
+
+
+// Writes the whole received frame straight into the simulated memory. Like the DMA engine,
+// this routine pads the frame with zeroes up to the next 32-bit boundary.
+// The caller must discard the received frame afterwards.
+
+// Writes the first 'byte_count' bytes of the received frame, so that frames that are too long can be truncated.
+
+void ethernet_dpi::backdoor_write_received_frame ( const uint32_t addr, const int byte_count )
+{
+  assert( is_backdoor_dma_enabled() );
+
+  if ( m_received_byte_count <= 0 )
+    throw std::runtime_error( "There is no received frame to write to memory." );
+
+  if ( byte_count <= 0 || byte_count > m_received_byte_count )
+    throw std::runtime_error( "Invalid frame length for the backdoor DMA mode." );
+
+  m_backdoor_memory_accessor->write_memory( addr, m_receive_buffer, byte_count );
+
+  const int padding_byte_count = ( DMA_ALIGNMENT - byte_count % DMA_ALIGNMENT ) % DMA_ALIGNMENT;
+
+  if ( padding_byte_count != 0 )
+  {
+    const char padding[ DMA_ALIGNMENT ] = { 0 };
+    m_backdoor_memory_accessor->write_memory( addr + byte_count, padding, padding_byte_count );
+  }
+}
+
+
+// Serialises the network state that the Verilog side cannot see: the frame being received,
+// the frame being assembled for sending, and the frames received but not yet delivered.
+// The Verilog state (registers, Buffer Descriptors, etc) is saved by the simulator itself.
+
+void ethernet_dpi::save_checkpoint ( std::string * const data )
+{
+  // Move the frames in the reactor ring or in the shared TAP interface ring to the queue, so that they are saved too.
+  // They will be delivered from the queue afterwards, so the order does not change.
+  if ( m_use_reactor || m_shared_tap != NULL )
+  {
+    const int saved_received_byte_count = m_received_byte_count;
+    std::string saved_received_frame( m_receive_buffer, saved_received_byte_count );
+
+    for ( ; ; )
+    {
+      // In vnet_hdr mode, take_frame_from_reactor_ring() may queue further segments behind the one it returns.
+      const size_t queue_size = m_received_frame_queue.size();
+
+      const int received_byte_count = m_use_reactor ? take_frame_from_reactor_ring() : take_frame_from_shared_tap();
+
+      if ( received_byte_count == 0 )
+        break;
+
+      m_received_frame_queue.insert( m_received_frame_queue.begin() + queue_size,
+                                     std::string( m_receive_buffer, received_byte_count ) );
+    }
+
+    memcpy( m_receive_buffer, saved_received_frame.data(), saved_received_byte_count );
+  }
+
+  checkpoint_writer writer( data );
+
+  writer.write_u32( CHECKPOINT_INSTANCE_MAGIC );
+  writer.write_u32( CHECKPOINT_VERSION );
+
+  writer.write_string( m_tap_interface_name );
+  writer.write_u8( m_print_informational_messages ? 1 : 0 );
+  writer.write_string( m_informational_message_prefix );
+  writer.write_string( m_options );
+
+  writer.write_u64( m_cycle_count );
+
+  writer.write_bytes( m_receive_buffer, m_received_byte_count );
+  writer.write_bytes( m_send_buffer, m_send_byte_count );
+
+  writer.write_u32( m_flow_control_flags );
+  writer.write_bytes( m_station_mac_addr, sizeof(m_station_mac_addr) );
+  writer.write_u64( m_tx_paused_until_cycle );
+  writer.write_u8( m_is_pause_frame_received ? 1 : 0 );
+  writer.write_u8( m_is_peer_paused ? 1 : 0 );
+  writer.write_u64( m_peer_pause_refresh_cycle );
+  writer.write_u32( m_rx_filter_moder );
+
+  writer.write_u32( uint32_t( m_received_frame_queue.size() ) );
+
+  for ( std::deque< std::string >::const_iterator it = m_received_frame_queue.begin();
+        it != m_received_frame_queue.end();
+        ++it )
+  {
+    writer.write_string( *it );
+  }
+
+  writer.write_u8( m_generator != NULL ? 1 : 0 );
+
+  if ( m_generator != NULL )
+    m_generator->save_state( &writer );
+}
+
+
+static void read_checkpoint_header ( checkpoint_reader * const reader )
+{
+  if ( reader->read_u32() != CHECKPOINT_INSTANCE_MAGIC )
+    throw std::runtime_error( "The checkpoint data is not valid." );
+
+  if ( reader->read_u32() != CHECKPOINT_VERSION )
+    throw std::runtime_error( "The checkpoint data version is not supported." );
+}
+
+
+// Re-creates an instance from checkpoint data. The TAP interface is opened again,
+// but it is not flushed.
+
+ethernet_dpi * ethernet_dpi::create_from_checkpoint ( checkpoint_reader * const reader )
+{
+  checkpoint_reader header_reader = *reader;
+
+  read_checkpoint_header( &header_reader );
+
+  const std::string tap_interface_name = header_reader.read_string();
+  const uint8_t print_informational_messages = header_reader.read_u8();
+  const std::string informational_message_prefix = header_reader.read_string();
+  const std::string options = header_reader.read_string();
+
+  ethernet_dpi * const this_obj = new ethernet_dpi( tap_interface_name.c_str(),
+                                                    print_informational_messages,
+                                                    informational_message_prefix.c_str(),
+                                                    options.c_str(),
+                                                    true );
+  try
+  {
+    this_obj->restore_checkpoint( reader );
+  }
+  catch ( ... )
+  {
+    delete this_obj;
+    throw;
+  }
+
+  return this_obj;
+}
+
+
+void ethernet_dpi::restore_checkpoint ( checkpoint_reader * const reader )
+{
+  read_checkpoint_header( reader );
+
+  const std::string tap_interface_name = reader->read_string();
+
+  if ( tap_interface_name != m_tap_interface_name )
+  {
+    throw std::runtime_error( format_msg( "The checkpoint data belongs to TAP interface \"%s\", but this instance uses TAP interface \"%s\".",
+                                          tap_interface_name.c_str(),
+                                          m_tap_interface_name.c_str() ) );
+  }
+
+  reader->read_u8();      // Print informational messages, only used when re-creating the instance.
+  reader->read_string();  // Informational message prefix, the same.
+  reader->read_string();  // Options, the same.
+
+  if ( m_record_log != NULL )
+    throw std::runtime_error( "Checkpoints cannot be restored in record mode." );
+
+  const uint64_t cycle_count = reader->read_u64();
+
+  uint32_t received_byte_count;
+  const void * const received_data = reader->read_bytes( &received_byte_count );
+
+  uint32_t send_byte_count;
+  const void * const send_data = reader->read_bytes( &send_byte_count );
+
+  const uint32_t flow_control_flags = reader->read_u32();
+
+  uint32_t station_mac_addr_length;
+  const void * const station_mac_addr = reader->read_bytes( &station_mac_addr_length );
+
+  const uint64_t tx_paused_until_cycle    = reader->read_u64();
+  const bool     is_pause_frame_received  = reader->read_u8() != 0;
+  const bool     is_peer_paused           = reader->read_u8() != 0;
+  const uint64_t peer_pause_refresh_cycle = reader->read_u64();
+  const uint32_t rx_filter_moder          = reader->read_u32();
+
+  if ( station_mac_addr_length != sizeof(m_station_mac_addr) )
+    throw std::runtime_error( "The checkpoint data is not valid." );
+
+  if ( received_byte_count > m_frame_buffer_size ||
+       send_byte_count > m_frame_buffer_size )
+  {
+    throw std::runtime_error( "The frames in the checkpoint data do not fit in the buffers, maybe the MTU has changed." );
+  }
+
+  std::deque< std::string > received_frame_queue;
+
+  const uint32_t queued_frame_count = reader->read_u32();
+
+  for ( uint32_t i = 0; i < queued_frame_count; ++i )
+  {
+    received_frame_queue.push_back( reader->read_string() );
+
+    if ( received_frame_queue.back().size() > m_frame_buffer_size )
+      throw std::runtime_error( "The frames in the checkpoint data do not fit in the buffers, maybe the MTU has changed." );
+  }
+
+  const bool has_generator_state = reader->read_u8() != 0;
+
+  if ( has_generator_state != ( m_generator != NULL ) )
+    throw std::runtime_error( "The checkpoint data does not match this instance's generator option." );
+
+  // This is the last piece of data. If it is valid, the generator is restored, and nothing else can fail afterwards.
+  if ( m_generator != NULL )
+    m_generator->restore_state( reader );
+
+  // The checkpoint has been validated, commit the changes now.
+  // Any frames received in the meantime are newer, so they come after the restored ones. This includes
+  // the frame that was being transferred to the simulated memory, because the simulation is rolled back
+  // and will never see it otherwise. In replay and generator modes, those frames are delivered again, so drop them.
+
+  if ( m_replay_log != NULL || m_generator != NULL )
+    m_received_frame_queue.clear();
+  else if ( m_received_byte_count != 0 )
+    m_received_frame_queue.push_front( std::string( m_receive_buffer, size_t( m_received_byte_count ) ) );
+
+  memcpy( m_receive_buffer, received_data, received_byte_count );
+  m_received_byte_count = int( received_byte_count );
+
+  memcpy( m_send_buffer, send_data, send_byte_count );
+  m_send_byte_count = int( send_byte_count );
+
+  m_received_frame_queue.swap( received_frame_queue );
+  m_received_frame_queue.insert( m_received_frame_queue.end(), received_frame_queue.begin(), received_frame_queue.end() );
+
+  m_cycle_count = cycle_count;
+
+  m_flow_control_flags = flow_control_flags;
+  memcpy( m_station_mac_addr, station_mac_addr, sizeof(m_station_mac_addr) );
+  m_tx_paused_until_cycle    = tx_paused_until_cycle;
+  m_is_pause_frame_received  = is_pause_frame_received;
+  m_is_peer_paused           = is_peer_paused;
+  m_peer_pause_refresh_cycle = peer_pause_refresh_cycle;
+  m_rx_filter_moder          = rx_filter_moder;
+
+  if ( m_latency_monitor != NULL )
+    m_latency_monitor->forget_pending_probes();
+
+  // A re-created instance has just opened the TAP interface without a filter.
+  if ( m_use_auto_rx_filter && 0 != ( m_rx_filter_moder & MODER_RXEN ) )
+    attach_auto_rx_filter();
+
+  if ( m_shared_tap != NULL )
+    m_shared_tap->set_station_address( unsigned( m_shared_tap_slot ), m_station_mac_addr, 0 != ( m_rx_filter_moder & MODER_PRO ) );
+
+  if ( m_replay_log != NULL )
+  {
+    m_replay_log->seek_after_cycle( m_cycle_count );
+    m_replay_end_reported = false;
+  }
+}
+
+
+// Helps wait_for_activity() below. Returns true if a new frame is already available,
+// otherwise adds the file descriptor to poll, if any.
+// A frame that has already been reported to the simulation does not count as activity,
+// as the Ethernet controller may be waiting for the software to provide an empty Rx Buffer Descriptor.
+// In this case, no other frames can be delivered anyway, so there is no need to wait for them.
+
+bool ethernet_dpi::prepare_to_wait_for_activity ( std::vector< pollfd > * const polled_fds,
+                                                 bool * const should_poll_reactor )
+{
+  if ( m_received_byte_count != 0 )
+    return false;
+
+  if ( !m_received_frame_queue.empty() )
+    return true;
+
+  if ( m_replay_log != NULL )
+  {
+    // The recorded frames arrive at given clock cycles, and not at given times, so the simulation must keep running.
+    return m_replay_log->has_next_record();
+  }
+
+  if ( m_generator != NULL )
+    return m_generator->has_more_frames();  // Same as above.
+
+  if ( m_use_reactor )
+  {
+    if ( m_reactor_failed.load() )
+      return true;  // The next tick() reports the error.
+
+    *should_poll_reactor = true;
+
+    return m_reactor_ring_head.load( std::memory_order_relaxed ) != m_reactor_ring_tail.load( std::memory_order_acquire );
+  }
+
+  pollfd polled_fd;
+
+  if ( m_shared_tap != NULL )
+  {
+    if ( m_shared_tap->prepare_to_wait( unsigned( m_shared_tap_slot ) ) )
+      return true;
+
+    // The frames in this process' queue of the TAP interface are only dispatched when an instance asks for them,
+    // so wake up for those as well, even if they turn out to be for someone else.
+    polled_fd.fd      = m_shared_tap->get_fd();
+    polled_fd.events  = POLLIN;
+    polled_fd.revents = 0;
+
+    polled_fds->push_back( polled_fd );
+
+    polled_fd.fd = m_shared_tap->get_doorbell_fd( unsigned( m_shared_tap_slot ) );
+  }
+  else if ( m_vhost_user_device != NULL )
+  {
+    if ( m_vhost_user_device->prepare_to_wait() )
+      return true;
+
+    polled_fd.fd = m_vhost_user_device->get_receive_event_fd();
+  }
+  else
+    polled_fd.fd = m_xdp_socket != NULL ? m_xdp_socket->get_fd() : m_tun_tap_clone_device;
+
+  polled_fd.events  = POLLIN;
+  polled_fd.revents = 0;
+
+  polled_fds->push_back( polled_fd );
+
+  return false;
+}
+
+
+// ------------------------- Checksum validation of sent frames -------------------------
+
+// Checks the checksum of a TCP, UDP, ICMP or ICMPv6 message. Other protocols are not checked.
+// Returns an empty string if the checksum is correct, or a description of the problem otherwise.
+
+static std::string check_l4_checksum ( const uint8_t protocol,
+                                       const uint64_t pseudo_header_sum,
+                                       const uint8_t * const l4,
+                                       const int l4_length,
+                                       const bool is_ipv4 )
+{
+  const char * name;
+  int checksum_offset;
+  int min_length;
+  bool uses_pseudo_header = true;
+
+  switch ( protocol )
+  {
+  case 6:
+    name = "TCP";
+    checksum_offset = 16;
+    min_length = 20;
+    break;
+
+  case 17:
+    name = "UDP";
+    checksum_offset = 6;
+    min_length = 8;
+    break;
+
+  case 1:
+    if ( !is_ipv4 )
+      return std::string();
+
+    name = "ICMP";
+    checksum_offset = 2;
+    min_length = 4;
+    uses_pseudo_header = false;
+    break;
+
+  case 58:
+    if ( is_ipv4 )
+      return std::string();
+
+    name = "ICMPv6";
+    checksum_offset = 2;
+    min_length = 4;
+    break;
+
+  default:
+    return std::string();
+  }
+
+  if ( l4_length < min_length )
+    return format_msg( "a truncated %s header", name );
+
+  const uint16_t stored_checksum = get_be16( l4 + checksum_offset );
+
+  if ( protocol == 17 && stored_checksum == 0 )
+  {
+    if ( is_ipv4 )
+      return std::string();  // The sender has not calculated the UDP checksum, which is allowed over IPv4.
+
+    return "a zero UDP checksum, which is not allowed over IPv6";
+  }
+
+  const uint64_t sum = add_to_internet_checksum( uses_pseudo_header ? pseudo_header_sum : 0, l4, l4_length );
+
+  if ( fold_internet_checksum( sum ) == 0xFFFF )
+    return std::string();
+
+  // Remove the stored checksum from the sum in order to report the right one.
+  const uint16_t expected_checksum = finish_internet_checksum( sum + uint16_t( ~stored_checksum ) );
+
+  return format_msg( "a bad %s checksum 0x%04X, expected 0x%04X", name, stored_checksum, expected_checksum );
+}
+
+
+// Checks the IPv4 header checksum and the checksum of the TCP, UDP, ICMP or ICMPv6 message inside,
+// if any. Frames with other EtherTypes are not checked, and neither are IP fragments,
+// because the L4 checksum covers the whole datagram.
+// Returns an empty string if the checksums are correct, or a description of the problem otherwise.
+
+static std::string check_frame_checksums ( const uint8_t * const frame, const int frame_length )
+{
+  int l3_offset = 12;
+  uint16_t ether_type;
+
+  for ( ; ; )
+  {
+    if ( l3_offset + 2 > frame_length )
+      return "a truncated Ethernet header";
+
+    ether_type = get_be16( frame + l3_offset );
+    l3_offset += 2;
+
+    if ( ether_type != 0x8100 && ether_type != 0x88A8 )  // 802.1Q and 802.1ad tags.
+      break;
+
+    l3_offset += 2;
+  }
+
+  const uint8_t * const ip = frame + l3_offset;
+  const int available_length = frame_length - l3_offset;
+
+  if ( ether_type == 0x0800 )
+  {
+    if ( available_length < 20 )
+      return "a truncated IPv4 header";
+
+    const int header_length = ( ip[0] & 0x0F ) * 4;
+    const int total_length  = get_be16( ip + 2 );
+
+    if ( ( ip[0] >> 4 ) != 4 || header_length < 20 || header_length > available_length )
+      return "an invalid IPv4 header";
+
+    if ( total_length < header_length || total_length > available_length )
+      return format_msg( "an IPv4 total length of %d bytes, but there are only %d bytes after the Ethernet header", total_length, available_length );
+
+    const uint64_t header_sum = add_to_internet_checksum( 0, ip, header_length );
+
+    if ( fold_internet_checksum( header_sum ) != 0xFFFF )
+    {
+      const uint16_t stored_checksum = get_be16( ip + 10 );
+
+      return format_msg( "a bad IPv4 header checksum 0x%04X, expected 0x%04X",
+                         stored_checksum,
+                         finish_internet_checksum( header_sum + uint16_t( ~stored_checksum ) ) );
+    }
+
+    if ( get_be16( ip + 6 ) & 0x3FFF )  // The MF flag or a fragment offset.
+      return std::string();
+
+    const int l4_length = total_length - header_length;
+
+    uint64_t pseudo_header_sum = add_to_internet_checksum( 0, ip + 12, 8 );  // Source and destination addresses.
+    pseudo_header_sum += ip[ 9 ];
+    pseudo_header_sum += l4_length;
+
+    return check_l4_checksum( ip[ 9 ], pseudo_header_sum, ip + header_length, l4_length, true );
+  }
+
+  if ( ether_type == 0x86DD )
+  {
+    if ( available_length < 40 )
+      return "a truncated IPv6 header";
+
+    if ( ( ip[0] >> 4 ) != 6 )
+      return "an invalid IPv6 header";
+
+    const int payload_length = get_be16( ip + 4 );
+
+    if ( payload_length == 0 )
+      return std::string();  // Jumbograms are not checked.
+
+    if ( 40 + payload_length > available_length )
+      return format_msg( "an IPv6 payload length of %d bytes, but there are only %d bytes after the IPv6 header", payload_length, available_length - 40 );
+
+    const int end_offset = 40 + payload_length;
+    uint8_t next_header = ip[ 6 ];
+    int offset = 40;
+
+    for ( ; ; )
+    {
+      if ( next_header != 0 && next_header != 43 && next_header != 44 && next_header != 60 )
+        break;
+
+      if ( offset + 8 > end_offset )
+        return "a truncated IPv6 extension header";
+
+      if ( next_header == 43 )
+        return std::string();  // A routing header changes the destination address in the pseudo-header, this is not supported.
+
+      if ( next_header == 44 && ( get_be16( ip + offset + 2 ) & 0xFFF9 ) != 0 )
+        return std::string();  // Not the only fragment.
+
+      const int extension_header_length = next_header == 44 ? 8 : ( ip[ offset + 1 ] + 1 ) * 8;
+
+      next_header = ip[ offset ];
+      offset += extension_header_length;
+    }
+
+    if ( offset > end_offset )
+      return "a truncated IPv6 extension header";
+
+    const int l4_length = end_offset - offset;
+
+    uint64_t pseudo_header_sum = add_to_internet_checksum( 0, ip + 8, 32 );  // Source and destination addresses.
+    pseudo_header_sum += next_header;
+    pseudo_header_sum += l4_length;
+
+    return check_l4_checksum( next_header, pseudo_header_sum, ip + offset, l4_length, false );
+  }
+
+  return std::string();
+}
+
+
+// Checks the frame in the send buffer, see option "check_tx_checksums" in the README file.
+// Errors in the frames sent by the simulated software are counted and logged, but the frames are sent anyway.
+
+void ethernet_dpi::check_sent_frame_checksums ( void )
+{
+  ++m_checked_tx_frame_count;
+
+  const std::string problem = check_frame_checksums( (const uint8_t *) m_send_buffer, m_send_byte_count );
+
+  if ( problem.empty() )
+    return;
+
+  ++m_bad_tx_frame_count;
+
+  if ( m_bad_tx_frame_count > MAX_LOGGED_CHECKSUM_ERRORS )
+    return;
+
+  fprintf( stderr, "%sThe frame sent to TAP interface \"%s\" at cycle %llu (%d bytes) has %s.\n",
+           WARNING_MSG_PREFIX,
+           m_tap_interface_name.c_str(),
+           (unsigned long long) m_cycle_count,
+           m_send_byte_count,
+           problem.c_str() );
+
+  if ( m_bad_tx_frame_count == MAX_LOGGED_CHECKSUM_ERRORS )
+  {
+    fprintf( stderr, "%sFurther bad frames sent to TAP interface \"%s\" will only be counted.\n",
+             WARNING_MSG_PREFIX,
+             m_tap_interface_name.c_str() );
+  }
+
+  fflush( stderr );
+}
+
+
+void ethernet_dpi::print_checksum_summary ( void )
+{
+  if ( m_bad_tx_frame_count != 0 )
+  {
+    fprintf( stderr, "%s%llu of %llu frames sent to TAP interface \"%s\" had checksum errors.\n",
+             WARNING_MSG_PREFIX,
+             (unsigned long long) m_bad_tx_frame_count,
+             (unsigned long long) m_checked_tx_frame_count,
+             m_tap_interface_name.c_str() );
+    fflush( stderr );
+  }
+  else if ( m_print_informational_messages )
+  {
+    printf( "%sAll %llu sent frames had correct checksums.\n",
+            m_informational_message_prefix.c_str(),
+            (unsigned long long) m_checked_tx_frame_count );
+    fflush( stdout );
+  }
+}
+
+
+// ------------------------- Traffic generator and sink -------------------------
+
+static void parse_mac_address ( const std::string & text, uint8_t * const mac, const char * const option_name )
+{
+  unsigned bytes[ 6 ];
+  char extra;
+
+  if ( 6 != sscanf( text.c_str(), "%x:%x:%x:%x:%x:%x%c", &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5], &extra ) )
+    throw std::runtime_error( format_msg( "Invalid MAC address \"%s\" in option \"%s\".", text.c_str(), option_name ) );
+
+  for ( int i = 0; i < 6; ++i )
+  {
+    if ( bytes[ i ] > 0xFF )
+      throw std::runtime_error( format_msg( "Invalid MAC address \"%s\" in option \"%s\".", text.c_str(), option_name ) );
+
+    mac[ i ] = uint8_t( bytes[ i ] );
+  }
+}
+
+
+static void parse_ip_address ( const std::string & text, in_addr * const addr, const char * const option_name )
+{
+  if ( 1 != inet_pton( AF_INET, text.c_str(), addr ) )
+    throw std::runtime_error( format_msg( "Invalid IP address \"%s\" in option \"%s\".", text.c_str(), option_name ) );
+}
+
+
+static uint64_t get_be64 ( const uint8_t * const p )
+{
+  return ( uint64_t( get_be32( p ) ) << 32 ) | get_be32( p + 4 );
+}
+
+
+static void put_be64 ( uint8_t * const p, const uint64_t val )
+{
+  put_be32( p, uint32_t( val >> 32 ) );
+  put_be32( p + 4, uint32_t( val ) );
+}
+
+
+traffic_generator::traffic_generator ( const std::string & traffic_type,
+                                       option_map * const options,
+                                       const int mtu )
+  : m_max_frame_length( mtu + 14 )
+  , m_total_frame_size_weight( 0 )
+  , m_min_frame_size( 0 )
+  , m_max_frame_size( 0 )
+  , m_is_schedule_started( false )
+  , m_next_burst_cycle( 0 )
+  , m_frames_left_in_burst( 0 )
+  , m_first_cycle( 0 )
+  , m_last_generated_frame_cycle( 0 )
+  , m_generated_frame_count( 0 )
+  , m_generated_byte_count( 0 )
+  , m_overrun_frame_count( 0 )
+  , m_sent_frame_count( 0 )
+  , m_sent_byte_count( 0 )
+  , m_reply_count( 0 )
+  , m_duplicate_reply_count( 0 )
+  , m_out_of_order_reply_count( 0 )
+  , m_corrupt_reply_count( 0 )
+  , m_other_frame_count( 0 )
+  , m_highest_reply_sequence_number( 0 )
+{
+  if ( traffic_type == "arp" )
+    m_traffic_type = traffic_arp;
+  else if ( traffic_type == "icmp" )
+    m_traffic_type = traffic_icmp;
+  else if ( traffic_type == "udp" )
+    m_traffic_type = traffic_udp;
+  else
+    throw std::runtime_error( format_msg( "Invalid generator option \"%s\", the traffic type must be \"arp\", \"icmp\" or \"udp\".", traffic_type.c_str() ) );
+
+  const double rate = atof( take_option( options, "gen_rate", "1" ).c_str() );
+
+  if ( rate <= 0 )
+    throw std::runtime_error( "Invalid gen_rate option." );
+
+  const int burst_length = atoi( take_option( options, "gen_burst", "1" ).c_str() );
+
+  if ( burst_length <= 0 )
+    throw std::runtime_error( "Invalid gen_burst option." );
+
+  m_burst_length = unsigned( burst_length );
+  m_burst_interval = m_burst_length * 1000.0 / rate;
+
+  m_frame_count_limit = strtoull( take_option( options, "gen_count", "0" ).c_str(), NULL, 10 );
+
+  parse_frame_sizes( take_option( options, "gen_size", "60" ) );
+
+  parse_mac_address( take_option( options, "gen_dst_mac", "ff:ff:ff:ff:ff:ff" ), m_dst_mac, "gen_dst_mac" );
+  parse_mac_address( take_option( options, "gen_src_mac", "02:00:00:00:00:02" ), m_src_mac, "gen_src_mac" );
+  parse_ip_address( take_option( options, "gen_dst_ip", "192.168.254.1" ), &m_dst_ip, "gen_dst_ip" );
+  parse_ip_address( take_option( options, "gen_src_ip", "192.168.254.254" ), &m_src_ip, "gen_src_ip" );
+
+  const int udp_port = atoi( take_option( options, "gen_udp_port", "7" ).c_str() );
+
+  if ( udp_port <= 0 || udp_port > 0xFFFF )
+    throw std::runtime_error( "Invalid gen_udp_port option." );
+
+  m_udp_port = uint16_t( udp_port );
+
+  m_random_state = strtoull( take_option( options, "gen_seed", "1" ).c_str(), NULL, 10 );
+
+  if ( m_random_state == 0 )
+    m_random_state = 1;  // The xorshift generator would only produce zeros.
+
+  memset( &m_start_time, 0, sizeof(m_start_time) );
+}
+
+
+// Accepts a fixed size like "60", a range like "60-1514" for a uniform distribution,
+// or a weighted list like "60:7/590:4/1514:1". The sizes include the Ethernet header, but not the CRC.
+
+void traffic_generator::parse_frame_sizes ( const std::string & sizes )
+{
+  const std::string error_msg = format_msg( "Invalid gen_size option \"%s\", the frame sizes must be between %d and %d bytes.",
+                                            sizes.c_str(),
+                                            MIN_ETHERNET_FRAME_LENGTH,
+                                            m_max_frame_length );
+  const size_t dash_pos = sizes.find( '-' );
+
+  if ( dash_pos != std::string::npos )
+  {
+    m_min_frame_size = atoi( sizes.substr( 0, dash_pos ).c_str() );
+    m_max_frame_size = atoi( sizes.c_str() + dash_pos + 1 );
+
+    if ( m_min_frame_size < MIN_ETHERNET_FRAME_LENGTH || m_max_frame_size > m_max_frame_length || m_min_frame_size > m_max_frame_size )
+      throw std::runtime_error( error_msg );
+
+    return;
+  }
+
+  size_t pos = 0;
+
+  for ( ; ; )
+  {
+    const size_t end_pos = sizes.find( '/', pos );
+    const std::string entry_text = sizes.substr( pos, end_pos == std::string::npos ? std::string::npos : end_pos - pos );
+    const size_t colon_pos = entry_text.find( ':' );
+
+    frame_size_entry entry;
+    entry.size   = atoi( entry_text.c_str() );
+    entry.weight = colon_pos == std::string::npos ? 1 : unsigned( atoi( entry_text.c_str() + colon_pos + 1 ) );
+
+    if ( entry.size < MIN_ETHERNET_FRAME_LENGTH || entry.size > m_max_frame_length || entry.weight == 0 )
+      throw std::runtime_error( error_msg );
+
+    m_frame_sizes.push_back( entry );
+    m_total_frame_size_weight += entry.weight;
+
+    if ( end_pos == std::string::npos )
+      break;
+
+    pos = end_pos + 1;
+  }
+}
+
+
+// xorshift64* generator, which is fast and good enough for choosing frame sizes.
+
+uint64_t traffic_generator::get_next_random_number ( void )
+{
+  m_random_state ^= m_random_state >> 12;
+  m_random_state ^= m_random_state << 25;
+  m_random_state ^= m_random_state >> 27;
+
+  return m_random_state * UINT64_C( 2685821657736338717 );
+}
+
+
+int traffic_generator::choose_frame_size ( void )
+{
+  if ( m_frame_sizes.empty() )
+    return m_min_frame_size + int( get_next_random_number() % unsigned( m_max_frame_size - m_min_frame_size + 1 ) );
+
+  unsigned weight = unsigned( get_next_random_number() % m_total_frame_size_weight );
+
+  for ( size_t i = 0; ; ++i )
+  {
+    assert( i < m_frame_sizes.size() );
+
+    if ( weight < m_frame_sizes[ i ].weight )
+      return m_frame_sizes[ i ].size;
+
+    weight -= m_frame_sizes[ i ].weight;
+  }
+}
+
+
+bool traffic_generator::has_more_frames ( void ) const
+{
+  return m_frame_count_limit == 0 || m_generated_frame_count < m_frame_count_limit;
+}
+
+
+void traffic_generator::save_state ( checkpoint_writer * const writer ) const
+{
+  uint64_t next_burst_cycle;
+  assert( sizeof(next_burst_cycle) == sizeof(m_next_burst_cycle) );
+  memcpy( &next_burst_cycle, &m_next_burst_cycle, sizeof(next_burst_cycle) );
+
+  writer->write_u64( m_random_state );
+  writer->write_u8( m_is_schedule_started ? 1 : 0 );
+  writer->write_u64( next_burst_cycle );
+  writer->write_u32( m_frames_left_in_burst );
+  writer->write_u64( m_first_cycle );
+  writer->write_u64( m_last_generated_frame_cycle );
+
+  writer->write_u64( m_generated_frame_count );
+  writer->write_u64( m_generated_byte_count );
+  writer->write_u64( m_overrun_frame_count );
+  writer->write_u64( m_sent_frame_count );
+  writer->write_u64( m_sent_byte_count );
+  writer->write_u64( m_reply_count );
+  writer->write_u64( m_duplicate_reply_count );
+  writer->write_u64( m_out_of_order_reply_count );
+  writer->write_u64( m_corrupt_reply_count );
+  writer->write_u64( m_other_frame_count );
+  writer->write_u64( m_highest_reply_sequence_number );
+
+  std::string is_reply_received( m_is_reply_received.size(), '\0' );
+
+  for ( size_t i = 0; i < m_is_reply_received.size(); ++i )
+    is_reply_received[ i ] = m_is_reply_received[ i ] ? 1 : 0;
+
+  writer->write_string( is_reply_received );
+}
+
+
+void traffic_generator::restore_state ( checkpoint_reader * const reader )
+{
+  // Read everything first, so that nothing changes if the data is truncated.
+
+  const uint64_t random_state               = reader->read_u64();
+  const bool     is_schedule_started        = reader->read_u8() != 0;
+  const uint64_t next_burst_cycle           = reader->read_u64();
+  const uint32_t frames_left_in_burst       = reader->read_u32();
+  const uint64_t first_cycle                = reader->read_u64();
+  const uint64_t last_generated_frame_cycle = reader->read_u64();
+
+  uint64_t counters[ 11 ];
+
+  for ( int i = 0; i < 11; ++i )
+    counters[ i ] = reader->read_u64();
+
+  const std::string is_reply_received = reader->read_string();
+
+  if ( is_reply_received.size() != counters[ 0 ] )
+    throw std::runtime_error( "The checkpoint data is not valid." );
+
+  // The wall-clock time only matters for the report. If the schedule had not started yet
+  // in this instance, for example, because it has just been re-created, start counting now.
+  if ( is_schedule_started && !m_is_schedule_started )
+    clock_gettime( CLOCK_MONOTONIC, &m_start_time );
+
+  m_random_state = random_state;
+  m_is_schedule_started = is_schedule_started;
+  memcpy( &m_next_burst_cycle, &next_burst_cycle, sizeof(m_next_burst_cycle) );
+  m_frames_left_in_burst = frames_left_in_burst;
+  m_first_cycle = first_cycle;
+  m_last_generated_frame_cycle = last_generated_frame_cycle;
+
+  m_generated_frame_count         = counters[ 0 ];
+  m_generated_byte_count          = counters[ 1 ];
+  m_overrun_frame_count           = counters[ 2 ];
+  m_sent_frame_count              = counters[ 3 ];
+  m_sent_byte_count               = counters[ 4 ];
+  m_reply_count                   = counters[ 5 ];
+  m_duplicate_reply_count         = counters[ 6 ];
+  m_out_of_order_reply_count      = counters[ 7 ];
+  m_corrupt_reply_count           = counters[ 8 ];
+  m_other_frame_count             = counters[ 9 ];
+  m_highest_reply_sequence_number = counters[ 10 ];
+
+  m_is_reply_received.assign( is_reply_received.size(), false );
+
+  for ( size_t i = 0; i < is_reply_received.size(); ++i )
+    m_is_reply_received[ i ] = is_reply_received[ i ] != 0;
+}
+
+
+int traffic_generator::generate_frame ( const uint64_t cycle, char * const buffer )
+{
+  if ( !has_more_frames() )
+    return 0;
+
+  if ( m_generated_frame_count != 0 && !m_is_schedule_started )
+  {
+    // The simulation has just taken the first frame.
+    m_is_schedule_started = true;
+    m_next_burst_cycle = double( cycle );
+    m_first_cycle = cycle;
+    clock_gettime( CLOCK_MONOTONIC, &m_start_time );
+  }
+
+  if ( m_is_schedule_started && m_frames_left_in_burst == 0 )
+  {
+    if ( double( cycle ) < m_next_burst_cycle )
+      return 0;
+
+    // If the simulation did not take the frames in time, skip the bursts it has missed,
+    // like a real Ethernet controller would drop them for lack of receive buffers.
+    while ( m_next_burst_cycle + m_burst_interval <= double( cycle ) )
+    {
+      m_overrun_frame_count += m_burst_length;
+      m_next_burst_cycle += m_burst_interval;
+    }
+
+    m_next_burst_cycle += m_burst_interval;
+    m_frames_left_in_burst = m_burst_length;
+  }
+
+  if ( m_frames_left_in_burst != 0 )
+    --m_frames_left_in_burst;
+
+  uint8_t * const frame = (uint8_t *) buffer;
+  const uint8_t no_mac[ 6 ] = { 0, 0, 0, 0, 0, 0 };
+
+  const int frame_length = m_traffic_type == traffic_arp
+                             ? build_arp_frame( frame, 1, no_mac, m_dst_ip )
+                             : build_ip_frame( frame, choose_frame_size(), m_generated_frame_count );
+
+  ++m_generated_frame_count;
+  m_generated_byte_count += frame_length;
+  m_last_generated_frame_cycle = cycle;
+  m_is_reply_received.push_back( false );
+
+  return frame_length;
+}
+
+
+// Builds an ARP request (operation 1) for the target IP address, or an ARP reply (operation 2)
+// to the given target.
+
+int traffic_generator::build_arp_frame ( uint8_t * const frame,
+                                         const uint16_t operation,
+                                         const uint8_t * const target_mac,
+                                         const in_addr & target_ip ) const
+{
+  memset( frame, 0, MIN_ETHERNET_FRAME_LENGTH );
+
+  memcpy( frame, operation == 1 ? m_dst_mac : target_mac, 6 );
+  memcpy( frame + 6, m_src_mac, 6 );
+  put_be16( frame + 12, 0x0806 );
+
+  uint8_t * const arp = frame + 14;
+
+  put_be16( arp + 0, 1 );       // Hardware type: Ethernet.
+  put_be16( arp + 2, 0x0800 );  // Protocol type: IPv4.
+  arp[ 4 ] = 6;
+  arp[ 5 ] = 4;
+  put_be16( arp + 6, operation );
+  memcpy( arp + 8, m_src_mac, 6 );
+  memcpy( arp + 14, &m_src_ip, 4 );
+  memcpy( arp + 18, target_mac, 6 );
+  memcpy( arp + 24, &target_ip, 4 );
+
+  return MIN_ETHERNET_FRAME_LENGTH;
+}
+
+
+int traffic_generator::build_ip_frame ( uint8_t * const frame, const int frame_length, const uint64_t sequence_number ) const
+{
+  const bool is_icmp = m_traffic_type == traffic_icmp;
+
+  memcpy( frame, m_dst_mac, 6 );
+  memcpy( frame + 6, m_src_mac, 6 );
+  put_be16( frame + 12, 0x0800 );
+
+  uint8_t * const ip = frame + 14;
+  const int ip_length = frame_length - 14;
+
+  ip[ 0 ] = 0x45;  // IPv4 with no options.
+  ip[ 1 ] = 0;
+  put_be16( ip + 2, uint16_t( ip_length ) );
+  put_be16( ip + 4, uint16_t( sequence_number ) );
+  put_be16( ip + 6, 0x4000 );  // Don't Fragment.
+  ip[ 8 ] = 64;
+  ip[ 9 ] = is_icmp ? 1 : 17;
+  put_be16( ip + 10, 0 );
+  memcpy( ip + 12, &m_src_ip, 4 );
+  memcpy( ip + 16, &m_dst_ip, 4 );
+  put_be16( ip + 10, finish_internet_checksum( add_to_internet_checksum( 0, ip, 20 ) ) );
+
+  // Both the ICMP echo header and the UDP header are 8 bytes long.
+  uint8_t * const l4 = ip + 20;
+  const int l4_length = ip_length - 20;
+  uint8_t * const payload = l4 + 8;
+  const int payload_length = l4_length - 8;
+
+  assert( payload_length >= GENERATOR_PAYLOAD_HEADER_LENGTH );
+
+  memcpy( payload, GENERATOR_PAYLOAD_MAGIC, 4 );
+  put_be64( payload + 4, sequence_number );
+
+  for ( int i = GENERATOR_PAYLOAD_HEADER_LENGTH; i < payload_length; ++i )
+    payload[ i ] = uint8_t( sequence_number + i );
+
+  if ( is_icmp )
+  {
+    l4[ 0 ] = 8;  // Echo request.
+    l4[ 1 ] = 0;
+    put_be16( l4 + 2, 0 );
+    put_be16( l4 + 4, GENERATOR_ICMP_ID );
+    put_be16( l4 + 6, uint16_t( sequence_number ) );
+    put_be16( l4 + 2, finish_internet_checksum( add_to_internet_checksum( 0, l4, l4_length ) ) );
+  }
+  else
+  {
+    put_be16( l4 + 0, GENERATOR_UDP_SRC_PORT );
+    put_be16( l4 + 2, m_udp_port );
+    put_be16( l4 + 4, uint16_t( l4_length ) );
+    put_be16( l4 + 6, 0 );
+
+    uint64_t pseudo_header_sum = add_to_internet_checksum( 0, ip + 12, 8 );
+    pseudo_header_sum += 17;
+    pseudo_header_sum += l4_length;
+
+    const uint16_t checksum = finish_internet_checksum( add_to_internet_checksum( pseudo_header_sum, l4, l4_length ) );
+
+    put_be16( l4 + 6, checksum == 0 ? 0xFFFF : checksum );
+  }
+
+  return frame_length;
+}
+
+
+std::string traffic_generator::sink_frame ( const uint64_t, const char * const data, const int byte_count )
+{
+  ++m_sent_frame_count;
+  m_sent_byte_count += byte_count;
+
+  const uint8_t * const frame = (const uint8_t *) data;
+  const uint16_t ether_type = byte_count >= 14 ? get_be16( frame + 12 ) : 0;
+
+  if ( ether_type == 0x0806 && byte_count >= 14 + 28 )
+  {
+    const uint8_t * const arp = frame + 14;
+    const uint16_t operation = get_be16( arp + 6 );
+
+    if ( operation == 1 && 0 == memcmp( arp + 24, &m_src_ip, 4 ) )
+    {
+      // The simulated system wants to know our MAC address in order to reply.
+      in_addr sender_ip;
+      memcpy( &sender_ip, arp + 14, 4 );
+
+      uint8_t reply[ MIN_ETHERNET_FRAME_LENGTH ];
+      const int reply_length = build_arp_frame( reply, 2, arp + 8, sender_ip );
+
+      return std::string( (const char *) reply, reply_length );
+    }
+
+    if ( operation == 2 && m_traffic_type == traffic_arp && 0 == memcmp( arp + 14, &m_dst_ip, 4 ) )
+    {
+      // ARP replies carry no sequence number, so they can only be counted.
+      ++m_reply_count;
+      return std::string();
+    }
+  }
+  else if ( ether_type == 0x0800 && byte_count >= 14 + 20 )
+  {
+    const uint8_t * const ip = frame + 14;
+    const int header_length = ( ip[ 0 ] & 0x0F ) * 4;
+    const int total_length  = get_be16( ip + 2 );
+
+    if ( header_length >= 20 && total_length >= header_length + 8 && 14 + total_length <= byte_count )
+    {
+      const uint8_t * const l4 = ip + header_length;
+      const int l4_length = total_length - header_length;
+
+      const bool is_echo_reply = m_traffic_type == traffic_icmp &&
+                                 ip[ 9 ] == 1 &&
+                                 l4[ 0 ] == 0 &&
+                                 get_be16( l4 + 4 ) == GENERATOR_ICMP_ID;
+
+      const bool is_udp_reply = m_traffic_type == traffic_udp &&
+                                ip[ 9 ] == 17 &&
+                                get_be16( l4 + 0 ) == m_udp_port &&
+                                get_be16( l4 + 2 ) == GENERATOR_UDP_SRC_PORT;
+
+      if ( is_echo_reply || is_udp_reply )
+      {
+        check_reply( l4 + 8, l4_length - 8 );
+        return std::string();
+      }
+    }
+  }
+
+  ++m_other_frame_count;
+  return std::string();
+}
+
+
+void traffic_generator::check_reply ( const uint8_t * const payload, const int payload_length )
+{
+  if ( payload_length < GENERATOR_PAYLOAD_HEADER_LENGTH || 0 != memcmp( payload, GENERATOR_PAYLOAD_MAGIC, 4 ) )
+  {
+    ++m_corrupt_reply_count;
+    return;
+  }
+
+  const uint64_t sequence_number = get_be64( payload + 4 );
+
+  if ( sequence_number >= m_is_reply_received.size() )
+  {
+    ++m_corrupt_reply_count;
+    return;
+  }
+
+  for ( int i = GENERATOR_PAYLOAD_HEADER_LENGTH; i < payload_length; ++i )
+  {
+    if ( payload[ i ] != uint8_t( sequence_number + i ) )
+    {
+      ++m_corrupt_reply_count;
+      return;
+    }
+  }
+
+  if ( m_is_reply_received[ sequence_number ] )
+  {
+    ++m_duplicate_reply_count;
+    return;
+  }
+
+  m_is_reply_received[ sequence_number ] = true;
+
+  if ( m_reply_count != 0 && sequence_number < m_highest_reply_sequence_number )
+    ++m_out_of_order_reply_count;
+  else
+    m_highest_reply_sequence_number = sequence_number;
+
+  ++m_reply_count;
+}
+
+
+void traffic_generator::print_report ( const std::string & prefix, const uint64_t cycle ) const
+{
+  const uint64_t cycle_count = m_is_schedule_started ? cycle - m_first_cycle : 0;
+  double elapsed_seconds = 0;
+
+  if ( m_is_schedule_started )
+  {
+    timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    elapsed_seconds = double( now.tv_sec - m_start_time.tv_sec ) + double( now.tv_nsec - m_start_time.tv_nsec ) / 1e9;
+  }
+
+  const double kcycles = cycle_count / 1000.0;
+  const double generation_kcycles = m_is_schedule_started ? ( m_last_generated_frame_cycle - m_first_cycle ) / 1000.0 : 0;
+
+  printf( "%sTraffic generator report after %llu clock cycles and %.3f seconds:\n",
+          prefix.c_str(),
+          (unsigned long long) cycle_count,
+          elapsed_seconds );
+
+  printf( "%s  Generated frames: %llu (%llu bytes), %.3f frames per 1000 cycles. Dropped because the simulation did not take them in time: %llu.\n",
+          prefix.c_str(),
+          (unsigned long long) m_generated_frame_count,
+          (unsigned long long) m_generated_byte_count,
+          generation_kcycles > 0 ? ( m_generated_frame_count - 1 ) / generation_kcycles : 0.0,
+          (unsigned long long) m_overrun_frame_count );
+
+  printf( "%s  Sent frames: %llu (%llu bytes), %.3f frames per 1000 cycles, %.3f Mbit/s of wall-clock time.\n",
+          prefix.c_str(),
+          (unsigned long long) m_sent_frame_count,
+          (unsigned long long) m_sent_byte_count,
+          kcycles > 0 ? m_sent_frame_count / kcycles : 0.0,
+          elapsed_seconds > 0 ? m_sent_byte_count * 8 / elapsed_seconds / 1e6 : 0.0 );
+
+  printf( "%s  Replies: %llu, lost: %llu, duplicates: %llu, out of order: %llu, corrupt: %llu, other sent frames: %llu.\n",
+          prefix.c_str(),
+          (unsigned long long) m_reply_count,
+          (unsigned long long)( m_generated_frame_count - std::min( m_reply_count, m_generated_frame_count ) ),
+          (unsigned long long) m_duplicate_reply_count,
+          (unsigned long long) m_out_of_order_reply_count,
+          (unsigned long long) m_corrupt_reply_count,
+          (unsigned long long) m_other_frame_count );
+
+  fflush( stdout );
+}
+
+
+// ------------------------- Round-trip latency -------------------------
+
+latency_monitor::latency_monitor ( const std::string & protocols, const std::string & udp_tag )
+  : m_match_icmp( false )
+  , m_match_udp( false )
+  , m_udp_tag_offset( 0 )
+  , m_udp_tag_length( GENERATOR_PAYLOAD_HEADER_LENGTH )
+  , m_next_probe_serial( 0 )
+  , m_unanswered_probe_count( 0 )
+{
+  if ( protocols == "icmp" || protocols == "1" )
+    m_match_icmp = true;
+  else if ( protocols == "udp" )
+    m_match_udp = true;
+  else if ( protocols == "all" )
+  {
+    m_match_icmp = true;
+    m_match_udp  = true;
+  }
+  else
+    throw std::runtime_error( format_msg( "Invalid latency option \"%s\", it must be \"icmp\", \"udp\" or \"all\".", protocols.c_str() ) );
+
+  if ( !udp_tag.empty() )
+  {
+    if ( !m_match_udp )
+      throw std::runtime_error( "Option \"latency_udp_tag\" requires option \"latency=udp\" or \"latency=all\"." );
+
+    // The default tag is the header of the payload of the frames generated with option "generator=udp".
+    char extra;
+
+    if ( 2 != sscanf( udp_tag.c_str(), "%d:%d%c", &m_udp_tag_offset, &m_udp_tag_length, &extra ) ||
+         m_udp_tag_offset < 0 ||
+         m_udp_tag_offset > MAX_FRAME_LENGTH ||
+         m_udp_tag_length <= 0 ||
+         m_udp_tag_length > MAX_LATENCY_UDP_TAG_LENGTH )
+    {
+      throw std::runtime_error( format_msg( "Invalid latency_udp_tag option \"%s\", the format is <offset>:<length>, and the length must be between 1 and %d bytes.",
+                                            udp_tag.c_str(),
+                                            MAX_LATENCY_UDP_TAG_LENGTH ) );
+    }
+  }
+}
+
+
+// Builds a key that identifies a request and its reply. The addresses and ports are always in the order of the request,
+// so that the key of a sent reply is the same as the key of the received request.
+
+bool latency_monitor::get_flow_key ( const uint8_t * const frame,
+                                     const int byte_count,
+                                     const bool is_sent_frame,
+                                     std::string * const key ) const
+{
+  if ( byte_count < 14 + 20 || get_be16( frame + 12 ) != 0x0800 )
+    return false;
+
+  const uint8_t * const ip = frame + 14;
+  const int header_length = ( ip[ 0 ] & 0x0F ) * 4;
+  const int total_length  = get_be16( ip + 2 );
+
+  if ( header_length < 20 || total_length < header_length + 8 || 14 + total_length > byte_count )
+    return false;
+
+  if ( get_be16( ip + 6 ) & 0x3FFF )  // The MF flag or a fragment offset.
+    return false;
+
+  const uint8_t * const l4 = ip + header_length;
+  const int l4_length = total_length - header_length;
+
+  const uint8_t * const request_src_ip = ip + ( is_sent_frame ? 16 : 12 );
+  const uint8_t * const request_dst_ip = ip + ( is_sent_frame ? 12 : 16 );
+
+  if ( m_match_icmp && ip[ 9 ] == 1 && l4[ 0 ] == ( is_sent_frame ? 0 : 8 ) )  // Echo reply or echo request.
+  {
+    key->assign( 1, 'I' );
+    key->append( (const char *) request_src_ip, 4 );
+    key->append( (const char *) request_dst_ip, 4 );
+    key->append( (const char *) l4 + 4, 4 );  // Identifier and sequence number.
+    return true;
+  }
+
+  if ( m_match_udp && ip[ 9 ] == 17 && l4_length >= 8 + m_udp_tag_offset + m_udp_tag_length )
+  {
+    key->assign( 1, 'U' );
+    key->append( (const char *) request_src_ip, 4 );
+    key->append( (const char *) request_dst_ip, 4 );
+    key->append( (const char *) l4 + ( is_sent_frame ? 2 : 0 ), 2 );  // Request source port.
+    key->append( (const char *) l4 + ( is_sent_frame ? 0 : 2 ), 2 );  // Request destination port.
+    key->append( (const char *) l4 + 8 + m_udp_tag_offset, m_udp_tag_length );
+    return true;
+  }
+
+  return false;
+}
+
+
+void latency_monitor::note_received_frame ( const uint64_t cycle, const uint8_t * const frame, const int byte_count )
+{
+  std::string key;
+
+  if ( !get_flow_key( frame, byte_count, false, &key ) )
+    return;
+
+  probe new_probe;
+  new_probe.cycle  = cycle;
+  new_probe.serial = m_next_probe_serial++;
+  clock_gettime( CLOCK_MONOTONIC, &new_probe.time );
+
+  const std::pair< probe_map::iterator, bool > res = m_pending_probes.insert( std::make_pair( key, new_probe ) );
+
+  if ( !res.second )
+  {
+    // The request has been received again before it was answered, for example, because the client retried.
+    ++m_unanswered_probe_count;
+    res.first->second = new_probe;
+  }
+
+  m_probe_order.push_back( std::make_pair( key, new_probe.serial ) );
+
+  // Limit the memory used by requests that are never answered.
+  while ( m_probe_order.size() > MAX_PENDING_LATENCY_PROBES )
+  {
+    const probe_map::iterator it = m_pending_probes.find( m_probe_order.front().first );
+
+    if ( it != m_pending_probes.end() && it->second.serial == m_probe_order.front().second )
+    {
+      m_pending_probes.erase( it );
+      ++m_unanswered_probe_count;
+    }
+
+    m_probe_order.pop_front();
+  }
+}
+
+
+void latency_monitor::note_sent_frame ( const uint64_t cycle, const uint8_t * const frame, const int byte_count )
+{
+  if ( m_pending_probes.empty() )
+    return;
+
+  std::string key;
+
+  if ( !get_flow_key( frame, byte_count, true, &key ) )
+    return;
+
+  const probe_map::iterator it = m_pending_probes.find( key );
+
+  if ( it == m_pending_probes.end() )
+    return;
+
+  timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now );
+
+  const int64_t elapsed_ns = int64_t( now.tv_sec - it->second.time.tv_sec ) * 1000000000 + ( now.tv_nsec - it->second.time.tv_nsec );
+
+  m_cycle_histogram.record( cycle - it->second.cycle );
+  m_wall_clock_histogram.record( uint64_t( std::max( elapsed_ns, int64_t( 0 ) ) ) );
+
+  m_pending_probes.erase( it );
+}
+
+
+// The pending requests are not part of the checkpoint data. After restoring a checkpoint, the cycle counter
+// may have gone back, and the requests received in the meantime belong to a future that will not happen.
+
+void latency_monitor::forget_pending_probes ( void )
+{
+  m_pending_probes.clear();
+  m_probe_order.clear();
+}
+
+
+void latency_monitor::print_report ( const std::string & prefix ) const
+{
+  printf( "%sRound-trip latency of %llu answered requests (%llu unanswered):\n",
+          prefix.c_str(),
+          (unsigned long long) m_cycle_histogram.get_count(),
+          (unsigned long long)( m_unanswered_probe_count + m_pending_probes.size() ) );
+
+  if ( m_cycle_histogram.get_count() != 0 )
+  {
+    printf( "%s  Clock cycles: %s.\n", prefix.c_str(), m_cycle_histogram.format_summary( 1, 0 ).c_str() );
+    printf( "%s  Wall-clock microseconds: %s.\n", prefix.c_str(), m_wall_clock_histogram.format_summary( 1000, 1 ).c_str() );
+  }
+
+  fflush( stdout );
+}
+
+
+void latency_monitor::write_log ( const std::string & filename ) const
+{
+  FILE * const file = fopen( filename.c_str(), "wt" );
+
+  if ( file == NULL )
+  {
+    const int errno_value = errno;
+    throw std::runtime_error( format_error_message( errno_value, "Cannot create latency log file \"%s\": ", filename.c_str() ) );
+  }
+
+  fprintf( file, "# Round-trip latency in clock cycles.\n" );
+  m_cycle_histogram.write_percentile_distribution( file, 1 );
+  fprintf( file, "\n# Round-trip latency in wall-clock microseconds.\n" );
+  m_wall_clock_histogram.write_percentile_distribution( file, 1000 );
+
+  const bool is_error = ferror( file ) != 0;
+
+  if ( fclose( file ) != 0 || is_error )
+    throw std::runtime_error( format_msg( "Cannot write latency log file \"%s\".", filename.c_str() ) );
+}
+
+
+// Called from the destructor, so it must not throw.
+
+void ethernet_dpi::print_latency_report ( void )
+{
+  m_latency_monitor->print_report( m_informational_message_prefix );
+
+  if ( m_latency_log_filename.empty() )
+    return;
+
+  try
+  {
+    m_latency_monitor->write_log( m_latency_log_filename );
+  }
+  catch ( const std::exception & e )
+  {
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
+    fflush( stderr );
+  }
+}
+
+
+// ------------------------- DMA cost profile -------------------------
+
+void ethernet_dpi::profile_dma_frame ( const bool is_rx,
+                                       const int byte_count,
+                                       const int queue_cycles,
+                                       const int dma_cycles,
+                                       const int beat_count,
+                                       const int ack_wait_cycles,
+                                       const int wait_state_cycles,
+                                       const int bus_error_count )
+{
+  if ( m_dma_profile == NULL )
+    m_dma_profile = new dma_profile();
+
+  m_dma_profile->record_frame( is_rx, byte_count, queue_cycles, dma_cycles, beat_count, ack_wait_cycles, wait_state_cycles, bus_error_count );
+}
+
+
+void dma_profile::record_frame ( const bool is_rx,
+                                 const int byte_count,
+                                 const int queue_cycles,
+                                 const int dma_cycles,
+                                 const int beat_count,
+                                 const int ack_wait_cycles,
+                                 const int wait_state_cycles,
+                                 const int bus_error_count )
+{
+  direction_stats * const stats = &m_directions[ is_rx ? 1 : 0 ];
+
+  ++stats->frame_count;
+  stats->byte_count        += uint64_t( std::max( byte_count, 0 ) );
+  stats->dma_cycles        += uint64_t( std::max( dma_cycles, 0 ) );
+  stats->beat_count        += uint64_t( std::max( beat_count, 0 ) );
+  stats->ack_wait_cycles   += uint64_t( std::max( ack_wait_cycles, 0 ) );
+  stats->wait_state_cycles += uint64_t( std::max( wait_state_cycles, 0 ) );
+  stats->bus_error_count   += uint64_t( std::max( bus_error_count, 0 ) );
+
+  int size_class = 0;
+
+  while ( size_class < DMA_PROFILE_SIZE_CLASS_COUNT - 1 && byte_count > DMA_PROFILE_SIZE_CLASS_LIMITS[ size_class ] )
+    ++size_class;
+
+  size_class_stats * const class_stats = &stats->size_classes[ size_class ];
+
+  class_stats->queue_cycles.record( uint64_t( std::max( queue_cycles, 0 ) ) );
+  class_stats->dma_cycles.record( uint64_t( std::max( dma_cycles, 0 ) ) );
+  class_stats->ack_wait_cycles.record( uint64_t( std::max( ack_wait_cycles, 0 ) ) );
+}
+
+
+static std::string format_percentiles ( const hdr_histogram & histogram )
+{
+  return format_msg( "%llu/%llu",
+                     (unsigned long long) histogram.get_value_at_percentile( 50 ),
+                     (unsigned long long) histogram.get_value_at_percentile( 99 ) );
+}
+
+
+void dma_profile::print_direction_report ( const std::string & prefix, const char * const direction_name, const direction_stats & stats )
+{
+  if ( stats.frame_count == 0 )
+    return;
+
+  printf( "%sDMA profile of %llu %s frames (%llu bytes):\n",
+          prefix.c_str(),
+          (unsigned long long) stats.frame_count,
+          direction_name,
+          (unsigned long long) stats.byte_count );
+
+  printf( "%s  DMA cycles per byte: %.3f, ack wait cycles per beat: %.3f, wait states: %.1f%% of the DMA cycles, bus errors: %llu.\n",
+          prefix.c_str(),
+          stats.byte_count == 0 ? 0.0 : double( stats.dma_cycles ) / double( stats.byte_count ),
+          stats.beat_count == 0 ? 0.0 : double( stats.ack_wait_cycles ) / double( stats.beat_count ),
+          stats.dma_cycles == 0 ? 0.0 : 100.0 * double( stats.wait_state_cycles ) / double( stats.dma_cycles ),
+          (unsigned long long) stats.bus_error_count );
+
+  printf( "%s  %-11s %10s %21s %21s %21s\n",
+          prefix.c_str(),
+          "Size",
+          "Frames",
+          "Queue cycles p50/p99",
+          "DMA cycles p50/p99",
+          "Ack waits p50/p99" );
+
+  for ( int i = 0; i < DMA_PROFILE_SIZE_CLASS_COUNT; ++i )
+  {
+    const size_class_stats & class_stats = stats.size_classes[ i ];
+
+    if ( class_stats.dma_cycles.get_count() == 0 )
+      continue;
+
+    std::string size_name;
+
+    if ( i == 0 )
+      size_name = format_msg( "<= %d", DMA_PROFILE_SIZE_CLASS_LIMITS[ 0 ] );
+    else if ( i == DMA_PROFILE_SIZE_CLASS_COUNT - 1 )
+      size_name = format_msg( ">= %d", DMA_PROFILE_SIZE_CLASS_LIMITS[ i - 1 ] + 1 );
+    else
+      size_name = format_msg( "%d-%d", DMA_PROFILE_SIZE_CLASS_LIMITS[ i - 1 ] + 1, DMA_PROFILE_SIZE_CLASS_LIMITS[ i ] );
+
+    printf( "%s  %-11s %10llu %21s %21s %21s\n",
+            prefix.c_str(),
+            size_name.c_str(),
+            (unsigned long long) class_stats.dma_cycles.get_count(),
+            format_percentiles( class_stats.queue_cycles ).c_str(),
+            format_percentiles( class_stats.dma_cycles ).c_str(),
+            format_percentiles( class_stats.ack_wait_cycles ).c_str() );
+  }
+}
+
+
+void dma_profile::print_report ( const std::string & prefix ) const
+{
+  print_direction_report( prefix, "sent", m_directions[ 0 ] );
+  print_direction_report( prefix, "received", m_directions[ 1 ] );
+  fflush( stdout );
+}
+
+
+// ------------------------- Ethernet flow control -------------------------
+
+// IEEE 802.3x PAUSE frames, see the CTRLMODER and TX_CTRL registers. A PAUSE frame is a MAC Control frame
+// with opcode 1 and the pause time in units of 512 bit times, the so-called pause quanta.
+// The simulation has no notion of bit times, so option "pause_quantum_cycles" converts them to clock cycles.
+
+static const uint8_t PAUSE_FRAME_DEST_MAC_ADDR[ 6 ] = { 0x01, 0x80, 0xC2, 0x00, 0x00, 0x01 };
+static const uint16_t MAC_CONTROL_ETHERTYPE    = 0x8808;
+static const uint16_t MAC_CONTROL_OPCODE_PAUSE = 0x0001;
+
+
+// Called by the Verilog side when the transmitter or the receiver gets enabled, because the MODER bits
+// that matter here, the CTRLMODER and the MAC address registers may not change afterwards.
+// It is also called on reset with all values set to 0. 'mac_addr' has the first address byte in bits 47:40.
+
+void ethernet_dpi::configure_mac ( const uint32_t moder, const uint32_t ctrlmoder, const uint64_t mac_addr )
+{
+  uint8_t old_station_mac_addr[ 6 ];
+  memcpy( old_station_mac_addr, m_station_mac_addr, sizeof(old_station_mac_addr) );
+  const uint32_t old_rx_filter_moder = m_rx_filter_moder;
+
+  m_flow_control_flags = ctrlmoder & ( CTRLMODER_PASSALL | CTRLMODER_RXFLOW | CTRLMODER_TXFLOW );
+
+  for ( int i = 0; i < 6; ++i )
+    m_station_mac_addr[ i ] = uint8_t( mac_addr >> ( 40 - 8 * i ) );
+
+  if ( 0 == ( m_flow_control_flags & CTRLMODER_RXFLOW ) )
+    m_tx_paused_until_cycle = 0;
+
+  if ( m_use_auto_rx_filter && 0 != ( moder & MODER_RXEN ) )
+  {
+    m_rx_filter_moder = moder;
+    attach_auto_rx_filter();
+  }
+
+  // Also on reset, so that the frames for the old MAC address are no longer delivered here.
+  // Updating the shared area takes a cross-process lock, so only do it if something has changed.
+  if ( m_shared_tap != NULL )
+  {
+    m_rx_filter_moder = moder;
+
+    if ( 0 != memcmp( old_station_mac_addr, m_station_mac_addr, sizeof(old_station_mac_addr) ) ||
+         0 != ( ( old_rx_filter_moder ^ moder ) & MODER_PRO ) )
+    {
+      m_shared_tap->set_station_address( unsigned( m_shared_tap_slot ), m_station_mac_addr, 0 != ( moder & MODER_PRO ) );
+    }
+  }
+}
+
+
+// Does not include the CRC, like the frames that the simulation sends.
+
+int ethernet_dpi::build_pause_frame ( char * const frame, const uint16_t pause_time ) const
+{
+  uint8_t * const p = (uint8_t *) frame;
+
+  memset( p, 0, MIN_ETHERNET_FRAME_LENGTH );
+  memcpy( p, PAUSE_FRAME_DEST_MAC_ADDR, 6 );
+  memcpy( p + 6, m_station_mac_addr, 6 );
+  put_be16( p + 12, MAC_CONTROL_ETHERTYPE );
+  put_be16( p + 14, MAC_CONTROL_OPCODE_PAUSE );
+  put_be16( p + 16, pause_time );
+
+  return MIN_ETHERNET_FRAME_LENGTH;
+}
+
+
+// For the TXPAUSERQ bit in the TX_CTRL register. The frame goes through the normal send path,
+// so it is recorded and checked in replay mode like any other frame sent by the simulation.
+
+void ethernet_dpi::send_pause_frame ( const uint16_t pause_time )
+{
+  if ( 0 == ( m_flow_control_flags & CTRLMODER_TXFLOW ) )
+    throw std::runtime_error( "Cannot send a PAUSE frame, because the TXFLOW bit in the CTRLMODER register was not set when the transmitter was enabled." );
+
+  char frame[ MIN_ETHERNET_FRAME_LENGTH ];
+  const int byte_count = build_pause_frame( frame, pause_time );
+
+  send_frame( frame, byte_count );
+}
+
+
+// Checks whether the frame just received is a PAUSE frame, and pauses the transmitter if so.
+// Returns whether the frame should be withheld from the simulation.
+
+bool ethernet_dpi::process_received_pause_frame ( void )
+{
+  const uint8_t * const frame = (const uint8_t *) m_receive_buffer;
+
+  if ( m_received_byte_count < 18 ||
+       get_be16( frame + 12 ) != MAC_CONTROL_ETHERTYPE ||
+       get_be16( frame + 14 ) != MAC_CONTROL_OPCODE_PAUSE )
+  {
+    return false;
+  }
+
+  // The real core accepts PAUSE frames sent to the reserved multicast address or to its own address.
+  if ( 0 != memcmp( frame, PAUSE_FRAME_DEST_MAC_ADDR, 6 ) &&
+       0 != memcmp( frame, m_station_mac_addr, 6 ) )
+  {
+    return false;
+  }
+
+  // A pause time of 0 lets the transmitter resume straight away.
+  // The frame currently being sent, if any, is not affected.
+  m_tx_paused_until_cycle = m_cycle_count + uint64_t( get_be16( frame + 16 ) ) * m_pause_quantum_cycles;
+  m_is_pause_frame_received = true;
+
+  if ( 0 != ( m_flow_control_flags & CTRLMODER_PASSALL ) )
+    return false;
+
+  ETHDPI_PROBE3( frame_discarded, m_tap_interface_name.c_str(), m_received_byte_count, DISCARD_REASON_PAUSE );
+
+  return true;
+}
+
+
+// Returns whether a PAUSE frame has been received since the last call, for the RXC interrupt.
+
+bool ethernet_dpi::take_pause_frame_received_event ( void )
+{
+  const bool ret = m_is_pause_frame_received;
+  m_is_pause_frame_received = false;
+  return ret;
+}
+
+
+void ethernet_dpi::update_flow_control ( unsigned char * const ready_to_send )
+{
+  if ( m_cycle_count < m_tx_paused_until_cycle )
+    *ready_to_send = 0;
+
+  if ( m_pause_watermark == 0 || 0 == ( m_flow_control_flags & CTRLMODER_TXFLOW ) )
+    return;
+
+  // The frames waiting in the reactor ring have not been taken by the simulation yet.
+  // If the ring keeps filling up, ask the peer to pause before the reactor must stop reading from the TAP interface.
+  // These PAUSE frames are not recorded, as the replay mode has no reactor ring that could fill up.
+  const unsigned queued_frame_count = m_reactor_ring_tail.load( std::memory_order_acquire ) -
+                                      m_reactor_ring_head.load( std::memory_order_relaxed );
+  char frame[ MIN_ETHERNET_FRAME_LENGTH ];
+
+  if ( queued_frame_count >= m_pause_watermark )
+  {
+    if ( !m_is_peer_paused || m_cycle_count >= m_peer_pause_refresh_cycle )
+    {
+      write_frame_to_tap( frame, build_pause_frame( frame, m_pause_time ) );
+
+      // Repeat the request halfway through the pause time, in case the ring does not drain in time.
+      m_is_peer_paused = true;
+      m_peer_pause_refresh_cycle = m_cycle_count + std::max( uint64_t( 1 ), uint64_t( m_pause_time ) * m_pause_quantum_cycles / 2 );
+    }
+  }
+  else if ( m_is_peer_paused && queued_frame_count <= m_pause_watermark / 2 )
+  {
+    // Let the peer resume straight away, instead of waiting for the pause time to expire.
+    write_frame_to_tap( frame, build_pause_frame( frame, 0 ) );
+    m_is_peer_paused = false;
+  }
+}
+
+
+// ------------------------- Receive filter -------------------------
+
+// A classic BPF program attached to the TAP interface with TUNATTACHFILTER drops unwanted frames inside the kernel,
+// before they are copied to user space. Without it, every frame on a busy bridge costs a read() system call,
+// and may keep the simulation from going idle. The program is either generated from the MAC address and
+// the MODER bits, see option "rx_filter=auto", or loaded from a file in the format of "tcpdump -ddd".
+
+static const uint32_t BPF_ACCEPT_FRAME = 0xFFFFFFFF;  // The number of bytes to keep, that is, the whole frame.
+static const uint32_t BPF_REJECT_FRAME = 0;
+
+
+// Appends a match for a destination MAC address. If it matches, the program jumps to the accept instruction,
+// which is not known yet, so the caller must fix up the instruction whose index is added to 'accept_jumps'.
+
+static void add_bpf_mac_addr_match ( std::vector< sock_filter > * const program,
+                                     std::vector< size_t > * const accept_jumps,
+                                     const uint8_t * const mac_addr )
+{
+  const sock_filter low_part  = BPF_STMT( BPF_LD | BPF_W | BPF_ABS, 2 );
+  const sock_filter low_test  = BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, get_be32( mac_addr + 2 ), 0, 2 );  // Skip the high part on mismatch.
+  const sock_filter high_part = BPF_STMT( BPF_LD | BPF_H | BPF_ABS, 0 );
+  const sock_filter high_test = BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, get_be16( mac_addr ), 0, 0 );
+
+  program->push_back( low_part );
+  program->push_back( low_test );
+  program->push_back( high_part );
+  accept_jumps->push_back( program->size() );
+  program->push_back( high_test );
+}
+
+
+// Accepts the same frames as the Verilog side does, so that the simulation does not notice the filter.
+// If 'ethertypes' is not empty, only frames with one of those EtherTypes are accepted.
+
+static std::vector< sock_filter > build_auto_rx_filter ( const uint8_t * const station_mac_addr,
+                                                         const uint32_t moder,
+                                                         const bool accept_pause_frames,
+                                                         const std::vector< uint16_t > & ethertypes )
+{
+  std::vector< sock_filter > program;
+  std::vector< size_t > accept_jumps;
+
+  if ( !ethertypes.empty() )
+  {
+    std::vector< uint16_t > accepted_ethertypes = ethertypes;
+
+    if ( accept_pause_frames )
+      accepted_ethertypes.push_back( MAC_CONTROL_ETHERTYPE );
+
+    const size_t count = accepted_ethertypes.size();
+
+    if ( count > 255 )
+      throw std::runtime_error( "Too many EtherTypes for the receive filter." );
+
+    const sock_filter load_ethertype = BPF_STMT( BPF_LD | BPF_H | BPF_ABS, 12 );
+    program.push_back( load_ethertype );
+
+    for ( size_t i = 0; i < count; ++i )
+    {
+      // On a match, jump over the rest of the tests and the reject instruction.
+      const sock_filter test = BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, accepted_ethertypes[ i ], uint8_t( count - i ), 0 );
+      program.push_back( test );
+    }
+
+    const sock_filter reject = BPF_STMT( BPF_RET | BPF_K, BPF_REJECT_FRAME );
+    program.push_back( reject );
+  }
+
+  if ( 0 != ( moder & MODER_PRO ) )
+  {
+    const sock_filter accept = BPF_STMT( BPF_RET | BPF_K, BPF_ACCEPT_FRAME );
+    program.push_back( accept );
+    return program;
+  }
+
+  add_bpf_mac_addr_match( &program, &accept_jumps, station_mac_addr );
+
+  if ( 0 == ( moder & MODER_BRO ) )
+  {
+    static const uint8_t broadcast_mac_addr[ 6 ] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+    add_bpf_mac_addr_match( &program, &accept_jumps, broadcast_mac_addr );
+  }
+
+  if ( accept_pause_frames )
+    add_bpf_mac_addr_match( &program, &accept_jumps, PAUSE_FRAME_DEST_MAC_ADDR );
+
+  const sock_filter reject = BPF_STMT( BPF_RET | BPF_K, BPF_REJECT_FRAME );
+  const sock_filter accept = BPF_STMT( BPF_RET | BPF_K, BPF_ACCEPT_FRAME );
+  program.push_back( reject );
+  program.push_back( accept );
+
+  const size_t accept_index = program.size() - 1;
+
+  for ( std::vector< size_t >::const_iterator it = accept_jumps.begin(); it != accept_jumps.end(); ++it )
+  {
+    assert( accept_index - ( *it + 1 ) <= 255 );
+    program[ *it ].jt = uint8_t( accept_index - ( *it + 1 ) );
+  }
+
+  return program;
+}
+
+
+// Reads a BPF program in the format that "tcpdump -ddd <expression>" prints: the number of instructions
+// on the first line, followed by one line per instruction with the decimal values "code jt jf k".
+
+static std::vector< sock_filter > read_rx_filter_file ( const std::string & filename )
+{
+  FILE * const f = fopen( filename.c_str(), "rt" );
+
+  if ( f == NULL )
+    throw std::runtime_error( format_error_message( errno, "Error opening receive filter file \"%s\": ", filename.c_str() ) );
+
+  std::vector< sock_filter > program;
+  unsigned instruction_count;
+  bool is_ok = 1 == fscanf( f, "%u", &instruction_count ) &&
+               instruction_count > 0 &&
+               instruction_count <= BPF_MAXINSNS;
+
+  for ( unsigned i = 0; is_ok && i < instruction_count; ++i )
+  {
+    unsigned code, jt, jf, k;
+
+    is_ok = 4 == fscanf( f, "%u %u %u %u", &code, &jt, &jf, &k ) &&
+            code <= 0xFFFF && jt <= 0xFF && jf <= 0xFF;
+
+    if ( is_ok )
+    {
+      sock_filter instruction;
+      instruction.code = uint16_t( code );
+      instruction.jt   = uint8_t( jt );
+      instruction.jf   = uint8_t( jf );
+      instruction.k    = k;
+      program.push_back( instruction );
+    }
+  }
+
+  fclose( f );
+
+  if ( !is_ok )
+    throw std::runtime_error( format_msg( "Receive filter file \"%s\" is not in the format of \"tcpdump -ddd\".", filename.c_str() ) );
+
+  return program;
+}
+
+
+// Parses option "rx_filter_ethertypes", a list of hexadecimal values separated by colons, like "0800:0806:86DD".
+
+static std::vector< uint16_t > parse_ethertype_list ( const std::string & list )
+{
+  std::vector< uint16_t > ethertypes;
+  const char * p = list.c_str();
+
+  for ( ; ; )
+  {
+    char * end;
+    errno = 0;
+    const unsigned long val = strtoul( p, &end, 16 );
+
+    if ( end == p || errno != 0 || val > 0xFFFF || ( *end != ':' && *end != '\0' ) )
+      throw std::runtime_error( "Invalid rx_filter_ethertypes option." );
+
+    ethertypes.push_back( uint16_t( val ) );
+
+    if ( *end == '\0' )
+      break;
+
+    p = end + 1;
+  }
+
+  return ethertypes;
+}
+
+
+void ethernet_dpi::attach_auto_rx_filter ( void )
+{
+  attach_rx_filter( build_auto_rx_filter( m_station_mac_addr,
+                                          m_rx_filter_moder,
+                                          0 != ( m_flow_control_flags & CTRLMODER_RXFLOW ),
+                                          m_rx_filter_ethertypes ) );
+}
+
+
+// Replaces any filter attached before, also the one left behind on a persistent TAP interface by a previous run.
+
+void ethernet_dpi::attach_rx_filter ( const std::vector< sock_filter > & program )
+{
+  assert( m_tun_tap_clone_device != -1 && !program.empty() );
+
+  sock_fprog fprog;
+  fprog.len    = (unsigned short) program.size();
+  fprog.filter = const_cast< sock_filter * >( &program[ 0 ] );
+
+  if ( ioctl( m_tun_tap_clone_device, TUNATTACHFILTER, &fprog ) == -1 )
+    throw std::runtime_error( format_error_message( errno, "Error attaching the receive filter to TAP interface \"%s\": ", m_tap_interface_name.c_str() ) );
+
+  if ( m_print_informational_messages )
+  {
+    printf( "%sAttached a receive filter with %d instructions to TAP interface \"%s\".\n",
+            m_informational_message_prefix.c_str(),
+            int( program.size() ),
+            m_tap_interface_name.c_str() );
+    fflush( stdout );
+  }
+}
+
+
+// ------------------------- AF_XDP transport -------------------------
+
+static int bpf_syscall ( const int cmd, bpf_attr * const attr )
+{
+  return int( syscall( __NR_bpf, cmd, attr, sizeof(*attr) ) );
+}
+
+
+static bpf_insn make_bpf_instruction ( const uint8_t code,
+                                       const uint8_t dst_reg,
+                                       const uint8_t src_reg,
+                                       const int32_t imm )
+{
+  bpf_insn instruction;
+  memset( &instruction, 0, sizeof(instruction) );
+  instruction.code    = code;
+  instruction.dst_reg = dst_reg & 0x0F;
+  instruction.src_reg = src_reg & 0x0F;
+  instruction.imm     = imm;
+  return instruction;
+}
+
+
+static void create_veth_pair ( const int netlink_socket,
+                               const std::string & interface_name,
+                               const std::string & peer_interface_name )
+{
+  struct
+  {
+    nlmsghdr   hdr;
+    ifinfomsg  info;
+    char       attributes[ 256 ];
+  } request;
+
+  memset( &request, 0, sizeof(request) );
+  request.hdr.nlmsg_len   = NLMSG_LENGTH( sizeof(request.info) );
+  request.hdr.nlmsg_type  = RTM_NEWLINK;
+  request.hdr.nlmsg_flags = NLM_F_CREATE | NLM_F_EXCL;
+  request.info.ifi_family = AF_UNSPEC;
+
+  add_rtnetlink_attribute( &request.hdr, sizeof(request), IFLA_IFNAME, interface_name.c_str(), interface_name.size() + 1 );
+
+  rtattr * const link_info = add_rtnetlink_attribute( &request.hdr, sizeof(request), IFLA_LINKINFO, NULL, 0 );
+  add_rtnetlink_attribute( &request.hdr, sizeof(request), IFLA_INFO_KIND, "veth", 5 );
+  rtattr * const info_data = add_rtnetlink_attribute( &request.hdr, sizeof(request), IFLA_INFO_DATA, NULL, 0 );
+
+  // The peer attribute starts with its own ifinfomsg.
+  ifinfomsg peer_info;
+  memset( &peer_info, 0, sizeof(peer_info) );
+  peer_info.ifi_family = AF_UNSPEC;
+  rtattr * const peer = add_rtnetlink_attribute( &request.hdr, sizeof(request), VETH_INFO_PEER, &peer_info, sizeof(peer_info) );
+  add_rtnetlink_attribute( &request.hdr, sizeof(request), IFLA_IFNAME, peer_interface_name.c_str(), peer_interface_name.size() + 1 );
+
+  end_rtnetlink_nested_attribute( &request.hdr, peer );
+  end_rtnetlink_nested_attribute( &request.hdr, info_data );
+  end_rtnetlink_nested_attribute( &request.hdr, link_info );
+
+  send_rtnetlink_request( netlink_socket,
+                          &request.hdr,
+                          format_msg( "creating veth pair \"%s\" and \"%s\"", interface_name.c_str(), peer_interface_name.c_str() ) );
+}
+
+
+// Attaches an XDP program to the given network interface, or detaches it if 'program_fd' is -1.
+
+static void set_xdp_program ( const std::string & interface_name, const int program_fd )
+{
+  const unsigned interface_index = if_nametoindex( interface_name.c_str() );
+
+  if ( interface_index == 0 )
+    throw std::runtime_error( format_error_message( errno, "Cannot find network interface \"%s\": ", interface_name.c_str() ) );
+
+  struct
+  {
+    nlmsghdr   hdr;
+    ifinfomsg  info;
+    char       attributes[ 64 ];
+  } request;
+
+  memset( &request, 0, sizeof(request) );
+  request.hdr.nlmsg_len   = NLMSG_LENGTH( sizeof(request.info) );
+  request.hdr.nlmsg_type  = RTM_SETLINK;
+  request.info.ifi_family = AF_UNSPEC;
+  request.info.ifi_index  = int( interface_index );
+
+  const int32_t  fd    = program_fd;
+  const uint32_t flags = XDP_FLAGS_DRV_MODE;
+
+  rtattr * const xdp = add_rtnetlink_attribute( &request.hdr, sizeof(request), IFLA_XDP, NULL, 0 );
+  add_rtnetlink_attribute( &request.hdr, sizeof(request), IFLA_XDP_FD,    &fd,    sizeof(fd) );
+  add_rtnetlink_attribute( &request.hdr, sizeof(request), IFLA_XDP_FLAGS, &flags, sizeof(flags) );
+  end_rtnetlink_nested_attribute( &request.hdr, xdp );
+
+  const int netlink_socket = open_rtnetlink_socket();
+
+  try
+  {
+    send_rtnetlink_request( netlink_socket,
+                            &request.hdr,
+                            format_msg( program_fd == -1 ? "detaching the XDP program from network interface \"%s\""
+                                                         : "attaching the XDP program to network interface \"%s\"",
+                                        interface_name.c_str() ) );
+  }
+  catch ( ... )
+  {
+    close_a( netlink_socket );
+    throw;
+  }
+
+  close_a( netlink_socket );
+}
+
+
+// The host's end of the veth pair would otherwise hand over frames without the final checksum,
+// and TCP super-frames bigger than the MTU, like a TAP interface does in vnet_hdr mode.
+// The XDP program sees them as they are, so these features must be turned off.
+
+static void disable_offload_features ( const std::string & interface_name )
+{
+  const int fd = socket( AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+
+  if ( fd == -1 )
+    throw std::runtime_error( format_error_message( errno, "Error creating a socket: " ) );
+
+  static const uint32_t commands[] = { ETHTOOL_STXCSUM, ETHTOOL_SGSO };
+
+  for ( size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i )
+  {
+    ethtool_value value;
+    value.cmd  = commands[ i ];
+    value.data = 0;
+
+    ifreq ifr;
+    memset( &ifr, 0, sizeof(ifr) );
+    strncpy( ifr.ifr_name, interface_name.c_str(), IFNAMSIZ - 1 );
+    ifr.ifr_data = (char *) &value;
+
+    if ( ioctl( fd, SIOCETHTOOL, &ifr ) == -1 )
+    {
+      const int errno_value = errno;
+      close_a( fd );
+      throw std::runtime_error( format_error_message( errno_value,
+                                                      "Error disabling the offload features of network interface \"%s\": ",
+                                                      interface_name.c_str() ) );
+    }
+  }
+
+  close_a( fd );
+}
+
+
+static int get_interface_mtu ( const std::string & interface_name )
+{
+  const int fd = socket( AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0 );
+
+  if ( fd == -1 )
+    throw std::runtime_error( format_error_message( errno, "Error creating a socket: " ) );
+
+  ifreq ifr;
+  memset( &ifr, 0, sizeof(ifr) );
+  strncpy( ifr.ifr_name, interface_name.c_str(), IFNAMSIZ - 1 );
+
+  const int res = ioctl( fd, SIOCGIFMTU, &ifr );
+  const int errno_value = errno;
+
+  close_a( fd );
+
+  if ( res == -1 )
+    throw std::runtime_error( format_error_message( errno_value, "Error getting the MTU for network interface \"%s\": ", interface_name.c_str() ) );
+
+  return ifr.ifr_mtu;
+}
+
+
+xdp_socket::xdp_socket ( const std::string & interface_name, const unsigned ring_size, const int max_frame_length )
+  : m_interface_name( interface_name )
+  , m_ring_size( ring_size )
+  , m_max_frame_length( max_frame_length )
+  , m_fd( -1 )
+  , m_map_fd( -1 )
+  , m_program_fd( -1 )
+  , m_is_program_attached( false )
+  , m_umem( NULL )
+  , m_umem_length( 0 )
+{
+  assert( ring_size != 0 && 0 == ( ring_size & ( ring_size - 1 ) ) );
+
+  memset( &m_rx_ring, 0, sizeof(m_rx_ring) );
+  memset( &m_tx_ring, 0, sizeof(m_tx_ring) );
+  memset( &m_fill_ring, 0, sizeof(m_fill_ring) );
+  memset( &m_completion_ring, 0, sizeof(m_completion_ring) );
+
+  try
+  {
+    // The kernel reserves XDP_PACKET_HEADROOM bytes at the beginning of each UMEM frame.
+    if ( max_frame_length > int( XDP_UMEM_FRAME_SIZE - XDP_PACKET_HEADROOM ) )
+      throw std::runtime_error( format_msg( "The MTU is too big for option \"xdp\", the maximum frame length is %d.",
+                                            int( XDP_UMEM_FRAME_SIZE - XDP_PACKET_HEADROOM ) ) );
+
+    const unsigned interface_index = if_nametoindex( interface_name.c_str() );
+
+    if ( interface_index == 0 )
+      throw std::runtime_error( format_error_message( errno, "Cannot find network interface \"%s\": ", interface_name.c_str() ) );
+
+    m_fd = socket( AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0 );
+
+    if ( m_fd == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error creating an AF_XDP socket: " ) );
+
+    // The first half of the UMEM frames receive, the second half send.
+    m_umem_length = size_t( 2 ) * ring_size * XDP_UMEM_FRAME_SIZE;
+    m_umem = mmap( NULL, m_umem_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+
+    if ( m_umem == MAP_FAILED )
+    {
+      m_umem = NULL;
+      throw std::runtime_error( format_error_message( errno, "Error allocating the AF_XDP memory area: " ) );
+    }
+
+    xdp_umem_reg umem_reg;
+    memset( &umem_reg, 0, sizeof(umem_reg) );
+    umem_reg.addr       = uint64_t( uintptr_t( m_umem ) );
+    umem_reg.len        = m_umem_length;
+    umem_reg.chunk_size = XDP_UMEM_FRAME_SIZE;
+    umem_reg.headroom   = 0;
+
+    if ( setsockopt( m_fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg) ) == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error registering the AF_XDP memory area: " ) );
+
+    static const int ring_options[] = { XDP_UMEM_FILL_RING, XDP_UMEM_COMPLETION_RING, XDP_RX_RING, XDP_TX_RING };
+    const int ring_entry_count = int( ring_size );
+
+    for ( size_t i = 0; i < sizeof(ring_options) / sizeof(ring_options[0]); ++i )
+    {
+      if ( setsockopt( m_fd, SOL_XDP, ring_options[ i ], &ring_entry_count, sizeof(ring_entry_count) ) == -1 )
+        throw std::runtime_error( format_error_message( errno, "Error setting the AF_XDP ring sizes: " ) );
+    }
+
+    xdp_mmap_offsets offsets;
+    socklen_t offsets_length = sizeof(offsets);
+
+    if ( getsockopt( m_fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsets_length ) == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error getting the AF_XDP ring offsets: " ) );
+
+    map_ring( &m_rx_ring, offsets.rx, XDP_PGOFF_RX_RING, sizeof(xdp_desc) );
+    map_ring( &m_tx_ring, offsets.tx, XDP_PGOFF_TX_RING, sizeof(xdp_desc) );
+    map_ring( &m_fill_ring, offsets.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t) );
+    map_ring( &m_completion_ring, offsets.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t) );
+
+    uint64_t * const fill_entries = (uint64_t *) m_fill_ring.entries;
+
+    for ( unsigned i = 0; i < ring_size; ++i )
+    {
+      fill_entries[ i ] = uint64_t( i ) * XDP_UMEM_FRAME_SIZE;
+      m_free_tx_frames.push_back( uint64_t( ring_size + i ) * XDP_UMEM_FRAME_SIZE );
+    }
+
+    __atomic_store_n( m_fill_ring.producer, uint32_t( ring_size ), __ATOMIC_RELEASE );
+
+    sockaddr_xdp addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sxdp_family   = AF_XDP;
+    addr.sxdp_ifindex  = interface_index;
+    addr.sxdp_queue_id = 0;
+    addr.sxdp_flags    = XDP_COPY;  // The veth driver has no zero-copy support.
+
+    if ( bind( m_fd, (const sockaddr *) &addr, sizeof(addr) ) == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error binding the AF_XDP socket to network interface \"%s\": ", interface_name.c_str() ) );
+
+    create_redirect_program();
+
+    set_xdp_program( interface_name, m_program_fd );
+    m_is_program_attached = true;
+  }
+  catch ( ... )
+  {
+    release_resources();
+    throw;
+  }
+}
+
+
+xdp_socket::~xdp_socket ( void )
+{
+  release_resources();
+}
+
+
+void xdp_socket::release_resources ( void )
+{
+  if ( m_is_program_attached )
+  {
+    // Otherwise, the program would stay attached to the interface after this process terminates.
+    try
+    {
+      set_xdp_program( m_interface_name, -1 );
+    }
+    catch ( ... )
+    {
+    }
+
+    m_is_program_attached = false;
+  }
+
+  ring * const rings[] = { &m_rx_ring, &m_tx_ring, &m_fill_ring, &m_completion_ring };
+
+  for ( size_t i = 0; i < sizeof(rings) / sizeof(rings[0]); ++i )
+  {
+    if ( rings[ i ]->mapping != NULL )
+    {
+      munmap( rings[ i ]->mapping, rings[ i ]->mapping_length );
+      rings[ i ]->mapping = NULL;
+    }
+  }
+
+  if ( m_program_fd != -1 )
+  {
+    close_a( m_program_fd );
+    m_program_fd = -1;
+  }
+
+  if ( m_map_fd != -1 )
+  {
+    close_a( m_map_fd );
+    m_map_fd = -1;
+  }
+
+  if ( m_fd != -1 )
+  {
+    close_a( m_fd );
+    m_fd = -1;
+  }
+
+  if ( m_umem != NULL )
+  {
+    munmap( m_umem, m_umem_length );
+    m_umem = NULL;
+  }
+}
+
+
+void xdp_socket::map_ring ( ring * const r,
+                            const xdp_ring_offset & offsets,
+                            const uint64_t page_offset,
+                            const size_t entry_size )
+{
+  r->mapping_length = size_t( offsets.desc ) + m_ring_size * entry_size;
+  r->mapping = mmap( NULL, r->mapping_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, off_t( page_offset ) );
+
+  if ( r->mapping == MAP_FAILED )
+  {
+    r->mapping = NULL;
+    throw std::runtime_error( format_error_message( errno, "Error mapping an AF_XDP ring: " ) );
+  }
+
+  r->producer = (uint32_t *)( (char *) r->mapping + offsets.producer );
+  r->consumer = (uint32_t *)( (char *) r->mapping + offsets.consumer );
+  r->entries  = (char *) r->mapping + offsets.desc;
+}
+
+
+// The XDP program redirects all frames to our socket with bpf_redirect_map( &map, 0, XDP_PASS ).
+// Until the socket is in the map, the frames go to the normal network stack instead.
+
+void xdp_socket::create_redirect_program ( void )
+{
+  bpf_attr attr;
+  memset( &attr, 0, sizeof(attr) );
+  attr.map_type    = BPF_MAP_TYPE_XSKMAP;
+  attr.key_size    = sizeof(uint32_t);
+  attr.value_size  = sizeof(uint32_t);
+  attr.max_entries = 1;
+
+  m_map_fd = bpf_syscall( BPF_MAP_CREATE, &attr );
+
+  if ( m_map_fd == -1 )
+    throw std::runtime_error( format_error_message( errno, "Error creating the XDP socket map, this needs the CAP_BPF capability: " ) );
+
+  const bpf_insn program[] =
+  {
+    // r1 = map, a 64-bit immediate value that takes 2 instructions.
+    make_bpf_instruction( BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, m_map_fd ),
+    make_bpf_instruction( 0, 0, 0, 0 ),
+    make_bpf_instruction( BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0 ),         // r2 = key 0
+    make_bpf_instruction( BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, XDP_PASS ),  // r3 = action if the key is not in the map
+    make_bpf_instruction( BPF_JMP | BPF_CALL, 0, 0, BPF_FUNC_redirect_map ),
+    make_bpf_instruction( BPF_JMP | BPF_EXIT, 0, 0, 0 )
+  };
+
+  memset( &attr, 0, sizeof(attr) );
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insn_cnt  = sizeof(program) / sizeof(program[0]);
+  attr.insns     = uint64_t( uintptr_t( program ) );
+  attr.license   = uint64_t( uintptr_t( "LGPL" ) );  // bpf_redirect_map() is not restricted to GPL programs.
+
+  m_program_fd = bpf_syscall( BPF_PROG_LOAD, &attr );
+
+  if ( m_program_fd == -1 )
+    throw std::runtime_error( format_error_message( errno, "Error loading the XDP program, this needs the CAP_BPF and CAP_NET_ADMIN capabilities: " ) );
+
+  const uint32_t key   = 0;
+  const uint32_t value = uint32_t( m_fd );
+
+  memset( &attr, 0, sizeof(attr) );
+  attr.map_fd = uint32_t( m_map_fd );
+  attr.key    = uint64_t( uintptr_t( &key ) );
+  attr.value  = uint64_t( uintptr_t( &value ) );
+  attr.flags  = BPF_ANY;
+
+  if ( bpf_syscall( BPF_MAP_UPDATE_ELEM, &attr ) == -1 )
+    throw std::runtime_error( format_error_message( errno, "Error adding the AF_XDP socket to the XDP socket map: " ) );
+}
+
+
+int xdp_socket::receive_frame ( char * const buffer )
+{
+  const uint32_t consumer = *m_rx_ring.consumer;
+
+  if ( consumer == __atomic_load_n( m_rx_ring.producer, __ATOMIC_ACQUIRE ) )
+    return 0;
+
+  const xdp_desc & desc = ( (const xdp_desc *) m_rx_ring.entries )[ consumer & ( m_ring_size - 1 ) ];
+  const uint64_t addr = desc.addr;
+  const uint32_t len  = desc.len;
+
+  if ( len > uint32_t( m_max_frame_length ) || addr + len > m_umem_length )
+    throw std::runtime_error( "Error receiving from the AF_XDP socket, the received packet is bigger than the MTU." );
+
+  memcpy( buffer, (const char *) m_umem + addr, len );
+
+  __atomic_store_n( m_rx_ring.consumer, consumer + 1, __ATOMIC_RELEASE );
+
+  // Give the buffer back to the kernel. The fill ring is as big as the number of Rx buffers, so it never overflows.
+  const uint32_t fill_producer = *m_fill_ring.producer;
+  ( (uint64_t *) m_fill_ring.entries )[ fill_producer & ( m_ring_size - 1 ) ] = addr - addr % XDP_UMEM_FRAME_SIZE;
+  __atomic_store_n( m_fill_ring.producer, fill_producer + 1, __ATOMIC_RELEASE );
+
+  return int( len );
+}
+
+
+void xdp_socket::reclaim_tx_frames ( void )
+{
+  const uint32_t producer = __atomic_load_n( m_completion_ring.producer, __ATOMIC_ACQUIRE );
+  uint32_t consumer = *m_completion_ring.consumer;
+
+  if ( consumer == producer )
+    return;
+
+  for ( ; consumer != producer; ++consumer )
+    m_free_tx_frames.push_back( ( (const uint64_t *) m_completion_ring.entries )[ consumer & ( m_ring_size - 1 ) ] );
+
+  __atomic_store_n( m_completion_ring.consumer, consumer, __ATOMIC_RELEASE );
+}
+
+
+bool xdp_socket::is_ready_to_send ( void )
+{
+  if ( m_free_tx_frames.empty() )
+    reclaim_tx_frames();
+
+  return !m_free_tx_frames.empty();
+}
+
+
+// In copy mode, the kernel only processes the Tx ring during a send call.
+
+void xdp_socket::wake_up_tx ( void )
+{
+  for ( ; ; )  // Repeat if EINTR.
+  {
+    if ( sendto( m_fd, NULL, 0, MSG_DONTWAIT, NULL, 0 ) != -1 )
+      return;
+
+    const int errno_value = errno;
+
+    if ( errno_value == EINTR )
+      continue;
+
+    // The kernel could not process all frames straight away, it continues on the next call.
+    if ( errno_value == EAGAIN || errno_value == EBUSY || errno_value == ENOBUFS )
+      return;
+
+    throw std::runtime_error( format_error_message( errno_value, "Error sending data through the AF_XDP socket: " ) );
+  }
+}
+
+
+void xdp_socket::send_frame ( const char * const frame, const int byte_count )
+{
+  assert( byte_count > 0 && byte_count <= m_max_frame_length );
+
+  while ( !is_ready_to_send() )
+  {
+    // All Tx buffers are in flight. The kernel normally releases them during the wake-up call.
+    wake_up_tx();
+  }
+
+  const uint64_t addr = m_free_tx_frames.back();
+  m_free_tx_frames.pop_back();
+
+  memcpy( (char *) m_umem + addr, frame, byte_count );
+
+  // The Tx ring is as big as the number of Tx buffers, so it never overflows.
+  const uint32_t producer = *m_tx_ring.producer;
+  xdp_desc & desc = ( (xdp_desc *) m_tx_ring.entries )[ producer & ( m_ring_size - 1 ) ];
+  desc.addr    = addr;
+  desc.len     = uint32_t( byte_count );
+  desc.options = 0;
+  __atomic_store_n( m_tx_ring.producer, producer + 1, __ATOMIC_RELEASE );
+
+  wake_up_tx();
+}
+
+
+// Creates the veth pair, unless it already exists. The host uses 'interface_name', like a TAP interface,
+// and the simulation uses the other end, whose name has an "x" appended.
+
+void ethernet_dpi::open_xdp ( const char * const interface_name,
+                              const int requested_mtu,
+                              const std::string & ip_addr,
+                              const unsigned ring_size )
+{
+  const std::string peer_interface_name = std::string( interface_name ) + "x";
+
+  if ( peer_interface_name.size() >= IFNAMSIZ )
+    throw std::runtime_error( format_msg( "The interface name \"%s\" is too long for option \"xdp\".", interface_name ) );
+
+  const int netlink_socket = open_rtnetlink_socket();
+
+  try
+  {
+    if ( if_nametoindex( interface_name ) == 0 )
+    {
+      create_veth_pair( netlink_socket, interface_name, peer_interface_name );
+
+      if ( !ip_addr.empty() )
+        add_ip_address( netlink_socket, interface_name, ip_addr );
+    }
+    else if ( if_nametoindex( peer_interface_name.c_str() ) == 0 )
+    {
+      throw std::runtime_error( format_msg( "Network interface \"%s\" exists, but not its veth peer \"%s\".",
+                                            interface_name,
+                                            peer_interface_name.c_str() ) );
+    }
+
+    set_link_up( netlink_socket, peer_interface_name.c_str(), requested_mtu );
+    set_link_up( netlink_socket, interface_name, requested_mtu );
+  }
+  catch ( ... )
+  {
+    close_a( netlink_socket );
+    throw;
+  }
+
+  close_a( netlink_socket );
+
+  disable_offload_features( interface_name );
+
+  m_mtu = get_interface_mtu( peer_interface_name );
+
+  if ( m_mtu > MAX_FRAME_LENGTH - MTU_MARGIN - CRC_LENGTH )
+  {
+    throw std::runtime_error( format_msg( "The MTU of %d for network interface \"%s\" is too big, the maximum is %d.",
+                                          m_mtu,
+                                          peer_interface_name.c_str(),
+                                          MAX_FRAME_LENGTH - MTU_MARGIN - CRC_LENGTH ) );
+  }
+
+  m_xdp_socket = new xdp_socket( peer_interface_name, ring_size, m_mtu + MTU_MARGIN );
+
+  if ( m_print_informational_messages )
+  {
+    printf( "%sUsing an AF_XDP socket on veth interface \"%s\", the host uses its peer \"%s\", MTU: %d.\n",
+            m_informational_message_prefix.c_str(),
+            peer_interface_name.c_str(),
+            interface_name,
+            m_mtu );
+    fflush( stdout );
+  }
+}
+
+
+// ------------------------- vhost-user transport -------------------------
+
+// vhost-user message types, see the vhost-user protocol specification.
+static const uint32_t VHOST_USER_GET_FEATURES   = 1;
+static const uint32_t VHOST_USER_SET_FEATURES   = 2;
+static const uint32_t VHOST_USER_SET_OWNER      = 3;
+static const uint32_t VHOST_USER_SET_MEM_TABLE  = 5;
+static const uint32_t VHOST_USER_SET_VRING_NUM  = 8;
+static const uint32_t VHOST_USER_SET_VRING_ADDR = 9;
+static const uint32_t VHOST_USER_SET_VRING_BASE = 10;
+static const uint32_t VHOST_USER_SET_VRING_KICK = 12;
+static const uint32_t VHOST_USER_SET_VRING_CALL = 13;
+
+static const uint32_t VHOST_USER_VERSION      = 1;
+static const uint32_t VHOST_USER_REPLY_FLAG   = 4;
+static const uint64_t VHOST_USER_VRING_NOFD   = 0x100;
+static const uint64_t VIRTIO_FEATURE_VERSION_1 = uint64_t( 1 ) << 32;
+
+static const uint16_t VIRTQ_DESC_F_NEXT          = 1;
+static const uint16_t VIRTQ_DESC_F_WRITE         = 2;
+static const uint16_t VIRTQ_USED_F_NO_NOTIFY     = 1;
+static const uint16_t VIRTQ_AVAIL_F_NO_INTERRUPT = 1;
+
+struct vhost_user_message_header
+{
+  uint32_t request;
+  uint32_t flags;
+  uint32_t size;  // Of the payload that follows.
+};
+
+struct vhost_user_vring_state
+{
+  uint32_t index;
+  uint32_t num;
+};
+
+struct vhost_user_vring_addr
+{
+  uint32_t index;
+  uint32_t flags;
+  uint64_t desc_user_addr;  // The ring addresses are in the front-end's address space.
+  uint64_t used_user_addr;
+  uint64_t avail_user_addr;
+  uint64_t log_guest_addr;
+};
+
+struct vhost_user_memory_table
+{
+  uint32_t region_count;
+  uint32_t padding;
+  uint64_t guest_phys_addr;
+  uint64_t memory_size;
+  uint64_t userspace_addr;
+  uint64_t mmap_offset;
+};
+
+
+static size_t round_up_to_page ( const size_t byte_count )
+{
+  const size_t page_size = 4096;
+  return ( byte_count + page_size - 1 ) / page_size * page_size;
+}
+
+
+// The shared memory area contains the receive queue, the transmit queue, and then one buffer per descriptor chain,
+// first the receive buffers and then the transmit ones. The descriptors use offsets into this area as addresses.
+
+vhost_user_device::vhost_user_device ( const std::string & socket_path, const unsigned queue_size, const int max_frame_length )
+  : m_socket_path( socket_path )
+  , m_queue_size( queue_size )
+  , m_max_frame_length( max_frame_length )
+  , m_socket( -1 )
+  , m_memory_fd( -1 )
+  , m_memory( NULL )
+  , m_memory_length( 0 )
+  , m_queue_area_length( 0 )
+  , m_header_length( 0 )
+  , m_is_rx_interrupt_enabled( false )
+{
+  assert( queue_size >= 2 && 0 == ( queue_size & ( queue_size - 1 ) ) );
+
+  for ( unsigned i = 0; i < 2; ++i )
+  {
+    memset( &m_queues[ i ], 0, sizeof(m_queues[ i ]) );
+    m_queues[ i ].kick_fd = -1;
+    m_queues[ i ].call_fd = -1;
+  }
+
+  try
+  {
+    if ( max_frame_length > int( VHOST_USER_BUFFER_SIZE - VHOST_USER_FRAME_OFFSET ) )
+      throw std::runtime_error( format_msg( "The MTU is too big for option \"vhost_user\", the maximum frame length is %d.",
+                                            int( VHOST_USER_BUFFER_SIZE - VHOST_USER_FRAME_OFFSET ) ) );
+
+    sockaddr_un addr;
+    memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+
+    if ( socket_path.size() >= sizeof(addr.sun_path) )
+      throw std::runtime_error( format_msg( "The vhost-user socket path \"%s\" is too long.", socket_path.c_str() ) );
+
+    strcpy( addr.sun_path, socket_path.c_str() );
+
+    m_socket = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+
+    if ( m_socket == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error creating a UNIX socket: " ) );
+
+    if ( connect( m_socket, (const sockaddr *) &addr, sizeof(addr) ) == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error connecting to vhost-user back-end \"%s\": ", socket_path.c_str() ) );
+
+    send_message( VHOST_USER_SET_OWNER, NULL, 0, -1 );
+
+    uint64_t features;
+    send_message( VHOST_USER_GET_FEATURES, NULL, 0, -1 );
+    receive_reply( VHOST_USER_GET_FEATURES, &features, sizeof(features) );
+
+    // No offload features are negotiated, so the frames are always complete.
+    // Without VHOST_USER_F_PROTOCOL_FEATURES, the back-end enables each queue as soon as it gets its kick file descriptor.
+    const uint64_t accepted_features = features & VIRTIO_FEATURE_VERSION_1;
+    m_header_length = accepted_features != 0 ? 12 : 10;
+    send_message( VHOST_USER_SET_FEATURES, &accepted_features, sizeof(accepted_features), -1 );
+
+    const size_t descriptors_length = m_queue_size * sizeof(vring_descriptor);
+    const size_t avail_length       = ( 3 + m_queue_size ) * sizeof(uint16_t);
+    const size_t used_length        = 3 * sizeof(uint16_t) + m_queue_size * sizeof(vring_used_element);
+
+    m_queue_area_length = round_up_to_page( descriptors_length + avail_length ) + round_up_to_page( used_length );
+    m_memory_length = 2 * m_queue_area_length + m_queue_size * VHOST_USER_BUFFER_SIZE;
+
+    m_memory_fd = memfd_create( "ethernet_dpi", MFD_CLOEXEC );
+
+    if ( m_memory_fd == -1 || ftruncate( m_memory_fd, off_t( m_memory_length ) ) == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error creating the vhost-user shared memory area: " ) );
+
+    void * const memory = mmap( NULL, m_memory_length, PROT_READ | PROT_WRITE, MAP_SHARED, m_memory_fd, 0 );
+
+    if ( memory == MAP_FAILED )
+      throw std::runtime_error( format_error_message( errno, "Error mapping the vhost-user shared memory area: " ) );
+
+    m_memory = (char *) memory;
+
+    vhost_user_memory_table memory_table;
+    memset( &memory_table, 0, sizeof(memory_table) );
+    memory_table.region_count    = 1;
+    memory_table.guest_phys_addr = 0;
+    memory_table.memory_size     = m_memory_length;
+    memory_table.userspace_addr  = uint64_t( uintptr_t( m_memory ) );
+    memory_table.mmap_offset     = 0;
+    send_message( VHOST_USER_SET_MEM_TABLE, &memory_table, sizeof(memory_table), m_memory_fd );
+
+    for ( unsigned i = 0; i < 2; ++i )
+      set_up_queue( i );
+
+    for ( unsigned i = 0; i < m_queue_size / 2; ++i )
+    {
+      make_available( &m_queues[ 0 ], uint16_t( 2 * i ) );
+      m_free_tx_buffers.push_back( uint16_t( 2 * i ) );
+    }
+  }
+  catch ( ... )
+  {
+    release_resources();
+    throw;
+  }
+}
+
+
+vhost_user_device::~vhost_user_device ( void )
+{
+  release_resources();
+}
+
+
+void vhost_user_device::release_resources ( void )
+{
+  for ( unsigned i = 0; i < 2; ++i )
+  {
+    if ( m_queues[ i ].kick_fd != -1 )
+    {
+      close_a( m_queues[ i ].kick_fd );
+      m_queues[ i ].kick_fd = -1;
+    }
+
+    if ( m_queues[ i ].call_fd != -1 )
+    {
+      close_a( m_queues[ i ].call_fd );
+      m_queues[ i ].call_fd = -1;
+    }
+  }
+
+  // Closing the socket tells the back-end to stop using the shared memory.
+  if ( m_socket != -1 )
+  {
+    close_a( m_socket );
+    m_socket = -1;
+  }
+
+  if ( m_memory != NULL )
+  {
+    munmap( m_memory, m_memory_length );
+    m_memory = NULL;
+  }
+
+  if ( m_memory_fd != -1 )
+  {
+    close_a( m_memory_fd );
+    m_memory_fd = -1;
+  }
+}
+
+
+void vhost_user_device::send_message ( const uint32_t request,
+                                       const void * const payload,
+                                       const uint32_t payload_size,
+                                       const int fd )
+{
+  vhost_user_message_header header;
+  header.request = request;
+  header.flags   = VHOST_USER_VERSION;
+  header.size    = payload_size;
+
+  iovec iov[ 2 ];
+  iov[ 0 ].iov_base = &header;
+  iov[ 0 ].iov_len  = sizeof(header);
+  iov[ 1 ].iov_base = const_cast< void * >( payload );
+  iov[ 1 ].iov_len  = payload_size;
+
+  msghdr msg;
+  memset( &msg, 0, sizeof(msg) );
+  msg.msg_iov    = iov;
+  msg.msg_iovlen = payload_size == 0 ? 1 : 2;
+
+  // File descriptors travel as ancillary data.
+  char control[ CMSG_SPACE( sizeof(int) ) ];
+
+  if ( fd != -1 )
+  {
+    memset( control, 0, sizeof(control) );
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr * const cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN( sizeof(int) );
+    memcpy( CMSG_DATA( cmsg ), &fd, sizeof(int) );
+  }
+
+  for ( ; ; )  // Repeat if EINTR.
+  {
+    const ssize_t sent_byte_count = sendmsg( m_socket, &msg, MSG_NOSIGNAL );
+
+    if ( sent_byte_count == -1 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      throw std::runtime_error( format_error_message( errno, "Error sending a message to vhost-user back-end \"%s\": ", m_socket_path.c_str() ) );
+    }
+
+    if ( sent_byte_count != ssize_t( sizeof(header) + payload_size ) )
+      throw std::runtime_error( format_msg( "Error sending a message to vhost-user back-end \"%s\", only part of it could be sent.", m_socket_path.c_str() ) );
+
+    break;
+  }
+}
+
+
+void vhost_user_device::receive_reply ( const uint32_t request, void * const payload, const uint32_t payload_size )
+{
+  vhost_user_message_header header;
+
+  for ( int part = 0; part < 2; ++part )
+  {
+    char * const buffer = part == 0 ? (char *) &header : (char *) payload;
+    const size_t byte_count = part == 0 ? sizeof(header) : payload_size;
+
+    for ( ; ; )  // Repeat if EINTR.
+    {
+      const ssize_t received_byte_count = recv( m_socket, buffer, byte_count, MSG_WAITALL );
+
+      if ( received_byte_count == -1 && errno == EINTR )
+        continue;
+
+      if ( received_byte_count == -1 )
+        throw std::runtime_error( format_error_message( errno, "Error receiving a reply from vhost-user back-end \"%s\": ", m_socket_path.c_str() ) );
+
+      if ( received_byte_count != ssize_t( byte_count ) )
+        throw std::runtime_error( format_msg( "The vhost-user back-end \"%s\" has closed the connection.", m_socket_path.c_str() ) );
+
+      break;
+    }
+
+    if ( part == 0 &&
+         ( header.request != request || 0 == ( header.flags & VHOST_USER_REPLY_FLAG ) || header.size != payload_size ) )
+    {
+      throw std::runtime_error( format_msg( "Invalid reply from vhost-user back-end \"%s\".", m_socket_path.c_str() ) );
+    }
+  }
+}
+
+
+uint64_t vhost_user_device::get_buffer_offset ( const unsigned buffer_index ) const
+{
+  return 2 * m_queue_area_length + uint64_t( buffer_index ) * VHOST_USER_BUFFER_SIZE;
+}
+
+
+// Each buffer takes the descriptors 2 * n and 2 * n + 1, so the descriptor table never changes,
+// except for the length of the frames to send.
+
+void vhost_user_device::set_up_queue ( const unsigned index )
+{
+  virtqueue * const q = &m_queues[ index ];
+  const bool is_rx = index == 0;
+  char * const base = m_memory + index * m_queue_area_length;
+  const size_t descriptors_length = m_queue_size * sizeof(vring_descriptor);
+
+  q->desc  = (vring_descriptor *) base;
+  q->avail = (uint16_t *)( base + descriptors_length );
+  q->used  = (uint16_t *)( base + round_up_to_page( descriptors_length + ( 3 + m_queue_size ) * sizeof(uint16_t) ) );
+
+  const uint16_t write_flag = is_rx ? VIRTQ_DESC_F_WRITE : 0;
+
+  for ( unsigned i = 0; i < m_queue_size / 2; ++i )
+  {
+    const uint64_t buffer_offset = get_buffer_offset( ( is_rx ? 0 : m_queue_size / 2 ) + i );
+
+    vring_descriptor * const header_desc = &q->desc[ 2 * i ];
+    header_desc->addr  = buffer_offset;
+    header_desc->len   = uint32_t( m_header_length );
+    header_desc->flags = VIRTQ_DESC_F_NEXT | write_flag;
+    header_desc->next  = uint16_t( 2 * i + 1 );
+
+    vring_descriptor * const data_desc = &q->desc[ 2 * i + 1 ];
+    data_desc->addr  = buffer_offset + VHOST_USER_FRAME_OFFSET;
+    data_desc->len   = is_rx ? uint32_t( m_max_frame_length ) : 0;
+    data_desc->flags = write_flag;
+    data_desc->next  = 0;
+  }
+
+  // The receive interrupts are only enabled while the simulation waits for activity, see prepare_to_wait().
+  q->avail[ 0 ] = is_rx ? VIRTQ_AVAIL_F_NO_INTERRUPT : 0;
+
+  q->kick_fd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+
+  if ( q->kick_fd == -1 || ( is_rx && -1 == ( q->call_fd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK ) ) ) )
+    throw std::runtime_error( format_error_message( errno, "Error creating an event file descriptor: " ) );
+
+  vhost_user_vring_state state;
+  state.index = index;
+  state.num   = m_queue_size;
+  send_message( VHOST_USER_SET_VRING_NUM, &state, sizeof(state), -1 );
+
+  state.num = 0;  // The first avail ring entry to process.
+  send_message( VHOST_USER_SET_VRING_BASE, &state, sizeof(state), -1 );
+
+  vhost_user_vring_addr addr;
+  memset( &addr, 0, sizeof(addr) );
+  addr.index           = index;
+  addr.desc_user_addr  = uint64_t( uintptr_t( q->desc ) );
+  addr.used_user_addr  = uint64_t( uintptr_t( q->used ) );
+  addr.avail_user_addr = uint64_t( uintptr_t( q->avail ) );
+  send_message( VHOST_USER_SET_VRING_ADDR, &addr, sizeof(addr), -1 );
+
+  // The transmit queue is polled, so it needs no call file descriptor.
+  const uint64_t call_index = is_rx ? index : index | VHOST_USER_VRING_NOFD;
+  send_message( VHOST_USER_SET_VRING_CALL, &call_index, sizeof(call_index), q->call_fd );
+
+  const uint64_t kick_index = index;
+  send_message( VHOST_USER_SET_VRING_KICK, &kick_index, sizeof(kick_index), q->kick_fd );
+}
+
+
+void vhost_user_device::make_available ( virtqueue * const q, const uint16_t head )
+{
+  // The queue size is a power of 2, so the free-running 16-bit indexes wrap around correctly.
+  q->avail[ 2 + q->next_avail_idx % m_queue_size ] = head;
+  ++q->next_avail_idx;
+
+  __atomic_store_n( &q->avail[ 1 ], q->next_avail_idx, __ATOMIC_RELEASE );
+
+  // The new index must be visible before checking whether the back-end wants to be notified,
+  // otherwise the back-end could go to sleep without seeing it.
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+
+  if ( 0 != ( __atomic_load_n( &q->used[ 0 ], __ATOMIC_RELAXED ) & VIRTQ_USED_F_NO_NOTIFY ) )
+    return;
+
+  const uint64_t one = 1;
+
+  if ( write( q->kick_fd, &one, sizeof(one) ) == -1 && errno != EAGAIN )
+    throw std::runtime_error( format_error_message( errno, "Error notifying vhost-user back-end \"%s\": ", m_socket_path.c_str() ) );
+}
+
+
+// Returns NULL if the back-end has not used any more buffers.
+
+vring_used_element * vhost_user_device::take_used_element ( virtqueue * const q )
+{
+  if ( q->last_used_idx == __atomic_load_n( &q->used[ 1 ], __ATOMIC_ACQUIRE ) )
+    return NULL;
+
+  vring_used_element * const element = (vring_used_element *)( q->used + 2 ) + q->last_used_idx % m_queue_size;
+  ++q->last_used_idx;
+
+  return element;
+}
+
+
+int vhost_user_device::receive_frame ( char * const buffer )
+{
+  virtqueue * const q = &m_queues[ 0 ];
+
+  const vring_used_element * const element = take_used_element( q );
+
+  if ( element == NULL )
+    return 0;
+
+  if ( m_is_rx_interrupt_enabled )
+  {
+    q->avail[ 0 ] = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    m_is_rx_interrupt_enabled = false;
+  }
+
+  const uint32_t head = element->id;
+  const uint32_t byte_count = element->len;
+
+  if ( head >= m_queue_size || head % 2 != 0 ||
+       byte_count < m_header_length || byte_count - m_header_length > uint32_t( m_max_frame_length ) )
+  {
+    throw std::runtime_error( format_msg( "The vhost-user back-end \"%s\" has returned an invalid receive buffer.", m_socket_path.c_str() ) );
+  }
+
+  const int frame_length = int( byte_count - m_header_length );
+
+  memcpy( buffer, m_memory + get_buffer_offset( head / 2 ) + VHOST_USER_FRAME_OFFSET, frame_length );
+
+  make_available( q, uint16_t( head ) );
+
+  return frame_length;
+}
+
+
+void vhost_user_device::reclaim_tx_buffers ( void )
+{
+  for ( ; ; )
+  {
+    const vring_used_element * const element = take_used_element( &m_queues[ 1 ] );
+
+    if ( element == NULL )
+      break;
+
+    if ( element->id >= m_queue_size || element->id % 2 != 0 )
+      throw std::runtime_error( format_msg( "The vhost-user back-end \"%s\" has returned an invalid transmit buffer.", m_socket_path.c_str() ) );
+
+    m_free_tx_buffers.push_back( uint16_t( element->id ) );
+  }
+}
+
+
+bool vhost_user_device::is_ready_to_send ( void )
+{
+  if ( m_free_tx_buffers.empty() )
+    reclaim_tx_buffers();
+
+  return !m_free_tx_buffers.empty();
+}
+
+
+void vhost_user_device::send_frame ( const char * const frame, const int byte_count )
+{
+  assert( byte_count > 0 && byte_count <= m_max_frame_length );
+
+  while ( !is_ready_to_send() )
+  {
+    // All transmit buffers are in use. The back-end runs on its own, so wait a little,
+    // but do not wait forever if it has gone away.
+    pollfd polled_fd;
+    polled_fd.fd      = m_socket;
+    polled_fd.events  = POLLIN;
+    polled_fd.revents = 0;
+
+    const int poll_res = poll( &polled_fd, 1, 1 );
+
+    if ( poll_res == -1 && errno != EINTR )
+      throw std::runtime_error( format_error_message( errno, "Error polling the vhost-user socket: " ) );
+
+    if ( poll_res == 1 )
+      throw std::runtime_error( format_msg( "The vhost-user back-end \"%s\" has closed the connection.", m_socket_path.c_str() ) );
+  }
+
+  const uint16_t head = m_free_tx_buffers.back();
+  m_free_tx_buffers.pop_back();
+
+  virtqueue * const q = &m_queues[ 1 ];
+  char * const buffer = m_memory + get_buffer_offset( m_queue_size / 2 + head / 2 );
+
+  memset( buffer, 0, m_header_length );  // No offload requests.
+  memcpy( buffer + VHOST_USER_FRAME_OFFSET, frame, byte_count );
+  q->desc[ head + 1 ].len = uint32_t( byte_count );
+
+  make_available( q, head );
+}
+
+
+bool vhost_user_device::prepare_to_wait ( void )
+{
+  virtqueue * const q = &m_queues[ 0 ];
+
+  if ( !m_is_rx_interrupt_enabled )
+  {
+    q->avail[ 0 ] = 0;
+    m_is_rx_interrupt_enabled = true;
+  }
+
+  // Reset the event counter, so that only new notifications wake us up. A frame that has arrived
+  // before the back-end saw the interrupts enabled is caught by the check below.
+  uint64_t count;
+
+  if ( read( q->call_fd, &count, sizeof(count) ) == -1 && errno != EAGAIN )
+    throw std::runtime_error( format_error_message( errno, "Error reading the vhost-user receive event: " ) );
+
+  __atomic_thread_fence( __ATOMIC_SEQ_CST );
+
+  return q->last_used_idx != __atomic_load_n( &q->used[ 1 ], __ATOMIC_ACQUIRE );
+}
+
+
+// ------------------------- Shared TAP interface -------------------------
+
+// Increment the version whenever the layout of shared_tap_area changes.
+static const uint32_t SHARED_TAP_MAGIC   = 0x45445354;  // "EDST"
+static const uint32_t SHARED_TAP_VERSION = 1;
+
+// Open addressing with linear probing, so the table must always have some empty entries.
+// It must be a power of 2.
+static const unsigned SHARED_TAP_HASH_TABLE_SIZE = 2 * MAX_SHARED_TAP_INSTANCES;
+
+static const size_t SHARED_TAP_ENTRY_ALIGNMENT = 64;  // A cache line.
+
+// How long to wait for the process that has created the shared memory object to initialise it.
+static const int SHARED_TAP_INIT_TIMEOUT_MS = 2000;
+
+struct shared_tap_slot
+{
+  int32_t  owner_pid;        // 0 if the slot is free.
+  uint8_t  mac_addr[ 6 ];    // All zeros if the instance has no MAC address yet.
+  uint8_t  is_promiscuous;
+  uint8_t  reserved;
+  uint32_t head;             // Next ring entry to consume, only written by the owner. The indexes are free-running.
+  uint32_t tail;             // Next ring entry to fill, only written by the dispatcher.
+  uint32_t is_waiting;       // Whether the owner wants a doorbell datagram for the next frame.
+  uint32_t reserved2;
+  uint64_t dropped_frame_count;
+};
+
+// The rings follow this structure in the shared memory object, MAX_SHARED_TAP_INSTANCES * ring_size entries
+// of entry_size bytes. Each entry starts with the frame length as a uint32_t.
+struct shared_tap_area
+{
+  uint32_t magic;       // Written last by the process that creates the object.
+  uint32_t version;
+  uint32_t ring_size;
+  uint32_t entry_size;
+
+  // Process-shared and robust, so that a process that dies while holding it does not block the others.
+  // It protects everything except for the ring indexes, and the dispatcher holds it while delivering frames.
+  pthread_mutex_t mutex;
+
+  uint8_t hash_table[ SHARED_TAP_HASH_TABLE_SIZE ];  // Slot number + 1, or 0 if the entry is empty.
+
+  shared_tap_slot slots[ MAX_SHARED_TAP_INSTANCES ];
+};
+
+
+pthread_mutex_t shared_tap::s_mutex = PTHREAD_MUTEX_INITIALIZER;
+shared_tap::shared_tap_map shared_tap::s_shared_taps;
+
+
+// Locks the mutex in the shared memory object. If its previous owner died, the protected data is still consistent,
+// as the ring indexes are updated last, and the hash table is rebuilt afterwards anyway.
+
+class shared_tap_lock
+{
+  pthread_mutex_t * const m_mutex;
+  bool m_is_locked;
+  bool m_was_owner_dead;
+
+public:
+  // If 'should_wait' is false, is_locked() tells whether the mutex was free.
+  shared_tap_lock ( pthread_mutex_t * const mutex, const bool should_wait )
+    : m_mutex( mutex )
+    , m_is_locked( false )
+    , m_was_owner_dead( false )
+  {
+    const int res = should_wait ? pthread_mutex_lock( m_mutex ) : pthread_mutex_trylock( m_mutex );
+
+    if ( res == EBUSY && !should_wait )
+      return;
+
+    if ( res == EOWNERDEAD )
+    {
+      pthread_mutex_consistent( m_mutex );
+      m_was_owner_dead = true;
+    }
+    else if ( res != 0 )
+      throw std::runtime_error( format_error_message( res, "Error locking the shared TAP interface: " ) );
+
+    m_is_locked = true;
+  }
+
+  ~shared_tap_lock ( void )
+  {
+    if ( m_is_locked )
+    {
+      const int res = pthread_mutex_unlock( m_mutex );
+      assert( res == 0 );
+      (void) res;
+    }
+  }
+
+  bool is_locked ( void ) const { return m_is_locked; }
+  bool was_owner_dead ( void ) const { return m_was_owner_dead; }
+};
+
+
+static uint64_t get_mac_addr_key ( const uint8_t * const mac_addr )
+{
+  uint64_t key = 0;
+
+  for ( int i = 0; i < 6; ++i )
+    key = ( key << 8 ) | mac_addr[ i ];
+
+  return key;
+}
+
+
+static unsigned hash_mac_addr ( const uint64_t key )
+{
+  // Fibonacci hashing, the upper bits of the product are the best mixed ones.
+  return unsigned( ( key * 0x9E3779B97F4A7C15ULL ) >> 32 ) & ( SHARED_TAP_HASH_TABLE_SIZE - 1 );
+}
+
+
+shared_tap * shared_tap::find_and_retain ( const std::string & interface_name )
+{
+  auto_mutex_lock lock( &s_mutex );
+
+  const shared_tap_map::iterator it = s_shared_taps.find( interface_name );
+
+  if ( it == s_shared_taps.end() )
+    return NULL;
+
+  ++it->second->m_reference_count;
+
+  return it->second;
+}
+
+
+shared_tap::shared_tap ( const std::string & interface_name, const int fd, const int mtu, const unsigned ring_size )
+  : m_interface_name( interface_name )
+  , m_reference_count( 1 )
+  , m_fd( -1 )
+  , m_mtu( mtu )
+  , m_ring_size( ring_size )
+  , m_entry_size( 0 )
+  , m_area_fd( -1 )
+  , m_area( NULL )
+  , m_area_length( 0 )
+  , m_doorbell_sender( -1 )
+  , m_dispatch_buffer( NULL )
+{
+  for ( unsigned i = 0; i < MAX_SHARED_TAP_INSTANCES; ++i )
+    m_doorbell_fds[ i ] = -1;
+
+  const int res = pthread_mutex_init( &m_tx_mutex, NULL );
+
+  if ( res != 0 )
+    throw std::runtime_error( format_error_message( res, "Error initialising a mutex: " ) );
+
+  try
+  {
+    m_entry_size = ( sizeof(uint32_t) + m_mtu + MTU_MARGIN + SHARED_TAP_ENTRY_ALIGNMENT - 1 )
+                     / SHARED_TAP_ENTRY_ALIGNMENT * SHARED_TAP_ENTRY_ALIGNMENT;
+
+    // We read one byte more than the MTU in order to know if the frame is longer than the maximum allowed.
+    m_dispatch_buffer = (char *) malloc( m_mtu + MTU_MARGIN + 1 );
+
+    if ( m_dispatch_buffer == NULL )
+      throw std::bad_alloc();
+
+    m_doorbell_sender = socket( AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+
+    if ( m_doorbell_sender == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error creating a UNIX socket: " ) );
+
+    map_area();
+
+    // The dispatcher must never block on a read() call.
+    const int flags = fcntl( fd, F_GETFL );
+
+    if ( flags == -1 || -1 == fcntl( fd, F_SETFL, flags | O_NONBLOCK ) )
+      throw std::runtime_error( format_error_message( errno, "Error setting the TAP interface to non-blocking mode: " ) );
+  }
+  catch ( ... )
+  {
+    release_resources();
+    pthread_mutex_destroy( &m_tx_mutex );
+    throw;
+  }
+
+  m_fd = fd;
+
+  auto_mutex_lock lock( &s_mutex );
+  s_shared_taps[ interface_name ] = this;
+}
+
+
+shared_tap::~shared_tap ( void )
+{
+  release_resources();
+  pthread_mutex_destroy( &m_tx_mutex );
+}
+
+
+void shared_tap::release ( void )
+{
+  {
+    auto_mutex_lock lock( &s_mutex );
+
+    assert( m_reference_count > 0 );
+
+    if ( --m_reference_count != 0 )
+      return;
+
+    s_shared_taps.erase( m_interface_name );
+  }
+
+  delete this;
+}
+
+
+void shared_tap::release_resources ( void )
+{
+  for ( unsigned i = 0; i < MAX_SHARED_TAP_INSTANCES; ++i )
+  {
+    if ( m_doorbell_fds[ i ] != -1 )
+    {
+      close_a( m_doorbell_fds[ i ] );
+      m_doorbell_fds[ i ] = -1;
+    }
+  }
+
+  if ( m_area != NULL )
+  {
+    munmap( m_area, m_area_length );
+    m_area = NULL;
+  }
+
+  if ( m_area_fd != -1 )
+  {
+    close_a( m_area_fd );
+    m_area_fd = -1;
+  }
+
+  if ( m_doorbell_sender != -1 )
+  {
+    close_a( m_doorbell_sender );
+    m_doorbell_sender = -1;
+  }
+
+  if ( m_fd != -1 )
+  {
+    close_a( m_fd );
+    m_fd = -1;
+  }
+
+  free( m_dispatch_buffer );
+  m_dispatch_buffer = NULL;
+}
+
+
+static std::string format_area_error ( const std::string & area_name, const char * const problem )
+{
+  return format_msg( "Shared memory object \"%s\" %s. If no other simulation is using it, remove /dev/shm%s .",
+                     area_name.c_str(),
+                     problem,
+                     area_name.c_str() );
+}
+
+
+// The shared memory object is left behind after the simulation, like a persistent TAP interface.
+// The next simulation reuses it and frees the slots of the processes that no longer exist.
+
+void shared_tap::map_area ( void )
+{
+  const std::string area_name = "/ethernet_dpi." + m_interface_name;
+
+  m_area_length = sizeof(shared_tap_area) + size_t( MAX_SHARED_TAP_INSTANCES ) * m_ring_size * m_entry_size;
+
+  m_area_fd = shm_open( area_name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600 );
+
+  const bool is_creator = m_area_fd != -1;
+
+  if ( is_creator )
+  {
+    if ( ftruncate( m_area_fd, off_t( m_area_length ) ) == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error setting the size of shared memory object \"%s\": ", area_name.c_str() ) );
+  }
+  else
+  {
+    if ( errno == EEXIST )
+      m_area_fd = shm_open( area_name.c_str(), O_RDWR | O_CLOEXEC, 0 );
+
+    if ( m_area_fd == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error opening shared memory object \"%s\": ", area_name.c_str() ) );
+  }
+
+  // The creator may not have set the size yet.
+  for ( int waited_ms = 0; ; waited_ms += 10 )
+  {
+    struct stat area_stat;
+
+    if ( fstat( m_area_fd, &area_stat ) == -1 )
+      throw std::runtime_error( format_error_message( errno, "Error getting the size of shared memory object \"%s\": ", area_name.c_str() ) );
+
+    if ( area_stat.st_size != 0 && size_t( area_stat.st_size ) != m_area_length )
+      throw std::runtime_error( format_area_error( area_name, "was created with a different MTU or shared_tap_ring_size option" ) );
+
+    if ( area_stat.st_size != 0 )
+      break;
+
+    if ( waited_ms >= SHARED_TAP_INIT_TIMEOUT_MS )
+      throw std::runtime_error( format_area_error( area_name, "has not been initialised" ) );
+
+    usleep( 10 * 1000 );
+  }
+
+  void * const area = mmap( NULL, m_area_length, PROT_READ | PROT_WRITE, MAP_SHARED, m_area_fd, 0 );
+
+  if ( area == MAP_FAILED )
+    throw std::runtime_error( format_error_message( errno, "Error mapping shared memory object \"%s\": ", area_name.c_str() ) );
+
+  m_area = (shared_tap_area *) area;
+
+  if ( is_creator )
+  {
+    // The rest is zero-filled already.
+    m_area->version    = SHARED_TAP_VERSION;
+    m_area->ring_size  = m_ring_size;
+    m_area->entry_size = uint32_t( m_entry_size );
+
+    pthread_mutexattr_t attr;
+    int res = pthread_mutexattr_init( &attr );
+
+    if ( res == 0 )
+      res = pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+
+    if ( res == 0 )
+      res = pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+
+    if ( res == 0 )
+      res = pthread_mutex_init( &m_area->mutex, &attr );
+
+    pthread_mutexattr_destroy( &attr );
+
+    if ( res != 0 )
+      throw std::runtime_error( format_error_message( res, "Error initialising the mutex in shared memory object \"%s\": ", area_name.c_str() ) );
+
+    __atomic_store_n( &m_area->magic, SHARED_TAP_MAGIC, __ATOMIC_RELEASE );
+    return;
+  }
+
+  for ( int waited_ms = 0; __atomic_load_n( &m_area->magic, __ATOMIC_ACQUIRE ) != SHARED_TAP_MAGIC; waited_ms += 10 )
+  {
+    if ( waited_ms >= SHARED_TAP_INIT_TIMEOUT_MS )
+      throw std::runtime_error( format_area_error( area_name, "has not been initialised" ) );
+
+    usleep( 10 * 1000 );
+  }
+
+  if ( m_area->version != SHARED_TAP_VERSION || m_area->ring_size != m_ring_size || m_area->entry_size != m_entry_size )
+    throw std::runtime_error( format_area_error( area_name, "was created by another version of this module, or with a different MTU or shared_tap_ring_size option" ) );
+}
+
+
+unsigned shared_tap::add_instance ( void )
+{
+  shared_tap_lock lock( &m_area->mutex, true );
+
+  const pid_t pid = getpid();
+  int free_slot = -1;
+
+  for ( unsigned i = 0; i < MAX_SHARED_TAP_INSTANCES; ++i )
+  {
+    shared_tap_slot * const s = &m_area->slots[ i ];
+
+    // Free the slots of the processes that have ended without removing their instances.
+    if ( s->owner_pid != 0 && s->owner_pid != pid && kill( s->owner_pid, 0 ) == -1 && errno == ESRCH )
+      s->owner_pid = 0;
+
+    if ( s->owner_pid == 0 && free_slot == -1 )
+      free_slot = int( i );
+  }
+
+  if ( free_slot == -1 )
+  {
+    throw std::runtime_error( format_msg( "Too many instances are sharing TAP interface \"%s\", the limit is %u.",
+                                          m_interface_name.c_str(),
+                                          MAX_SHARED_TAP_INSTANCES ) );
+  }
+
+  const unsigned slot = unsigned( free_slot );
+
+  open_doorbell( slot );
+
+  shared_tap_slot * const s = &m_area->slots[ slot ];
+
+  memset( s, 0, sizeof(*s) );
+  s->owner_pid = pid;
+
+  rebuild_hash_table();
+
+  return slot;
+}
+
+
+void shared_tap::remove_instance ( const unsigned slot )
+{
+  assert( slot < MAX_SHARED_TAP_INSTANCES );
+
+  try
+  {
+    shared_tap_lock lock( &m_area->mutex, true );
+
+    memset( &m_area->slots[ slot ], 0, sizeof(m_area->slots[ slot ]) );
+
+    rebuild_hash_table();
+  }
+  catch ( ... )
+  {
+    // This is only called when destroying an instance, so there is no way to report the error.
+    // The slot is freed anyway when this process ends, see add_instance().
+  }
+
+  if ( m_doorbell_fds[ slot ] != -1 )
+  {
+    close_a( m_doorbell_fds[ slot ] );
+    m_doorbell_fds[ slot ] = -1;
+  }
+}
+
+
+// The doorbell sockets live in the abstract namespace, which belongs to the network namespace
+// like the TAP interface itself, and they disappear together with their processes.
+
+static sockaddr_un get_doorbell_address ( const std::string & interface_name, const unsigned slot, socklen_t * const addr_length )
+{
+  sockaddr_un addr;
+  memset( &addr, 0, sizeof(addr) );
+  addr.sun_family = AF_UNIX;
+
+  // The first byte of sun_path stays 0.
+  const std::string name = format_msg( "ethernet_dpi.%s.%u", interface_name.c_str(), slot );
+  assert( name.size() < sizeof(addr.sun_path) - 1 );
+  memcpy( &addr.sun_path[ 1 ], name.data(), name.size() );
+
+  *addr_length = socklen_t( offsetof( sockaddr_un, sun_path ) + 1 + name.size() );
+
+  return addr;
+}
+
+
+void shared_tap::open_doorbell ( const unsigned slot )
+{
+  assert( m_doorbell_fds[ slot ] == -1 );
+
+  const int fd = socket( AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+
+  if ( fd == -1 )
+    throw std::runtime_error( format_error_message( errno, "Error creating a UNIX socket: " ) );
+
+  socklen_t addr_length;
+  const sockaddr_un addr = get_doorbell_address( m_interface_name, slot, &addr_length );
+
+  if ( bind( fd, (const sockaddr *) &addr, addr_length ) == -1 )
+  {
+    const int errno_value = errno;
+    close_a( fd );
+    throw std::runtime_error( format_error_message( errno_value,
+                                                    "Error creating the doorbell socket for slot %u of shared TAP interface \"%s\": ",
+                                                    slot,
+                                                    m_interface_name.c_str() ) );
+  }
+
+  m_doorbell_fds[ slot ] = fd;
+}
+
+
+// Must be called with the mutex in the shared memory object locked.
+
+void shared_tap::rebuild_hash_table ( void )
+{
+  memset( m_area->hash_table, 0, sizeof(m_area->hash_table) );
+
+  for ( unsigned i = 0; i < MAX_SHARED_TAP_INSTANCES; ++i )
+  {
+    const shared_tap_slot * const s = &m_area->slots[ i ];
+    const uint64_t key = get_mac_addr_key( s->mac_addr );
+
+    if ( s->owner_pid == 0 || key == 0 )
+      continue;
+
+    unsigned index = hash_mac_addr( key );
+
+    while ( m_area->hash_table[ index ] != 0 )
+      index = ( index + 1 ) & ( SHARED_TAP_HASH_TABLE_SIZE - 1 );
+
+    m_area->hash_table[ index ] = uint8_t( i + 1 );
+  }
+}
+
+
+void shared_tap::set_station_address ( const unsigned slot, const uint8_t * const mac_addr, const bool is_promiscuous )
+{
+  assert( slot < MAX_SHARED_TAP_INSTANCES );
+
+  shared_tap_lock lock( &m_area->mutex, true );
+
+  const uint64_t key = get_mac_addr_key( mac_addr );
+
+  for ( unsigned i = 0; i < MAX_SHARED_TAP_INSTANCES && key != 0; ++i )
+  {
+    const shared_tap_slot * const s = &m_area->slots[ i ];
+
+    if ( i != slot && s->owner_pid != 0 && get_mac_addr_key( s->mac_addr ) == key )
+    {
+      throw std::runtime_error( format_msg( "MAC address %02X:%02X:%02X:%02X:%02X:%02X is already used by slot %u of shared TAP interface \"%s\".",
+                                            mac_addr[ 0 ], mac_addr[ 1 ], mac_addr[ 2 ], mac_addr[ 3 ], mac_addr[ 4 ], mac_addr[ 5 ],
+                                            i,
+                                            m_interface_name.c_str() ) );
+    }
+  }
+
+  shared_tap_slot * const s = &m_area->slots[ slot ];
+
+  memcpy( s->mac_addr, mac_addr, sizeof(s->mac_addr) );
+  s->is_promiscuous = is_promiscuous ? 1 : 0;
+
+  rebuild_hash_table();
+}
+
+
+char * shared_tap::get_ring_entry ( const unsigned slot, const uint32_t index ) const
+{
+  return (char *) ( m_area + 1 ) + ( size_t( slot ) * m_ring_size + index % m_ring_size ) * m_entry_size;
+}
+
+
+void shared_tap::dispatch_frames ( void )
+{
+  shared_tap_lock lock( &m_area->mutex, false );
+
+  if ( !lock.is_locked() )
+    return;
+
+  if ( lock.was_owner_dead() )
+    rebuild_hash_table();
+
+  // Leave the rest for later, so that the instance calling this routine does not stall for too long.
+  for ( unsigned frame_count = 0; frame_count < m_ring_size; ++frame_count )
+  {
+    const ssize_t received_byte_count = read( m_fd, m_dispatch_buffer, m_mtu + MTU_MARGIN + 1 );
+
+    if ( received_byte_count == 0 )
+      throw std::runtime_error( "Cannot read data from the TAP interface." );
+
+    if ( received_byte_count == -1 )
+    {
+      if ( errno == EINTR )
+        continue;
+
+      if ( errno == EAGAIN || errno == EWOULDBLOCK )
+        break;
+
+      throw std::runtime_error( format_error_message( errno, "Error reading data from the TAP interface: " ) );
+    }
+
+    if ( received_byte_count > ssize_t( m_mtu + MTU_MARGIN ) )
+      throw std::runtime_error( "Error reading data from the TAP interface, the received packet is bigger than the MTU." );
+
+    const uint8_t * const dest_mac_addr = (const uint8_t *) m_dispatch_buffer;
+    const int byte_count = int( received_byte_count );
+
+    if ( byte_count < 6 )
+      continue;
+
+    // The group bit is set for broadcast and multicast frames. All instances get those,
+    // and the Verilog side filters them like the real MAC would.
+    const bool is_group_addr = 0 != ( dest_mac_addr[ 0 ] & 1 );
+
+    int owner_slot = -1;
+
+    if ( !is_group_addr )
+    {
+      const uint64_t key = get_mac_addr_key( dest_mac_addr );
+
+      for ( unsigned index = hash_mac_addr( key ); m_area->hash_table[ index ] != 0; index = ( index + 1 ) & ( SHARED_TAP_HASH_TABLE_SIZE - 1 ) )
+      {
+        const unsigned slot = m_area->hash_table[ index ] - 1u;
+
+        if ( get_mac_addr_key( m_area->slots[ slot ].mac_addr ) == key )
+        {
+          owner_slot = int( slot );
+          deliver_frame( slot, m_dispatch_buffer, byte_count );
+          break;
+        }
+      }
+    }
+
+    for ( unsigned slot = 0; slot < MAX_SHARED_TAP_INSTANCES; ++slot )
+    {
+      const shared_tap_slot * const s = &m_area->slots[ slot ];
+
+      if ( s->owner_pid != 0 && int( slot ) != owner_slot && ( is_group_addr || s->is_promiscuous ) )
+        deliver_frame( slot, m_dispatch_buffer, byte_count );
+    }
+  }
+}
+
+
+// Must be called with the mutex in the shared memory object locked.
+
+void shared_tap::deliver_frame ( const unsigned slot, const char * const frame, const int byte_count )
+{
+  shared_tap_slot * const s = &m_area->slots[ slot ];
+
+  const uint32_t tail = s->tail;
+
+  if ( tail - __atomic_load_n( &s->head, __ATOMIC_ACQUIRE ) >= m_ring_size )
+  {
+    ETHDPI_PROBE2( queue_full, m_interface_name.c_str(), m_ring_size );
+
+    ++s->dropped_frame_count;
+    return;
+  }
+
+  char * const entry = get_ring_entry( slot, tail );
+  const uint32_t length = uint32_t( byte_count );
+
+  memcpy( entry, &length, sizeof(length) );
+  memcpy( entry + sizeof(length), frame, byte_count );
+
+  // Sequentially consistent, together with the is_waiting flag, see prepare_to_wait().
+  __atomic_store_n( &s->tail, tail + 1, __ATOMIC_SEQ_CST );
+
+  if ( __atomic_exchange_n( &s->is_waiting, 0, __ATOMIC_SEQ_CST ) != 0 )
+  {
+    socklen_t addr_length;
+    const sockaddr_un addr = get_doorbell_address( m_interface_name, slot, &addr_length );
+    const char doorbell = 0;
+
+    // If the doorbell socket is already full, the owner will wake up anyway.
+    if ( sendto( m_doorbell_sender, &doorbell, sizeof(doorbell), 0, (const sockaddr *) &addr, addr_length ) == -1 &&
+         errno != EAGAIN && errno != ECONNREFUSED )
+    {
+      throw std::runtime_error( format_error_message( errno, "Error ringing the doorbell of slot %u of the shared TAP interface: ", slot ) );
+    }
+  }
+}
+
+
+int shared_tap::take_frame ( const unsigned slot, char * const buffer )
+{
+  assert( slot < MAX_SHARED_TAP_INSTANCES );
+
+  shared_tap_slot * const s = &m_area->slots[ slot ];
+
+  const uint32_t head = s->head;
+
+  if ( head == __atomic_load_n( &s->tail, __ATOMIC_ACQUIRE ) )
+    return 0;
+
+  const char * const entry = get_ring_entry( slot, head );
+  uint32_t length;
+
+  memcpy( &length, entry, sizeof(length) );
+  assert( length <= uint32_t( m_mtu + MTU_MARGIN ) );
+  memcpy( buffer, entry + sizeof(length), length );
+
+  __atomic_store_n( &s->head, head + 1, __ATOMIC_RELEASE );
+
+  return int( length );
+}
+
+
+bool shared_tap::prepare_to_wait ( const unsigned slot )
+{
+  assert( slot < MAX_SHARED_TAP_INSTANCES && m_doorbell_fds[ slot ] != -1 );
+
+  shared_tap_slot * const s = &m_area->slots[ slot ];
+
+  // Discard the old doorbell datagrams, so that only new frames wake us up.
+  char doorbell;
+
+  while ( recv( m_doorbell_fds[ slot ], &doorbell, sizeof(doorbell), 0 ) != -1 )
+  {
+  }
+
+  if ( errno != EAGAIN && errno != EWOULDBLOCK )
+    throw std::runtime_error( format_error_message( errno, "Error reading the doorbell of the shared TAP interface: " ) );
+
+  __atomic_store_n( &s->is_waiting, 1, __ATOMIC_SEQ_CST );
+
+  dispatch_frames();
+
+  // A frame delivered before the dispatcher saw the flag is caught here.
+  return s->head != __atomic_load_n( &s->tail, __ATOMIC_SEQ_CST );
+}
+
+
+uint64_t shared_tap::get_dropped_frame_count ( const unsigned slot ) const
+{
+  return __atomic_load_n( &m_area->slots[ slot ].dropped_frame_count, __ATOMIC_RELAXED );
+}
+
+
+// ------------------------- Instance table -------------------------
+
+// The Verilog side identifies each instance by a handle, which is its position in this table plus one.
+// A raw pointer would not survive a checkpoint, because the simulator saves and restores the handle
+// with the rest of the Verilog state. A new instance gets the lowest free handle, so the handles only depend
+// on the order of creation and destruction, which is deterministic, and the restored handles refer to the right instances.
+// Reusing the handles of destroyed instances means that the capacity only limits the number of instances that exist at a time.
+//
+// With verilator --threads, the DPI functions of different instances may run at the same time in different threads.
+// Looking up a handle does not take any lock, so the table has a fixed capacity and never moves in memory.
+// Each instance is only called from the thread that evaluates its Verilog always block at the time,
+// so the instances themselves need no locking either.
+
+static const long long MAX_INSTANCE_COUNT = 1024;
+
+static std::atomic< ethernet_dpi * > s_instances[ MAX_INSTANCE_COUNT ];
+static std::atomic< long long > s_instance_count( 0 );  // Highest handle assigned so far.
+
+// Serialises the creation, restoration and destruction of instances, and protects the process-wide state
+// that is only used on those occasions, like s_memory_accessors and s_network_namespace.
+static pthread_mutex_t s_instance_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Returns NULL if the handle is not valid.
+
+static ethernet_dpi * find_instance ( const long long obj )
+{
+  if ( obj <= 0 || obj > s_instance_count.load( std::memory_order_acquire ) )
+    return NULL;
+
+  return s_instances[ obj - 1 ].load( std::memory_order_acquire );
+}
+
+
+static ethernet_dpi * get_instance ( const long long obj )
+{
+  ethernet_dpi * const instance = find_instance( obj );
+
+  if ( instance == NULL )
+    throw std::runtime_error( "Invalid obj parameter." );
+
+  return instance;
+}
+
+
+// Must be called with s_instance_table_mutex locked.
+
+static void set_instance ( const long long obj, ethernet_dpi * const instance )
+{
+  assert( obj > 0 && obj <= MAX_INSTANCE_COUNT );
+
+  s_instances[ obj - 1 ].store( instance, std::memory_order_release );
+
+  if ( obj > s_instance_count.load( std::memory_order_relaxed ) )
+    s_instance_count.store( obj, std::memory_order_release );
+}
+
+
+static void save_instance_checkpoint ( const long long obj, std::string * const data )
+{
+  get_instance( obj )->save_checkpoint( data );
+}
+
+
+// If the instance exists, its network state is replaced. Otherwise, it is re-created,
+// which is what happens when a simulation is restored in a new process,
+// as the simulator does not run the Verilog initial blocks again.
+
+static void restore_instance_checkpoint ( const long long obj, checkpoint_reader * const reader )
+{
+  if ( obj <= 0 || obj > MAX_INSTANCE_COUNT )
+    throw std::runtime_error( "Invalid obj parameter." );
+
+  auto_mutex_lock lock( &s_instance_table_mutex );
+
+  ethernet_dpi * const instance = find_instance( obj );
+
+  if ( instance == NULL )
+    set_instance( obj, ethernet_dpi::create_from_checkpoint( reader ) );
+  else
+    instance->restore_checkpoint( reader );
+}
+
+
+static void write_file ( const char * const filename, const std::string & data )
+{
+  FILE * const f = fopen( filename, "wb" );
+
+  if ( f == NULL )
+    throw std::runtime_error( format_error_message( errno, "Error creating file \"%s\": ", filename ) );
+
+  const bool is_ok = data.size() == fwrite( data.data(), 1, data.size(), f );
+  const int errno_val = errno;
+
+  if ( 0 != fclose( f ) || !is_ok )
+    throw std::runtime_error( format_error_message( is_ok ? errno : errno_val, "Error writing to file \"%s\": ", filename ) );
+}
+
+
+static std::string read_file ( const char * const filename )
+{
+  FILE * const f = fopen( filename, "rb" );
+
+  if ( f == NULL )
+    throw std::runtime_error( format_error_message( errno, "Error opening file \"%s\": ", filename ) );
+
+  std::string ret;
+  char buffer[ 4096 ];
+
+  for ( ; ; )
+  {
+    const size_t byte_count = fread( buffer, 1, sizeof(buffer), f );
+
+    ret.append( buffer, byte_count );
+
+    if ( byte_count < sizeof(buffer) )
+      break;
+  }
+
+  const bool is_error = 0 != ferror( f );
+  fclose( f );
+
+  if ( is_error )
+    throw std::runtime_error( format_msg( "Error reading from file \"%s\".", filename ) );
+
+  return ret;
+}
+
+
+// Blocks until any instance has a new received frame, or until the timeout expires.
+// A negative timeout means no timeout. Returns whether there was any activity.
+// If no instance can receive anything, there is nothing to wait for, and this routine returns straight away.
+
+static bool wait_for_activity ( const int timeout_in_milliseconds )
+{
+  std::vector< pollfd > polled_fds;
+  bool should_poll_reactor = false;
+
+  // No instance may be destroyed while we are polling its file descriptors.
+  // Waiting is only allowed while the model is not being evaluated, so nobody else needs the lock in the meantime.
+  auto_mutex_lock lock( &s_instance_table_mutex );
+
+  const int reactor_fd = ethernet_dpi_reactor::begin_waiting_for_activity();
+
+  try
+  {
+    bool is_activity = false;
+    const long long instance_count = s_instance_count.load( std::memory_order_acquire );
+
+    for ( long long obj = 1; obj <= instance_count && !is_activity; ++obj )
+    {
+      ethernet_dpi * const instance = find_instance( obj );
+
+      if ( instance != NULL )
+        is_activity = instance->prepare_to_wait_for_activity( &polled_fds, &should_poll_reactor );
+    }
+
+    if ( !is_activity && should_poll_reactor )
+    {
+      assert( reactor_fd != -1 );
+
+      pollfd polled_fd;
+
+      polled_fd.fd      = reactor_fd;
+      polled_fd.events  = POLLIN;
+      polled_fd.revents = 0;
+
+      polled_fds.push_back( polled_fd );
+    }
+
+    // If no instance can receive anything, just sleep for the timeout, so that the caller does not busy-spin.
+    // Without a timeout, we would block forever.
+    if ( !is_activity && polled_fds.empty() && timeout_in_milliseconds < 0 )
+    {
+      throw std::runtime_error( "Cannot wait for network activity without a timeout, because no instance can receive any frames." );
+    }
+
+    if ( !is_activity )
+    {
+      for ( ; ; )  // Repeat if EINTR.
+      {
+        const int poll_res = poll( polled_fds.empty() ? NULL : &polled_fds[ 0 ], polled_fds.size(), timeout_in_milliseconds );
+
+        if ( poll_res == -1 )
+        {
+          if ( errno == EINTR )
+            continue;
+
+          throw std::runtime_error( format_error_message( errno, "Error waiting for network activity: " ) );
+        }
+
+        is_activity = poll_res != 0;
+        break;
       }
+    }
+
+    ethernet_dpi_reactor::end_waiting_for_activity();
+
+    return is_activity;
+  }
+  catch ( ... )
+  {
+    ethernet_dpi_reactor::end_waiting_for_activity();
+    throw;
+  }
+}
+
+
+// ------------------------- C++ harness interface -------------------------
+
+void ethernet_dpi_save_state ( std::string * const data )
+{
+  data->clear();
+
+  checkpoint_writer writer( data );
+
+  writer.write_u32( CHECKPOINT_PROCESS_MAGIC );
+  writer.write_u32( CHECKPOINT_VERSION );
+  auto_mutex_lock lock( &s_instance_table_mutex );
+
+  const long long instance_count = s_instance_count.load( std::memory_order_acquire );
+
+  writer.write_u32( uint32_t( instance_count ) );
+
+  for ( long long obj = 1; obj <= instance_count; ++obj )
+  {
+    if ( find_instance( obj ) == NULL )
+    {
+      writer.write_u8( 0 );
+      continue;
+    }
+
+    std::string instance_data;
+    save_instance_checkpoint( obj, &instance_data );
+
+    writer.write_u8( 1 );
+    writer.write_string( instance_data );
+  }
+}
+
+
+void ethernet_dpi_restore_state ( const std::string & data )
+{
+  checkpoint_reader reader( data.data(), data.size() );
+
+  if ( reader.read_u32() != CHECKPOINT_PROCESS_MAGIC )
+    throw std::runtime_error( "The checkpoint data is not valid." );
+
+  if ( reader.read_u32() != CHECKPOINT_VERSION )
+    throw std::runtime_error( "The checkpoint data version is not supported." );
+
+  const uint32_t instance_count = reader.read_u32();
+
+  for ( uint32_t i = 0; i < instance_count; ++i )
+  {
+    if ( reader.read_u8() == 0 )
+      continue;
+
+    uint32_t byte_count;
+    const void * const instance_data = reader.read_bytes( &byte_count );
+
+    checkpoint_reader instance_reader( instance_data, byte_count );
+    restore_instance_checkpoint( (long long)( i + 1 ), &instance_reader );
+  }
+}
+
+
+void ethernet_dpi_enter_network_namespace ( const char * const netns, const char * const userns )
+{
+  assert( netns != NULL );
+
+  auto_mutex_lock lock( &s_instance_table_mutex );
+
+  enter_network_namespace( netns, userns ? userns : "" );
+}
+
+
+void ethernet_dpi_register_memory_accessor ( const char * const name,
+                                             ethernet_dpi_memory_accessor * const accessor )
+{
+  assert( name != NULL );
+
+  auto_mutex_lock lock( &s_instance_table_mutex );
+
+  if ( accessor == NULL )
+    s_memory_accessors.erase( name );
+  else
+    s_memory_accessors[ name ] = accessor;
+}
+
+
+// ---------------------------- DPI interface ----------------------------
+
+int ethernet_dpi_create ( const char * const tap_interface_name,
+                          const unsigned char print_informational_messages,
+                          const char * const informational_message_prefix,
+                          const char * const options,
+                          long long * const obj )
+{
+  ETHDPI_PROBE1( dpi_create, tap_interface_name );
+
+  *obj = 0;  // In case of error, return the equivalent of NULL.
+             // Otherwise, the 'final' Verilog section must check whether ethernet_dpi_create() failed before calling ethernet_dpi_destroy().
+
+  ethernet_dpi * this_obj = NULL;
+  long long new_obj;
+
+  try
+  {
+    // Creating instances is rare, so they are all created one at a time.
+    auto_mutex_lock lock( &s_instance_table_mutex );
+
+    const long long instance_count = s_instance_count.load( std::memory_order_relaxed );
+
+    for ( new_obj = 1; new_obj <= instance_count; ++new_obj )
+    {
+      if ( s_instances[ new_obj - 1 ].load( std::memory_order_relaxed ) == NULL )
+        break;
+    }
+
+    if ( new_obj > MAX_INSTANCE_COUNT )
+      throw std::runtime_error( format_msg( "Too many instances, the limit is %lld at a time.", MAX_INSTANCE_COUNT ) );
+
+    this_obj = new ethernet_dpi( tap_interface_name,
+                                 print_informational_messages,
+                                 informational_message_prefix,
+                                 options,
+                                 false );
+
+    set_instance( new_obj, this_obj );
+  }
+  catch ( const std::exception & e )
+  {
+    // We should return this error string to the caller,
+    // but Verilog does not have good support for variable-length strings.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
+    fflush( stderr );
+
+    delete this_obj;
+
+    return RET_FAILURE;
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX );
+    fflush( stderr );
+
+    delete this_obj;
+
+    return RET_FAILURE;
+  }
+
+  *obj = new_obj;
+  return RET_SUCCESS;
+}
+
+
+void ethernet_dpi_destroy ( const long long obj )
+{
+  ETHDPI_PROBE1( dpi_destroy, obj );
+
+  if ( obj <= 0 || obj > s_instance_count.load( std::memory_order_acquire ) )
+    return;
+
+  // wait_for_activity() holds the lock while it uses the instances and their file descriptors.
+  auto_mutex_lock lock( &s_instance_table_mutex );
+
+  delete s_instances[ obj - 1 ].exchange( NULL, std::memory_order_acq_rel );
+}
+
+
+int ethernet_dpi_tick ( const long long obj,
+                        int * const received_frame_byte_count,
+                        unsigned char * const ready_to_send )
+{
+  ETHDPI_PROBE1( dpi_tick, obj );
+
+  try
+  {
+    ethernet_dpi * const this_obj = get_instance( obj );
+
+    this_obj->tick( received_frame_byte_count, ready_to_send );
+
+    return RET_SUCCESS;
+  }
+  catch ( const std::exception & e )
+  {
+    // We should return this error string to the caller,
+    // but Verilog does not have good support for variable-length strings.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
+    fflush( stderr );
+
+    return RET_FAILURE;
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX );
+    fflush( stderr );
+
+    return RET_FAILURE;
+  }
+}
+
+
+int ethernet_dpi_flush_tap_receive_buffer ( const long long obj )
+{
+  ETHDPI_PROBE1( dpi_flush_tap_receive_buffer, obj );
+
+  try
+  {
+    ethernet_dpi * const this_obj = get_instance( obj );
+
+    this_obj->flush_tap_receive_buffer();
+
+    return RET_SUCCESS;
+  }
+  catch ( const std::exception & e )
+  {
+    // We should return this error string to the caller,
+    // but Verilog does not have good support for variable-length strings.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
+    fflush( stderr );
+
+    return RET_FAILURE;
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX );
+    fflush( stderr );
+
+    return RET_FAILURE;
+  }
+}
+
+
+int ethernet_dpi_add_byte_to_tx_frame ( const long long obj, const char data )
+{
+  ETHDPI_PROBE1( dpi_add_byte_to_tx_frame, obj );
+
+  try
+  {
+    ethernet_dpi * const this_obj = get_instance( obj );
+
+    this_obj->add_byte_to_tx_frame( data );
+
+    return RET_SUCCESS;
+  }
+  catch ( const std::exception & e )
+  {
+    // We should return this error string to the caller,
+    // but Verilog does not have good support for variable-length strings.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
+    fflush( stderr );
+
+    return RET_FAILURE;
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX );
+    fflush( stderr );
+
+    return RET_FAILURE;
+  }
+}
+
+
+int ethernet_dpi_new_tx_frame ( const long long obj )
+{
+  ETHDPI_PROBE1( dpi_new_tx_frame, obj );
 
-      throw std::runtime_error( format_error_message( errno, "Error reading data from the TAP interface: " ) );
-    }
+  try
+  {
+    ethernet_dpi * const this_obj = get_instance( obj );
 
-    if ( false )
-    {
-      printf( "Received byte count: %u\n", unsigned(received_byte_count) );
-      fflush( stdout );
-    }
+    this_obj->new_tx_frame();
 
-    if ( received_byte_count > ssize_t( m_mtu + MTU_MARGIN ) )
-    {
-      throw std::runtime_error( "Error reading data from the TAP interface, the received packet is bigger than the MTU." );
-    }
+    return RET_SUCCESS;
+  }
+  catch ( const std::exception & e )
+  {
+    // We should return this error string to the caller,
+    // but Verilog does not have good support for variable-length strings.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
+    fflush( stderr );
 
-    if ( APPEND_DUMMY_CRC )
-    {
-      // The dummy CRC is "DEADFOOD" in hex.
-      assert( CRC_LENGTH == 4 );
-      m_receive_buffer[ received_byte_count++ ] = 0xDE;
-      m_receive_buffer[ received_byte_count++ ] = 0xAD;
-      m_receive_buffer[ received_byte_count++ ] = 0xF0;
-      m_receive_buffer[ received_byte_count++ ] = 0x0D;
-    }
+    return RET_FAILURE;
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX );
+    fflush( stderr );
 
-    return (int) received_byte_count;
+    return RET_FAILURE;
   }
 }
 
 
-void ethernet_dpi::tick ( int * const received_frame_byte_count,
-                          unsigned char * const ready_to_send )
+int ethernet_dpi_send_tx_frame ( const long long obj )
 {
-  if ( m_received_byte_count == 0 )
-  {
-    m_received_byte_count = receive_frame();
-  }
+  ETHDPI_PROBE1( dpi_send_tx_frame, obj );
 
-  *received_frame_byte_count = m_received_byte_count;
+  try
+  {
+    ethernet_dpi * const this_obj = get_instance( obj );
 
+    this_obj->send_tx_frame();
 
-  // Possible optimisation: if the TAP interface was ready to send the last time,
-  // and we have not sent or received anything, then it should still be ready to send,
-  // there is no need to poll.
+    return RET_SUCCESS;
+  }
+  catch ( const std::exception & e )
+  {
+    // We should return this error string to the caller,
+    // but Verilog does not have good support for variable-length strings.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
+    fflush( stderr );
 
-  for ( ; ; )  // Repeat if EINTR.
+    return RET_FAILURE;
+  }
+  catch ( ... )
   {
-    pollfd polled_fd;
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX );
+    fflush( stderr );
 
-    polled_fd.fd      = m_tun_tap_clone_device;
-    polled_fd.events  = POLLOUT | POLLERR;
-    polled_fd.revents = 0;
+    return RET_FAILURE;
+  }
+}
 
-    const int poll_res = poll( &polled_fd, 1, 0 );
 
-    if ( poll_res == -1 )
-    {
-      if ( errno == EINTR )
-        continue;
+int ethernet_dpi_get_received_frame_byte ( const long long obj,
+                                           const int offset,
+                                           char * const data )
+{
+  ETHDPI_PROBE1( dpi_get_received_frame_byte, obj );
 
-      throw std::runtime_error( format_error_message( errno, "Error polling the TAP interface to send: " ) );
-    }
+  try
+  {
+    ethernet_dpi * const this_obj = get_instance( obj );
 
-    if ( poll_res == 0 )
-    {
-      *ready_to_send = 0;
-      break;
-    }
+    this_obj->get_received_frame_byte( offset, data );
+  }
+  catch ( const std::exception & e )
+  {
+    // We should return this error string to the caller,
+    // but Verilog does not have good support for variable-length strings.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
+    fflush( stderr );
 
-    assert( poll_res == 1 );
-    *ready_to_send = 1;
-    break;
+    return RET_FAILURE;
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX );
+    fflush( stderr );
+
+    return RET_FAILURE;
   }
+
+  return RET_SUCCESS;
 }
 
 
-void ethernet_dpi::get_received_frame_byte ( const int offset, char * const data )
+int ethernet_dpi_discard_received_frame ( const long long obj )
 {
-  if ( offset < 0 || offset >= m_received_byte_count )
-      throw std::runtime_error( "The received frame byte offset is out of range." );
+  ETHDPI_PROBE1( dpi_discard_received_frame, obj );
 
-  *data = m_receive_buffer[ offset ];
-}
+  try
+  {
+    ethernet_dpi * const this_obj = get_instance( obj );
 
+    this_obj->discard_received_frame();
+  }
+  catch ( const std::exception & e )
+  {
+    // We should return this error string to the caller,
+    // but Verilog does not have good support for variable-length strings.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
+    fflush( stderr );
 
-void ethernet_dpi::discard_received_frame ( void )
-{
-  m_received_byte_count = 0;
-}
+    return RET_FAILURE;
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX );
+    fflush( stderr );
 
+    return RET_FAILURE;
+  }
 
-// ---------------------------- DPI interface ----------------------------
+  return RET_SUCCESS;
+}
 
-int ethernet_dpi_create ( const char * const tap_interface_name,
-                          const unsigned char print_informational_messages,
-                          const char * const informational_message_prefix,
-                          long long * const obj )
-{
-  *obj = 0;  // In case of error, return the equivalent of NULL.
-             // Otherwise, the 'final' Verilog section must check whether ethernet_dpi_create() failed before calling ethernet_dpi_destroy().
 
-  ethernet_dpi * this_obj = NULL;
+int ethernet_dpi_is_backdoor_dma_enabled ( const long long obj,
+                                           unsigned char * const is_enabled )
+{
+  ETHDPI_PROBE1( dpi_is_backdoor_dma_enabled, obj );
 
   try
   {
-    this_obj = new ethernet_dpi( tap_interface_name,
-                                 print_informational_messages,
-                                 informational_message_prefix );
+    ethernet_dpi * const this_obj = get_instance( obj );
+
+    *is_enabled = this_obj->is_backdoor_dma_enabled() ? 1 : 0;
   }
   catch ( const std::exception & e )
   {
@@ -699,8 +8874,6 @@ int ethernet_dpi_create ( const char * const tap_interface_name,
     fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
     fflush( stderr );
 
-    delete this_obj;
-
     return RET_FAILURE;
   }
   catch ( ... )
@@ -708,39 +8881,57 @@ int ethernet_dpi_create ( const char * const tap_interface_name,
     fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX );
     fflush( stderr );
 
-    delete this_obj;
-
     return RET_FAILURE;
   }
 
-  assert( sizeof(*obj) >= sizeof(this_obj) );
-  *obj = (long long)this_obj;
   return RET_SUCCESS;
 }
 
 
-void ethernet_dpi_destroy ( const long long obj )
+int ethernet_dpi_backdoor_send_tx_frame ( const long long obj,
+                                          const int addr,
+                                          const int byte_count )
 {
-  const ethernet_dpi * const this_obj = (const ethernet_dpi *)obj;
+  ETHDPI_PROBE1( dpi_backdoor_send_tx_frame, obj );
+
+  try
+  {
+    ethernet_dpi * const this_obj = get_instance( obj );
+
+    this_obj->backdoor_send_tx_frame( uint32_t( addr ), byte_count );
+  }
+  catch ( const std::exception & e )
+  {
+    // We should return this error string to the caller,
+    // but Verilog does not have good support for variable-length strings.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
+    fflush( stderr );
+
+    return RET_FAILURE;
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX );
+    fflush( stderr );
+
+    return RET_FAILURE;
+  }
 
-  delete this_obj;
+  return RET_SUCCESS;
 }
 
 
-int ethernet_dpi_tick ( const long long obj,
-                        int * const received_frame_byte_count,
-                        unsigned char * const ready_to_send )
+int ethernet_dpi_backdoor_write_received_frame ( const long long obj,
+                                                 const int addr,
+                                                 const int byte_count )
 {
+  ETHDPI_PROBE1( dpi_backdoor_write_received_frame, obj );
+
   try
   {
-    ethernet_dpi * const this_obj = (ethernet_dpi *)obj;
-
-    if ( this_obj == NULL )
-      throw std::runtime_error( "Invalid obj parameter." );
-
-    this_obj->tick( received_frame_byte_count, ready_to_send );
+    ethernet_dpi * const this_obj = get_instance( obj );
 
-    return RET_SUCCESS;
+    this_obj->backdoor_write_received_frame( uint32_t( addr ), byte_count );
   }
   catch ( const std::exception & e )
   {
@@ -758,21 +8949,21 @@ int ethernet_dpi_tick ( const long long obj,
 
     return RET_FAILURE;
   }
+
+  return RET_SUCCESS;
 }
 
 
-int ethernet_dpi_flush_tap_receive_buffer ( const long long obj )
+int ethernet_dpi_save ( const long long obj,
+                        const char * const filename )
 {
+  ETHDPI_PROBE1( dpi_save, obj );
+
   try
   {
-    ethernet_dpi * const this_obj = (ethernet_dpi *)obj;
-
-    if ( this_obj == NULL )
-      throw std::runtime_error( "Invalid obj parameter." );
-
-    this_obj->flush_tap_receive_buffer();
-
-    return RET_SUCCESS;
+    std::string data;
+    save_instance_checkpoint( obj, &data );
+    write_file( filename, data );
   }
   catch ( const std::exception & e )
   {
@@ -790,21 +8981,22 @@ int ethernet_dpi_flush_tap_receive_buffer ( const long long obj )
 
     return RET_FAILURE;
   }
+
+  return RET_SUCCESS;
 }
 
 
-int ethernet_dpi_add_byte_to_tx_frame ( const long long obj, const char data )
+int ethernet_dpi_restore ( const long long obj,
+                           const char * const filename )
 {
+  ETHDPI_PROBE1( dpi_restore, obj );
+
   try
   {
-    ethernet_dpi * const this_obj = (ethernet_dpi *)obj;
-
-    if ( this_obj == NULL )
-      throw std::runtime_error( "Invalid obj parameter." );
+    const std::string data = read_file( filename );
 
-    this_obj->add_byte_to_tx_frame( data );
-
-    return RET_SUCCESS;
+    checkpoint_reader reader( data.data(), data.size() );
+    restore_instance_checkpoint( obj, &reader );
   }
   catch ( const std::exception & e )
   {
@@ -822,21 +9014,23 @@ int ethernet_dpi_add_byte_to_tx_frame ( const long long obj, const char data )
 
     return RET_FAILURE;
   }
+
+  return RET_SUCCESS;
 }
 
 
-int ethernet_dpi_new_tx_frame ( const long long obj )
+int ethernet_dpi_configure_mac ( const long long obj,
+                                const int moder,
+                                const int ctrlmoder,
+                                const long long mac_addr )
 {
+  ETHDPI_PROBE1( dpi_configure_mac, obj );
+
   try
   {
-    ethernet_dpi * const this_obj = (ethernet_dpi *)obj;
-
-    if ( this_obj == NULL )
-      throw std::runtime_error( "Invalid obj parameter." );
+    ethernet_dpi * const this_obj = get_instance( obj );
 
-    this_obj->new_tx_frame();
-
-    return RET_SUCCESS;
+    this_obj->configure_mac( uint32_t( moder ), uint32_t( ctrlmoder ), uint64_t( mac_addr ) );
   }
   catch ( const std::exception & e )
   {
@@ -854,21 +9048,21 @@ int ethernet_dpi_new_tx_frame ( const long long obj )
 
     return RET_FAILURE;
   }
+
+  return RET_SUCCESS;
 }
 
 
-int ethernet_dpi_send_tx_frame ( const long long obj )
+int ethernet_dpi_send_pause_frame ( const long long obj,
+                                    const int pause_time )
 {
+  ETHDPI_PROBE1( dpi_send_pause_frame, obj );
+
   try
   {
-    ethernet_dpi * const this_obj = (ethernet_dpi *)obj;
-
-    if ( this_obj == NULL )
-      throw std::runtime_error( "Invalid obj parameter." );
+    ethernet_dpi * const this_obj = get_instance( obj );
 
-    this_obj->send_tx_frame();
-
-    return RET_SUCCESS;
+    this_obj->send_pause_frame( uint16_t( pause_time ) );
   }
   catch ( const std::exception & e )
   {
@@ -886,21 +9080,21 @@ int ethernet_dpi_send_tx_frame ( const long long obj )
 
     return RET_FAILURE;
   }
+
+  return RET_SUCCESS;
 }
 
 
-int ethernet_dpi_get_received_frame_byte ( const long long obj,
-                                           const int offset,
-                                           char * const data )
+int ethernet_dpi_take_pause_frame_received_event ( const long long obj,
+                                                   unsigned char * const is_received )
 {
+  ETHDPI_PROBE1( dpi_take_pause_frame_received_event, obj );
+
   try
   {
-    ethernet_dpi * const this_obj = (ethernet_dpi *)obj;
-
-    if ( this_obj == NULL )
-      throw std::runtime_error( "Invalid obj parameter." );
+    ethernet_dpi * const this_obj = get_instance( obj );
 
-    this_obj->get_received_frame_byte( offset, data );
+    *is_received = this_obj->take_pause_frame_received_event() ? 1 : 0;
   }
   catch ( const std::exception & e )
   {
@@ -923,16 +9117,14 @@ int ethernet_dpi_get_received_frame_byte ( const long long obj,
 }
 
 
-int ethernet_dpi_discard_received_frame ( const long long obj )
+int ethernet_dpi_wait_for_activity ( const int timeout_in_milliseconds,
+                                     unsigned char * const is_activity )
 {
+  ETHDPI_PROBE1( dpi_wait_for_activity, timeout_in_milliseconds );
+
   try
   {
-    ethernet_dpi * const this_obj = (ethernet_dpi *)obj;
-
-    if ( this_obj == NULL )
-      throw std::runtime_error( "Invalid obj parameter." );
-
-    this_obj->discard_received_frame();
+    *is_activity = wait_for_activity( timeout_in_milliseconds ) ? 1 : 0;
   }
   catch ( const std::exception & e )
   {
@@ -953,3 +9145,65 @@ int ethernet_dpi_discard_received_frame ( const long long obj )
 
   return RET_SUCCESS;
 }
+
+
+// Tracing must not stop the simulation, so this routine does not report any errors.
+// Events for invalid handles are ignored, like ethernet_dpi_destroy() does.
+
+void ethernet_dpi_trace ( const long long obj,
+                          const int event_type,
+                          const int bd_index,
+                          const int addr,
+                          const int data )
+{
+  ETHDPI_PROBE1( dpi_trace, obj );
+
+  ethernet_dpi * const this_obj = find_instance( obj );
+
+  if ( this_obj == NULL )
+    return;
+
+  this_obj->trace( uint32_t( event_type ), uint32_t( bd_index ), uint32_t( addr ), uint32_t( data ) );
+}
+
+
+void ethernet_dpi_profile_dma_frame ( const long long obj,
+                                      const int is_rx,
+                                      const int byte_count,
+                                      const int queue_cycles,
+                                      const int dma_cycles,
+                                      const int beat_count,
+                                      const int ack_wait_cycles,
+                                      const int wait_state_cycles,
+                                      const int bus_error_count )
+{
+  ETHDPI_PROBE1( dpi_profile_dma_frame, obj );
+
+  ethernet_dpi * const this_obj = find_instance( obj );
+
+  if ( this_obj == NULL )
+    return;
+
+  try
+  {
+    this_obj->profile_dma_frame( is_rx != 0,
+                                 byte_count,
+                                 queue_cycles,
+                                 dma_cycles,
+                                 beat_count,
+                                 ack_wait_cycles,
+                                 wait_state_cycles,
+                                 bus_error_count );
+  }
+  catch ( const std::exception & e )
+  {
+    // There is no way to report an error to the caller, and the profile is not essential.
+    fprintf( stderr, "%s%s\n", ERROR_MSG_PREFIX, e.what() );
+    fflush( stderr );
+  }
+  catch ( ... )
+  {
+    fprintf( stderr, "%sUnexpected C++ exception.\n", ERROR_MSG_PREFIX );
+    fflush( stderr );
+  }
+}
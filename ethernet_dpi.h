@@ -0,0 +1,104 @@
+
+/* Public C++ interface of the Ethernet DPI module.
+
+   The Verilog side only needs the DPI functions declared in ethernet_dpi.v .
+   This header file declares the additional routines that the C++ simulation harness
+   (the code that drives the Verilator model) may want to call.
+
+   See the README file for information about this module.
+
+   Copyright (c) 2011 R. Diez
+
+   This source file may be used and distributed without
+   restriction provided that this copyright statement is not
+   removed from the file and that any derivative work contains
+   the original copyright notice and the associated disclaimer.
+
+   This source file is free software; you can redistribute it
+   and/or modify it under the terms of the GNU Lesser General
+   Public License version 3 as published by the Free Software Foundation.
+
+   This source is distributed in the hope that it will be
+   useful, but WITHOUT ANY WARRANTY; without even the implied
+   warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+   PURPOSE.  See the GNU Lesser General Public License for more
+   details.
+
+   You should have received a copy of the GNU Lesser General
+   Public License along with this source; if not, download it
+   from http://www.gnu.org/licenses/
+*/
+
+#ifndef ETHERNET_DPI_H_INCLUDED
+#define ETHERNET_DPI_H_INCLUDED
+
+#include <stddef.h>  // For size_t.
+#include <stdint.h>  // For uint32_t.
+#include <string>
+
+
+// Gives the Ethernet DPI module direct access to the simulated memory for the "backdoor DMA" mode,
+// see option "backdoor_dma" in the README file.
+//
+// The addresses are the same ones the simulated software writes to the Buffer Descriptors.
+// Data is transferred in address order, that is, the byte at 'addr' is the first byte of the Ethernet frame.
+// The routines may throw a C++ exception derived from std::exception in order to report an error.
+
+class ethernet_dpi_memory_accessor
+{
+public:
+  virtual ~ethernet_dpi_memory_accessor ( void ) {}
+
+  virtual void read_memory  ( uint32_t addr, void * buffer, size_t byte_count ) = 0;
+  virtual void write_memory ( uint32_t addr, const void * data, size_t byte_count ) = 0;
+};
+
+
+// Makes a memory accessor available under the given name. Call this routine before the simulation
+// creates the Ethernet DPI instances that refer to that name.
+// The accessor object must outlive all Ethernet DPI instances that use it.
+// Registering a NULL accessor removes the name again.
+
+void ethernet_dpi_register_memory_accessor ( const char * name, ethernet_dpi_memory_accessor * accessor );
+
+
+// Moves this process into a network namespace, see options "netns" and "userns" in the README file.
+// 'netns' is either "private", which creates a new user and network namespace, or the path of an existing
+// network namespace to join, like "/proc/1234/ns/net". 'userns' is the path of a user namespace to join first,
+// or NULL. All threads started afterwards inherit the namespaces.
+//
+// Entering a user namespace only works while the process has a single thread. If your simulation harness
+// starts other threads before the Verilog model creates the Ethernet DPI instances (for example,
+// with verilator --threads), call this routine at the beginning of main() with the same values as the options.
+// The instances will then find the process already in that namespace.
+// This routine throws a C++ exception derived from std::exception in order to report an error.
+
+void ethernet_dpi_enter_network_namespace ( const char * netns, const char * userns );
+
+
+// Saves and restores the network state of all Ethernet DPI instances, for use together with
+// the simulator's own checkpoint mechanism (for example, Verilator's --savable option).
+// The network state includes the frames received but not yet delivered to the simulation
+// and the frame being assembled for sending. See "Checkpoints" in the README file.
+//
+// When restoring in a new process, call ethernet_dpi_restore_state() after restoring the Verilator model,
+// because the simulator does not run the Verilog initial blocks again. The instances are then re-created
+// and the TAP interfaces are opened again, but they are not flushed.
+// These routines throw a C++ exception derived from std::exception in order to report an error.
+
+void ethernet_dpi_save_state    ( std::string * data );
+void ethernet_dpi_restore_state ( const std::string & data );
+
+
+// Blocks until any Ethernet DPI instance in this process has received a new frame, or until the timeout expires.
+// A negative timeout means no timeout. Sets *is_activity to 1 if a frame has arrived, and to 0 otherwise.
+// If no instance can receive any frames, it just sleeps for the timeout, and a negative timeout is then an error.
+// Returns 0 on success, or 1 on error (the error message has already been printed to stderr).
+//
+// Call this routine only while the simulated system is idle, for example, when the simulated CPU is waiting
+// for an interrupt and all Ethernet DPI instances assert their quiescent_o signal. See the README file for details.
+// This routine is also a DPI function, and its declaration must match the one that Verilator generates.
+
+extern "C" int ethernet_dpi_wait_for_activity ( int timeout_in_milliseconds, unsigned char * is_activity );
+
+#endif  // Include this header file only once.
@@ -55,6 +55,17 @@
 `define ETHDPI_BUFFER_DESCRIPTORS_BEGIN `ETHDPI_ADDR_WIDTH'h400  // The Tx descriptors come first, then the Rx. The boundary is at ethreg_tx_bd_num.
 `define ETHDPI_BUFFER_DESCRIPTORS_END   `ETHDPI_ADDR_WIDTH'h800  // One address beyond the end.
 
+// Extension registers. They do not exist in the real Ethernet core, and they are only decoded
+// if parameter ENABLE_EXTENSION_REGISTERS is set. Otherwise, accessing them yields a bus error as usual.
+`define ETHDPI_EXT_REGISTERS_BEGIN `ETHDPI_ADDR_WIDTH'h200
+`define ETHDPI_EXT_INTMOD_FRAMES   `ETHDPI_ADDR_WIDTH'h200  // Interrupt moderation: number of frames to wait for (0 disables moderation).
+`define ETHDPI_EXT_INTMOD_CYCLES   `ETHDPI_ADDR_WIDTH'h204  // Interrupt moderation: maximum number of clock cycles to wait for (0 means no limit).
+`define ETHDPI_EXT_BD_COUNT        `ETHDPI_ADDR_WIDTH'h208  // Total number of Buffer Descriptors in the Tx and Rx rings (0 means the standard 128).
+`define ETHDPI_EXT_BD_INDEX        `ETHDPI_ADDR_WIDTH'h20C  // Index of the Buffer Descriptor accessed through EXT_BD_FLAGS and EXT_BD_ADDRESS.
+`define ETHDPI_EXT_BD_FLAGS        `ETHDPI_ADDR_WIDTH'h210  // First word (flags) of the Buffer Descriptor selected by EXT_BD_INDEX.
+`define ETHDPI_EXT_BD_ADDRESS      `ETHDPI_ADDR_WIDTH'h214  // Second word (buffer address) of the Buffer Descriptor selected by EXT_BD_INDEX.
+`define ETHDPI_EXT_REGISTERS_END   `ETHDPI_ADDR_WIDTH'h218  // One address beyond the end.
+
 // MODER register
 `define ETHDPI_MODER_RXEN     `ETHDPI_DATA_WIDTH'h00000001  // Receive Enable
 `define ETHDPI_MODER_TXEN     `ETHDPI_DATA_WIDTH'h00000002  // Transmit Enable
@@ -78,8 +89,8 @@
 // Definitions for the INT (Interrupt Source) and INT_MASK registers.
 `define ETHDPI_INT_RESERVED 31:7
 `define ETHDPI_INT_ALL 6:0
-`define ETHDPI_INT_RXC  6  // A Control Frame was received. Always 0, as this implementation does not support receiving Ethernet flow control frames.
-`define ETHDPI_INT_TXC  5  // A Control Frame was transmitted. Always 0, as this implementation does not support sending Ethernet flow control frames.
+`define ETHDPI_INT_RXC  6  // A PAUSE Control Frame was received. Only if the RXFLOW bit in the CTRLMODER register is set.
+`define ETHDPI_INT_TXC  5  // A PAUSE Control Frame requested with the TXPAUSERQ bit in the TX_CTRL register was transmitted.
 `define ETHDPI_INT_BUSY 4  // A frame was discarded due to insufficient number of receive buffers.
                            // Always 0, as this implementation does not support this feature. Ethernet Frames will only be read
                            // from the TAP interface if there is an available Buffer Descriptor. If the TAP interface's internal buffer
@@ -88,11 +99,18 @@
 `define ETHDPI_INT_RXF  2  // Receive Frame (frame has been received).
 `define ETHDPI_INT_TXE  1  // Transmit Error, can never happen.
 `define ETHDPI_INT_TXB  0  // Transmit Buffer (frame has been transmitted).
+`define ETHDPI_INT_MODERATED_MASK ( ( 1 << `ETHDPI_INT_RXF ) | ( 1 << `ETHDPI_INT_TXB ) )  // Interrupt sources affected by interrupt moderation.
 
 // PACKETLEN register.
 `define ETHDPI_PACKETLEN_MINFL 31:16
 `define ETHDPI_PACKETLEN_MAXFL 15:0
 
+// CTRLMODER register.
+`define ETHDPI_CTRLMODER_RESERVED 31:3
+`define ETHDPI_CTRLMODER_TXFLOW   2  // Allow sending PAUSE Control Frames.
+`define ETHDPI_CTRLMODER_RXFLOW   1  // Pause the transmitter upon reception of a PAUSE Control Frame.
+`define ETHDPI_CTRLMODER_PASSALL  0  // Pass all received Control Frames to the Rx Buffer Descriptors.
+
 // TX_CTRL register.
 `define ETHDPI_TX_CTRL_RESERVED 31:17
 `define ETHDPI_TX_CTRL_TXPAUSERQ 16
@@ -133,14 +151,34 @@
 `define ETHDPI_RXBD_OR    6      // Overrun during reception (can never happen).
 `define ETHDPI_RXBD_IS    5      // Invalid Symbol (can never happen).
 `define ETHDPI_RXBD_DN    4      // Dribble Nibble (received frame cannot be divided by 8, an extra nibble was added) (can never happen).
-`define ETHDPI_RXBD_TL    3      // Too Long (bigger than the current PAKETLEN register) (can never happen).
+`define ETHDPI_RXBD_TL    3      // Too Long (bigger than the current PAKETLEN register and HUGEN is not set). The frame is truncated.
 `define ETHDPI_RXBD_SF    2      // Short Frame (smaller than PAKETLEN register) (can never happen).
 `define ETHDPI_RXBD_CRC   1      // CRC error (can never happen).
 `define ETHDPI_RXBD_LC    0      // Late Collision (collision detected during reception) (can never happen).
-`define ETHDPI_RXBD_CLEAR_ERRORS_MASK  ~( `ETHDPI_RXBD_OR | `ETHDPI_RXBD_IS | `ETHDPI_RXBD_DN | `ETHDPI_RXBD_TL | `ETHDPI_RXBD_SF | `ETHDPI_RXBD_CRC | `ETHDPI_RXBD_LC )
+`define ETHDPI_RXBD_CLEAR_ERRORS_MASK  ~( ( 32'h1 << `ETHDPI_RXBD_OR  ) | \
+                                           ( 32'h1 << `ETHDPI_RXBD_IS  ) | \
+                                           ( 32'h1 << `ETHDPI_RXBD_DN  ) | \
+                                           ( 32'h1 << `ETHDPI_RXBD_TL  ) | \
+                                           ( 32'h1 << `ETHDPI_RXBD_SF  ) | \
+                                           ( 32'h1 << `ETHDPI_RXBD_CRC ) | \
+                                           ( 32'h1 << `ETHDPI_RXBD_LC  ) )
 
 `define ETHDPI_EXPECTED_WB_SEL_VALUE 4'b1111
-`define ETHDPI_M_WB_SEL_VALUE        4'b1111
+
+// Wishbone B3 registered feedback cycle type identifiers (CTI) and burst type extensions (BTE).
+`define ETHDPI_WB_CTI_CLASSIC        3'b000  // Classic cycle.
+`define ETHDPI_WB_CTI_INCR_BURST     3'b010  // Incrementing burst cycle.
+`define ETHDPI_WB_CTI_END_OF_BURST   3'b111  // Last beat of a burst.
+`define ETHDPI_WB_BTE_LINEAR         2'b00   // Linear burst.
+
+// Event types for ethernet_dpi_trace(). They must match the TRACE_xxx constants in ethernet_dpi.cpp .
+`define ETHDPI_TRACE_TX_BD_START       1  // addr: buffer address, data: frame length.
+`define ETHDPI_TRACE_TX_DMA_READ       2  // addr: memory address, data: the 32-bit word read.
+`define ETHDPI_TRACE_TX_BD_DONE        3  // data: frame length.
+`define ETHDPI_TRACE_RX_BD_START       4  // addr: buffer address, data: number of bytes to write.
+`define ETHDPI_TRACE_RX_DMA_WRITE      5  // addr: memory address, data: the 32-bit word written.
+`define ETHDPI_TRACE_RX_BD_DONE        6  // data: the new Rx Buffer Descriptor flags.
+`define ETHDPI_TRACE_RX_FRAME_REJECTED 7  // data: frame length.
 
 
 module ethernet_dpi #(
@@ -150,8 +188,41 @@ module ethernet_dpi #(
                       // Whether the C++ side prints informational messages to stdout.
                       // Error messages cannot be turned off and get printed to stderr.
                       print_informational_messages = 1,
+
+                      // Options for the C++ side, like "key1=value1,key2=value2". See the README file for the list of options.
+                      dpi_options = "",
+
+                      // Whether to record the Buffer Descriptor processing and every 32-bit word transferred over DMA
+                      // in the binary trace ring on the C++ side. This has no effect unless dpi_options
+                      // sets the "trace" option, see the README file.
                       TRACE_DMA_TRAFFIC = 0,
-                      INSERT_WAIT_STATE_BETWEEN_DMA_ACCESSES = 1
+
+                      // Whether to measure the DMA costs of every frame (cycles waiting for the state machine,
+                      // DMA duration, Wishbone acknowledge waits, wait states and bus errors) and report them
+                      // to the C++ side, which prints a profile split by direction and frame size at the end.
+                      PROFILE_DMA = 0,
+
+                      INSERT_WAIT_STATE_BETWEEN_DMA_ACCESSES = 1,
+
+                      // Maximum number of 32-bit beats in a DMA burst on the Wishbone master interface.
+                      // The default of 1 generates only classic Wishbone cycles, which every interconnect supports.
+                      // Greater values generate registered feedback incrementing bursts (see m_wb_cti_o and m_wb_bte_o).
+                      // The optional wait state (see INSERT_WAIT_STATE_BETWEEN_DMA_ACCESSES) is then only inserted between bursts.
+                      MAX_DMA_BURST_LENGTH = 1,
+
+                      // Data width of the Wishbone master interface used for DMA transfers, either 32 or 64 bits.
+                      // The Wishbone slave interface to the Ethernet Controller registers is always 32 bits wide.
+                      // Memory is assumed to be big endian, so the byte at the lowest address travels on the most significant byte lane.
+                      M_WB_DATA_WIDTH = 32,
+
+                      // Whether the extension registers (see ETHDPI_EXT_REGISTERS_BEGIN) are available.
+                      // They are off by default, so that the register map matches the real Ethernet core.
+                      ENABLE_EXTENSION_REGISTERS = 0,
+
+                      // Number of additional Buffer Descriptors beyond the standard 128, only reachable through
+                      // the extension registers (see ETHDPI_EXT_BD_COUNT). The additional descriptors are not
+                      // cleared on reset, so that large values do not slow down the simulation.
+                      EXTENDED_BUFFER_DESCRIPTOR_COUNT = 0
                      )
                     (
                      // WISHBONE common
@@ -171,22 +242,30 @@ module ethernet_dpi #(
 
                      // WISHBONE master, used by the Ethernet Controller to access the main memory in a DMA fashion.
                      output wire [`ETHDPI_ADDR_WIDTH-1:0] m_wb_adr_o,
-                     output wire [3:0]                    m_wb_sel_o,
+                     output wire [M_WB_DATA_WIDTH/8-1:0]  m_wb_sel_o,
                      output wire                          m_wb_we_o,
-                     output wire [`ETHDPI_DATA_WIDTH-1:0] m_wb_dat_o,
-                     input wire [`ETHDPI_DATA_WIDTH-1:0]  m_wb_dat_i,
+                     output wire [M_WB_DATA_WIDTH-1:0]    m_wb_dat_o,
+                     input wire [M_WB_DATA_WIDTH-1:0]     m_wb_dat_i,
                      output wire                          m_wb_cyc_o,
                      output wire                          m_wb_stb_o,
                      input wire                           m_wb_ack_i,
                      input wire                           m_wb_err_i,
+                     output wire [2:0]                    m_wb_cti_o,  // Only used if MAX_DMA_BURST_LENGTH > 1, otherwise always classic cycles.
+                     output wire [1:0]                    m_wb_bte_o,
 
-                     output wire                          int_o  // Ethernet interrupt request
+                     output wire                          int_o,  // Ethernet interrupt request
+                     output wire                          quiescent_o  // Optional, see update_quiescence_flag.
                     );
 
    // --- DPI definitions begin ---
+
+   // None of these functions is declared 'pure', as all of them have side effects, and the simulator could otherwise
+   // skip or merge some calls. None of them needs 'context' either, as they never call back into Verilog.
+   // Calls for different instances may run at the same time, see "Multi-threaded simulations" in the README file.
    import "DPI-C" function int ethernet_dpi_create ( input string   tap_interface_name,
                                                      input bit      print_informational_messages,
                                                      input string   informational_message_prefix,
+                                                     input string   options,
                                                      output longint obj );
 
    // It is not necessary to call ethernet_dpi_destroy(). However, calling it
@@ -225,6 +304,82 @@ module ethernet_dpi #(
    // ethernet_dpi_tick() will then load the next one from the TAP interface.
    import "DPI-C" function int ethernet_dpi_discard_received_frame ( input longint obj );
 
+
+   // ------ Routines for the backdoor DMA mode ------
+
+   // The backdoor DMA mode is enabled with the "backdoor_dma" option. In this mode, frames are transferred
+   // to and from the simulated memory in a single step through a memory accessor registered by the C++ harness,
+   // instead of over the Wishbone master interface.
+   import "DPI-C" function int ethernet_dpi_is_backdoor_dma_enabled ( input  longint obj,
+                                                                      output bit     is_enabled );
+
+   // Reads the frame from memory and sends it, there is no need to call ethernet_dpi_new_tx_frame() beforehand.
+   import "DPI-C" function int ethernet_dpi_backdoor_send_tx_frame ( input longint obj,
+                                                                     input int     addr,
+                                                                     input int     byte_count );
+
+   // Writes the first byte_count bytes of the received frame to memory, padded up to the next 32-bit boundary.
+   // Call ethernet_dpi_discard_received_frame() afterwards.
+   import "DPI-C" function int ethernet_dpi_backdoor_write_received_frame ( input longint obj,
+                                                                            input int     addr,
+                                                                            input int     byte_count );
+
+   // ------ Routines for checkpoints ------
+
+   // Saves or restores the network state of this instance (pending frames and so on) to or from a file.
+   // The rest of the state is part of the Verilog model and must be saved by the simulator.
+   // Restoring re-creates the instance if necessary, without flushing the TAP interface.
+   import "DPI-C" function int ethernet_dpi_save ( input longint obj,
+                                                   input string  filename );
+
+   import "DPI-C" function int ethernet_dpi_restore ( input longint obj,
+                                                      input string  filename );
+
+   // ------ Routines for Ethernet flow control ------
+
+   // Passes the MODER and CTRLMODER registers and the MAC address to the C++ side, which handles the received PAUSE frames,
+   // holds off ready_to_send while the transmitter is paused, and builds the TAP receive filter (option "rx_filter=auto").
+   // The MAC address has the first byte in bits 47:40.
+   import "DPI-C" function int ethernet_dpi_configure_mac ( input longint obj,
+                                                            input int     moder,
+                                                            input int     ctrlmoder,
+                                                            input longint mac_addr );
+
+   import "DPI-C" function int ethernet_dpi_send_pause_frame ( input longint obj,
+                                                               input int     pause_time );
+
+   // Returns whether a PAUSE frame has been received since the last call.
+   import "DPI-C" function int ethernet_dpi_take_pause_frame_received_event ( input  longint obj,
+                                                                              output bit     is_received );
+
+   // ------ Routines for idle simulations ------
+
+   // Blocks until any instance in the process has a new received frame, or until the timeout expires.
+   // A negative timeout means no timeout. This is a process-wide routine, it does not need an obj argument.
+   import "DPI-C" function int ethernet_dpi_wait_for_activity ( input  int timeout_in_milliseconds,
+                                                                output bit is_activity );
+
+   // ------ Routines for tracing ------
+
+   // Records an event in the trace ring of this instance, if the "trace" option is set. This is cheap,
+   // the event is stored as a binary record, and a background thread renders it as text later on.
+   import "DPI-C" function void ethernet_dpi_trace ( input longint obj,
+                                                     input int     event_type,
+                                                     input int     bd_index,
+                                                     input int     addr,
+                                                     input int     data );
+
+   // Adds the DMA costs of a frame to the profile of this instance, see PROFILE_DMA.
+   import "DPI-C" function void ethernet_dpi_profile_dma_frame ( input longint obj,
+                                                                 input int     is_rx,
+                                                                 input int     byte_count,
+                                                                 input int     queue_cycles,
+                                                                 input int     dma_cycles,
+                                                                 input int     beat_count,
+                                                                 input int     ack_wait_cycles,
+                                                                 input int     wait_state_cycles,
+                                                                 input int     bus_error_count );
+
    // --- DPI definitions end ---
 
    // ---- Ethernet Controller registers begin.
@@ -246,33 +401,207 @@ module ethernet_dpi #(
    reg [31:0] ethreg_ctrlmoder;
    //  ---- Ethernet Controller registers end.
 
-   localparam buffer_descriptor_count = 128;
+   // ---- Extension registers begin.
+   reg [31:0] ethreg_ext_intmod_frames;
+   reg [31:0] ethreg_ext_intmod_cycles;
+   reg [31:0] ethreg_ext_bd_count;
+   reg [31:0] ethreg_ext_bd_index;
+   // ---- Extension registers end.
+
+   // Interrupt moderation state. The state machine sets the event flags whenever a frame completion
+   // raises the TXB or RXF interrupt source bit, and update_interrupt_moderation() consumes them
+   // in the next clock cycle.
+   bit        intmod_tx_frame_event;
+   bit        intmod_rx_frame_event;
+   reg [31:0] intmod_frame_count;  // Frames completed since the last interrupt was acknowledged.
+   reg [31:0] intmod_cycle_count;  // Clock cycles since the first pending frame event.
+   bit        intmod_released;     // Whether int_o may be asserted for the moderated interrupt sources.
 
-   reg  [31:0] buffer_descriptor_flags    [ buffer_descriptor_count-1 : 0 ];
-   reg  [31:0] buffer_descriptor_addresses[ buffer_descriptor_count-1 : 0 ];
+   bit is_reset_asserted;  // So that the C++ side is only reconfigured on the first reset cycle.
+
+   localparam buffer_descriptor_count = 128;  // Number of Buffer Descriptors in the standard address window.
+
+   // The extended Buffer Descriptors follow the standard ones in the same memory, but only the standard ones
+   // are cleared on reset. The software must initialise all descriptors in the extended ring before use.
+   localparam buffer_descriptor_table_size = buffer_descriptor_count + EXTENDED_BUFFER_DESCRIPTOR_COUNT;
+
+   localparam M_WB_SEL_WIDTH     = M_WB_DATA_WIDTH / 8;   // Number of bytes per DMA beat.
+   localparam DMA_WORDS_PER_BEAT = M_WB_DATA_WIDTH / 32;  // Number of 32-bit words per DMA beat.
+
+   reg  [31:0] buffer_descriptor_flags    [ buffer_descriptor_table_size-1 : 0 ];
+   reg  [31:0] buffer_descriptor_addresses[ buffer_descriptor_table_size-1 : 0 ];
+   int         buffer_descriptor_ring_size;  // Tx Buffer Descriptors first, then the Rx ones up to this limit. See ETHDPI_EXT_BD_COUNT.
 
    longint   obj;  // There can be several instances of this module, and each one has a diferent obj value,
-                   // which is a pointer to a class instance on the C++ side.
+                   // which is a handle to a class instance on the C++ side. The handle is not a pointer,
+                   // so it remains valid after restoring a checkpoint.
 
-   typedef enum { state_idle,
-                  state_waiting_for_dma_read_to_complete,
-                  state_wait_state_between_dma_reads,
-                  state_waiting_for_dma_write_to_complete,
-                  state_wait_state_between_dma_writes
-                } state_machine_state_enum;
+   // The Tx and Rx DMA channels work independently of each other, so that a frame can be received
+   // while another one is being sent. They share the Wishbone master interface, see arbitrate_dma_bus().
+   typedef enum { channel_idle,
+                  channel_waiting_for_bus,             // The channel is transferring a frame and needs the next DMA access.
+                  channel_waiting_for_dma_to_complete  // The channel owns the Wishbone master interface.
+                } dma_channel_state_enum;
 
-   state_machine_state_enum current_state;
+   dma_channel_state_enum tx_channel_state;
+   dma_channel_state_enum rx_channel_state;
+   bit last_dma_grant_was_rx;  // For the round-robin arbitration between both channels.
+   bit dma_bus_wait_state;     // Whether the Wishbone master interface is in a wait state, see release_dma_bus().
 
    int current_tx_bd_index;
    int current_rx_bd_index;
-   int current_dma_addr_offset;
+   int tx_dma_addr_offset;
+   int rx_dma_addr_offset;
+   int dma_burst_beats_left;  // Including the current one.
+
+   // Which 32-bit words of the data bus the current DMA beat transfers. On a 64-bit bus,
+   // the first beat may start on the second word, as Buffer Descriptor addresses need only be 32-bit aligned.
+   // Slot 0 is the word at the lowest address, that is, the most significant word on the bus.
+   int dma_beat_first_word_slot;
+   int dma_beat_word_count;
    bit received_frame_mac_addr_miss_flag;
+   bit received_frame_too_long_flag;
+   int rx_dma_byte_count;  // Number of bytes of the received frame to write to memory, see ETHDPI_RXBD_TL.
+   bit backdoor_dma_enabled;  // Set once at the beginning, see ethernet_dpi_is_backdoor_dma_enabled().
+
+   // DMA cost profile, see PROFILE_DMA and update_dma_profile(). Index 0 is the Tx channel, and index 1 the Rx channel.
+   int dma_profile_queue_wait_count [0:1];  // Cycles the next frame has been waiting for the channel.
+   int dma_profile_queue_cycle_count[0:1];  // The queue cycles of the frame being transferred.
+   int dma_profile_cycle_count      [0:1];
+   int dma_profile_beat_count       [0:1];
+   int dma_profile_ack_wait_count   [0:1];
+   int dma_profile_wait_state_count [0:1];
+   bit dma_profile_report_pending   [0:1];
+   int dma_profile_byte_count       [0:1];
 
    `define ETHDPI_ERROR_PREFIX       { module_name, " error: " }
    `define ETHDPI_INFORMATION_PREFIX { module_name, ": " }
    `define ETHDPI_TRACE_PREFIX       { module_name, ": " }
 
 
+   task automatic trace_dma_event;
+      input int        event_type;
+      input int        bd_index;
+      input reg [31:0] addr;
+      input reg [31:0] data;
+      begin
+         if ( TRACE_DMA_TRAFFIC )
+           ethernet_dpi_trace( obj, event_type, bd_index, addr, data );
+      end
+   endtask
+
+
+   // Counts the DMA costs for the profile, see PROFILE_DMA. This task must be called before step_state_machine(),
+   // so that the channels can take the queue cycle counts and reset them in the same clock cycle.
+   // The frame costs are reported one clock cycle after the frame has completed, once the last counts have been updated.
+
+   task automatic update_dma_profile ( input int received_frame_byte_count );
+      begin
+         if ( PROFILE_DMA )
+           begin
+              bit is_tx_frame_waiting = 0 != ( ethreg_moder & `ETHDPI_MODER_TXEN ) &&
+                                        ethreg_tx_bd_num > 0 &&
+                                        buffer_descriptor_flags[ current_tx_bd_index ][ `ETHDPI_TXBD_RD ];
+
+              update_dma_channel_profile( 0, tx_channel_state, is_tx_frame_waiting );
+              update_dma_channel_profile( 1, rx_channel_state, received_frame_byte_count > 0 );
+           end
+      end
+   endtask
+
+
+   task automatic update_dma_channel_profile;
+      input bit                    is_rx;
+      input dma_channel_state_enum channel_state;
+      input bit                    is_frame_waiting;
+      begin
+         if ( is_frame_waiting && channel_state == channel_idle )
+           dma_profile_queue_wait_count[ is_rx ] <= dma_profile_queue_wait_count[ is_rx ] + 1;
+         else
+           dma_profile_queue_wait_count[ is_rx ] <= 0;
+
+         if ( dma_profile_report_pending[ is_rx ] )
+           begin
+              ethernet_dpi_profile_dma_frame( obj,
+                                              { 31'b0, is_rx },
+                                              dma_profile_byte_count       [ is_rx ],
+                                              dma_profile_queue_cycle_count[ is_rx ],
+                                              dma_profile_cycle_count      [ is_rx ],
+                                              dma_profile_beat_count       [ is_rx ],
+                                              dma_profile_ack_wait_count   [ is_rx ],
+                                              dma_profile_wait_state_count [ is_rx ],
+                                              0 );
+
+              dma_profile_report_pending  [ is_rx ] <= 0;
+              dma_profile_cycle_count     [ is_rx ] <= 0;
+              dma_profile_beat_count      [ is_rx ] <= 0;
+              dma_profile_ack_wait_count  [ is_rx ] <= 0;
+              dma_profile_wait_state_count[ is_rx ] <= 0;
+           end
+         else if ( channel_state == channel_waiting_for_dma_to_complete )
+           begin
+              dma_profile_cycle_count[ is_rx ] <= dma_profile_cycle_count[ is_rx ] + 1;
+
+              if ( m_wb_ack_i )
+                dma_profile_beat_count[ is_rx ] <= dma_profile_beat_count[ is_rx ] + 1;
+              else if ( ! m_wb_err_i )
+                dma_profile_ack_wait_count[ is_rx ] <= dma_profile_ack_wait_count[ is_rx ] + 1;
+           end
+         else if ( channel_state == channel_waiting_for_bus )
+           begin
+              // Waiting for the other channel's DMA access does not count as a wait state.
+              dma_profile_cycle_count[ is_rx ] <= dma_profile_cycle_count[ is_rx ] + 1;
+
+              if ( dma_bus_wait_state )
+                dma_profile_wait_state_count[ is_rx ] <= dma_profile_wait_state_count[ is_rx ] + 1;
+           end
+      end
+   endtask
+
+
+   // Called when a channel takes a frame, in order to remember how long it has been waiting.
+
+   task automatic start_dma_profile ( input bit is_rx );
+      begin
+         if ( PROFILE_DMA )
+           begin
+              dma_profile_queue_cycle_count[ is_rx ] <= dma_profile_queue_wait_count[ is_rx ];
+              dma_profile_queue_wait_count [ is_rx ] <= 0;
+           end
+      end
+   endtask
+
+
+   task automatic finish_dma_profile ( input bit is_rx, input int byte_count );
+      begin
+         if ( PROFILE_DMA )
+           begin
+              dma_profile_report_pending[ is_rx ] <= 1;
+              dma_profile_byte_count    [ is_rx ] <= byte_count;
+           end
+      end
+   endtask
+
+
+   // A bus error stops the simulation, so the profile of the failed frame is reported straight away,
+   // and the C++ side prints it when the simulation finishes.
+
+   task automatic report_dma_bus_error ( input bit is_rx, input int byte_count );
+      begin
+         if ( PROFILE_DMA )
+           ethernet_dpi_profile_dma_frame( obj,
+                                           { 31'b0, is_rx },
+                                           byte_count,
+                                           dma_profile_queue_cycle_count[ is_rx ],
+                                           dma_profile_cycle_count      [ is_rx ] + 1,
+                                           dma_profile_beat_count       [ is_rx ],
+                                           dma_profile_ack_wait_count   [ is_rx ],
+                                           dma_profile_wait_state_count [ is_rx ],
+                                           1 );
+      end
+   endtask
+
+
    // Thin wrapper around ethernet_dpi_get_received_frame_byte() that checks for any error returned.
    task automatic get_received_frame_byte;
       input  int  offset;
@@ -340,6 +669,189 @@ module ethernet_dpi #(
    endtask;
 
 
+   // Writes wb_dat_i to one of the 2 words of a Buffer Descriptor, either through the standard
+   // address window or through the extension registers.
+
+   task automatic write_buffer_descriptor_word;
+      input int bd_index;
+      input bit is_first_word_in_bd;
+
+      bit is_tx;
+      bit is_bd_enabled;
+      begin
+         is_tx = ( bd_index < ethreg_tx_bd_num );
+
+         /* $display( "%sWriting to Buffer Descriptor %d, is first word: %d, is tx: %d, data: 0x%08X.",
+                   `ETHDPI_TRACE_PREFIX, bd_index, is_first_word_in_bd, is_tx, wb_dat_i ); */
+
+         if ( is_tx )
+           begin
+              is_bd_enabled = ( 0 != ( ethreg_moder & `ETHDPI_MODER_TXEN ) ) &&
+                              buffer_descriptor_flags[ bd_index ][ `ETHDPI_TXBD_RD ];
+           end
+         else
+           begin
+              is_bd_enabled = ( 0 != ( ethreg_moder & `ETHDPI_MODER_RXEN ) &&
+                              buffer_descriptor_flags[ bd_index ][ `ETHDPI_RXBD_RD ] );
+           end
+
+         if ( is_bd_enabled )
+           begin
+              $display( "%sThe client is trying to update a Buffer Descriptor which has been previously enabled for transmission or reception and could possibly be in use by the Ethernet Controller. This is probably an error in the client.", `ETHDPI_ERROR_PREFIX );
+              $finish;
+           end
+
+         if ( is_first_word_in_bd )
+           begin
+              if ( is_tx )
+                begin
+                   if ( 0 != wb_dat_i[`ETHDPI_TXBD_RESERVED] )
+                     begin
+                        $display( "%sThe client is trying to set reserved bits in the Tx Buffer Descriptor, which is probably an error.", `ETHDPI_ERROR_PREFIX );
+                        $finish;
+                     end
+
+                   /* The PAD bit is ignored, see the README file for details.
+                   if ( 0 != ( wb_dat_i[`ETHDPI_TXBD_PAD] ) )
+                     begin
+                        $display( "%sThe client is setting the PAD bit in the Tx Buffer Descriptor, which is not supported yet.", `ETHDPI_ERROR_PREFIX );
+                        $finish;
+                     end */
+
+                   // There is a global CRC flag in the MODER register and another CRC flag in the Tx Buffer Descriptor,
+                   // and it is not clear in the Ethernet core documentation (as of dec 2011) how those two work together.
+                   // However, I've seen assignment "CrcEnIn(r_CrcEn | PerPacketCrcEn)" in the Verilog source code,
+                   // so I guess either flag will enable CRC generation.
+                   if ( 0 == ( wb_dat_i[`ETHDPI_TXBD_CRC] ) &&
+                        0 == ( ethreg_moder & `ETHDPI_MODER_CRCEN ) )
+                     begin
+                        $display( "%sThe client is trying to send an Ethernet frame with an already-calculated CRC at the end, as both the TXBD_CRC bit in the Tx Buffer Descriptor and the CRCEN bit in the Mode Register (MODER) are not set. This is however not supported yet, the Ethernet Controller must be configured to generate the CRC itself.", `ETHDPI_ERROR_PREFIX );
+                        $finish;
+                     end
+
+                   /* $display( "%sSetting Tx Buffer Descriptor: data len: %d",
+                             `ETHDPI_TRACE_PREFIX,
+                             wb_dat_i[`ETHDPI_TXBD_LEN] ); */
+                end
+              else
+                begin
+                   if ( 0 != wb_dat_i[`ETHDPI_RXBD_RESERVED] )
+                     begin
+                        $display( "%sThe client is trying to set reserved bits in the Rx Buffer Descriptor, which is probably an error. The addr was: 0x%08h, BD index was: 0x%08h, the data was: 0x%08h",
+                                  `ETHDPI_ERROR_PREFIX, wb_adr_i, bd_index, wb_dat_i );
+                        $finish;
+                     end
+
+                   /* $display( "%sSetting Rx Buffer Descriptor: data len: %d",
+                             `ETHDPI_TRACE_PREFIX,
+                             wb_dat_i[`ETHDPI_RXBD_LEN] ); */
+                end
+
+              buffer_descriptor_flags[ bd_index ] <= wb_dat_i;
+           end
+         else
+           begin
+              /* $display( "%sSet the Buffer Descriptor to address: 0x%08X.",
+                        `ETHDPI_TRACE_PREFIX,
+                        wb_dat_i ); */
+
+              if ( 0 != ( wb_dat_i % 4 ) )
+                begin
+                   $display( "%sThe client is trying to write an unaligned memory address to a Buffer Descriptor, but this Ethernet simulation model does not support unaligned memory addresses.", `ETHDPI_ERROR_PREFIX );
+                   $finish;
+                end
+
+              buffer_descriptor_addresses[ bd_index ] <= wb_dat_i;
+           end
+      end
+   endtask
+
+
+   task automatic wishbone_write_extension_register;
+      begin
+         unique case ( wb_adr_i )
+           // The interrupt moderation registers can be written to at any time, even if the TXEN or RXEN flags are set,
+           // so that the client software can tune the interrupt moderation parameters under load.
+           `ETHDPI_EXT_INTMOD_FRAMES:  ethreg_ext_intmod_frames <= wb_dat_i;
+           `ETHDPI_EXT_INTMOD_CYCLES:  ethreg_ext_intmod_cycles <= wb_dat_i;
+
+           `ETHDPI_EXT_BD_COUNT:
+             begin
+                int new_ring_size = ( wb_dat_i == 0 ) ? buffer_descriptor_count : wb_dat_i;
+
+                if ( 0 != ( ethreg_moder & ( `ETHDPI_MODER_TXEN | `ETHDPI_MODER_RXEN ) ) )
+                  begin
+                     $display( "%sThe client is trying to change the number of Buffer Descriptors (extension register EXT_BD_COUNT) after the TXEN or RXEN flag has been set.",
+                               `ETHDPI_ERROR_PREFIX );
+                     $finish;
+                  end
+                else if ( wb_dat_i > buffer_descriptor_table_size ||
+                          new_ring_size < buffer_descriptor_count ||
+                          new_ring_size < ethreg_tx_bd_num )
+                  begin
+                     $display( "%sThe client is trying to write the out-of-range value %0d to extension register EXT_BD_COUNT. The value must be 0 or between %0d and %0d, and not less than TX_BD_NUM.",
+                               `ETHDPI_ERROR_PREFIX, wb_dat_i, buffer_descriptor_count, buffer_descriptor_table_size );
+                     $finish;
+                  end
+                else
+                  begin
+                     ethreg_ext_bd_count <= wb_dat_i;
+                     buffer_descriptor_ring_size <= new_ring_size;
+
+                     // Reset the buffer indexes, like writing to TX_BD_NUM does.
+                     current_tx_bd_index <= 0;
+                     current_rx_bd_index <= ethreg_tx_bd_num;
+                  end
+             end
+
+           `ETHDPI_EXT_BD_INDEX:
+             if ( wb_dat_i >= buffer_descriptor_table_size )
+               begin
+                  $display( "%sThe client is trying to select Buffer Descriptor %0d with extension register EXT_BD_INDEX, but there are only %0d of them.",
+                            `ETHDPI_ERROR_PREFIX, wb_dat_i, buffer_descriptor_table_size );
+                  $finish;
+               end
+             else
+               ethreg_ext_bd_index <= wb_dat_i;
+
+           `ETHDPI_EXT_BD_FLAGS:    write_buffer_descriptor_word( ethreg_ext_bd_index, 1 );
+           `ETHDPI_EXT_BD_ADDRESS:  write_buffer_descriptor_word( ethreg_ext_bd_index, 0 );
+
+           default:
+             begin
+                $display( "%sInvalid Wishbone address 0x%08X in the extension register area, write cycle. Reported as a bus error by asserting wb_err_o.",
+                          `ETHDPI_ERROR_PREFIX, wb_adr_i );
+                wb_ack_o <= 0;
+                wb_err_o <= 1;
+             end
+         endcase;
+      end
+   endtask
+
+
+   task automatic wishbone_read_extension_register;
+      begin
+         unique case ( wb_adr_i )
+           `ETHDPI_EXT_INTMOD_FRAMES:  wb_dat_o <= ethreg_ext_intmod_frames;
+           `ETHDPI_EXT_INTMOD_CYCLES:  wb_dat_o <= ethreg_ext_intmod_cycles;
+           `ETHDPI_EXT_BD_COUNT:       wb_dat_o <= ethreg_ext_bd_count;
+           `ETHDPI_EXT_BD_INDEX:       wb_dat_o <= ethreg_ext_bd_index;
+           `ETHDPI_EXT_BD_FLAGS:       wb_dat_o <= buffer_descriptor_flags    [ ethreg_ext_bd_index ];
+           `ETHDPI_EXT_BD_ADDRESS:     wb_dat_o <= buffer_descriptor_addresses[ ethreg_ext_bd_index ];
+
+           default:
+             begin
+                $display( "%sInvalid Wishbone address 0x%08X in the extension register area, read cycle. Reported as a bus error by asserting wb_err_o.",
+                          `ETHDPI_ERROR_PREFIX, wb_adr_i );
+                wb_dat_o <= {`ETHDPI_DATA_WIDTH{1'bx}};
+                wb_ack_o <= 0;
+                wb_err_o <= 1;
+             end
+         endcase;
+      end
+   endtask
+
+
    task automatic wishbone_write;
       begin
          // $display( "%sWishbone write to wb_adr_i=0x%08X, data=0x%08X.", `ETHDPI_TRACE_PREFIX, wb_adr_i, wb_dat_i );
@@ -348,7 +860,8 @@ module ethernet_dpi #(
          unique case ( wb_adr_i )
            `ETHDPI_MODER,
            `ETHDPI_INT,
-           `ETHDPI_INT_MASK:
+           `ETHDPI_INT_MASK,
+           `ETHDPI_TX_CTRL:  // The TXPAUSERQ bit is meant to be set while the transmitter is running.
              begin
                 // Nothing to do here.
              end
@@ -359,7 +872,6 @@ module ethernet_dpi #(
            `ETHDPI_IPGT,
            `ETHDPI_IPGR1,
            `ETHDPI_IPGR2,
-           `ETHDPI_TX_CTRL,
            `ETHDPI_PACKETLEN,
            `ETHDPI_COLLCONF,
            `ETHDPI_TX_BD_NUM,
@@ -446,12 +958,6 @@ module ethernet_dpi #(
                      $finish;
                   end
 
-                if ( 0 != ( wb_dat_i & `ETHDPI_MODER_HUGEN ) )
-                  begin
-                     $display( "%sThe client is setting the HUGEN bit in the Mode Register (MODER), which is not supported yet.", `ETHDPI_ERROR_PREFIX );
-                     $finish;
-                  end
-
                 /* The PAD bit is ignored, see the README file for details.
                 if ( 0 != ( wb_dat_i & `ETHDPI_MODER_PAD ) )
                   begin
@@ -474,6 +980,19 @@ module ethernet_dpi #(
                      ethernet_dpi_flush_tap_receive_buffer( obj );
                   end
 
+                if ( 0 != ( wb_dat_i & ( `ETHDPI_MODER_TXEN | `ETHDPI_MODER_RXEN ) ) &&
+                     ( 0 == ( ethreg_moder & ( `ETHDPI_MODER_TXEN | `ETHDPI_MODER_RXEN ) ) ||
+                       0 != ( ( wb_dat_i ^ ethreg_moder ) & ( `ETHDPI_MODER_RXEN | `ETHDPI_MODER_BRO | `ETHDPI_MODER_PRO ) ) ) )
+                  begin
+                     // The CTRLMODER and MAC address registers may not change from now on.
+                     // The receive filter on the C++ side depends on the address recognition bits in MODER.
+                     if ( 0 != ethernet_dpi_configure_mac( obj, wb_dat_i, ethreg_ctrlmoder, { 16'h0, ethreg_mac_addr } ) )
+                       begin
+                          $display( "%sError calling ethernet_dpi_configure_mac().", `ETHDPI_ERROR_PREFIX );
+                          $finish;
+                       end
+                  end
+
                 ethreg_moder <= wb_dat_i;
              end
 
@@ -500,11 +1019,17 @@ module ethernet_dpi #(
 
                 if ( 0 != wb_dat_i[`ETHDPI_TX_CTRL_TXPAUSERQ] )
                   begin
-                     $display( "%sThe client is trying to send an Ethernet pause control frame, which is not supported yet by this implementation.", `ETHDPI_ERROR_PREFIX );
-                     $finish;
+                     // The PAUSE frame goes out straight away, so the TXPAUSERQ bit never reads as 1.
+                     if ( 0 != ethernet_dpi_send_pause_frame( obj, { 16'h0, wb_dat_i[`ETHDPI_TX_CTRL_TXPAUSETV] } ) )
+                       begin
+                          $display( "%sError calling ethernet_dpi_send_pause_frame().", `ETHDPI_ERROR_PREFIX );
+                          $finish;
+                       end
+
+                     ethreg_int[`ETHDPI_INT_TXC] <= 1;
                   end
 
-                ethreg_tx_ctrl <= wb_dat_i;
+                ethreg_tx_ctrl <= wb_dat_i & ~( 1 << `ETHDPI_TX_CTRL_TXPAUSERQ );
              end
 
            `ETHDPI_INT:
@@ -588,7 +1113,7 @@ module ethernet_dpi #(
              begin
                 // NOTE: according to the specification, out-of-range values should be ignored, that is,
                 //       they are not written to the register.
-                if ( wb_dat_i > buffer_descriptor_count )
+                if ( wb_dat_i > buffer_descriptor_ring_size )
                   begin
                      $display( "%sThe client is trying to write an out-of-range value to the register that specifies the number of Transmit Buffer Descriptors (TX_BD_NUM). The out-of-range value will be ignored, but this is probably an error in the client software.", `ETHDPI_ERROR_PREFIX );
                      $finish;
@@ -663,100 +1188,29 @@ module ethernet_dpi #(
                 ethreg_miicommand <= wb_dat_i;
              end
 
-           `ETHDPI_CTRLMODER:   ethreg_ctrlmoder  <= wb_dat_i;  // The value in this register is ignored.
+           `ETHDPI_CTRLMODER:
+             begin
+                if ( 0 != wb_dat_i[`ETHDPI_CTRLMODER_RESERVED] )
+                  begin
+                     $display( "%sThe client is trying to set reserved bits in the Control Module Mode Register (CTRLMODER), which is probably an error.", `ETHDPI_ERROR_PREFIX );
+                     $finish;
+                  end
+
+                ethreg_ctrlmoder <= wb_dat_i;  // Passed to the C++ side when the transmitter or the receiver gets enabled.
+             end
 
            default:
              begin
                 if ( wb_adr_i >= `ETHDPI_BUFFER_DESCRIPTORS_BEGIN &&
                      wb_adr_i <  `ETHDPI_BUFFER_DESCRIPTORS_END )
                   begin
-                     integer bd_index = ( wb_adr_i - `ETHDPI_BUFFER_DESCRIPTORS_BEGIN ) / 8;
-                     bit     is_first_word_in_bd = !wb_adr_i[2];
-                     bit     is_tx = ( bd_index < ethreg_tx_bd_num );
-                     bit     is_bd_enabled;
-
-                     /* $display( "%sWriting to Buffer Descriptor %d, is first word: %d, is tx: %d, data: 0x%08X.",
-                               `ETHDPI_TRACE_PREFIX, bd_index, is_first_word_in_bd, is_tx, wb_dat_i ); */
-
-                     if ( is_tx )
-                       begin
-                          is_bd_enabled = ( 0 != ( ethreg_moder & `ETHDPI_MODER_TXEN ) ) &&
-                                          buffer_descriptor_flags[ bd_index ][ `ETHDPI_TXBD_RD ];
-                       end
-                     else
-                       begin
-                          is_bd_enabled = ( 0 != ( ethreg_moder & `ETHDPI_MODER_RXEN ) &&
-                                          buffer_descriptor_flags[ bd_index ][ `ETHDPI_RXBD_RD ] );
-                       end
-
-                     if ( is_bd_enabled )
-                       begin
-                          $display( "%sThe client is trying to update a Buffer Descriptor which has been previously enabled for transmission or reception and could possibly be in use by the Ethernet Controller. This is probably an error in the client.", `ETHDPI_ERROR_PREFIX );
-                          $finish;
-                       end
-
-                     if ( is_first_word_in_bd )
-                       begin
-                          if ( is_tx )
-                            begin
-                               if ( 0 != wb_dat_i[`ETHDPI_TXBD_RESERVED] )
-                                 begin
-                                    $display( "%sThe client is trying to set reserved bits in the Tx Buffer Descriptor, which is probably an error.", `ETHDPI_ERROR_PREFIX );
-                                    $finish;
-                                 end
-
-                               /* The PAD bit is ignored, see the README file for details.
-                               if ( 0 != ( wb_dat_i[`ETHDPI_TXBD_PAD] ) )
-                                 begin
-                                    $display( "%sThe client is setting the PAD bit in the Tx Buffer Descriptor, which is not supported yet.", `ETHDPI_ERROR_PREFIX );
-                                    $finish;
-                                 end */
-
-                               // There is a global CRC flag in the MODER register and another CRC flag in the Tx Buffer Descriptor,
-                               // and it is not clear in the Ethernet core documentation (as of dec 2011) how those two work together.
-                               // However, I've seen assignment "CrcEnIn(r_CrcEn | PerPacketCrcEn)" in the Verilog source code,
-                               // so I guess either flag will enable CRC generation.
-                               if ( 0 == ( wb_dat_i[`ETHDPI_TXBD_CRC] ) &&
-                                    0 == ( ethreg_moder & `ETHDPI_MODER_CRCEN ) )
-                                 begin
-                                    $display( "%sThe client is trying to send an Ethernet frame with an already-calculated CRC at the end, as both the TXBD_CRC bit in the Tx Buffer Descriptor and the CRCEN bit in the Mode Register (MODER) are not set. This is however not supported yet, the Ethernet Controller must be configured to generate the CRC itself.", `ETHDPI_ERROR_PREFIX );
-                                    $finish;
-                                 end
-
-                               /* $display( "%sSetting Tx Buffer Descriptor: data len: %d",
-                                         `ETHDPI_TRACE_PREFIX,
-                                         wb_dat_i[`ETHDPI_TXBD_LEN] ); */
-                            end
-                          else
-                            begin
-                               if ( 0 != wb_dat_i[`ETHDPI_RXBD_RESERVED] )
-                                 begin
-                                    $display( "%sThe client is trying to set reserved bits in the Rx Buffer Descriptor, which is probably an error. The addr was: 0x%08h, BD index was: 0x%08h, the data was: 0x%08h",
-                                              `ETHDPI_ERROR_PREFIX, wb_adr_i, bd_index, wb_dat_i );
-                                    $finish;
-                                 end
-
-                               /* $display( "%sSetting Rx Buffer Descriptor: data len: %d",
-                                         `ETHDPI_TRACE_PREFIX,
-                                         wb_dat_i[`ETHDPI_RXBD_LEN] ); */
-                            end
-
-                          buffer_descriptor_flags[ bd_index ] <= wb_dat_i;
-                       end
-                     else
-                       begin
-                          /* $display( "%sSet the Buffer Descriptor to address: 0x%08X.",
-                                    `ETHDPI_TRACE_PREFIX,
-                                    wb_dat_i ); */
-
-                          if ( 0 != ( wb_dat_i % 4 ) )
-                            begin
-                               $display( "%sThe client is trying to write an unaligned memory address to a Buffer Descriptor, but this Ethernet simulation model does not support unaligned memory addresses.", `ETHDPI_ERROR_PREFIX );
-                               $finish;
-                            end
-
-                          buffer_descriptor_addresses[ bd_index ] <= wb_dat_i;
-                       end
+                     write_buffer_descriptor_word( ( wb_adr_i - `ETHDPI_BUFFER_DESCRIPTORS_BEGIN ) / 8, !wb_adr_i[2] );
+                  end
+                else if ( ENABLE_EXTENSION_REGISTERS &&
+                          wb_adr_i >= `ETHDPI_EXT_REGISTERS_BEGIN &&
+                          wb_adr_i <  `ETHDPI_EXT_REGISTERS_END )
+                  begin
+                     wishbone_write_extension_register;
                   end
                 else
                   begin
@@ -864,6 +1318,12 @@ module ethernet_dpi #(
                      else
                        wb_dat_o <= buffer_descriptor_addresses[ bd_index ];
                   end
+                else if ( ENABLE_EXTENSION_REGISTERS &&
+                          wb_adr_i >= `ETHDPI_EXT_REGISTERS_BEGIN &&
+                          wb_adr_i <  `ETHDPI_EXT_REGISTERS_END )
+                  begin
+                     wishbone_read_extension_register;
+                  end
                 else
                   begin
                      $display( "%sInvalid Wishbone address 0x%08X, read cycle. Reported as a bus error by asserting wb_err_o.",
@@ -878,97 +1338,330 @@ module ethernet_dpi #(
    endtask
 
 
-   task automatic start_wishbone_master_cycle;
-      begin
-         m_wb_sel_o <= `ETHDPI_M_WB_SEL_VALUE;
-         m_wb_cyc_o <= 1;
-         m_wb_stb_o <= 1;
-      end
-   endtask
+   // Returns the number of Wishbone beats for the next DMA access, which is 1 for a classic cycle.
 
-   task automatic stop_wishbone_master_cycle;
+   function automatic int calculate_dma_burst_length;
+      input reg [31:0] beat_addr;  // Not necessarily aligned to the data bus width.
+      input int        byte_count_left;
       begin
-         m_wb_cyc_o <= 0;
-         m_wb_stb_o <= 0;
-         m_wb_dat_o <= 0;
-         m_wb_we_o  <= 0;
-         m_wb_sel_o <= 0;
-         m_wb_adr_o <= 0;
-      end
-   endtask
+         int first_word_slot = ( beat_addr % M_WB_SEL_WIDTH ) / 4;
+         int beat_count = ( first_word_slot + ( byte_count_left + 3 ) / 4 + DMA_WORDS_PER_BEAT - 1 ) / DMA_WORDS_PER_BEAT;
 
-   task automatic clear_wishbone_slave_outputs;
-      begin
-         wb_dat_o <= 0;
-         wb_ack_o <= 0;
-         wb_err_o <= 0;
+         if ( beat_count > MAX_DMA_BURST_LENGTH )
+           calculate_dma_burst_length = MAX_DMA_BURST_LENGTH;
+         else
+           calculate_dma_burst_length = beat_count;
       end
-   endtask
-
+   endfunction
 
-   task automatic start_dma_read;
 
-      input int offset;
+   // Prepares the address, byte select and data signals on the Wishbone master interface
+   // for the DMA beat that transfers the frame data at the given offset.
+   // Only whole 32-bit words are selected, which matches the behaviour of a 32-bit data bus
+   // when padding the last received word. Words outside the frame are left unselected.
 
+   task automatic set_up_dma_beat;
+      input reg [31:0] buffer_addr;
+      input int        offset;
+      input int        frame_byte_count;
+      input bit        is_write;
       begin
-         // $display("%sInitiating next DMA read from address 0x%08X",
-         //          `ETHDPI_TRACE_PREFIX,
-         //          buffer_descriptor_addresses[ current_tx_bd_index ] + offset );
+         reg [31:0]                beat_addr       = buffer_addr + offset;
+         int                       first_word_slot = ( beat_addr % M_WB_SEL_WIDTH ) / 4;
+         int                       word_count      = ( frame_byte_count - offset + 3 ) / 4;
+         reg [M_WB_SEL_WIDTH-1:0]  sel             = 0;
+         reg [M_WB_DATA_WIDTH-1:0] data            = 0;
 
-         m_wb_adr_o <= buffer_descriptor_addresses[ current_tx_bd_index ] + offset;
-         m_wb_we_o  <= 0;
-         m_wb_dat_o <= 0;
-         start_wishbone_master_cycle;
+         if ( word_count > DMA_WORDS_PER_BEAT - first_word_slot )
+           word_count = DMA_WORDS_PER_BEAT - first_word_slot;
 
-         current_state <= state_waiting_for_dma_read_to_complete;
-      end
-   endtask
+         for ( int w = 0; w < word_count; w++ )
+           begin
+              sel[ M_WB_SEL_WIDTH - 1 - 4 * ( first_word_slot + w ) -: 4 ] = 4'b1111;
 
-   task automatic start_dma_write;
+              if ( is_write )
+                begin
+                   reg [31:0] word;
 
-      input int received_frame_byte_count;
-      input int offset;
+                   get_32_bits_worth_of_received_frame_data( offset + 4 * w, frame_byte_count, word );
 
-      reg [31:0] data;
+                   data[ M_WB_DATA_WIDTH - 1 - 32 * ( first_word_slot + w ) -: 32 ] = word;
 
-      begin
-         // $display( "%sInitiating next DMA write to address 0x%08X",
+                   trace_dma_event( `ETHDPI_TRACE_RX_DMA_WRITE, current_rx_bd_index, beat_addr + 4 * w, word );
+                end
+           end
+
+         m_wb_adr_o <= beat_addr - ( beat_addr % M_WB_SEL_WIDTH );
+         m_wb_sel_o <= sel;
+         m_wb_we_o  <= is_write;
+         m_wb_dat_o <= data;
+
+         dma_beat_first_word_slot <= first_word_slot;
+         dma_beat_word_count      <= word_count;
+      end
+   endtask
+
+
+   // Appends the valid bytes in a 32-bit word read over DMA to the frame being sent.
+
+   task automatic add_dma_word_to_tx_frame;
+      input reg [31:0] word;
+      input int        byte_count_left;  // This includes the bytes in this word.
+      begin
+         if ( byte_count_left < 1 )
+           begin
+              $display( "%sInternal error calculating the DMA addresses.", `ETHDPI_ERROR_PREFIX );
+              $finish;
+           end
+
+         if ( 0 != ethernet_dpi_add_byte_to_tx_frame( obj, word[ 31:24 ] ) )
+           begin
+              $display( "%sError appending to the DPI tx queue.", `ETHDPI_ERROR_PREFIX );
+              $finish;
+           end
+
+         if ( byte_count_left >= 2 )  // In a separate if(), as Verilator does not support short-circuit expression evaluation yet (as of Dec 2011).
+           if ( 0 != ethernet_dpi_add_byte_to_tx_frame( obj, word[ 23:16 ] ) )
+           begin
+              $display( "%sError appending to the DPI tx queue.", `ETHDPI_ERROR_PREFIX );
+              $finish;
+           end
+
+         if ( byte_count_left >= 3 )
+           if ( 0 != ethernet_dpi_add_byte_to_tx_frame( obj, word[ 15:8  ] ) )
+           begin
+              $display( "%sError appending to the DPI tx queue.", `ETHDPI_ERROR_PREFIX );
+              $finish;
+           end
+
+         if ( byte_count_left >= 4 )
+           if ( 0 != ethernet_dpi_add_byte_to_tx_frame( obj, word[  7:0  ] ) )
+           begin
+              $display( "%sError appending a byte to the tx Ethernet frame.", `ETHDPI_ERROR_PREFIX );
+              $finish;
+           end
+      end
+   endtask
+
+
+   task automatic start_wishbone_master_cycle;
+      input int burst_length;
+      begin
+         m_wb_cyc_o <= 1;
+         m_wb_stb_o <= 1;
+         m_wb_bte_o <= `ETHDPI_WB_BTE_LINEAR;
+
+         if ( burst_length > 1 )
+           m_wb_cti_o <= `ETHDPI_WB_CTI_INCR_BURST;
+         else
+           m_wb_cti_o <= `ETHDPI_WB_CTI_CLASSIC;
+
+         dma_burst_beats_left <= burst_length;
+      end
+   endtask
+
+
+   // Advances to the next beat of the current burst. The caller must call set_up_dma_beat() too.
+   // With registered feedback, the slave has already seen the next address coming,
+   // so it can acknowledge the next beat straight away.
+
+   task automatic continue_wishbone_burst;
+      begin
+         if ( dma_burst_beats_left == 2 )
+           m_wb_cti_o <= `ETHDPI_WB_CTI_END_OF_BURST;
+
+         dma_burst_beats_left <= dma_burst_beats_left - 1;
+      end
+   endtask
+
+   task automatic stop_wishbone_master_cycle;
+      begin
+         m_wb_cyc_o <= 0;
+         m_wb_stb_o <= 0;
+         m_wb_dat_o <= 0;
+         m_wb_we_o  <= 0;
+         m_wb_sel_o <= 0;
+         m_wb_adr_o <= 0;
+         m_wb_cti_o <= `ETHDPI_WB_CTI_CLASSIC;
+         m_wb_bte_o <= `ETHDPI_WB_BTE_LINEAR;
+         dma_burst_beats_left <= 0;
+         dma_beat_first_word_slot <= 0;
+         dma_beat_word_count <= 0;
+      end
+   endtask
+
+   task automatic clear_wishbone_slave_outputs;
+      begin
+         wb_dat_o <= 0;
+         wb_ack_o <= 0;
+         wb_err_o <= 0;
+      end
+   endtask
+
+
+   task automatic start_dma_read;
+
+      input int offset;
+
+      begin
+         // $display("%sInitiating next DMA read from address 0x%08X",
+         //          `ETHDPI_TRACE_PREFIX,
+         //          buffer_descriptor_addresses[ current_tx_bd_index ] + offset );
+
+         int frame_byte_count = { 16'h0, buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_LEN] };
+
+         set_up_dma_beat( buffer_descriptor_addresses[ current_tx_bd_index ], offset, frame_byte_count, 0 );
+         start_wishbone_master_cycle( calculate_dma_burst_length( buffer_descriptor_addresses[ current_tx_bd_index ] + offset,
+                                                                  frame_byte_count - offset ) );
+
+         tx_channel_state <= channel_waiting_for_dma_to_complete;
+      end
+   endtask
+
+   task automatic start_dma_write;
+
+      input int byte_count_to_write;
+      input int offset;
+
+      begin
+         // $display( "%sInitiating next DMA write to address 0x%08X",
          //           `ETHDPI_TRACE_PREFIX,
          //           buffer_descriptor_addresses[ current_rx_bd_index ] + offset );
 
-         get_32_bits_worth_of_received_frame_data( offset, received_frame_byte_count, data );
+         set_up_dma_beat( buffer_descriptor_addresses[ current_rx_bd_index ], offset, byte_count_to_write, 1 );
+         start_wishbone_master_cycle( calculate_dma_burst_length( buffer_descriptor_addresses[ current_rx_bd_index ] + offset,
+                                                                  byte_count_to_write - offset ) );
 
-         m_wb_adr_o <= buffer_descriptor_addresses[ current_rx_bd_index ] + offset;
-         m_wb_we_o  <= 1;
-         m_wb_dat_o <= data;
-         start_wishbone_master_cycle;
+         rx_channel_state <= channel_waiting_for_dma_to_complete;
+      end
+   endtask
 
-         if ( TRACE_DMA_TRAFFIC )
-           $display( "%sWriting Rx data over DMA: 0x%08X", `ETHDPI_TRACE_PREFIX, data );
 
-         current_state <= state_waiting_for_dma_write_to_complete;
+   // Updates the Tx Buffer Descriptor and the interrupt source after a frame has been sent.
+
+   task automatic complete_tx_frame;
+      begin
+         trace_dma_event( `ETHDPI_TRACE_TX_BD_DONE, current_tx_bd_index, 0, { 16'h0, buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_LEN] } );
+
+         finish_dma_profile( 0, { 16'h0, buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_LEN] } );
+
+         buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_RD  ] <= 0;
+         buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_UR  ] <= 0;
+         buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_RTRY] <= 0;
+         buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_RL  ] <= 0;
+         buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_LC  ] <= 0;
+         buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_DF  ] <= 0;
+         buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_CS  ] <= 0;
+
+         if ( buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_IRQ] )
+           begin
+              // $display( "%sSetting the Tx interrupt source bit", `ETHDPI_TRACE_PREFIX );
+              ethreg_int[`ETHDPI_INT_TXB] <= 1;
+              intmod_tx_frame_event <= 1;
+           end
+
+         if ( buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_WR] )
+           current_tx_bd_index <= 0;
+         else if ( current_tx_bd_index == ethreg_tx_bd_num - 1 )
+           current_tx_bd_index <= 0;
+         else
+           current_tx_bd_index <= current_tx_bd_index + 1;
+
+         tx_channel_state <= channel_idle;
       end
    endtask
 
 
-   task automatic step_state_machine;
-      input int received_frame_byte_count;
+   // Discards the received frame in the DPI module, and updates the Rx Buffer Descriptor
+   // and the interrupt source after the frame has been written to memory.
+
+   task automatic complete_rx_frame;
+      input int received_frame_byte_count;  // The number of bytes written to memory.
+      input bit mac_addr_miss_flag;
+      input bit too_long_flag;
+      begin
+         reg [31:0] new_val;
+
+         if ( 0 != ethernet_dpi_discard_received_frame( obj ) )
+           begin
+              $display( "%sError discarding the received frame in the DPI module.", `ETHDPI_ERROR_PREFIX );
+              $finish;
+           end
+
+         new_val = buffer_descriptor_flags[ current_rx_bd_index ];
+
+         new_val[`ETHDPI_RXBD_RD ] = 0;
+         new_val &= `ETHDPI_RXBD_CLEAR_ERRORS_MASK;
+         new_val[`ETHDPI_RXBD_LEN] = received_frame_byte_count[15:0];
+         new_val[`ETHDPI_RXBD_M  ] = mac_addr_miss_flag;
+         new_val[`ETHDPI_RXBD_TL ] = too_long_flag;
+
+         buffer_descriptor_flags[ current_rx_bd_index ] <= new_val;
+
+         trace_dma_event( `ETHDPI_TRACE_RX_BD_DONE, current_rx_bd_index, 0, new_val );
+
+         finish_dma_profile( 1, received_frame_byte_count );
+
+         if ( buffer_descriptor_flags[ current_rx_bd_index ][`ETHDPI_RXBD_IRQ] )
+           begin
+              // $display( "%sSetting the Rx interrupt source bit", `ETHDPI_TRACE_PREFIX );
+              ethreg_int[`ETHDPI_INT_RXF] <= 1;
+              intmod_rx_frame_event <= 1;
+           end
+
+         if ( buffer_descriptor_flags[ current_rx_bd_index ][`ETHDPI_RXBD_WR] )
+           current_rx_bd_index <= ethreg_tx_bd_num;
+         else if ( current_rx_bd_index == buffer_descriptor_ring_size - 1 )
+           current_rx_bd_index <= ethreg_tx_bd_num;
+         else
+           current_rx_bd_index <= current_rx_bd_index + 1;
+
+         rx_channel_state <= channel_idle;
+      end
+   endtask
+
+
+   // Called when a channel ends its Wishbone cycle. With the optional wait state, no channel may start
+   // another DMA access in the same clock cycle, so the Wishbone master interface stays idle for one clock cycle
+   // and other bus masters get a chance to access memory.
+
+   task automatic release_dma_bus;
+      inout bit is_bus_free;
+      begin
+         if ( INSERT_WAIT_STATE_BETWEEN_DMA_ACCESSES )
+           begin
+              is_bus_free = 0;
+              dma_bus_wait_state <= 1;
+           end
+         else
+           is_bus_free = 1;
+      end
+   endtask
+
+
+   // Takes the next frame to send, and handles the completion of the Tx channel's DMA reads.
+   // The inout arguments tell arbitrate_dma_bus() what the channel needs in this clock cycle,
+   // as the nonblocking assignments to the channel state only take effect in the next one.
+
+   task automatic step_tx_channel;
       input bit ready_to_send;
+      inout bit wants_bus;
+      inout bit is_bus_free;
+      inout int dma_offset;
       begin
-         unique case ( current_state )
+         unique case ( tx_channel_state )
 
-           state_idle:
+           channel_idle:
              begin
                 if ( ready_to_send &&
                      0 != ( ethreg_moder & `ETHDPI_MODER_TXEN ) &&
                      ethreg_tx_bd_num > 0 &&
                      buffer_descriptor_flags[ current_tx_bd_index ][ `ETHDPI_TXBD_RD ] )
                   begin
-                     /* $display("%sInitiating DMA read for Tx Buffer Descriptor %d, address 0x%08X, data length is %d bytes.",
-                              `ETHDPI_TRACE_PREFIX,
-                              current_tx_bd_index,
-                              buffer_descriptor_addresses[ current_tx_bd_index ],
-                              buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_LEN] ); */
+                     trace_dma_event( `ETHDPI_TRACE_TX_BD_START,
+                                      current_tx_bd_index,
+                                      buffer_descriptor_addresses[ current_tx_bd_index ],
+                                      { 16'h0, buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_LEN] } );
 
                      if ( buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_LEN] < 4 )
                        begin
@@ -976,44 +1669,135 @@ module ethernet_dpi #(
                           $finish;
                        end
 
-                     if ( 0 != ethernet_dpi_new_tx_frame( obj ) )
+                     start_dma_profile( 0 );
+
+                     if ( backdoor_dma_enabled )
                        begin
-                          $display( "%sError preparing a new Ethernet frame to send.", `ETHDPI_ERROR_PREFIX );
-                          $finish;
+                          if ( 0 != ethernet_dpi_backdoor_send_tx_frame( obj,
+                                                                         buffer_descriptor_addresses[ current_tx_bd_index ],
+                                                                         { 16'h0, buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_LEN] } ) )
+                            begin
+                               $display( "%sError sending the DPI frame over the backdoor DMA.", `ETHDPI_ERROR_PREFIX );
+                               $finish;
+                            end
+
+                          complete_tx_frame;
                        end
+                     else
+                       begin
+                          if ( 0 != ethernet_dpi_new_tx_frame( obj ) )
+                            begin
+                               $display( "%sError preparing a new Ethernet frame to send.", `ETHDPI_ERROR_PREFIX );
+                               $finish;
+                            end
 
-                     m_wb_adr_o <= buffer_descriptor_addresses[ current_tx_bd_index ];
-                     m_wb_we_o  <= 0;
-                     m_wb_dat_o <= 0;
-                     start_wishbone_master_cycle;
+                          tx_dma_addr_offset <= 0;
+                          dma_offset = 0;
+                          tx_channel_state <= channel_waiting_for_bus;
+                          wants_bus = 1;
+                       end
+                  end
+             end
 
-                     current_dma_addr_offset <= 0;
+           channel_waiting_for_bus:
+             begin
+                // Nothing to do here, see arbitrate_dma_bus().
+             end
 
-                     current_state <= state_waiting_for_dma_read_to_complete;
+           channel_waiting_for_dma_to_complete:
+             begin
+                if ( m_wb_err_i )
+                  begin
+                     report_dma_bus_error( 0, { 16'h0, buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_LEN] } );
+                     $display( "%sWishbone bus error reading ethernet data over DMA.", `ETHDPI_ERROR_PREFIX );
+                     $finish;
                   end
-                else if ( received_frame_byte_count > 0 &&
-                          0 != ( ethreg_moder & `ETHDPI_MODER_RXEN ) &&
-                          ethreg_tx_bd_num < buffer_descriptor_count &&
-                          buffer_descriptor_flags[ current_rx_bd_index ][ `ETHDPI_RXBD_RD ] )
+                else if ( m_wb_ack_i )
                   begin
-                     reg [31:0] data;
+                     // This includes the bytes being read at this Wishbone cycle.
+                     int byte_count_left = { 16'h0, buffer_descriptor_flags[ current_tx_bd_index ] [`ETHDPI_TXBD_LEN] } - tx_dma_addr_offset;
+                     int next_offset = tx_dma_addr_offset + 4 * dma_beat_word_count;
+
+                     for ( int w = 0; w < dma_beat_word_count; w++ )
+                       begin
+                          trace_dma_event( `ETHDPI_TRACE_TX_DMA_READ,
+                                           current_tx_bd_index,
+                                           buffer_descriptor_addresses[ current_tx_bd_index ] + tx_dma_addr_offset + 4 * w,
+                                           m_wb_dat_i[ M_WB_DATA_WIDTH - 1 - 32 * ( dma_beat_first_word_slot + w ) -: 32 ] );
 
-                     /* $display( "%sInitiating DMA write for Rx Buffer Descriptor %d, address 0x%08X, frame data length is %d bytes.",
-                               `ETHDPI_TRACE_PREFIX,
-                               current_rx_bd_index,
-                               buffer_descriptor_addresses[ current_rx_bd_index ],
-                               received_frame_byte_count ); */
+                          add_dma_word_to_tx_frame( m_wb_dat_i[ M_WB_DATA_WIDTH - 1 - 32 * ( dma_beat_first_word_slot + w ) -: 32 ],
+                                                    byte_count_left - 4 * w );
+                       end
 
-                     if ( received_frame_byte_count > { 16'h00, ethreg_packetlen[ `ETHDPI_PACKETLEN_MAXFL ] } )
+                     if ( byte_count_left <= 4 * dma_beat_word_count )
                        begin
-                          // The frame is too big, ignore it.
-                          // This is an uncommon scenario, so generate an error. If you really need
-                          // this behaviour, just comment this error out. You will probably have to
-                          // set the "Too Long" (TL) bit too, see below.
-                          $display( "%sThe frame received is too big to fit in the receiver buffer.", `ETHDPI_ERROR_PREFIX );
-                          $finish;
+                          stop_wishbone_master_cycle;
+                          release_dma_bus( is_bus_free );
+
+                          if ( 0 != ethernet_dpi_send_tx_frame( obj ) )
+                            begin
+                               $display( "%sError sending the DPI frame.", `ETHDPI_ERROR_PREFIX );
+                               $finish;
+                            end
+
+                          complete_tx_frame;
+                       end
+                     else if ( dma_burst_beats_left > 1 )
+                       begin
+                          tx_dma_addr_offset <= next_offset;
+                          set_up_dma_beat( buffer_descriptor_addresses[ current_tx_bd_index ],
+                                           next_offset,
+                                           { 16'h0, buffer_descriptor_flags[ current_tx_bd_index ] [`ETHDPI_TXBD_LEN] },
+                                           0 );
+                          continue_wishbone_burst;
                        end
-                     else if ( received_frame_byte_count < 6 )
+                     else
+                       begin
+                          stop_wishbone_master_cycle;
+                          release_dma_bus( is_bus_free );
+
+                          tx_dma_addr_offset <= next_offset;
+                          dma_offset = next_offset;
+                          tx_channel_state <= channel_waiting_for_bus;
+                          wants_bus = 1;
+                       end
+                  end
+                else
+                  begin
+                     // Nothing to do here, just wait for the next time around.
+                  end
+             end
+
+           default:
+             begin
+                $display( "%sDefault case for tx_channel_state=%d.", `ETHDPI_ERROR_PREFIX, tx_channel_state );
+                $finish;
+             end
+           endcase;
+      end
+   endtask
+
+
+   // Takes the next received frame, and handles the completion of the Rx channel's DMA writes.
+   // See step_tx_channel() about the inout arguments.
+
+   task automatic step_rx_channel;
+      input int received_frame_byte_count;
+      inout bit wants_bus;
+      inout bit is_bus_free;
+      inout int dma_offset;
+      inout int dma_byte_count;
+      begin
+         unique case ( rx_channel_state )
+
+           channel_idle:
+             begin
+                if ( received_frame_byte_count > 0 &&
+                     0 != ( ethreg_moder & `ETHDPI_MODER_RXEN ) &&
+                     ethreg_tx_bd_num < buffer_descriptor_ring_size &&
+                     buffer_descriptor_flags[ current_rx_bd_index ][ `ETHDPI_RXBD_RD ] )
+                  begin
+                     if ( received_frame_byte_count < 6 )
                        begin
                           // The frame is too small, ignore it. We could receive small frames (see the RECSMALL flag),
                           // but this functionality has not been implemented yet. Besides, I don't think that
@@ -1026,6 +1810,17 @@ module ethernet_dpi #(
                        begin
                           byte mac_addr_0, mac_addr_1, mac_addr_2, mac_addr_3, mac_addr_4, mac_addr_5;
                           bit  is_broadcast, is_our_mac_addr, is_addr_match, should_receive;
+                          int  byte_count_to_write;
+                          bit  is_too_long;
+
+                          // Unless huge frames are enabled, frames longer than MAXFL are truncated to MAXFL bytes,
+                          // and the Too Long (TL) flag is set in the Rx Buffer Descriptor. MAXFL is always
+                          // a multiple of 4, so the DMA transfer does not write past it.
+                          is_too_long = 0 == ( ethreg_moder & `ETHDPI_MODER_HUGEN ) &&
+                                        received_frame_byte_count > { 16'h00, ethreg_packetlen[ `ETHDPI_PACKETLEN_MAXFL ] };
+
+                          byte_count_to_write = is_too_long ? { 16'h00, ethreg_packetlen[ `ETHDPI_PACKETLEN_MAXFL ] }
+                                                            : received_frame_byte_count;
 
                           get_received_frame_byte( 0, mac_addr_0 );
                           get_received_frame_byte( 1, mac_addr_1 );
@@ -1050,125 +1845,93 @@ module ethernet_dpi #(
 
                           if ( ! should_receive )
                             begin
+                               trace_dma_event( `ETHDPI_TRACE_RX_FRAME_REJECTED, current_rx_bd_index, 0, received_frame_byte_count );
+
+                               if ( PROFILE_DMA )
+                                 dma_profile_queue_wait_count[ 1 ] <= 0;
+
                                if ( 0 != ethernet_dpi_discard_received_frame( obj ) )
                                  begin
                                     $display( "%sError discarding the received frame in the DPI module.", `ETHDPI_ERROR_PREFIX );
                                     $finish;
                                  end
                             end
-                          else
+                          else if ( backdoor_dma_enabled )
                             begin
-                               received_frame_mac_addr_miss_flag <= ! is_addr_match;
+                               trace_dma_event( `ETHDPI_TRACE_RX_BD_START, current_rx_bd_index, buffer_descriptor_addresses[ current_rx_bd_index ], byte_count_to_write );
+
+                               start_dma_profile( 1 );
 
-                               get_32_bits_worth_of_received_frame_data( 0, received_frame_byte_count, data );
+                               if ( 0 != ethernet_dpi_backdoor_write_received_frame( obj,
+                                                                                      buffer_descriptor_addresses[ current_rx_bd_index ],
+                                                                                      byte_count_to_write ) )
+                                 begin
+                                    $display( "%sError writing the received frame over the backdoor DMA.", `ETHDPI_ERROR_PREFIX );
+                                    $finish;
+                                 end
 
-                               m_wb_adr_o <= buffer_descriptor_addresses[ current_rx_bd_index ];
-                               m_wb_we_o  <= 1;
-                               m_wb_dat_o <= data;
-                               start_wishbone_master_cycle;
+                               complete_rx_frame( byte_count_to_write, ! is_addr_match, is_too_long );
+                            end
+                          else
+                            begin
+                               received_frame_mac_addr_miss_flag <= ! is_addr_match;
+                               received_frame_too_long_flag <= is_too_long;
+                               rx_dma_byte_count <= byte_count_to_write;
 
-                               current_dma_addr_offset <= 0;
+                               trace_dma_event( `ETHDPI_TRACE_RX_BD_START, current_rx_bd_index, buffer_descriptor_addresses[ current_rx_bd_index ], byte_count_to_write );
 
-                               if ( TRACE_DMA_TRAFFIC )
-                                 $display( "%sWriting Rx data over DMA: 0x%08X", `ETHDPI_TRACE_PREFIX, data );
+                               start_dma_profile( 1 );
 
-                               current_state <= state_waiting_for_dma_write_to_complete;
+                               rx_dma_addr_offset <= 0;
+                               dma_offset = 0;
+                               dma_byte_count = byte_count_to_write;
+                               rx_channel_state <= channel_waiting_for_bus;
+                               wants_bus = 1;
                             end
                        end
                   end
              end
 
-           state_waiting_for_dma_read_to_complete:
+           channel_waiting_for_bus:
+             begin
+                // Nothing to do here, see arbitrate_dma_bus().
+             end
+
+           channel_waiting_for_dma_to_complete:
              begin
                 if ( m_wb_err_i )
                   begin
-                     $display( "%sWishbone bus error reading ethernet data over DMA.", `ETHDPI_ERROR_PREFIX );
+                     report_dma_bus_error( 1, rx_dma_byte_count );
+                     $display( "%sWishbone bus error writing ethernet data over DMA.", `ETHDPI_ERROR_PREFIX );
                      $finish;
                   end
                 else if ( m_wb_ack_i )
                   begin
-                     // This includes the bytes being read at this Wishbone cycle.
-                     int byte_count_left = { 16'h0, buffer_descriptor_flags[ current_tx_bd_index ] [`ETHDPI_TXBD_LEN] } - current_dma_addr_offset;
-
-                     if ( TRACE_DMA_TRAFFIC )
-                       begin
-                          $display( "%sTx data read over DMA: 0x%08X", `ETHDPI_TRACE_PREFIX, m_wb_dat_i );
-                       end
-
-                     if ( byte_count_left < 1 )
-                       begin
-                          $display( "%sInternal error calculating the DMA addresses.", `ETHDPI_ERROR_PREFIX );
-                          $finish;
-                       end
-
-                     if ( 0 != ethernet_dpi_add_byte_to_tx_frame( obj, m_wb_dat_i[ 31:24 ] ) )
-                       begin
-                          $display( "%sError appending to the DPI tx queue.", `ETHDPI_ERROR_PREFIX );
-                          $finish;
-                       end
-
-                     if ( byte_count_left >= 2 )  // In a separate if(), as Verilator does not support short-circuit expression evaluation yet (as of Dec 2011).
-                       if ( 0 != ethernet_dpi_add_byte_to_tx_frame( obj, m_wb_dat_i[ 23:16 ] ) )
-                       begin
-                          $display( "%sError appending to the DPI tx queue.", `ETHDPI_ERROR_PREFIX );
-                          $finish;
-                       end
+                     reg [31:0] next_offset = rx_dma_addr_offset + 4 * dma_beat_word_count;
 
-                     if ( byte_count_left >= 3 )
-                       if ( 0 != ethernet_dpi_add_byte_to_tx_frame( obj, m_wb_dat_i[ 15:8  ] ) )
-                       begin
-                          $display( "%sError appending to the DPI tx queue.", `ETHDPI_ERROR_PREFIX );
-                          $finish;
-                       end
-
-                     if ( byte_count_left >= 4 )
-                       if ( 0 != ethernet_dpi_add_byte_to_tx_frame( obj, m_wb_dat_i[  7:0  ] ) )
+                     // Have we written the last 32 bits? If so, we're done here with the Ethernet frame reception.
+                     if ( next_offset >= rx_dma_byte_count )
                        begin
-                          $display( "%sError appending a byte to the tx Ethernet frame.", `ETHDPI_ERROR_PREFIX );
-                          $finish;
+                          stop_wishbone_master_cycle;
+                          release_dma_bus( is_bus_free );
+                          complete_rx_frame( rx_dma_byte_count, received_frame_mac_addr_miss_flag, received_frame_too_long_flag );
                        end
-
-                     stop_wishbone_master_cycle;
-
-                     if ( byte_count_left <= 4 )
+                     else if ( dma_burst_beats_left > 1 )
                        begin
-                          if ( 0 != ethernet_dpi_send_tx_frame( obj ) )
-                            begin
-                               $display( "%sError sending the DPI frame.", `ETHDPI_ERROR_PREFIX );
-                               $finish;
-                            end
-
-                          buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_RD  ] <= 0;
-                          buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_UR  ] <= 0;
-                          buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_RTRY] <= 0;
-                          buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_RL  ] <= 0;
-                          buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_LC  ] <= 0;
-                          buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_DF  ] <= 0;
-                          buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_CS  ] <= 0;
-
-                          if ( buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_IRQ] )
-                            begin
-                               // $display( "%sSetting the Tx interrupt source bit", `ETHDPI_TRACE_PREFIX );
-                               ethreg_int[`ETHDPI_INT_TXB] <= 1;
-                            end
-
-                          if ( buffer_descriptor_flags[ current_tx_bd_index ][`ETHDPI_TXBD_WR] )
-                            current_tx_bd_index <= 0;
-                          else if ( current_tx_bd_index == ethreg_tx_bd_num - 1 )
-                            current_tx_bd_index <= 0;
-                          else
-                            current_tx_bd_index <= current_tx_bd_index + 1;
+                          set_up_dma_beat( buffer_descriptor_addresses[ current_rx_bd_index ], next_offset, rx_dma_byte_count, 1 );
+                          continue_wishbone_burst;
 
-                          current_state <= state_idle;
+                          rx_dma_addr_offset <= next_offset;
                        end
                      else
                        begin
-                          current_dma_addr_offset <= current_dma_addr_offset + 4;
+                          stop_wishbone_master_cycle;
+                          release_dma_bus( is_bus_free );
 
-                          if ( INSERT_WAIT_STATE_BETWEEN_DMA_ACCESSES )
-                            current_state <= state_wait_state_between_dma_reads;
-                          else
-                            start_dma_read( current_dma_addr_offset + 4 );
+                          rx_dma_addr_offset <= next_offset;
+                          dma_offset = next_offset;
+                          rx_channel_state <= channel_waiting_for_bus;
+                          wants_bus = 1;
                        end
                   end
                 else
@@ -1177,86 +1940,167 @@ module ethernet_dpi #(
                   end
              end
 
-           state_waiting_for_dma_write_to_complete:
+           default:
              begin
-                if ( m_wb_err_i )
-                  begin
-                     $display( "%sWishbone bus error writing ethernet data over DMA.", `ETHDPI_ERROR_PREFIX );
-                     $finish;
-                  end
-                else if ( m_wb_ack_i )
-                  begin
-                     reg [31:0] next_offset = current_dma_addr_offset + 4;
+                $display( "%sDefault case for rx_channel_state=%d.", `ETHDPI_ERROR_PREFIX, rx_channel_state );
+                $finish;
+             end
+           endcase;
+      end
+   endtask
 
-                     stop_wishbone_master_cycle;
 
-                     // Have we written the last 32 bits? If so, we're done here with the Ethernet frame reception.
-                     if ( next_offset >= received_frame_byte_count )
-                       begin
-                          reg [31:0] new_val;
+   // Starts the next DMA access on the Wishbone master interface. If both channels are waiting for it,
+   // they take turns after every access (or burst), so that neither direction starves under bidirectional load.
 
-                          if ( 0 != ethernet_dpi_discard_received_frame( obj ) )
-                            begin
-                               $display( "%sError discarding the received frame in the DPI module.", `ETHDPI_ERROR_PREFIX );
-                               $finish;
-                            end
+   task automatic arbitrate_dma_bus;
+      input bit tx_wants_bus;
+      input bit rx_wants_bus;
+      input bit is_bus_free;
+      input int tx_dma_offset;
+      input int rx_dma_offset;
+      input int rx_byte_count;
+      begin
+         if ( is_bus_free && ( tx_wants_bus || rx_wants_bus ) )
+           begin
+              if ( rx_wants_bus && ( ! tx_wants_bus || ! last_dma_grant_was_rx ) )
+                begin
+                   start_dma_write( rx_byte_count, rx_dma_offset );
+                   last_dma_grant_was_rx <= 1;
+                end
+              else
+                begin
+                   start_dma_read( tx_dma_offset );
+                   last_dma_grant_was_rx <= 0;
+                end
+           end
+      end
+   endtask
 
-                          new_val = buffer_descriptor_flags[ current_rx_bd_index ];
 
-                          new_val[`ETHDPI_RXBD_RD ] = 0;
-                          new_val &= `ETHDPI_RXBD_CLEAR_ERRORS_MASK;
-                          new_val[`ETHDPI_RXBD_LEN] = received_frame_byte_count[15:0];
-                          new_val[`ETHDPI_RXBD_M  ] = received_frame_mac_addr_miss_flag;
+   task automatic step_state_machine;
+      input int received_frame_byte_count;
+      input bit ready_to_send;
+      begin
+         bit tx_wants_bus   = tx_channel_state == channel_waiting_for_bus;
+         bit rx_wants_bus   = rx_channel_state == channel_waiting_for_bus;
+         bit is_bus_free    = tx_channel_state != channel_waiting_for_dma_to_complete &&
+                              rx_channel_state != channel_waiting_for_dma_to_complete;
+         int tx_dma_offset  = tx_dma_addr_offset;
+         int rx_dma_offset  = rx_dma_addr_offset;
+         int rx_byte_count  = rx_dma_byte_count;
 
-                          buffer_descriptor_flags[ current_rx_bd_index ] <= new_val;
+         dma_bus_wait_state <= 0;
 
-                          if ( buffer_descriptor_flags[ current_rx_bd_index ][`ETHDPI_RXBD_IRQ] )
-                            begin
-                               // $display( "%sSetting the Rx interrupt source bit", `ETHDPI_TRACE_PREFIX );
-                               ethreg_int[`ETHDPI_INT_RXF] <= 1;
-                            end
+         step_tx_channel( ready_to_send, tx_wants_bus, is_bus_free, tx_dma_offset );
+         step_rx_channel( received_frame_byte_count, rx_wants_bus, is_bus_free, rx_dma_offset, rx_byte_count );
 
-                          if ( buffer_descriptor_flags[ current_rx_bd_index ][`ETHDPI_RXBD_WR] )
-                            current_rx_bd_index <= ethreg_tx_bd_num;
-                          else if ( current_rx_bd_index == buffer_descriptor_count )
-                            current_rx_bd_index <= ethreg_tx_bd_num;
-                          else
-                            current_rx_bd_index <= current_rx_bd_index + 1;
+         arbitrate_dma_bus( tx_wants_bus, rx_wants_bus, is_bus_free, tx_dma_offset, rx_dma_offset, rx_byte_count );
+      end
+   endtask
 
-                          current_state <= state_idle;
-                       end
-                     else
-                       begin
-                          current_dma_addr_offset <= next_offset;
 
-                          if ( INSERT_WAIT_STATE_BETWEEN_DMA_ACCESSES )
-                               current_state <= state_wait_state_between_dma_writes;
-                          else
-                               start_dma_write( received_frame_byte_count, next_offset );
-                       end
-                  end
-                else
-                  begin
-                     // Nothing to do here, just wait for the next time around.
-                  end
-             end
+   // Drives quiescent_o, which tells the simulation harness that this Ethernet controller has nothing to do
+   // until either the software or the network gives it more work. That is, the state machine is idle,
+   // the current Tx Buffer Descriptor is not ready, the current received frame (if any) cannot be stored yet,
+   // and no moderated interrupt is waiting for its cycle limit. The harness can then stop clocking the simulation
+   // and call ethernet_dpi_wait_for_activity() instead, if the rest of the system is idle too.
 
-           state_wait_state_between_dma_reads:
-             begin
-                start_dma_read( current_dma_addr_offset );
-             end
+   task automatic update_quiescence_flag ( input int received_frame_byte_count );
+      begin
+         bit is_tx_work_pending = 0 != ( ethreg_moder & `ETHDPI_MODER_TXEN ) &&
+                                  ethreg_tx_bd_num > 0 &&
+                                  buffer_descriptor_flags[ current_tx_bd_index ][ `ETHDPI_TXBD_RD ];
+
+         bit is_rx_work_pending = received_frame_byte_count > 0 &&
+                                  0 != ( ethreg_moder & `ETHDPI_MODER_RXEN ) &&
+                                  ethreg_tx_bd_num < buffer_descriptor_ring_size &&
+                                  buffer_descriptor_flags[ current_rx_bd_index ][ `ETHDPI_RXBD_RD ];
+
+         bit is_intmod_timer_running = ethreg_ext_intmod_frames != 0 &&
+                                       ethreg_ext_intmod_cycles != 0 &&
+                                       ! intmod_released &&
+                                       0 != ( ethreg_int & ethreg_int_mask & `ETHDPI_INT_MODERATED_MASK );
+
+         quiescent_o <= tx_channel_state == channel_idle &&
+                        rx_channel_state == channel_idle &&
+                        ! is_tx_work_pending &&
+                        ! is_rx_work_pending &&
+                        ! is_intmod_timer_running &&
+                        ! intmod_tx_frame_event &&
+                        ! intmod_rx_frame_event;
+      end
+   endtask
 
-           state_wait_state_between_dma_writes:
-             begin
-                start_dma_write( received_frame_byte_count, current_dma_addr_offset );
-             end
 
-           default:
-             begin
-                $display( "%sDefault case for current_state=%d.", `ETHDPI_ERROR_PREFIX, current_state );
-                $finish;
-             end
-           endcase;
+   // The C++ side consumes the PAUSE frames it receives, unless the PASSALL bit is set,
+   // so this is the only way to find out that one has arrived.
+
+   task automatic update_pause_frame_interrupt;
+      begin
+         bit is_pause_frame_received;
+
+         if ( 0 != ethernet_dpi_take_pause_frame_received_event( obj, is_pause_frame_received ) )
+           begin
+              $display( "%sError calling ethernet_dpi_take_pause_frame_received_event().", `ETHDPI_ERROR_PREFIX );
+              $finish;
+           end
+
+         if ( is_pause_frame_received )
+           ethreg_int[`ETHDPI_INT_RXC] <= 1;
+      end
+   endtask
+
+
+   // Interrupt moderation holds back the assertion of int_o for the TXB and RXF interrupt sources
+   // until either ethreg_ext_intmod_frames frames have completed, or ethreg_ext_intmod_cycles clock cycles
+   // have elapsed since the first pending frame event. The interrupt source bits themselves are
+   // set as usual, so that a polling driver still sees them straight away.
+   // The moderation state is reset when the client clears all moderated interrupt source bits.
+   //
+   // This task must be called before step_state_machine(), because it clears the frame event flags
+   // that the state machine may set again during the same clock cycle.
+
+   task automatic update_interrupt_moderation;
+      begin
+         reg [31:0] new_frame_count;
+         bit        is_moderated_int_pending = 0 != ( ethreg_int & ethreg_int_mask & `ETHDPI_INT_MODERATED_MASK );
+         bit        is_other_int_pending     = 0 != ( ethreg_int & ethreg_int_mask & ~`ETHDPI_INT_MODERATED_MASK );
+
+         new_frame_count = intmod_frame_count + { 31'b0, intmod_tx_frame_event } + { 31'b0, intmod_rx_frame_event };
+
+         intmod_tx_frame_event <= 0;
+         intmod_rx_frame_event <= 0;
+
+         if ( ethreg_ext_intmod_frames == 0 )
+           begin
+              intmod_frame_count <= 0;
+              intmod_cycle_count <= 0;
+              intmod_released    <= 0;
+
+              int_o <= is_moderated_int_pending || is_other_int_pending;
+           end
+         else if ( ! is_moderated_int_pending && new_frame_count == intmod_frame_count )
+           begin
+              // The client has acknowledged all moderated interrupts, or none has happened yet.
+              intmod_frame_count <= 0;
+              intmod_cycle_count <= 0;
+              intmod_released    <= 0;
+
+              int_o <= is_other_int_pending;
+           end
+         else
+           begin
+              bit should_release = intmod_released ||
+                                   new_frame_count >= ethreg_ext_intmod_frames ||
+                                   ( ethreg_ext_intmod_cycles != 0 && intmod_cycle_count >= ethreg_ext_intmod_cycles );
+
+              intmod_frame_count <= new_frame_count;
+              intmod_cycle_count <= intmod_cycle_count + 1;
+              intmod_released    <= should_release;
+
+              int_o <= is_other_int_pending || ( is_moderated_int_pending && should_release );
+           end
       end
    endtask
 
@@ -1273,8 +2117,11 @@ module ethernet_dpi #(
          m_wb_we_o  = 0;
          m_wb_sel_o = 0;
          m_wb_adr_o = 0;
+         m_wb_cti_o = `ETHDPI_WB_CTI_CLASSIC;
+         m_wb_bte_o = `ETHDPI_WB_BTE_LINEAR;
 
          int_o = 0;
+         quiescent_o = 0;
 
          ethreg_moder      = `ETHDPI_MODER_CRCEN | `ETHDPI_MODER_PAD;
          ethreg_mac_addr   = 0;
@@ -1293,17 +2140,58 @@ module ethernet_dpi #(
          ethreg_miicommand = 0;
          ethreg_ctrlmoder  = 0;
 
+         if ( 0 != ethernet_dpi_configure_mac( obj, 0, 0, 0 ) )
+           begin
+              $display( "%sError calling ethernet_dpi_configure_mac().", `ETHDPI_ERROR_PREFIX );
+              $finish;
+           end
+
+         ethreg_ext_intmod_frames = 0;
+         ethreg_ext_intmod_cycles = 0;
+         ethreg_ext_bd_count      = 0;
+         ethreg_ext_bd_index      = 0;
+
+         intmod_tx_frame_event = 0;
+         intmod_rx_frame_event = 0;
+         intmod_frame_count    = 0;
+         intmod_cycle_count    = 0;
+         intmod_released       = 0;
+
+         is_reset_asserted = 0;
+
          for ( integer i = 0; i < buffer_descriptor_count; i++ )
            begin
               buffer_descriptor_flags    [i] = 0;
               buffer_descriptor_addresses[i] = 0;
            end
 
-         current_state = state_idle;
+         buffer_descriptor_ring_size = buffer_descriptor_count;
+         tx_channel_state = channel_idle;
+         rx_channel_state = channel_idle;
+         last_dma_grant_was_rx = 0;
+         dma_bus_wait_state = 0;
          current_tx_bd_index = 0;
          current_rx_bd_index = ethreg_tx_bd_num;
-         current_dma_addr_offset = 0;
+         tx_dma_addr_offset = 0;
+         rx_dma_addr_offset = 0;
+         dma_burst_beats_left = 0;
+         dma_beat_first_word_slot = 0;
+         dma_beat_word_count = 0;
          received_frame_mac_addr_miss_flag = 0;
+         received_frame_too_long_flag = 0;
+         rx_dma_byte_count = 0;
+
+         for ( integer i = 0; i < 2; i++ )
+           begin
+              dma_profile_queue_wait_count [i] = 0;
+              dma_profile_queue_cycle_count[i] = 0;
+              dma_profile_cycle_count      [i] = 0;
+              dma_profile_beat_count       [i] = 0;
+              dma_profile_ack_wait_count   [i] = 0;
+              dma_profile_wait_state_count [i] = 0;
+              dma_profile_report_pending   [i] = 0;
+              dma_profile_byte_count       [i] = 0;
+           end
       end
    endtask
 
@@ -1318,6 +2206,7 @@ module ethernet_dpi #(
            stop_wishbone_master_cycle;
 
            int_o <= 0;
+           quiescent_o <= 0;
 
            ethreg_moder      <= `ETHDPI_MODER_CRCEN | `ETHDPI_MODER_PAD;
            ethreg_mac_addr   <= 0;
@@ -1336,6 +2225,30 @@ module ethernet_dpi #(
            ethreg_miicommand <= 0;
            ethreg_ctrlmoder  <= 0;
 
+           // This call may be expensive, for example, with option shared_tap, so do not repeat it
+           // on every clock cycle while reset is held.
+           if ( !is_reset_asserted )
+             begin
+                if ( 0 != ethernet_dpi_configure_mac( obj, 0, 0, 0 ) )
+                  begin
+                     $display( "%sError calling ethernet_dpi_configure_mac().", `ETHDPI_ERROR_PREFIX );
+                     $finish;
+                  end
+             end
+
+           is_reset_asserted <= 1;
+
+           ethreg_ext_intmod_frames <= 0;
+           ethreg_ext_intmod_cycles <= 0;
+           ethreg_ext_bd_count      <= 0;
+           ethreg_ext_bd_index      <= 0;
+
+           intmod_tx_frame_event <= 0;
+           intmod_rx_frame_event <= 0;
+           intmod_frame_count    <= 0;
+           intmod_cycle_count    <= 0;
+           intmod_released       <= 0;
+
            for ( integer i = 0; i < buffer_descriptor_count; i++ )
              begin
                 // Use = instead of <= , for Verilator (as of dic 2011) cannot use <= in loops that initialise arrays like this.
@@ -1345,17 +2258,42 @@ module ethernet_dpi #(
                 /* verilator lint_on BLKSEQ */
              end
 
-           current_state <= state_idle;
+           // The extended Buffer Descriptors are deliberately not cleared here, see buffer_descriptor_table_size.
+           buffer_descriptor_ring_size <= buffer_descriptor_count;
+           tx_channel_state <= channel_idle;
+           rx_channel_state <= channel_idle;
+           last_dma_grant_was_rx <= 0;
+           dma_bus_wait_state <= 0;
            current_tx_bd_index <= 0;
            current_rx_bd_index <= ethreg_tx_bd_num;
-           current_dma_addr_offset <= 0;
+           tx_dma_addr_offset <= 0;
+           rx_dma_addr_offset <= 0;
            received_frame_mac_addr_miss_flag <= 0;
+           received_frame_too_long_flag <= 0;
+           rx_dma_byte_count <= 0;
+
+           for ( integer i = 0; i < 2; i++ )
+             begin
+                // See the comment about Verilator above.
+                /* verilator lint_off BLKSEQ */
+                dma_profile_queue_wait_count [i] = 0;
+                dma_profile_queue_cycle_count[i] = 0;
+                dma_profile_cycle_count      [i] = 0;
+                dma_profile_beat_count       [i] = 0;
+                dma_profile_ack_wait_count   [i] = 0;
+                dma_profile_wait_state_count [i] = 0;
+                dma_profile_report_pending   [i] = 0;
+                dma_profile_byte_count       [i] = 0;
+                /* verilator lint_on BLKSEQ */
+             end
 	    end
       else
         begin
            int received_frame_byte_count;
            bit ready_to_send;
 
+           is_reset_asserted <= 0;
+
            // Possible optimisation: we don't need to poll the TAP interface if we are currently sending
            // or receiving a frame.
            if ( 0 != ethernet_dpi_tick( obj, received_frame_byte_count, ready_to_send ) )
@@ -1364,9 +2302,17 @@ module ethernet_dpi #(
                 $finish;
              end
 
-           step_state_machine( received_frame_byte_count, ready_to_send );
+           if ( ethreg_ctrlmoder[`ETHDPI_CTRLMODER_RXFLOW] )
+             update_pause_frame_interrupt;
+
+           // This also drives int_o.
+           update_interrupt_moderation;
+
+           update_quiescence_flag( received_frame_byte_count );
 
-           int_o <= ( 0 != ( ethreg_int & ethreg_int_mask ) );
+           update_dma_profile( received_frame_byte_count );
+
+           step_state_machine( received_frame_byte_count, ready_to_send );
 
            // Default values for the Wishbone slave output signals.
            clear_wishbone_slave_outputs;
@@ -1408,19 +2354,52 @@ module ethernet_dpi #(
    end
 
 
+   // The simulation harness can call these functions in order to save or restore the network state
+   // together with the simulator checkpoint. They return 0 on success.
+
+   function automatic int save_network_state ( input string filename );
+      /*verilator public*/
+      return ethernet_dpi_save( obj, filename );
+   endfunction
+
+   function automatic int restore_network_state ( input string filename );
+      /*verilator public*/
+      return ethernet_dpi_restore( obj, filename );
+   endfunction
+
+
    initial
      begin
         obj = 0;
 
+        if ( M_WB_DATA_WIDTH != 32 && M_WB_DATA_WIDTH != 64 )
+          begin
+             $display( "%sParameter M_WB_DATA_WIDTH must be either 32 or 64.", `ETHDPI_ERROR_PREFIX );
+             $finish;
+          end
+
+        if ( EXTENDED_BUFFER_DESCRIPTOR_COUNT != 0 && !ENABLE_EXTENSION_REGISTERS )
+          begin
+             $display( "%sParameter EXTENDED_BUFFER_DESCRIPTOR_COUNT requires parameter ENABLE_EXTENSION_REGISTERS.", `ETHDPI_ERROR_PREFIX );
+             $finish;
+          end
+
         if ( 0 != ethernet_dpi_create( tap_interface_name,
                                        print_informational_messages,
                                        `ETHDPI_INFORMATION_PREFIX,
+                                       dpi_options,
                                        obj ) )
           begin
              $display( "%sError creating the object instance.", `ETHDPI_ERROR_PREFIX );
              $finish;
           end
 
+        if ( 0 != ethernet_dpi_is_backdoor_dma_enabled( obj, backdoor_dma_enabled ) )
+          begin
+             $display( "%sError querying the backdoor DMA mode.", `ETHDPI_ERROR_PREFIX );
+             $finish;
+          end
+
         initial_reset;
      end
 